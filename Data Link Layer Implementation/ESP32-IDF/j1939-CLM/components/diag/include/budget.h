@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#if defined(ESP_PLATFORM)
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#endif
+
+namespace Budget {
+
+    // Heap used by one subsystem, against a limit fixed at compile time.
+    // Exceeding the limit does not fail the allocation; it is counted and
+    // reported by "mem" so the limit can be corrected before it matters.
+    //
+    // Accounts are file-scope objects and add themselves to the report when
+    // constructed; the counters are atomic since allocations and frees of
+    // one subsystem can come from different tasks.
+    class Account {
+    public:
+        Account(const char* name, size_t limit);
+
+        void charge(size_t bytes);
+        void release(size_t bytes);
+
+        // malloc and free for C code with hooks (cJSON) or raw buffers
+        void* malloc(size_t size);
+        void free(void* ptr);
+
+        const char* name;
+        size_t limit;
+        uint32_t in_use;
+        uint32_t peak;
+        uint32_t allocs;
+        uint32_t frees;
+        uint32_t overruns;          // allocations that took in_use above limit
+        Account* next;
+    };
+
+    // STL allocator charging an account, e.g.
+    //   std::vector<uint8_t, Budget::Allocator<uint8_t, heap>>
+    template <typename T, Account& A>
+    class Allocator {
+    public:
+        typedef T value_type;
+
+        template <typename U>
+        struct rebind {
+            typedef Allocator<U, A> other;
+        };
+
+        Allocator() {}
+
+        template <typename U>
+        Allocator(const Allocator<U, A>&) {}
+
+        T* allocate(size_t n) {
+            A.charge(n * sizeof(T));
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n) {
+            A.release(n * sizeof(T));
+            ::operator delete(ptr);
+        }
+    };
+
+    template <typename T, typename U, Account& A>
+    bool operator==(const Allocator<T, A>&, const Allocator<U, A>&) {
+        return true;
+    }
+
+    template <typename T, typename U, Account& A>
+    bool operator!=(const Allocator<T, A>&, const Allocator<U, A>&) {
+        return false;
+    }
+
+#if defined(ESP_PLATFORM)
+    // Stack owner reported by "mem" with its high-water mark
+    class TaskRecord {
+    public:
+        const char* name;
+        TaskHandle_t handle;
+        size_t stack_bytes;
+        TaskRecord* next;
+
+    protected:
+        TaskRecord(size_t stack_bytes) : name(NULL), handle(NULL), stack_bytes(stack_bytes), next(NULL) {}
+        void add(const char* task_name, TaskHandle_t task);
+    };
+
+    // Task whose control block and stack are part of the object, so the
+    // stack is reserved at link time instead of taken from the heap
+    template <size_t STACK_BYTES>
+    class StaticTask : public TaskRecord {
+    public:
+        StaticTask() : TaskRecord(STACK_BYTES) {}
+
+        TaskHandle_t create(TaskFunction_t entry, const char* task_name, void* arg, UBaseType_t priority) {
+            TaskHandle_t task = xTaskCreateStatic(entry, task_name, STACK_DEPTH, arg, priority, stack, &tcb);
+            add(task_name, task);
+            return task;
+        }
+
+    private:
+        // IDF counts stacks in bytes, StackType_t being one byte
+        static constexpr size_t STACK_DEPTH = STACK_BYTES / sizeof(StackType_t);
+
+        StaticTask_t tcb;
+        StackType_t stack[STACK_DEPTH];
+    };
+
+    template <typename T, size_t LENGTH>
+    class StaticQueue {
+    public:
+        QueueHandle_t create() {
+            return xQueueCreateStatic(LENGTH, sizeof(T), storage, &control);
+        }
+
+    private:
+        StaticQueue_t control;
+        uint8_t storage[LENGTH * sizeof(T)];
+    };
+#endif
+
+    class StaticMutex {
+    public:
+        SemaphoreHandle_t create() {
+            return xSemaphoreCreateMutexStatic(&control);
+        }
+
+    private:
+        StaticSemaphore_t control;
+    };
+
+    // JSON lines for the host:
+    //   {"mem":"heap","free":..,"min_free":..,"largest_block":..,"total":..}
+    //   {"mem":"task","name":"j1939_receiver","stack":4096,"min_free":..}
+    //   {"mem":"account","name":"j1939","limit":..,"in_use":..,"peak":..,
+    //    "allocs":..,"frees":..,"overruns":..}
+    void report();
+
+    // "" or "report", from {"c":"mem","d":"..."}
+    bool execute(const char* command);
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#endif
+
+// HOT_PATH marks the functions a received or sent frame passes through
+// (MCP2515 SPI helpers, readMessage/sendMessage, J1939 decode and TP
+// parsing); HOT_DATA the constant tables they read. With
+// CONFIG_DIAG_HOT_PATH_IRAM (menuconfig, Diagnostics) they are linked into
+// IRAM and DRAM, so the receive path no longer misses the flash cache while
+// NVS or OTA writes keep flash busy. Otherwise both expand to nothing and
+// the code stays in flash.
+//
+// Check the placement and size with Test scripts/hot_path_report.py on the
+// build's link map, and the latency under flash load with the "flash"
+// command (components/diag/flash_stress.cpp).
+#if defined(ESP_PLATFORM) && defined(CONFIG_DIAG_HOT_PATH_IRAM) && CONFIG_DIAG_HOT_PATH_IRAM
+#define HOT_PATH_IRAM 1
+#define HOT_PATH IRAM_ATTR
+#define HOT_DATA DRAM_ATTR
+// The CAN interrupt keeps running while the flash cache is disabled
+#define HOT_PATH_INTR_FLAGS ESP_INTR_FLAG_IRAM
+#else
+#define HOT_PATH_IRAM 0
+#define HOT_PATH
+#define HOT_DATA
+#define HOT_PATH_INTR_FLAGS 0
+#endif
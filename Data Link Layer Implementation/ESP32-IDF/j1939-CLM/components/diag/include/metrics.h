@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hot_path.h"
+
+namespace Metrics {
+
+    // Bounds of a histogram; bucket i counts values <= bounds[i], the last
+    // bucket everything above the last bound
+    constexpr size_t MAX_BOUNDS = 11;
+
+    enum class Kind : uint8_t {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM
+    };
+
+    // Metrics are file-scope objects of the subsystem that updates them and
+    // add themselves to the registry when constructed. Register them during
+    // startup, before the tasks that dump them run; they are never removed.
+    //
+    // Updates are plain loads and stores, a few cycles with no locks or
+    // atomic read-modify-write: each metric must have one writer at a time
+    // (one task, one ISR, or tasks holding a common mutex; spi_mutex covers
+    // the driver and J1939 metrics). Counters written from several places
+    // at once use inc_shared(). Dumps read 32-bit words, which cannot tear,
+    // so a histogram's count and sum can at most be one sample apart.
+    class Metric {
+    public:
+        const char* subsystem;
+        const char* name;
+        Kind kind;
+        Metric* next;
+
+    protected:
+        Metric(const char* subsystem, const char* name, Kind kind);
+    };
+
+    class Counter : public Metric {
+    public:
+        Counter(const char* subsystem, const char* name) : Metric(subsystem, name, Kind::COUNTER), count(0) {}
+
+        inline void HOT_PATH inc(uint32_t n = 1) {
+            count += n;
+        }
+
+        inline void inc_shared(uint32_t n = 1) {
+            __atomic_fetch_add(&count, n, __ATOMIC_RELAXED);
+        }
+
+        uint32_t value() const { return count; }
+        void reset() { count = 0; }
+
+    private:
+        uint32_t count;
+    };
+
+    // A level with its high-water mark, either set by its owner or sampled
+    // through a callback when dumped (e.g. the depth of a FreeRTOS queue)
+    class Gauge : public Metric {
+    public:
+        typedef int32_t (*Sampler)(void* arg);
+
+        Gauge(const char* subsystem, const char* name, Sampler sampler = NULL, void* arg = NULL)
+            : Metric(subsystem, name, Kind::GAUGE), level(0), peak(0), sampler(sampler), arg(arg) {}
+
+        inline void set(int32_t value) {
+            level = value;
+            raise_peak(value);
+        }
+
+        inline void add(int32_t delta) {
+            level += delta;
+            raise_peak(level);
+        }
+
+        int32_t value();
+        int32_t max() const { return peak; }
+        void reset() { peak = level; }
+
+    private:
+        inline void raise_peak(int32_t value) {
+            if (value > peak) {
+                peak = value;
+            }
+        }
+
+        int32_t level;
+        int32_t peak;
+        Sampler sampler;
+        void* arg;
+    };
+
+    class Histogram : public Metric {
+    public:
+        template <size_t N>
+        Histogram(const char* subsystem, const char* name, const uint32_t (&bounds)[N])
+            : Metric(subsystem, name, Kind::HISTOGRAM), bounds(bounds), bound_count(N), buckets{}, count(0), sum(0), peak(0) {
+            static_assert(N > 0 && N <= MAX_BOUNDS, "too many histogram bounds");
+        }
+
+        inline void record(uint32_t value) {
+            size_t b = 0;
+            while (b < bound_count && value > bounds[b]) {
+                b++;
+            }
+            buckets[b]++;
+            count++;
+            sum += value;
+            if (value > peak) {
+                peak = value;
+            }
+        }
+
+        void reset();
+        void print() const;
+
+    private:
+        const uint32_t* bounds;
+        size_t bound_count;
+        uint32_t buckets[MAX_BOUNDS + 1];
+        uint32_t count;
+        uint32_t sum;               // wraps; in the unit of the bounds
+        uint32_t peak;
+    };
+
+    // One JSON line per subsystem after an info line:
+    //   {"stats":"info","uptime_ms":..,"metrics":..}
+    //   {"stats":"j1939","rx_frames":..,"sessions":..,"sessions_max":..,
+    //    "reassembly_ms":{"n":..,"sum":..,"max":..,"le":[..],"b":[..]}}
+    void dump();
+
+    // Zeroes counters and histograms; gauges keep their level
+    void reset();
+
+    // Dumps every period_ms from a low priority task, 0 stops
+    bool set_push_period(uint32_t period_ms);
+
+    // "dump", "reset", "dump,reset" or "push,<ms>", from {"c":"stats","d":"..."}
+    bool execute(const char* command);
+
+}
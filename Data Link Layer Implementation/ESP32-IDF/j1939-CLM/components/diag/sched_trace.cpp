@@ -0,0 +1,384 @@
+/**
+ * @file sched_trace.cpp
+ * @brief FreeRTOS scheduling trace around the CAN receive path
+ * @version 1.0
+ *
+ * Records task switches, delays, blocking on queues and mutexes, takes and
+ * gives of the watched mutexes (spi_mutex, bus_state_mutex) and queues, and
+ * the MCP2515 interrupt into a RAM ring per core, and exports them as Chrome
+ * trace JSON for chrome://tracing or ui.perfetto.dev:
+ *
+ *   {"c":"sched","d":"start"}       clear and record
+ *   {"c":"sched","d":"stop"}
+ *   {"c":"sched","d":"dump"}        print {"traceEvents":[...]}
+ *
+ * The hooks are FreeRTOS trace macros, compiled into the kernel only when the
+ * project is built with idf.py -DSCHED_TRACE=ON build (see the project
+ * CMakeLists and sched_trace_hooks.h). Test scripts/trace_capture.py
+ * --kind sched saves a dump to a file.
+ *
+ */
+
+#include "sched_trace.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace SchedTrace {
+
+#if CONFIG_DIAG_SCHED_TRACE
+
+struct Event {
+    uint32_t ts_us;         // low 32 bits of esp_timer_get_time()
+    uint32_t task;
+    uint32_t object;
+    EventType type;
+    uint8_t core;
+    uint16_t slot;          // written last, low bits of the ring slot
+};
+
+struct Ring {
+    uint32_t head;
+    Event events[RING_SIZE];
+};
+
+struct Object {
+    void* handle;
+    const char* name;
+};
+
+static DRAM_ATTR Ring rings[portNUM_PROCESSORS];
+static DRAM_ATTR Object objects[MAX_OBJECTS];
+static DRAM_ATTR uint32_t object_count = 0;
+static volatile DRAM_ATTR bool recording = false;
+
+static inline bool IRAM_ATTR is_watched(void* handle) {
+    for (uint32_t i = 0; i < object_count; i++) {
+        if (objects[i].handle == handle) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void IRAM_ATTR append(EventType type, void* task, void* object) {
+    uint8_t core = (uint8_t)xPortGetCoreID();
+    Ring& ring = rings[core];
+    uint32_t slot = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+
+    Event& event = ring.events[slot % RING_SIZE];
+    event.ts_us = (uint32_t)esp_timer_get_time();
+    event.task = (uint32_t)(uintptr_t)task;
+    event.object = (uint32_t)(uintptr_t)object;
+    event.type = type;
+    event.core = core;
+    __atomic_store_n(&event.slot, (uint16_t)slot, __ATOMIC_RELEASE);
+}
+
+void watch(void* handle, const char* name) {
+    if (handle && object_count < MAX_OBJECTS) {
+        objects[object_count].handle = handle;
+        objects[object_count].name = name;
+        __atomic_store_n(&object_count, object_count + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void IRAM_ATTR isr_enter() {
+    if (recording) {
+        append(EventType::ISR_ENTER, NULL, NULL);
+    }
+}
+
+void IRAM_ATTR isr_exit() {
+    if (recording) {
+        append(EventType::ISR_EXIT, NULL, NULL);
+    }
+}
+
+void start() {
+    recording = false;
+    for (Ring& ring : rings) {
+        ring.head = 0;
+        memset(ring.events, 0xFF, sizeof(ring.events));
+    }
+    recording = true;
+}
+
+void stop() {
+    recording = false;
+}
+
+static const char* object_name(uint32_t object, char* buf, size_t size) {
+    for (uint32_t i = 0; i < object_count; i++) {
+        if ((uint32_t)(uintptr_t)objects[i].handle == object) {
+            return objects[i].name;
+        }
+    }
+    snprintf(buf, size, "0x%08X", (unsigned int)object);
+    return buf;
+}
+
+// Keeps the separators of the event list and names each (pid, tid) once
+class Writer {
+public:
+    Writer() : first(true) {}
+
+    void begin_event() {
+        printf(first ? "\n" : ",\n");
+        first = false;
+    }
+
+    void name_thread(int pid, uint32_t tid, const char* name) {
+        uint64_t key = ((uint64_t)pid << 32) | tid;
+        if (named.insert(key).second) {
+            begin_event();
+            printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                   pid, (unsigned int)tid, name);
+        }
+    }
+
+    void slice(int pid, uint32_t tid, const char* name, int64_t start, int64_t end) {
+        begin_event();
+        printf("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u}",
+               name, (long long)start, (long long)(end - start), pid, (unsigned int)tid);
+    }
+
+    void instant(int pid, uint32_t tid, const char* name, int64_t ts) {
+        begin_event();
+        printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":%d,\"tid\":%u}",
+               name, (long long)ts, pid, (unsigned int)tid);
+    }
+
+private:
+    bool first;
+    std::set<uint64_t> named;
+};
+
+static constexpr int TASKS_PID = 10;
+static constexpr uint32_t ISR_TID = 0;
+
+static const char* task_name(uint32_t task) {
+    return task ? pcTaskGetName((TaskHandle_t)(uintptr_t)task) : "ISR";
+}
+
+void export_chrome() {
+    bool was_recording = recording;
+    recording = false;
+
+    std::vector<Event> events;
+    uint32_t overwritten = 0;
+    for (Ring& ring : rings) {
+        uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        uint32_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+        overwritten += first;
+        for (uint32_t slot = first; slot < head; slot++) {
+            const Event& event = ring.events[slot % RING_SIZE];
+            if (__atomic_load_n(&event.slot, __ATOMIC_ACQUIRE) == (uint16_t)slot) {
+                events.push_back(event);
+            }
+        }
+    }
+
+    // Back to full µs timestamps, assuming the ring is less than 35 minutes old
+    int64_t now = esp_timer_get_time();
+    auto full_time = [now](uint32_t ts) { return now + (int32_t)(ts - (uint32_t)now); };
+    std::sort(events.begin(), events.end(), [&](const Event& a, const Event& b) {
+        return full_time(a.ts_us) < full_time(b.ts_us);
+    });
+
+    struct Running { uint32_t task; int64_t since; };
+    struct Wait { const char* what; uint32_t object; int64_t since; };
+    std::map<uint8_t, Running> running;                         // per core
+    std::map<uint8_t, int64_t> in_isr;                          // per core
+    std::map<uint32_t, Wait> waiting;                           // per task
+    std::map<std::pair<uint32_t, uint32_t>, int64_t> holding;   // (task, mutex)
+
+    Writer out;
+    char name[48];
+    char buf[16];
+
+    printf("{\"traceEvents\":[");
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        out.begin_event();
+        printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"core %d\"}}", core, core);
+    }
+    out.begin_event();
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tasks\"}}", TASKS_PID);
+
+    for (const Event& event : events) {
+        int64_t ts = full_time(event.ts_us);
+        uint32_t task = event.task;
+
+        switch (event.type) {
+        case EventType::SWITCH_IN: {
+            auto r = running.find(event.core);
+            if (r != running.end()) {
+                out.name_thread(event.core, r->second.task, task_name(r->second.task));
+                out.slice(event.core, r->second.task, task_name(r->second.task), r->second.since, ts);
+            }
+            running[event.core] = {task, ts};
+
+            // A blocked or sleeping task has waited until it runs again
+            auto w = waiting.find(task);
+            if (w != waiting.end()) {
+                if (w->second.object) {
+                    snprintf(name, sizeof(name), "%s %s", w->second.what, object_name(w->second.object, buf, sizeof(buf)));
+                } else {
+                    snprintf(name, sizeof(name), "%s", w->second.what);
+                }
+                out.name_thread(TASKS_PID, task, task_name(task));
+                out.slice(TASKS_PID, task, name, w->second.since, ts);
+                waiting.erase(w);
+            }
+            break;
+        }
+        case EventType::DELAY:
+            waiting[task] = {"delay", 0, ts};
+            break;
+        case EventType::BLOCK_SEND:
+            waiting[task] = {"wait send", event.object, ts};
+            break;
+        case EventType::BLOCK_RECEIVE:
+            waiting[task] = {"wait", event.object, ts};
+            break;
+        case EventType::QUEUE_RECEIVE:
+            holding[{task, event.object}] = ts;
+            break;
+        case EventType::QUEUE_SEND: {
+            auto h = holding.find({task, event.object});
+            if (h != holding.end()) {
+                snprintf(name, sizeof(name), "hold %s", object_name(event.object, buf, sizeof(buf)));
+                out.name_thread(TASKS_PID, task, task_name(task));
+                out.slice(TASKS_PID, task, name, h->second, ts);
+                holding.erase(h);
+            } else {
+                snprintf(name, sizeof(name), "send %s", object_name(event.object, buf, sizeof(buf)));
+                out.name_thread(TASKS_PID, task, task_name(task));
+                out.instant(TASKS_PID, task, name, ts);
+            }
+            break;
+        }
+        case EventType::QUEUE_RECEIVE_FAILED:
+            snprintf(name, sizeof(name), "timeout %s", object_name(event.object, buf, sizeof(buf)));
+            out.name_thread(TASKS_PID, task, task_name(task));
+            out.instant(TASKS_PID, task, name, ts);
+            break;
+        case EventType::QUEUE_SEND_FROM_ISR:
+        case EventType::QUEUE_RECEIVE_FROM_ISR:
+            snprintf(name, sizeof(name), "%s %s", event.type == EventType::QUEUE_SEND_FROM_ISR ? "isr send" : "isr receive",
+                     object_name(event.object, buf, sizeof(buf)));
+            out.name_thread(event.core, ISR_TID, "ISR");
+            out.instant(event.core, ISR_TID, name, ts);
+            break;
+        case EventType::ISR_ENTER:
+            in_isr[event.core] = ts;
+            break;
+        case EventType::ISR_EXIT: {
+            auto i = in_isr.find(event.core);
+            if (i != in_isr.end()) {
+                out.name_thread(event.core, ISR_TID, "ISR");
+                out.slice(event.core, ISR_TID, "mcp2515 isr", i->second, ts);
+                in_isr.erase(i);
+            }
+            break;
+        }
+        }
+    }
+
+    printf("\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%u,\"overwritten\":%u}}\n",
+           (unsigned int)events.size(), (unsigned int)overwritten);
+
+    recording = was_recording;
+}
+
+bool execute(const char* command) {
+    if (strcmp(command, "start") == 0) {
+        start();
+    } else if (strcmp(command, "stop") == 0) {
+        stop();
+    } else if (strcmp(command, "dump") == 0) {
+        export_chrome();
+        return true;
+    } else {
+        printf("{\"sched\":\"error\",\"usage\":\"start|stop|dump\"}\n");
+        return false;
+    }
+    printf("{\"sched\":\"%s\",\"recording\":%s}\n", command, recording ? "true" : "false");
+    return true;
+}
+
+#else
+
+void watch(void* handle, const char* name) {}
+// In IRAM like the recorder: the CAN interrupt may run with the cache off
+void IRAM_ATTR isr_enter() {}
+void IRAM_ATTR isr_exit() {}
+void start() {}
+void stop() {}
+void export_chrome() {}
+
+bool execute(const char* command) {
+    printf("{\"sched\":\"error\",\"reason\":\"built without -DSCHED_TRACE=ON\"}\n");
+    return false;
+}
+
+#endif
+
+}
+
+#if CONFIG_DIAG_SCHED_TRACE
+
+using SchedTrace::EventType;
+
+extern "C" void IRAM_ATTR sched_trace_task_switched_in(void) {
+    if (SchedTrace::recording) {
+        SchedTrace::append(EventType::SWITCH_IN, xTaskGetCurrentTaskHandle(), NULL);
+    }
+}
+
+extern "C" void IRAM_ATTR sched_trace_task_delay(void) {
+    if (SchedTrace::recording) {
+        SchedTrace::append(EventType::DELAY, xTaskGetCurrentTaskHandle(), NULL);
+    }
+}
+
+extern "C" void IRAM_ATTR sched_trace_queue(void* queue, int op) {
+    if (!SchedTrace::recording) {
+        return;
+    }
+    switch (op) {
+    case SCHED_TRACE_BLOCK_SEND:
+        SchedTrace::append(EventType::BLOCK_SEND, xTaskGetCurrentTaskHandle(), queue);
+        return;
+    case SCHED_TRACE_BLOCK_RECEIVE:
+        SchedTrace::append(EventType::BLOCK_RECEIVE, xTaskGetCurrentTaskHandle(), queue);
+        return;
+    }
+    if (!SchedTrace::is_watched(queue)) {
+        return;
+    }
+    switch (op) {
+    case SCHED_TRACE_QUEUE_SEND:
+        SchedTrace::append(EventType::QUEUE_SEND, xTaskGetCurrentTaskHandle(), queue);
+        break;
+    case SCHED_TRACE_QUEUE_SEND_FROM_ISR:
+        SchedTrace::append(EventType::QUEUE_SEND_FROM_ISR, NULL, queue);
+        break;
+    case SCHED_TRACE_QUEUE_RECEIVE:
+        SchedTrace::append(EventType::QUEUE_RECEIVE, xTaskGetCurrentTaskHandle(), queue);
+        break;
+    case SCHED_TRACE_QUEUE_RECEIVE_FROM_ISR:
+        SchedTrace::append(EventType::QUEUE_RECEIVE_FROM_ISR, NULL, queue);
+        break;
+    case SCHED_TRACE_QUEUE_RECEIVE_FAILED:
+        SchedTrace::append(EventType::QUEUE_RECEIVE_FAILED, xTaskGetCurrentTaskHandle(), queue);
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,189 @@
+/**
+ * @file trace.cpp
+ * @brief End-to-end message latency tracing across firmware stages
+ * @version 1.0
+ *
+ * A message sent from the UART gets a trace ID, and every stage it passes
+ * records a timestamp: line complete, queued, BAM announce and each TP.DT on
+ * the sender; interrupt, announce, each TP.DT, reassembly and output on the
+ * receivers. Events go to one ring per core and are dumped as Chrome trace
+ * JSON:
+ *
+ *   {"c":"trace","d":"on"}      start recording (off by default)
+ *   {"c":"trace","d":"dump"}    print {"traceEvents":[...]} over the UART
+ *   {"c":"trace","d":"clear"}
+ *
+ * Test scripts/trace_capture.py collects the dumps of several nodes, aligns
+ * their clocks on the shared BAMs and writes one file for chrome://tracing
+ * or ui.perfetto.dev. Once a node follows the bus time master (timesync),
+ * its dump is in bus time ("sync" in otherData) and needs no alignment.
+ *
+ */
+
+#include "trace.h"
+#include "sync_clock.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace Trace {
+
+struct Event {
+    int64_t ts_us;
+    uint32_t slot;          // written last; a reader sees a torn event as a mismatch
+    uint16_t id;
+    uint16_t arg;
+    Stage stage;
+    uint8_t core;
+};
+
+struct Ring {
+    uint32_t head;
+    Event events[RING_SIZE];
+};
+
+static const char* const STAGE_NAMES[] = {
+    "uart_line", "queued", "single_frame", "bam_announce", "tp_dt",
+    "rx_isr", "rx_announce", "rx_dt", "reassembled", "sink",
+};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == (size_t)Stage::COUNT, "stage names");
+
+static Ring rings[portNUM_PROCESSORS];
+static uint8_t node_address = 0;
+static uint32_t next_tag = 0;
+
+volatile uint32_t isr_time_low = 0;
+volatile bool enabled = false;
+
+void init(uint8_t source_addr) {
+    node_address = source_addr;
+}
+
+void enable(bool on) {
+    enabled = on;
+}
+
+bool is_enabled() {
+    return enabled;
+}
+
+uint16_t begin() {
+    if (!enabled) {
+        return NO_TRACE;
+    }
+    uint32_t n = __atomic_fetch_add(&next_tag, 1, __ATOMIC_RELAXED);
+    return from_tag(node_address, (uint8_t)(n % NO_TAG));
+}
+
+void record(Stage stage, uint16_t id, uint16_t arg) {
+    if (enabled && id != NO_TRACE) {
+        record_at(stage, id, arg, esp_timer_get_time());
+    }
+}
+
+void record_at(Stage stage, uint16_t id, uint16_t arg, int64_t ts_us) {
+    if (!enabled || id == NO_TRACE) {
+        return;
+    }
+    uint8_t core = (uint8_t)xPortGetCoreID();
+    Ring& ring = rings[core];
+    uint32_t slot = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+
+    Event& event = ring.events[slot % RING_SIZE];
+    event.ts_us = ts_us;
+    event.id = id;
+    event.arg = arg;
+    event.stage = stage;
+    event.core = core;
+    __atomic_store_n(&event.slot, slot, __ATOMIC_RELEASE);
+}
+
+int64_t last_isr_time() {
+    int64_t now = esp_timer_get_time();
+    return now - (uint32_t)((uint32_t)now - isr_time_low);
+}
+
+void clear() {
+    bool was_enabled = enabled;
+    enabled = false;
+    for (Ring& ring : rings) {
+        ring.head = 0;
+        memset(ring.events, 0xFF, sizeof(ring.events));
+    }
+    enabled = was_enabled;
+}
+
+void export_chrome() {
+    bool was_enabled = enabled;
+    enabled = false;
+
+    std::vector<Event> events;
+    uint32_t overwritten = 0;
+    for (Ring& ring : rings) {
+        uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        uint32_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+        overwritten += first;
+        for (uint32_t slot = first; slot < head; slot++) {
+            const Event& event = ring.events[slot % RING_SIZE];
+            if (__atomic_load_n(&event.slot, __ATOMIC_ACQUIRE) == slot) {
+                events.push_back(event);
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(),
+              [](const Event& a, const Event& b) { return a.ts_us < b.ts_us; });
+
+    printf("{\"traceEvents\":[\n");
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"node 0x%02X\"}}",
+           node_address, node_address);
+
+    // Each stage is drawn from the previous stage of the same message, so the
+    // slice lengths add up to the time spent on this node
+    bool synced = SyncClock::is_synced();
+    std::map<uint16_t, int64_t> previous;
+    for (const Event& event : events) {
+        const char* name = STAGE_NAMES[(size_t)event.stage];
+        int64_t ts_us = SyncClock::to_sync(event.ts_us);
+        auto it = previous.find(event.id);
+        if (it == previous.end()) {
+            printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"trace %04X\"}}",
+                   node_address, event.id, event.id);
+            printf(",\n{\"name\":\"%s\",\"cat\":\"j1939\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":%u,\"tid\":%u,"
+                   "\"args\":{\"trace\":\"%04X\",\"arg\":%u,\"core\":%u}}",
+                   name, (long long)ts_us, node_address, event.id, event.id, event.arg, event.core);
+        } else {
+            printf(",\n{\"name\":\"%s\",\"cat\":\"j1939\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%u,\"tid\":%u,"
+                   "\"args\":{\"trace\":\"%04X\",\"arg\":%u,\"core\":%u}}",
+                   name, (long long)it->second, (long long)(ts_us - it->second), node_address, event.id,
+                   event.id, event.arg, event.core);
+        }
+        previous[event.id] = ts_us;
+    }
+
+    printf("\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"node\":\"%02X\",\"events\":%u,\"overwritten\":%u,\"sync\":%s}}\n",
+           node_address, (unsigned int)events.size(), (unsigned int)overwritten, synced ? "true" : "false");
+
+    enabled = was_enabled;
+}
+
+bool execute(const char* command) {
+    if (strcmp(command, "on") == 0) {
+        enable(true);
+    } else if (strcmp(command, "off") == 0) {
+        enable(false);
+    } else if (strcmp(command, "clear") == 0) {
+        clear();
+    } else if (strcmp(command, "dump") == 0) {
+        export_chrome();
+        return true;
+    } else {
+        printf("{\"trace\":\"error\",\"usage\":\"on|off|clear|dump\"}\n");
+        return false;
+    }
+    printf("{\"trace\":\"%s\",\"enabled\":%s}\n", command, enabled ? "true" : "false");
+    return true;
+}
+
+}
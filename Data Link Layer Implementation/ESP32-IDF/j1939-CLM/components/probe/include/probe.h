@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "j1939.h"
+#include "budget.h"
+
+namespace Probe {
+
+    // Proprietary B PGNs, so requests and replies differ in the CAN ID
+    constexpr uint32_t PGN_PROBE_REQUEST = 0xFF50;
+    constexpr uint32_t PGN_PROBE_REPLY = 0xFF51;
+
+    // Request: seq (LE16) and a pattern. The reply has the same size and
+    // starts with seq, the requester's address and the responder's turnaround
+    // in µs (LE24); the rest of the request is reflected unchanged.
+    constexpr size_t HEADER_SIZE = 6;
+    constexpr size_t MIN_SIZE = HEADER_SIZE;
+    constexpr size_t MAX_SIZE = 1785;
+    constexpr uint32_t MAX_TURNAROUND_US = 0xFFFFFF;
+
+    constexpr size_t JOB_QUEUE_LEN = 8;
+    constexpr uint32_t TASK_STACK_SIZE = 4096;
+    constexpr UBaseType_t TASK_PRIORITY = 6;
+
+    // Replies can take a while: the controller paces TP.DT packets 50 ms apart
+    constexpr uint32_t BASE_TIMEOUT_MS = 1000;
+    constexpr uint32_t TIMEOUT_PER_PACKET_MS = 120;
+
+    // The first four columns are those of Test scripts/complete_latency_test.py
+    constexpr const char* CSV_HEADER =
+        "message_id,round_trip_latency_ms,encryption_time_ms,processing_time_ms,"
+        "one_way_latency_ms,send_time_ms,size,tx_timestamp_us,rx_timestamp_us";
+
+    // Round-trip latency on the bus, measured by the nodes themselves.
+    //
+    // Every node answers probe requests while echo is on. A node told to ping
+    // sends count requests of the given size (single frame up to 8 bytes, BAM
+    // above) one at a time, and prints one CSV line per reply with µs
+    // timestamps from esp_timer: the round trip, the peer's turnaround as
+    // processing time and (round trip - turnaround) / 2 as the one-way
+    // estimate. Nothing is encrypted on the bus, so encryption_time_ms is 0.
+    //
+    // on_message() is called from the receiver task and only queues work; the
+    // probe task does all sending, under the SPI mutex.
+    class Prober {
+    public:
+        Prober(J1939::Controller* controller, SemaphoreHandle_t spi_mutex, uint8_t source_addr);
+        ~Prober();
+
+        bool init();
+
+        // Returns true if the message was a probe and has been consumed
+        bool on_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len);
+
+        bool start(uint16_t count, uint16_t size, uint32_t interval_ms);
+        void stop();
+        void set_echo(bool enabled) { echo_enabled = enabled; }
+        bool is_echo_enabled() const { return echo_enabled; }
+
+    private:
+        enum class JobType : uint8_t {
+            REQUEST,
+            REPLY,
+            START,
+            STOP
+        };
+
+        struct Job {
+            JobType type;
+            uint8_t src_addr;
+            uint16_t len;
+            int64_t rx_us;
+            uint8_t* data;          // heap copy of the payload, freed by the task
+            uint16_t count;
+            uint32_t interval_ms;
+        };
+
+        struct Run {
+            bool active;
+            bool waiting;
+            uint16_t count;
+            uint16_t size;
+            uint32_t interval_ms;
+            uint32_t timeout_us;
+            uint16_t sent;
+            uint16_t received;
+            uint16_t timeouts;
+            uint16_t corrupt;
+            uint16_t seq;
+            int64_t tx_us;
+            int64_t send_us;        // duration of the send call
+            int64_t next_send_us;
+        };
+
+        static void task_entry(void* arg);
+        void task_loop();
+        bool queue_payload(JobType type, uint8_t src_addr, const uint8_t* data, size_t len);
+
+        void begin_run(const Job& job);
+        void end_run();
+        void step_run(int64_t now_us);
+        void send_request();
+        void handle_reply(const Job& job);
+        void send_echo(const Job& job);
+        bool send(uint32_t pgn, const uint8_t* data, size_t len);
+
+        J1939::Controller* j1939;
+        SemaphoreHandle_t spi_mutex;
+        uint8_t source_address;
+        QueueHandle_t jobs;
+        TaskHandle_t task;
+        Budget::StaticQueue<Job, JOB_QUEUE_LEN> jobs_memory;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory;
+        volatile bool echo_enabled;
+        uint32_t echo_dropped;
+        Run run;
+        uint8_t buffer[MAX_SIZE];
+    };
+
+}
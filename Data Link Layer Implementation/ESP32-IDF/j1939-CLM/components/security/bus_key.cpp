@@ -0,0 +1,112 @@
+/**
+ * @file bus_key.cpp
+ * @brief Vehicle bus key in NVS, with a menuconfig default
+ * @version 1.0
+ *
+ *   {"c":"key","d":"00112233445566778899aabbccddeeff"}   store, used from the next start
+ *   {"c":"key","d":"clear"}                              back to CONFIG_SECURITY_BUS_KEY
+ *
+ * The key itself is never printed. The default key is in every build, so
+ * it is not trusted: until a key is stored, start authorisation refuses,
+ * heartbeats give no "alive" verdicts and updates over CAN are refused,
+ * unless CONFIG_SECURITY_ALLOW_DEFAULT_KEY is set for the bench.
+ *
+ */
+
+#include "bus_key.h"
+#include "sdkconfig.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static const char* TAG = "BusKey";
+
+namespace BusKey {
+
+static const char* NVS_NAMESPACE = "security";
+static const char* NVS_KEY = "bus_key";
+
+static bool parse_hex(const char* hex, uint8_t key[SipHash::KEY_SIZE]) {
+    if (strlen(hex) != 2 * SipHash::KEY_SIZE) {
+        return false;
+    }
+    for (size_t i = 0; i < SipHash::KEY_SIZE; i++) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1])) {
+            return false;
+        }
+        key[i] = (uint8_t)strtoul(byte, NULL, 16);
+    }
+    return true;
+}
+
+State load(uint8_t key[SipHash::KEY_SIZE]) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        size_t len = SipHash::KEY_SIZE;
+        esp_err_t err = nvs_get_blob(nvs, NVS_KEY, key, &len);
+        nvs_close(nvs);
+        if (err == ESP_OK && len == SipHash::KEY_SIZE) {
+            return State::PROVISIONED;
+        }
+    }
+    if (!parse_hex(CONFIG_SECURITY_BUS_KEY, key)) {
+        ESP_LOGE(TAG, "CONFIG_SECURITY_BUS_KEY is not 32 hex digits");
+        return State::NONE;
+    }
+    ESP_LOGW(TAG, "No bus key in NVS, using the configured default%s",
+             trusted(State::DEFAULT_KEY) ? "" : ", which is not trusted");
+    return State::DEFAULT_KEY;
+}
+
+bool trusted(State state) {
+#if defined(CONFIG_SECURITY_ALLOW_DEFAULT_KEY)
+    return state != State::NONE;
+#else
+    return state == State::PROVISIONED;
+#endif
+}
+
+const char* state_name(State state) {
+    switch (state) {
+    case State::NONE: return "none";
+    case State::PROVISIONED: return "provisioned";
+    case State::DEFAULT_KEY: return "default";
+    }
+    return "unknown";
+}
+
+bool execute(const char* command) {
+    uint8_t key[SipHash::KEY_SIZE];
+    bool clear = strcmp(command, "clear") == 0;
+    if (!clear && !parse_hex(command, key)) {
+        printf("{\"key\":\"error\",\"usage\":\"<32 hex digits>|clear\"}\n");
+        return false;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = clear ? nvs_erase_key(nvs, NVS_KEY) : nvs_set_blob(nvs, NVS_KEY, key, SipHash::KEY_SIZE);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    memset(key, 0, sizeof(key));
+
+    if (err != ESP_OK) {
+        printf("{\"key\":\"error\",\"reason\":\"nvs %d\"}\n", err);
+        return false;
+    }
+    printf("{\"key\":\"%s\",\"restart\":true}\n", clear ? "cleared" : "stored");
+    return true;
+}
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include "siphash.h"
+
+namespace BusKey {
+
+    enum class State : uint8_t {
+        NONE,               // nothing in NVS and CONFIG_SECURITY_BUS_KEY not valid
+        PROVISIONED,        // stored in NVS with the "key" command
+        DEFAULT_KEY         // CONFIG_SECURITY_BUS_KEY: built in, so anyone can know it
+    };
+
+    // The key shared by the nodes of a vehicle: the one stored in NVS, or
+    // CONFIG_SECURITY_BUS_KEY if none is
+    State load(uint8_t key[SipHash::KEY_SIZE]);
+
+    // Whether a key may authorise anything: a provisioned one, or the
+    // default in builds with CONFIG_SECURITY_ALLOW_DEFAULT_KEY (the bench)
+    bool trusted(State state);
+
+    // "none", "provisioned" or "default", for status lines
+    const char* state_name(State state);
+
+    // From {"c":"key","d":"..."}: 32 hex digits are stored in NVS and used
+    // from the next start; "clear" returns to the configured key
+    bool execute(const char* command);
+
+}
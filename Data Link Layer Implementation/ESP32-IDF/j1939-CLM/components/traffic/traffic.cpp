@@ -0,0 +1,613 @@
+/**
+ * @file traffic.cpp
+ * @brief On-bus traffic generator for load and soak testing
+ * @version 1.0
+ *
+ * Commands, sent as {"c":"gen","d":"<command>"} (fields comma separated,
+ * PGN and SA in hex, times in ms):
+ *
+ * - add,sf|bam,PGN,SA,period,size[,jitter[,counter|random|zero|ones[,priority]]]
+ *                       add a stream; size is the DLC for sf, 9..1785 for bam
+ * - mix                 add a typical engine/brake/tachograph mix with DM1 and
+ *                       component ID BAMs
+ * - clear               remove all streams
+ * - gap,MS              TP.DT spacing of BAM streams (default 50)
+ * - load,PCT            scale all periods to this bus load; 0 = nominal periods
+ * - start[,S]           run, for S seconds if given
+ * - stop
+ * - sweep,FROM,TO,STEP,S   run each load from FROM to TO percent for S seconds
+ * - status
+ *
+ * While running, {"gen":"load",...} is printed every second with requested,
+ * nominal and achieved load; a sweep prints {"gen":"step",...} per load.
+ *
+ *   {"c":"gen","d":"mix"}
+ *   {"c":"gen","d":"sweep,10,60,10,5"}
+ *
+ */
+
+#include "traffic.h"
+#include "mcp2515/can.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* TAG = "Traffic";
+
+namespace Traffic {
+
+static constexpr uint8_t TP_SESSIONS[] = {2, 3, 6, 7, 10, 11};
+static constexpr size_t TP_SESSION_COUNT = sizeof(TP_SESSIONS) / sizeof(TP_SESSIONS[0]);
+static constexpr uint32_t INTERMISSION_BITS = 3;
+
+static uint16_t bam_packets(uint16_t size) {
+    return (size + 6) / 7;
+}
+
+Generator::Generator(CanController* mcp, SemaphoreHandle_t spi_mutex, uint32_t bitrate)
+    : mcp2515(mcp),
+      spi_mutex(spi_mutex),
+      state_mutex(NULL),
+      bitrate(bitrate),
+      task(NULL),
+      timer(NULL),
+      stream_count(0),
+      bam_gap_us(DEFAULT_BAM_GAP_US),
+      target_load(0),
+      running(false),
+      stop_us(0),
+      sweep_count(0),
+      sweep_index(0),
+      sweep_step_us(0),
+      step_start_us(0),
+      step_bits(0),
+      window_start_us(0),
+      window_bits(0),
+      frames(0),
+      messages(0),
+      tx_busy(0),
+      late(0),
+      last_load(0) {
+    memset(streams, 0, sizeof(streams));
+}
+
+Generator::~Generator() {
+    if (timer) {
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+    }
+    if (task) {
+        vTaskDelete(task);
+    }
+    if (state_mutex) {
+        vSemaphoreDelete(state_mutex);
+    }
+}
+
+bool Generator::init() {
+    state_mutex = state_mutex_memory.create();
+    if (!state_mutex) {
+        ESP_LOGE(TAG, "Failed to create state mutex");
+        return false;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = timer_callback;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "traffic";
+    if (esp_timer_create(&args, &timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create timer");
+        return false;
+    }
+
+    task = task_memory.create(task_entry, "traffic", this, TASK_PRIORITY);
+    if (!task) {
+        ESP_LOGE(TAG, "Failed to create generator task");
+        return false;
+    }
+    return true;
+}
+
+uint32_t Generator::frame_bits(const can_frame* frame) {
+    uint8_t bits[160];
+    size_t n = 0;
+    auto push = [&](uint32_t value, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+            bits[n++] = (value >> i) & 1;
+        }
+    };
+
+    bool rtr = frame->can_id & CAN_RTR_FLAG;
+    uint8_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+
+    push(0, 1);                                         // SOF
+    if (frame->can_id & CAN_EFF_FLAG) {
+        uint32_t id = frame->can_id & CAN_EFF_MASK;
+        push(id >> 18, 11);
+        push(3, 2);                                     // SRR, IDE
+        push(id & 0x3FFFF, 18);
+        push(rtr, 1);
+        push(0, 2);                                     // r1, r0
+    } else {
+        push(frame->can_id & CAN_SFF_MASK, 11);
+        push(rtr, 1);
+        push(0, 2);                                     // IDE, r0
+    }
+    push(dlc, 4);
+    if (!rtr) {
+        for (int i = 0; i < dlc; i++) {
+            push(frame->data[i], 8);
+        }
+    }
+
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool next = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+    push(crc, 15);
+
+    // A complementary bit follows every run of five, and starts the next run
+    uint32_t stuffed = 0;
+    int last = -1;
+    int run = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (bits[i] == last) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5) {
+            stuffed++;
+            last = !last;
+            run = 1;
+        }
+    }
+
+    // CRC delimiter, ACK, ACK delimiter, EOF and intermission
+    return (uint32_t)n + stuffed + 3 + 7 + INTERMISSION_BITS;
+}
+
+bool Generator::add_stream(const StreamConfig& config) {
+    bool valid = config.bam ? (config.size > 8 && config.size <= MAX_BAM_SIZE) : config.size <= 8;
+    if (!valid || config.pgn > 0x3FFFF || config.priority > 7 || config.period_us < MIN_PERIOD_US ||
+        config.jitter_us >= config.period_us) {
+        return false;
+    }
+
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    bool added = stream_count < MAX_STREAMS;
+    if (added) {
+        Stream& stream = streams[stream_count++];
+        memset(&stream, 0, sizeof(stream));
+        stream.config = config;
+        stream.period_us = config.period_us;
+        apply_load();
+    }
+    xSemaphoreGive(state_mutex);
+    return added;
+}
+
+void Generator::clear_streams() {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    stream_count = 0;
+    xSemaphoreGive(state_mutex);
+}
+
+void Generator::add_default_mix() {
+    static const StreamConfig mix[] = {
+        {false, 0xF004, 0x00, 3, 8, 10000, 200, Pattern::COUNTER},      // EEC1
+        {false, 0xF003, 0x00, 3, 8, 50000, 1000, Pattern::COUNTER},     // EEC2
+        {false, 0xFEF1, 0x00, 6, 8, 100000, 2000, Pattern::COUNTER},    // CCVS
+        {false, 0xFEF2, 0x00, 6, 8, 100000, 2000, Pattern::RANDOM},     // LFE
+        {false, 0xFEEE, 0x00, 6, 8, 1000000, 20000, Pattern::COUNTER},  // ET1
+        {false, 0xF001, 0x0B, 6, 8, 100000, 2000, Pattern::COUNTER},    // EBC1
+        {false, 0xFEBF, 0x0B, 6, 8, 100000, 2000, Pattern::RANDOM},     // EBC2
+        {false, 0xFE6C, 0x17, 3, 8, 50000, 1000, Pattern::COUNTER},     // TCO1
+        {true, 0xFECA, 0x00, 6, 20, 1000000, 20000, Pattern::COUNTER},  // DM1
+        {true, 0xFEEB, 0x17, 7, 40, 5000000, 100000, Pattern::ZERO},    // component ID
+    };
+    for (const StreamConfig& config : mix) {
+        add_stream(config);
+    }
+}
+
+void Generator::set_bam_gap_us(uint32_t gap_us) {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    bam_gap_us = gap_us < MIN_BAM_GAP_US ? MIN_BAM_GAP_US : gap_us;
+    apply_load();
+    xSemaphoreGive(state_mutex);
+}
+
+double Generator::nominal_load() const {
+    double bits_per_s = 0;
+    for (size_t i = 0; i < stream_count; i++) {
+        const Stream& stream = streams[i];
+        can_frame frame = {};
+        build_frame(stream, &frame);
+        double bits = frame_bits(&frame);
+        if (stream.config.bam) {
+            // TP.CM and TP.DT frames are all 8 bytes long
+            bits *= 1 + bam_packets(stream.config.size);
+        }
+        bits_per_s += bits * 1e6 / stream.config.period_us;
+    }
+    return 100.0 * bits_per_s / bitrate;
+}
+
+// Called with state_mutex held
+void Generator::apply_load() {
+    double nominal = nominal_load();
+    double factor = (target_load > 0 && nominal > 0) ? target_load / nominal : 1.0;
+    for (size_t i = 0; i < stream_count; i++) {
+        Stream& stream = streams[i];
+        double period = stream.config.period_us / factor;
+        // A BAM cannot repeat before its packets are out
+        double minimum = stream.config.bam ? (double)(bam_packets(stream.config.size) + 1) * bam_gap_us : MIN_PERIOD_US;
+        stream.period_us = (uint32_t)(period > minimum ? period : minimum);
+    }
+}
+
+bool Generator::set_target_load(double percent) {
+    if (percent < 0 || percent > 100) {
+        return false;
+    }
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    target_load = percent;
+    apply_load();
+    xSemaphoreGive(state_mutex);
+    return true;
+}
+
+bool Generator::start(uint32_t duration_s) {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    bool started = stream_count > 0;
+    if (started) {
+        int64_t now_us = esp_timer_get_time();
+        apply_load();
+        for (size_t i = 0; i < stream_count; i++) {
+            // Random phases, so the streams do not all start in the same instant
+            Stream& stream = streams[i];
+            stream.next_us = now_us + esp_random() % stream.period_us;
+            stream.message_us = stream.next_us;
+            stream.packet = 0;
+        }
+        running = true;
+        stop_us = duration_s ? now_us + (int64_t)duration_s * 1000000 : 0;
+        window_start_us = now_us;
+        window_bits = 0;
+        step_start_us = now_us;
+        step_bits = 0;
+        frames = 0;
+        messages = 0;
+        tx_busy = 0;
+        late = 0;
+        last_load = 0;
+    }
+    xSemaphoreGive(state_mutex);
+
+    if (started) {
+        xTaskNotifyGive(task);
+    }
+    return started;
+}
+
+void Generator::stop() {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    if (running) {
+        running = false;
+        sweep_count = 0;
+        esp_timer_stop(timer);
+        print_report("stopped", esp_timer_get_time() - window_start_us);
+    }
+    xSemaphoreGive(state_mutex);
+}
+
+bool Generator::sweep(double from, double to, double step, uint32_t seconds_per_step) {
+    if (from <= 0 || to > 100 || step <= 0 || from > to || seconds_per_step == 0) {
+        return false;
+    }
+
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    sweep_count = 0;
+    for (double load = from; load <= to + 1e-9 && sweep_count < MAX_SWEEP_STEPS; load += step) {
+        sweep_steps[sweep_count++] = load;
+    }
+    sweep_index = 0;
+    sweep_step_us = seconds_per_step * 1000000;
+    target_load = sweep_steps[0];
+    xSemaphoreGive(state_mutex);
+
+    if (!start()) {
+        sweep_count = 0;
+        return false;
+    }
+    return true;
+}
+
+Report Generator::report() {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    Report r = {};
+    r.running = running;
+    r.streams = (uint8_t)stream_count;
+    r.requested_load = target_load;
+    r.nominal_load = nominal_load();
+    r.achieved_load = last_load;
+    r.frames = frames;
+    r.messages = messages;
+    r.tx_busy = tx_busy;
+    r.late = late;
+    xSemaphoreGive(state_mutex);
+    return r;
+}
+
+void Generator::timer_callback(void* arg) {
+    xTaskNotifyGive(((Generator*)arg)->task);
+}
+
+void Generator::task_entry(void* arg) {
+    ((Generator*)arg)->task_loop();
+}
+
+void Generator::task_loop() {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(state_mutex, portMAX_DELAY);
+        if (!running) {
+            xSemaphoreGive(state_mutex);
+            continue;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        int64_t next_us = service(now_us);
+
+        if (now_us - window_start_us >= REPORT_PERIOD_US) {
+            last_load = 100.0 * window_bits * 1e6 / ((double)bitrate * (now_us - window_start_us));
+            print_report("load", now_us - window_start_us);
+            window_start_us = now_us;
+            window_bits = 0;
+        }
+        if (sweep_count && now_us - step_start_us >= (int64_t)sweep_step_us) {
+            end_step(now_us);
+        }
+        if (running && stop_us && now_us >= stop_us) {
+            running = false;
+            print_report("done", now_us - window_start_us);
+        }
+
+        if (running) {
+            int64_t wake_us = next_us;
+            if (window_start_us + (int64_t)REPORT_PERIOD_US < wake_us) {
+                wake_us = window_start_us + REPORT_PERIOD_US;
+            }
+            int64_t delay_us = wake_us - esp_timer_get_time();
+            esp_timer_stop(timer);
+            esp_timer_start_once(timer, delay_us > 50 ? delay_us : 50);
+        }
+        xSemaphoreGive(state_mutex);
+    }
+}
+
+// Sends every frame that is due; returns when the next one is
+int64_t Generator::service(int64_t now_us) {
+    int64_t next_us = now_us + REPORT_PERIOD_US;
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(10)) != pdTRUE) {
+        return now_us + RETRY_US;
+    }
+    for (size_t i = 0; i < stream_count; i++) {
+        Stream& stream = streams[i];
+
+        // A stream a full period behind drops the message instead of bursting
+        if (stream.packet == 0 && now_us - stream.next_us > (int64_t)stream.period_us) {
+            late++;
+            stream.message_us = now_us;
+            stream.next_us = now_us;
+        }
+
+        while (stream.next_us <= now_us) {
+            if (!emit(stream, now_us)) {
+                tx_busy++;
+                stream.next_us = now_us + RETRY_US;
+                break;
+            }
+        }
+        if (stream.next_us < next_us) {
+            next_us = stream.next_us;
+        }
+    }
+    xSemaphoreGive(spi_mutex);
+    return next_us;
+}
+
+bool Generator::emit(Stream& stream, int64_t now_us) {
+    can_frame frame;
+    build_frame(stream, &frame);
+    if (mcp2515->sendMessage(&frame) != CanController::ERROR_OK) {
+        return false;
+    }
+
+    uint32_t bits = frame_bits(&frame);
+    window_bits += bits;
+    step_bits += bits;
+    frames++;
+
+    if (!stream.config.bam) {
+        schedule_next(stream, stream.message_us, true);
+    } else if (stream.packet < bam_packets(stream.config.size)) {
+        // TP.DT packets follow the TP.CM and each other at the BAM gap
+        stream.packet++;
+        stream.next_us = now_us + bam_gap_us;
+    } else {
+        schedule_next(stream, stream.message_us, true);
+    }
+    return true;
+}
+
+void Generator::schedule_next(Stream& stream, int64_t base_us, bool message_done) {
+    if (message_done) {
+        messages++;
+        stream.counter++;
+        stream.packet = 0;
+    }
+    // Jitter is applied around the ideal start, so it does not accumulate
+    stream.message_us = base_us + stream.period_us;
+    int64_t jitter = 0;
+    if (stream.config.jitter_us) {
+        jitter = (int64_t)(esp_random() % (2 * stream.config.jitter_us + 1)) - stream.config.jitter_us;
+    }
+    stream.next_us = stream.message_us + jitter;
+}
+
+void Generator::build_frame(const Stream& stream, can_frame* frame) const {
+    const StreamConfig& config = stream.config;
+    uint32_t priority = (uint32_t)config.priority << 26;
+    size_t index = &stream - streams;
+    uint8_t session = TP_SESSIONS[index % TP_SESSION_COUNT];
+
+    memset(frame->data, 0xFF, sizeof(frame->data));
+    frame->can_dlc = 8;
+
+    size_t offset = 0;
+    size_t count = 0;
+    uint8_t* out = frame->data;
+    if (!config.bam) {
+        frame->can_id = CAN_EFF_FLAG | priority | ((config.pgn & 0x3FFFF) << 8) | config.sa;
+        frame->can_dlc = config.size;
+        count = config.size;
+    } else if (stream.packet == 0) {
+        uint16_t packets = bam_packets(config.size);
+        frame->can_id = CAN_EFF_FLAG | priority | (0xECFFu << 8) | config.sa;
+        frame->data[0] = 0x20 | (session << 4);
+        frame->data[1] = config.size & 0xFF;
+        frame->data[2] = config.size >> 8;
+        frame->data[3] = packets > 255 ? 0xFF : packets;
+        frame->data[4] = 0xFF;
+        frame->data[5] = config.pgn & 0xFF;
+        frame->data[6] = (config.pgn >> 8) & 0xFF;
+        frame->data[7] = (config.pgn >> 16) & 0xFF;
+        return;
+    } else {
+        frame->can_id = CAN_EFF_FLAG | priority | (0xEBFFu << 8) | config.sa;
+        frame->data[0] = (((stream.packet - 1) % 15) + 1) | (session << 4);
+        offset = (size_t)(stream.packet - 1) * 7;
+        count = config.size - offset < 7 ? config.size - offset : 7;
+        out = frame->data + 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        switch (config.pattern) {
+        case Pattern::COUNTER: out[i] = (uint8_t)(stream.counter + offset + i); break;
+        case Pattern::RANDOM: out[i] = (uint8_t)esp_random(); break;
+        case Pattern::ZERO: out[i] = 0x00; break;
+        case Pattern::ONES: out[i] = 0xFF; break;
+        }
+    }
+}
+
+void Generator::end_step(int64_t now_us) {
+    double achieved = 100.0 * step_bits * 1e6 / ((double)bitrate * (now_us - step_start_us));
+    printf("{\"gen\":\"step\",\"requested\":%.1f,\"achieved\":%.2f,\"tx_busy\":%" PRIu32 ",\"late\":%" PRIu32 "}\n",
+           target_load, achieved, tx_busy, late);
+
+    sweep_index++;
+    if (sweep_index >= sweep_count) {
+        sweep_count = 0;
+        running = false;
+        printf("{\"gen\":\"sweep\",\"done\":true}\n");
+        return;
+    }
+    target_load = sweep_steps[sweep_index];
+    apply_load();
+    step_start_us = now_us;
+    step_bits = 0;
+}
+
+void Generator::print_report(const char* kind, int64_t elapsed_us) {
+    double achieved = elapsed_us > 0 ? 100.0 * window_bits * 1e6 / ((double)bitrate * elapsed_us) : last_load;
+    printf("{\"gen\":\"%s\",\"requested\":%.1f,\"nominal\":%.2f,\"achieved\":%.2f,\"frames\":%" PRIu32
+           ",\"messages\":%" PRIu32 ",\"tx_busy\":%" PRIu32 ",\"late\":%" PRIu32 "}\n",
+           kind, target_load, nominal_load(), achieved, frames, messages, tx_busy, late);
+}
+
+void Generator::print_status() {
+    Report r = report();
+    printf("{\"gen\":\"status\",\"running\":%s,\"streams\":%u,\"requested\":%.1f,\"nominal\":%.2f,"
+           "\"achieved\":%.2f,\"bam_gap_ms\":%.1f,\"frames\":%" PRIu32 ",\"tx_busy\":%" PRIu32 "}\n",
+           r.running ? "true" : "false", r.streams, r.requested_load, r.nominal_load, r.achieved_load,
+           bam_gap_us / 1000.0, r.frames, r.tx_busy);
+}
+
+static Pattern parse_pattern(const char* text, bool* ok) {
+    if (strcmp(text, "counter") == 0) return Pattern::COUNTER;
+    if (strcmp(text, "random") == 0) return Pattern::RANDOM;
+    if (strcmp(text, "zero") == 0) return Pattern::ZERO;
+    if (strcmp(text, "ones") == 0) return Pattern::ONES;
+    *ok = false;
+    return Pattern::COUNTER;
+}
+
+bool Generator::execute(const char* command) {
+    char buf[128];
+    strncpy(buf, command, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    const char* fields[10];
+    size_t n = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(buf, ",", &save); tok && n < 10; tok = strtok_r(NULL, ",", &save)) {
+        fields[n++] = tok;
+    }
+
+    bool ok = n > 0;
+    const char* op = ok ? fields[0] : "";
+    if (strcmp(op, "add") == 0 && n >= 6) {
+        StreamConfig config = {};
+        config.bam = strcmp(fields[1], "bam") == 0;
+        ok = config.bam || strcmp(fields[1], "sf") == 0;
+        config.pgn = strtoul(fields[2], NULL, 16);
+        config.sa = (uint8_t)strtoul(fields[3], NULL, 16);
+        config.period_us = (uint32_t)(strtod(fields[4], NULL) * 1000);
+        config.size = (uint16_t)atoi(fields[5]);
+        config.jitter_us = n > 6 ? (uint32_t)(strtod(fields[6], NULL) * 1000) : 0;
+        config.pattern = n > 7 ? parse_pattern(fields[7], &ok) : Pattern::COUNTER;
+        config.priority = n > 8 ? (uint8_t)atoi(fields[8]) : DEFAULT_PRIORITY;
+        ok = ok && add_stream(config);
+    } else if (strcmp(op, "mix") == 0) {
+        add_default_mix();
+    } else if (strcmp(op, "clear") == 0) {
+        stop();
+        clear_streams();
+    } else if (strcmp(op, "gap") == 0 && n == 2) {
+        set_bam_gap_us((uint32_t)(strtod(fields[1], NULL) * 1000));
+    } else if (strcmp(op, "load") == 0 && n == 2) {
+        ok = set_target_load(strtod(fields[1], NULL));
+    } else if (strcmp(op, "start") == 0) {
+        ok = start(n > 1 ? (uint32_t)atoi(fields[1]) : 0);
+    } else if (strcmp(op, "stop") == 0) {
+        stop();
+    } else if (strcmp(op, "sweep") == 0 && n == 5) {
+        ok = sweep(strtod(fields[1], NULL), strtod(fields[2], NULL), strtod(fields[3], NULL),
+                   (uint32_t)atoi(fields[4]));
+    } else if (strcmp(op, "status") != 0) {
+        ok = false;
+    }
+
+    if (ok) {
+        print_status();
+    } else {
+        printf("{\"gen\":\"error\",\"command\":\"%s\"}\n", command);
+    }
+    return ok;
+}
+
+}
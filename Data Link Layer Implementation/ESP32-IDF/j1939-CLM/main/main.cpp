@@ -20,6 +20,8 @@
  * MCP2515:
  * - SPI pins: MISO=GPIO19, MOSI=GPIO23, CLK=GPIO18, CS=GPIO5
  * - Interrupt pin: GPIO21
+ * TWAI instead (CAN controller in menuconfig): TX=GPIO25, RX=GPIO26 to a
+ *   3.3 V transceiver
  * LED outouts (for the door locks):
  * - Managed output pins: GPIO2(built-in LED), GPIO15, GPIO4, GPIO22
  * 
@@ -28,8 +30,54 @@
  *    - Command "np" with data "ON"/"unlock" turns GPIO pins on
  *    - Command "np" with data "OFF"/"lock" turns GPIO pins off
  *    - Other commands/data trigger temporary GPIO activation
+ *    - Command "ping" with data "count,size[,interval_ms]" measures the round
+ *      trip to the other nodes over CAN alone (CSV output), "stop" ends a run
+ *    - Command "echo" with data "on"/"off" controls answering such probes
+ *    - Command "gen" drives the bus traffic generator for load and soak
+ *      tests, e.g. "mix" then "sweep,10,60,10,5" (see traffic.cpp)
+ *    - Command "trace" with data "on"/"off"/"clear"/"dump" records when each
+ *      message passes each stage on this node; "dump" prints Chrome trace
+ *      JSON (see Test scripts/trace_capture.py)
+ *    - Command "prof" with data "dump"/"reset"/"dump,reset" prints the
+ *      per-function cycle histograms of a CONFIG_DIAG_PROFILE build
+ *    - Command "sched" with data "start"/"stop"/"dump" records task
+ *      switches, blocking and mutex holds of an idf.py -DSCHED_TRACE=ON
+ *      build; "dump" prints Chrome trace JSON
+ *    - Command "stats" with data "dump"/"reset"/"dump,reset" prints the
+ *      driver, J1939, queue, GPIO counters and histograms, one JSON line
+ *      per subsystem; "push,<ms>" repeats the dump, "push,0" stops
+ *    - Command "mem" prints the free heap, its low-water mark and largest
+ *      block, the stack high-water mark of every task and the heap accounts
+ *      with their compile-time limits
+ *    - Command "flash" with data "start[,<ms>]"/"stop" writes NVS in the
+ *      background to measure the receive latency ("rx" in "stats") while
+ *      flash is busy, e.g. with and without CONFIG_DIAG_HOT_PATH_IRAM
+ *    - Command "filter" with data "on"/"off" restricts reception to frames
+ *      addressed to this node or global (on from start-up), or accepts all;
+ *      compare "driver" rx_frames and "j1939" rx_other_da in "stats"
+ *    - Command "ota" with data "begin,..."/"data,..."/"end[,reboot]"/"abort"
+ *      updates another node's firmware over CAN through this one; driven by
+ *      Test scripts/ota_push.py (see can_ota.cpp). Every node accepts
+ *      updates addressed to it from a node with the same bus key.
+ *    - Command "time" with data "master[,<period ms>]"/"follow"/"off"/
+ *      "status" sets this node's part in the bus time sync (this node is
+ *      the master from start-up, see timesync.cpp); "status" prints the
+ *      offset, drift and last sync error
+ *    - Command "hb" with data "status"/"period,<ms>"/"on"/"off"/
+ *      "expect,<SA>"/"forget,<SA>" controls the authenticated heartbeat and
+ *      the peer table; missing peers and heartbeats without a valid token
+ *      are reported as {"alert":"heartbeat",...} (see heartbeat.cpp)
+ *    - Command "key" with data "<32 hex digits>" or "clear" stores the bus
+ *      key used from the next start; until one is stored the built-in
+ *      default is not trusted (see bus_key.cpp)
+ *    - Command "lanes" with data "status"/"critical,<PGN>"/"normal,<PGN>"/
+ *      "bulk,<PGN>"/"clear,<PGN>"/"priority,<0-6>" shows or changes how
+ *      received frames are split into the critical, normal and bulk receive
+ *      lanes (see rx_lanes.cpp); "stats" has each lane's latency
  * 
- * 2. CAN messages: Format [pgn_index,]message
+ * 2. CAN messages: Format [@XX,][pgn_index,]message
+ *    - Optional @XX sends peer-to-peer (PDU1) PGNs to address XX (hex)
+ *      instead of all nodes
  *    - Optional pgn_index (1-3) selects PGN type:
  *      1=PEER_TO_PEER, 2=GROUP_MESSAGE, 3=EXTRA
  *    - Messages ≤8 bytes sent as single frame
@@ -46,17 +94,35 @@
 #include "freertos/queue.h"
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <vector>
 #include <map>
 #include "driver/uart.h"
 #include "esp_vfs_dev.h"
-#include "mcp2515/mcp2515.h"
+#include "can_controller.h"
 #include "mcp2515/can.h"
 #include "j1939.h"
+#include "trace.h"
+#include "profile.h"
+#include "sched_trace.h"
+#include "metrics.h"
+#include "budget.h"
+#include "hot_path.h"
+#include "flash_stress.h"
+#include "probe.h"
+#include "can_ota.h"
+#include "timesync.h"
+#include "heartbeat.h"
+#include "bus_key.h"
+#include "rx_lanes.h"
+#include "traffic.h"
 #include "cJSON.h"
 
 const char *TAG = "CLM";
 #define SOURCE_ADDR 0x52
+#define TIME_ROLE TimeSync::Role::MASTER    // the other nodes follow this one
+#define BUS_BITRATE 500000      // matches CAN_500KBPS below
 #define PIN_NUM_MISO 19
 #define PIN_NUM_MOSI 23
 #define PIN_NUM_CLK 18
@@ -74,10 +140,16 @@ const gpio_num_t managed_pins[] = {BUILTIN_LED, GPIO_PIN_15, GPIO_PIN_4, GPIO_PI
 #define NUM_MANAGED_PINS (sizeof(managed_pins) / sizeof(managed_pins[0]))
 
 spi_device_handle_t spi_handle;
-MCP2515 *mcp2515;
+CanController *mcp2515;
 SemaphoreHandle_t spi_mutex = NULL;
 static QueueHandle_t gpio_evt_queue = NULL;
 J1939::Controller *j1939_controller = NULL;
+Probe::Prober *prober = NULL;
+CanOta::Updater *updater = NULL;
+TimeSync::Synchronizer *synchronizer = NULL;
+Heartbeat::Monitor *heartbeat = NULL;
+Traffic::Generator *generator = NULL;
+RxLanes::Dispatcher *dispatcher = NULL;
 TaskHandle_t receiver_task_handle = NULL;
 TaskHandle_t sender_task_handle = NULL;
 TaskHandle_t led_task_handle = NULL;
@@ -93,17 +165,111 @@ typedef struct {
     uint32_t duration_ms;
 } led_control_t;
 
+static int32_t queue_depth(void *queue) {
+    QueueHandle_t handle = *(QueueHandle_t *)queue;
+    return handle ? (int32_t)uxQueueMessagesWaiting(handle) : 0;
+}
+
+static Metrics::Counter can_interrupts("gpio", "can_interrupts");
+static Metrics::Counter outputs_on("gpio", "outputs_on");
+static Metrics::Gauge gpio_evt_depth("queue", "gpio_evt", queue_depth, &gpio_evt_queue);
+static Metrics::Counter gpio_evt_full("queue", "gpio_evt_full");
+static Metrics::Gauge led_control_depth("queue", "led_control", queue_depth, &led_control_queue);
+static Metrics::Gauge tx_pending("queue", "tx_pending");
+static Metrics::Counter tx_expired("queue", "tx_expired");
+static const uint32_t RX_LATENCY_US[] = {100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+static Metrics::Histogram rx_latency_us("rx", "latency_us", RX_LATENCY_US);     // interrupt to first frame decoded
+
+// Stacks, queue storage and the SPI mutex are reserved at link time; what
+// still comes from the heap is charged to an account reported by "mem"
+static Budget::StaticTask<2048> led_task_memory;
+static Budget::StaticTask<4096> receiver_task_memory;
+static Budget::StaticTask<4096> sender_task_memory;
+static Budget::StaticQueue<uint32_t, 10> gpio_evt_queue_memory;
+static Budget::StaticQueue<led_control_t, 5> led_control_queue_memory;
+static Budget::StaticMutex spi_mutex_memory;
+static Budget::Account uart_tx_heap("uart_tx", 16 * 1024);   // sender backlog
+static Budget::Account cjson_heap("cjson", 4 * 1024);        // one command's tree
+
+static void *cjson_malloc(size_t size) {
+    return cjson_heap.malloc(size);
+}
+
+static void cjson_free(void *ptr) {
+    cjson_heap.free(ptr);
+}
+
 static void IRAM_ATTR gpio_isr_handler(void *arg) {
-    uint32_t gpio_num = (uint32_t)arg;
-    xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
+    SchedTrace::isr_enter();
+    Trace::isr();
+    MCP2515::onInterrupt();
+    can_interrupts.inc();
+    uint32_t isr_time = (uint32_t)esp_timer_get_time();
+    if (xQueueSendFromISR(gpio_evt_queue, &isr_time, NULL) != pdTRUE) {
+        gpio_evt_full.inc();
+    }
+    SchedTrace::isr_exit();
+}
+
+#if CONFIG_CAN_BACKEND_TWAI
+// Receive alert of the TWAI backend, queued like the INT pin interrupt
+static void can_rx_notify(void *arg, int64_t time_us) {
+    can_interrupts.inc();
+    uint32_t isr_time = (uint32_t)time_us;
+    if (xQueueSend(gpio_evt_queue, &isr_time, 0) != pdTRUE) {
+        gpio_evt_full.inc();
+    }
+}
+#endif
+
+void on_j1939_message(void *context, uint32_t pgn, uint8_t src_addr, const uint8_t *data, size_t len) {
+    if (prober && prober->on_message(pgn, src_addr, data, len)) {
+        return;
+    }
+    if (updater && updater->on_message(pgn, src_addr, data, len)) {
+        return;
+    }
+    J1939::Controller::print_message(pgn, src_addr, data, len);
+}
+
+void ping_command(const char *arg) {
+    if (strcmp(arg, "stop") == 0) {
+        prober->stop();
+        return;
+    }
+
+    unsigned int count = 0, size = 0, interval_ms = 100;
+    if (sscanf(arg, "%u,%u,%u", &count, &size, &interval_ms) < 2 || count > 0xFFFF || size > 0xFFFF ||
+        !prober->start(count, size, interval_ms)) {
+        printf("{\"probe\":\"error\",\"usage\":\"count,size[,interval_ms] with size %u..%u\"}\n",
+               (unsigned int)Probe::MIN_SIZE, (unsigned int)Probe::MAX_SIZE);
+    }
+}
+
+// {"c":"filter","d":"on"|"off"}: receive only frames addressed to this node
+// or global (the default), or everything
+static void set_address_filter(const char *arg) {
+    bool enable = strcmp(arg, "on") == 0;
+    if (!enable && strcmp(arg, "off") != 0) {
+        printf("{\"filter\":\"error\",\"usage\":\"on|off\"}\n");
+        return;
+    }
+    bool ok = false;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        ok = j1939_controller->set_address_filter(enable);
+        xSemaphoreGive(spi_mutex);
+    }
+    printf("{\"filter\":\"%s\",\"sa\":\"%02X\",\"ok\":%s}\n", enable ? "on" : "off", SOURCE_ADDR, ok ? "true" : "false");
 }
 
 bool process_json_message(const uint8_t *data, size_t len) {
+    PROFILE_SCOPE("process_json_message");
+
     if (len < 2 || data[0] != '{' || data[len-1] != '}') {
         return false;
     }
     
-    char *json_str = (char*)malloc(len + 1);
+    char *json_str = (char*)cjson_heap.malloc(len + 1);
     if (!json_str) {
         ESP_LOGE(TAG, "Memory allocation failed");
         return false;
@@ -113,7 +279,7 @@ bool process_json_message(const uint8_t *data, size_t len) {
     json_str[len] = '\0';
     
     cJSON *root = cJSON_Parse(json_str);
-    free(json_str);
+    cjson_heap.free(json_str);
     
     if (!root) {
         return false;
@@ -161,6 +327,51 @@ bool process_json_message(const uint8_t *data, size_t len) {
                 xQueueSend(led_control_queue, &led_msg, portMAX_DELAY);
             }
         }
+        else if (strcmp(cmd, "ping") == 0) {
+            ping_command(data_val);
+        }
+        else if (strcmp(cmd, "echo") == 0) {
+            prober->set_echo(strcmp(data_val, "off") != 0);
+        }
+        else if (strcmp(cmd, "gen") == 0) {
+            generator->execute(data_val);
+        }
+        else if (strcmp(cmd, "trace") == 0) {
+            Trace::execute(data_val);
+        }
+        else if (strcmp(cmd, "prof") == 0) {
+            Profile::execute(data_val);
+        }
+        else if (strcmp(cmd, "sched") == 0) {
+            SchedTrace::execute(data_val);
+        }
+        else if (strcmp(cmd, "stats") == 0) {
+            Metrics::execute(data_val);
+        }
+        else if (strcmp(cmd, "mem") == 0) {
+            Budget::execute(data_val);
+        }
+        else if (strcmp(cmd, "flash") == 0) {
+            FlashStress::execute(data_val);
+        }
+        else if (strcmp(cmd, "filter") == 0) {
+            set_address_filter(data_val);
+        }
+        else if (strcmp(cmd, "ota") == 0) {
+            updater->execute(data_val);
+        }
+        else if (strcmp(cmd, "time") == 0) {
+            synchronizer->execute(data_val);
+        }
+        else if (strcmp(cmd, "hb") == 0) {
+            heartbeat->execute(data_val);
+        }
+        else if (strcmp(cmd, "key") == 0) {
+            BusKey::execute(data_val);
+        }
+        else if (strcmp(cmd, "lanes") == 0) {
+            dispatcher->execute(data_val);
+        }
         else {
             // ESP_LOGI(TAG, "Command '%s' detected, blinking LEDs", cmd);
             led_control_t led_msg;
@@ -206,8 +417,8 @@ void init_interrupt_pin() {
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
     gpio_config(&io_conf);
-    gpio_evt_queue = xQueueCreate(10, sizeof(uint32_t));
-    gpio_install_isr_service(0);
+    gpio_evt_queue = gpio_evt_queue_memory.create();
+    gpio_install_isr_service(HOT_PATH_INTR_FLAGS);
     gpio_isr_handler_add(PIN_NUM_INT, gpio_isr_handler, (void *)(uint32_t)PIN_NUM_INT);
     // ESP_LOGI(TAG, "GPIO interrupt initialized on pin %d", PIN_NUM_INT);
 }
@@ -234,6 +445,7 @@ void led_control_task(void *pvParameters) {
     for (;;) {
         if (xQueueReceive(led_control_queue, &control_msg, portMAX_DELAY)) {
             if (control_msg.turn_on) {
+                outputs_on.inc();
                 if (control_msg.duration_ms > 0) {
                     // ESP_LOGI(TAG, "Turning on all GPIOs for %" PRIu32 " ms", control_msg.duration_ms);
                     for (int i = 0; i < NUM_MANAGED_PINS; i++) {
@@ -261,15 +473,25 @@ void led_control_task(void *pvParameters) {
 }
 
 void receiver_task(void *pvParameters) {
-    uint32_t gpio_num;
+    uint32_t isr_time;
     can_frame frame;
     // ESP_LOGI(TAG, "Receiver task started");
     for (;;) {
-        if (xQueueReceive(gpio_evt_queue, &gpio_num, pdMS_TO_TICKS(100))) {
+        if (xQueueReceive(gpio_evt_queue, &isr_time, pdMS_TO_TICKS(100))) {
             if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+                bool first = true;
+                int64_t now = esp_timer_get_time();
+                int64_t rx_time = now - (uint32_t)((uint32_t)now - isr_time);
                 while (mcp2515->checkReceive()) {
-                    if (mcp2515->readMessage(&frame) == MCP2515::ERROR_OK) {
-                        j1939_controller->decode_j1939_message(&frame);
+                    if (mcp2515->readMessage(&frame) == CanController::ERROR_OK) {
+                        // Only the first frame of a drain raised the interrupt
+                        if (!synchronizer->on_frame(&frame, first ? rx_time : 0) && !heartbeat->on_frame(&frame)) {
+                            dispatcher->submit(&frame, first ? rx_time : 0);
+                        }
+                        if (first) {
+                            rx_latency_us.record((uint32_t)esp_timer_get_time() - isr_time);
+                            first = false;
+                        }
                     }
                 }
                 mcp2515->clearRXInterrupts();
@@ -278,8 +500,10 @@ void receiver_task(void *pvParameters) {
         } else {
             if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                 if (mcp2515->checkReceive()) {
-                    if (mcp2515->readMessage(&frame) == MCP2515::ERROR_OK) {
-                        j1939_controller->decode_j1939_message(&frame);
+                    if (mcp2515->readMessage(&frame) == CanController::ERROR_OK) {
+                        if (!synchronizer->on_frame(&frame, 0) && !heartbeat->on_frame(&frame)) {
+                            dispatcher->submit(&frame, 0);
+                        }
                         mcp2515->clearRXInterrupts();
                     }
                 }
@@ -287,10 +511,22 @@ void receiver_task(void *pvParameters) {
             }
         }
         vTaskDelay(10 / portTICK_PERIOD_MS);
-        j1939_controller->cleanup_stale_sessions();
     }
 }
 
+// Optional "@XX," prefix of a UART line: the destination address in hex for
+// peer-to-peer (PDU1) PGNs. Without it messages go to all nodes.
+static uint8_t parse_destination(uint8_t **line, size_t *len) {
+    uint8_t *p = *line;
+    if (*len >= 4 && p[0] == '@' && isxdigit(p[1]) && isxdigit(p[2]) && p[3] == ',') {
+        char hex[3] = {(char)p[1], (char)p[2], '\0'};
+        *line += 4;
+        *len -= 4;
+        return (uint8_t)strtoul(hex, NULL, 16);
+    }
+    return J1939::GLOBAL_ADDRESS;
+}
+
 void sender_task(void *pvParameters) {
     // ESP_LOGI(TAG, "Sender task started");
     uart_config_t uart_config = {
@@ -312,13 +548,15 @@ void sender_task(void *pvParameters) {
     
     typedef struct {
         uint32_t pgn;
+        uint8_t dst;
         uint8_t data[BUF_SIZE];
         size_t len;
         bool is_multi_frame;
         uint32_t timestamp;
+        uint16_t trace_id;
     } message_entry_t;
     
-    std::vector<message_entry_t> message_queue;
+    std::vector<message_entry_t, Budget::Allocator<message_entry_t, uart_tx_heap>> message_queue;
     
     while (1) {
         bool message_sent = false;
@@ -327,9 +565,9 @@ void sender_task(void *pvParameters) {
                 if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                     bool send_result;
                     if (it->is_multi_frame) {
-                        send_result = j1939_controller->send_multi_frame_message(it->pgn, it->data, it->len);
+                        send_result = j1939_controller->send_multi_frame_message(it->pgn, it->dst, it->data, it->len, it->trace_id);
                     } else {
-                        send_result = j1939_controller->send_single_frame_message(it->pgn, 0xFF, it->data, it->len);
+                        send_result = j1939_controller->send_single_frame_message(it->pgn, it->dst, it->data, it->len, it->trace_id);
                     }
                     xSemaphoreGive(spi_mutex);
                     if (send_result) {
@@ -339,6 +577,7 @@ void sender_task(void *pvParameters) {
                         uint32_t current_time = esp_log_timestamp();
                         if (current_time - it->timestamp > 5000) {
                             // ESP_LOGW(TAG, "Message in queue timed out, removing");
+                            tx_expired.inc();
                             it = message_queue.erase(it);
                         } else {
                             ++it;
@@ -355,11 +594,13 @@ void sender_task(void *pvParameters) {
             }
         }
         
+        tx_pending.set(message_queue.size());
         int len = uart_read_bytes(UART_NUM, data_ptr, 1, message_queue.empty() ? portMAX_DELAY : 10);
         if (len > 0) {
             data_ptr++;
             data_len++;
             if (*(data_ptr - 1) == '\n' || *(data_ptr - 1) == '\r' || data_len >= BUF_SIZE - 1) {
+                int64_t line_time = esp_timer_get_time();
                 *data_ptr = '\0';
                 data_ptr = data;
                 if (data_len > 0 && (data[data_len - 1] == '\n' || data[data_len - 1] == '\r')) {
@@ -375,14 +616,17 @@ void sender_task(void *pvParameters) {
                     // ESP_LOGI(TAG, "Non-JSON message, sending to CAN bus");
                     
                     uint8_t pgn_index = 0;
-                    uint8_t *message_start = data;
-                    size_t message_len = data_len;
+                    uint8_t *line = data;
+                    size_t line_len = data_len;
+                    uint8_t dst = parse_destination(&line, &line_len);
+                    uint8_t *message_start = line;
+                    size_t message_len = line_len;
                     uint32_t selected_pgn = J1939::PGN_EXTRA;
                     
-                    if (data_len >= 3 && data[0] >= '1' && data[0] <= '3' && data[1] == ',') {
-                        pgn_index = data[0] - '0';
-                        message_start = &data[2];
-                        message_len = data_len - 2;
+                    if (line_len >= 3 && line[0] >= '1' && line[0] <= '3' && line[1] == ',') {
+                        pgn_index = line[0] - '0';
+                        message_start = &line[2];
+                        message_len = line_len - 2;
                         
                         switch (pgn_index) {
                         case 1:
@@ -399,17 +643,20 @@ void sender_task(void *pvParameters) {
                             break;
                         }
                     } else {
-                        message_start = data;
-                        message_len = data_len;
+                        message_start = line;
+                        message_len = line_len;
                     }
                     
+                    uint16_t trace_id = Trace::begin();
+                    Trace::record_at(Trace::Stage::UART_LINE, trace_id, message_len, line_time);
+
                     bool sent = false;
                     if (j1939_controller->is_bus_available()) {
                         if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                             if (message_len <= 8) {
-                                sent = j1939_controller->send_single_frame_message(selected_pgn, 0xFF, message_start, message_len);
+                                sent = j1939_controller->send_single_frame_message(selected_pgn, dst, message_start, message_len, trace_id);
                             } else {
-                                sent = j1939_controller->send_multi_frame_message(selected_pgn, message_start, message_len);
+                                sent = j1939_controller->send_multi_frame_message(selected_pgn, dst, message_start, message_len, trace_id);
                             }
                             xSemaphoreGive(spi_mutex);
                         }
@@ -418,11 +665,15 @@ void sender_task(void *pvParameters) {
                     if (!sent) {
                         message_entry_t entry;
                         entry.pgn = selected_pgn;
+                        entry.dst = dst;
                         memcpy(entry.data, message_start, message_len);
                         entry.len = message_len;
                         entry.is_multi_frame = (message_len > 8);
                         entry.timestamp = esp_log_timestamp();
+                        entry.trace_id = trace_id;
                         message_queue.push_back(entry);
+                        tx_pending.set(message_queue.size());
+                        Trace::record(Trace::Stage::QUEUED, trace_id);
                     }
                 }
                 
@@ -444,47 +695,115 @@ extern "C" void app_main(void) {
     }
     ESP_ERROR_CHECK(ret);
     
+    cJSON_Hooks hooks = {cjson_malloc, cjson_free};
+    cJSON_InitHooks(&hooks);
+
+#if CONFIG_CAN_BACKEND_TWAI
+    static TwaiCan can_device;
+    mcp2515 = &can_device;
+    gpio_evt_queue = gpio_evt_queue_memory.create();
+    can_device.setReceiveNotify(can_rx_notify, NULL);
+#else
     if (!init_spi(&spi_handle)) {
         ESP_LOGE(TAG, "Failed to initialize SPI");
         return;
     }
-    
-    mcp2515 = new MCP2515(&spi_handle);
+
+    static MCP2515 mcp2515_device(&spi_handle);
+    mcp2515 = &mcp2515_device;
     init_interrupt_pin();
+#endif
     init_gpio_pins();
     
-    if (mcp2515->reset() != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to reset MCP2515");
+    if (mcp2515->reset() != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to reset CAN controller");
         return;
     }
     
-    if (mcp2515->setBitrate(CAN_500KBPS, MCP_8MHZ) != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to set MCP2515 bitrate");
+    if (mcp2515->setBitrate(CAN_500KBPS, MCP_8MHZ) != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to set CAN bitrate");
         return;
     }
     
-    if (mcp2515->setNormalMode() != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to set MCP2515 normal mode");
+    if (mcp2515->setNormalMode() != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to set CAN normal mode");
         return;
     }
     
-    mcp2515->setInterruptMask(MCP2515::CANINTF_RX0IF | MCP2515::CANINTF_RX1IF);
+    mcp2515->setInterruptMask(CanController::CANINTF_RX0IF | CanController::CANINTF_RX1IF);
     vTaskDelay(100 / portTICK_PERIOD_MS);
     
-    spi_mutex = xSemaphoreCreateMutex();
+    spi_mutex = spi_mutex_memory.create();
     
-    led_control_queue = xQueueCreate(5, sizeof(led_control_t));
+    led_control_queue = led_control_queue_memory.create();
     
-    j1939_controller = new J1939::Controller(mcp2515, SOURCE_ADDR);
+    SchedTrace::watch(spi_mutex, "spi_mutex");
+    SchedTrace::watch(gpio_evt_queue, "gpio_evt_queue");
+    SchedTrace::watch(led_control_queue, "led_control_queue");
+    Trace::init(SOURCE_ADDR);
+    static J1939::Controller j1939_device(mcp2515, SOURCE_ADDR);
+    j1939_controller = &j1939_device;
     if (!j1939_controller->init()) {
         ESP_LOGE(TAG, "Failed to initialize J1939 controller");
         return;
     }
+    if (!j1939_controller->set_address_filter(true)) {
+        ESP_LOGE(TAG, "Failed to set CAN acceptance filters");
+    }
+
+    static Probe::Prober prober_instance(j1939_controller, spi_mutex, SOURCE_ADDR);
+    prober = &prober_instance;
+    if (!prober->init()) {
+        ESP_LOGE(TAG, "Failed to initialize latency probe");
+        return;
+    }
+
+    static CanOta::Updater updater_instance(j1939_controller, spi_mutex, SOURCE_ADDR);
+    updater = &updater_instance;
+    if (!updater->init()) {
+        ESP_LOGE(TAG, "Failed to initialize CAN firmware update");
+        return;
+    }
+
+    static TimeSync::Synchronizer synchronizer_instance(mcp2515, spi_mutex, SOURCE_ADDR);
+    synchronizer = &synchronizer_instance;
+    if (!synchronizer->init(TIME_ROLE)) {
+        ESP_LOGE(TAG, "Failed to initialize time sync");
+        return;
+    }
+
+    static Heartbeat::Monitor heartbeat_instance(mcp2515, spi_mutex, SOURCE_ADDR, BUS_BITRATE);
+    heartbeat = &heartbeat_instance;
+    if (!heartbeat->init(true)) {
+        ESP_LOGE(TAG, "Failed to initialize heartbeat");
+        return;
+    }
+
+    static Traffic::Generator generator_instance(mcp2515, spi_mutex, BUS_BITRATE);
+    generator = &generator_instance;
+    if (!generator->init()) {
+        ESP_LOGE(TAG, "Failed to initialize traffic generator");
+        return;
+    }
+    j1939_controller->set_message_sink(on_j1939_message, NULL);
+
+    // Decodes from here on; OTA chunks come as transport messages and
+    // commands as single frames, so all of the updater's PGN goes to bulk
+    static RxLanes::Dispatcher dispatcher_instance(j1939_controller, spi_mutex);
+    dispatcher = &dispatcher_instance;
+    dispatcher->set_rule(CanOta::PGN_OTA, RxLanes::Lane::BULK);
+    if (!dispatcher->init()) {
+        // ESP_LOGE(TAG, "Failed to initialize receive lanes");
+        return;
+    }
     
     // ESP_LOGI(TAG, "MCP2515 and J1939 initialized and ready!");
     
-    xTaskCreate(led_control_task, "led_control", 2048, NULL, 5, &led_task_handle);
+    led_task_handle = led_task_memory.create(led_control_task, "led_control", NULL, 5);
     
-    xTaskCreate(receiver_task, "j1939_receiver", 4096, NULL, 10, &receiver_task_handle);
-    xTaskCreate(sender_task, "j1939_sender", 4096, NULL, 5, &sender_task_handle);
+    receiver_task_handle = receiver_task_memory.create(receiver_task, "j1939_receiver", NULL, 10);
+    sender_task_handle = sender_task_memory.create(sender_task, "j1939_sender", NULL, 5);
+
+    // Started up far enough to be kept if it came in over CAN
+    CanOta::Updater::confirm_running_image();
 }
\ No newline at end of file
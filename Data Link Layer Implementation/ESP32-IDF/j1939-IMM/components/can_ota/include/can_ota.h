@@ -0,0 +1,225 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+#include "j1939.h"
+#include "budget.h"
+#include "siphash.h"
+
+namespace CanOta {
+
+    // Proprietary A2, peer-to-peer: the destination is in the PS byte, so
+    // nodes with the address filter on never receive other nodes' images
+    constexpr uint32_t PGN_OTA = 0x1EF00;
+
+    // First byte of every message. From the gateway, all to one target:
+    //   BEGIN   size (LE32), version (LE32), SHA-256 of the image (32
+    //           bytes), MAC (LE64): SipHash-2-4 with the bus key over the
+    //           gateway's and the target's addresses, the size, the version
+    //           and the hash
+    //   DATA    offset (LE32), up to CHUNK_SIZE image bytes
+    //   END     1 to restart into the new image once it is verified, MAC
+    //           (LE64) over both addresses, the restart flag, the nonce of
+    //           the READY, the version and the hash
+    //   ABORT
+    // From the target to the gateway, a single frame:
+    //   STATUS  Status, offset (LE32): where the image continues for READY,
+    //           ACK, BUSY and BAD_OFFSET, the bytes written otherwise; READY
+    //           adds a fresh random nonce (NONCE_SIZE bytes)
+    enum class Op : uint8_t {
+        BEGIN = 1,
+        DATA = 2,
+        END = 3,
+        ABORT = 4,
+        STATUS = 0x80
+    };
+
+    enum class Status : uint8_t {
+        READY = 0,              // BEGIN accepted, possibly resuming
+        ACK = 1,                // chunk buffered; the next one may follow
+        BUSY = 2,               // both buffers in use, send the chunk again
+        BAD_OFFSET = 3,
+        DONE = 4,               // hash matched, boot partition set
+        NOT_STARTED = 5,
+        TOO_LARGE = 6,
+        NO_PARTITION = 7,
+        FLASH_ERROR = 8,
+        HASH_MISMATCH = 9,
+        INVALID_IMAGE = 10,     // rejected by esp_ota_set_boot_partition
+        ABORTED = 11,
+        BAD_MAC = 12,           // BEGIN or END not from a holder of the bus key, or none provisioned here
+        IN_PROGRESS = 13,       // another gateway's transfer is under way
+        OLD_VERSION = 14        // version below the last one installed here
+    };
+
+    constexpr size_t CHUNK_SIZE = 512;
+    constexpr size_t DATA_HEADER_SIZE = 5;
+    constexpr size_t HASH_SIZE = 32;
+    constexpr size_t MAC_SIZE = 8;
+    constexpr size_t NONCE_SIZE = 8;
+    constexpr size_t BEGIN_SIZE = 9 + HASH_SIZE + MAC_SIZE;
+    constexpr size_t END_SIZE = 2 + MAC_SIZE;
+    constexpr size_t STATUS_SIZE = 8;
+    constexpr size_t READY_SIZE = 6 + NONCE_SIZE;
+    constexpr size_t BUFFER_COUNT = 2;
+    constexpr uint32_t SECTOR_SIZE = 4096;
+
+    constexpr size_t JOB_QUEUE_LEN = 4;
+    constexpr uint32_t TASK_STACK_SIZE = 4096;
+    constexpr UBaseType_t TASK_PRIORITY = 4;        // below the J1939 sender and receiver
+    constexpr uint32_t RESTART_DELAY_MS = 1000;
+
+    // A transfer with no chunk from its gateway for this long may be taken
+    // over by another gateway's BEGIN or ABORT
+    constexpr uint32_t TAKEOVER_MS = 10000;
+
+    // Firmware update over CAN, on both ends of the bus.
+    //
+    // As the target, the node streams an image into the inactive OTA
+    // partition. on_message() runs on the receiver task and copies each
+    // DATA chunk into one of two buffers; the update task erases the sectors
+    // the chunk needs, acknowledges it and then programs it and feeds the
+    // SHA-256, so the gateway sends the next chunk while this one is
+    // written. Erases happen before the acknowledgement, when no chunk is
+    // arriving, and the image is never held in RAM.
+    //
+    // The bytes written are saved in NVS at every sector boundary: a BEGIN
+    // for the same image resumes there, after hashing what is already in
+    // flash, whether the gateway or this node was interrupted.
+    //
+    // Only a node with the provisioned bus key can start an update: the
+    // BEGIN carries a MAC over the size, version and hash of the image, so
+    // the image that ends up in the boot partition is one a key holder sent
+    // to this node. Chunks are not authenticated; forged ones fail the hash
+    // at END. A recorded transfer can't be replayed: END must carry a MAC
+    // over the nonce this node sent in its READY, and a version below the
+    // last one installed (kept in NVS) is refused at BEGIN.
+    // While a transfer is under way, BEGIN and ABORT from any other node are
+    // refused until it has stalled for TAKEOVER_MS.
+    //
+    // As the gateway, execute() sends the messages for a target from UART
+    // commands (Test scripts/ota_push.py) and the target's STATUS frames
+    // are printed as JSON lines.
+    class Updater {
+    public:
+        Updater(J1939::Controller* controller, SemaphoreHandle_t spi_mutex, uint8_t source_addr);
+        ~Updater();
+
+        bool init();
+
+        // Returns true if the message was an update message and has been consumed
+        bool on_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len);
+
+        // Gateway side, from {"c":"ota","d":"..."}:
+        //   "begin,<dst>,<size>,<version>,<sha256 hex>"
+        //   "data,<offset>,<base64>"
+        //   "end[,reboot]"
+        //   "abort"
+        bool execute(const char* command);
+
+        // Confirms the running image after an update, cancelling the
+        // rollback the bootloader would otherwise do on the next restart
+        static void confirm_running_image();
+
+    private:
+        enum class State : uint8_t {
+            IDLE,
+            PREPARING,          // BEGIN queued, resume point not known yet
+            RECEIVING,
+            FAILED
+        };
+
+        enum class JobType : uint8_t {
+            BEGIN,
+            DATA,
+            END,
+            ABORT,
+            REPLY
+        };
+
+        struct Job {
+            JobType type;
+            uint8_t src_addr;
+            uint8_t buffer;
+            Status status;
+            uint32_t offset;
+            uint32_t size;
+            uint32_t version;
+            bool reboot;
+            uint8_t hash[HASH_SIZE];
+            uint8_t mac[MAC_SIZE];
+        };
+
+        struct Buffer {
+            uint32_t offset;
+            uint16_t len;
+            uint8_t data[CHUNK_SIZE];
+        };
+
+        static void task_entry(void* arg);
+        void task_loop();
+        bool queue_job(const Job& job);
+        void queue_reply(uint8_t dst, Status status, uint32_t offset);
+        bool held_by_other(uint8_t src_addr) const;
+
+        void begin(const Job& job);
+        void write_chunk(const Job& job);
+        void finish(const Job& job);
+        void abort_update(const Job& job);
+        uint32_t load_resume_offset(const Job& job);
+        void save_progress(uint32_t offset, bool start);
+        void clear_progress();
+        void save_min_version(uint32_t version);
+        bool hash_flash(uint32_t size);
+        void reply(uint8_t dst, Status status, uint32_t offset, const uint8_t* ready_nonce = NULL);
+
+        // Gateway
+        bool send(const uint8_t* data, size_t len);
+        void print_status(uint8_t src_addr, Status status, uint32_t offset);
+
+        J1939::Controller* j1939;
+        SemaphoreHandle_t spi_mutex;
+        uint8_t source_address;
+        uint8_t key[SipHash::KEY_SIZE];
+        bool keyed;
+        QueueHandle_t jobs;
+        QueueHandle_t free_buffers;
+        TaskHandle_t task;
+        Budget::StaticQueue<Job, JOB_QUEUE_LEN> jobs_memory;
+        Budget::StaticQueue<uint8_t, BUFFER_COUNT> free_buffers_memory;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory;
+        Buffer buffers[BUFFER_COUNT];
+
+        // Target: state and next_offset are written by the update task and
+        // read by on_message on the receiver task
+        volatile State state;
+        volatile uint32_t next_offset;
+        volatile uint8_t gateway;       // set on the receiver task with the BEGIN
+        volatile int64_t last_chunk_us;
+        volatile uint32_t min_version;  // lowest version BEGIN may carry
+        const esp_partition_t* partition;
+        uint32_t image_size;
+        uint32_t image_version;
+        uint8_t nonce[NONCE_SIZE];
+        uint32_t written;
+        uint32_t erased;
+        uint8_t image_hash[HASH_SIZE];
+        mbedtls_sha256_context sha;
+
+        // Gateway: the target being updated and the nonce of its READY
+        uint8_t target;
+        uint32_t target_size;
+        uint32_t target_version;
+        uint8_t target_hash[HASH_SIZE];
+        uint8_t target_nonce[NONCE_SIZE];
+        bool have_nonce;
+        uint32_t resumed_from;
+        int64_t begin_us;
+    };
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// FreeRTOS trace macros for the scheduling trace (sched_trace.cpp).
+//
+// The project CMakeLists force-includes this header into every translation
+// unit when built with -DSCHED_TRACE=ON, so the FreeRTOS kernel sees these
+// definitions before its empty defaults in FreeRTOS.h. It must stay valid C
+// and must not be included directly.
+
+#if !defined(__ASSEMBLER__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void sched_trace_task_switched_in(void);
+void sched_trace_task_delay(void);
+void sched_trace_queue(void* queue, int op);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define SCHED_TRACE_QUEUE_SEND              0
+#define SCHED_TRACE_QUEUE_SEND_FROM_ISR     1
+#define SCHED_TRACE_QUEUE_RECEIVE           2
+#define SCHED_TRACE_QUEUE_RECEIVE_FROM_ISR  3
+#define SCHED_TRACE_QUEUE_RECEIVE_FAILED    4
+#define SCHED_TRACE_BLOCK_SEND              5
+#define SCHED_TRACE_BLOCK_RECEIVE           6
+
+#define traceTASK_SWITCHED_IN()                 sched_trace_task_switched_in()
+#define traceTASK_DELAY()                       sched_trace_task_delay()
+#define traceTASK_DELAY_UNTIL(xTimeToWake)      sched_trace_task_delay()
+
+// Mutexes and semaphores are queues: take is a receive, give a send
+#define traceQUEUE_SEND(pxQueue)                sched_trace_queue((void*)(pxQueue), SCHED_TRACE_QUEUE_SEND)
+#define traceQUEUE_SEND_FROM_ISR(pxQueue)       sched_trace_queue((void*)(pxQueue), SCHED_TRACE_QUEUE_SEND_FROM_ISR)
+#define traceQUEUE_RECEIVE(pxQueue)             sched_trace_queue((void*)(pxQueue), SCHED_TRACE_QUEUE_RECEIVE)
+#define traceQUEUE_RECEIVE_FROM_ISR(pxQueue)    sched_trace_queue((void*)(pxQueue), SCHED_TRACE_QUEUE_RECEIVE_FROM_ISR)
+#define traceQUEUE_RECEIVE_FAILED(pxQueue)      sched_trace_queue((void*)(pxQueue), SCHED_TRACE_QUEUE_RECEIVE_FAILED)
+#define traceBLOCKING_ON_QUEUE_SEND(pxQueue)    sched_trace_queue((void*)(pxQueue), SCHED_TRACE_BLOCK_SEND)
+#define traceBLOCKING_ON_QUEUE_RECEIVE(pxQueue) sched_trace_queue((void*)(pxQueue), SCHED_TRACE_BLOCK_RECEIVE)
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * @file profile.cpp
+ * @brief Scoped cycle-counter profiler with per-site log2 histograms
+ * @version 1.0
+ *
+ * Functions wrapped in PROFILE_SCOPE("name") add their duration in CPU cycles
+ * (CCOUNT on the ESP32, rdtsc or clock_gettime on the host) to a histogram
+ * with one bucket per power of two, kept per core so no locks are taken on
+ * the hot path:
+ *
+ *   {"c":"prof","d":"dump"}         one JSON line per site
+ *   {"c":"prof","d":"dump,reset"}
+ *
+ * Profiling is compiled in with CONFIG_DIAG_PROFILE (Component config ->
+ * Diagnostics in menuconfig); otherwise the macro is empty and the command
+ * reports it as disabled.
+ *
+ */
+
+#include "profile.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(ESP_PLATFORM)
+#include "esp_private/esp_clk.h"
+#else
+#include <time.h>
+#endif
+
+namespace Profile {
+
+static const char* site_names[MAX_SITES];
+static uint32_t registered = 0;
+static Histogram histograms[CORES][MAX_SITES];
+static uint32_t migrated = 0;
+
+uint16_t register_site(const char* name) {
+    uint32_t count = __atomic_load_n(&registered, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count && i < MAX_SITES; i++) {
+        if (site_names[i] && strcmp(site_names[i], name) == 0) {
+            return (uint16_t)i;
+        }
+    }
+    uint32_t index = __atomic_fetch_add(&registered, 1, __ATOMIC_ACQ_REL);
+    if (index >= MAX_SITES) {
+        return NO_SITE;
+    }
+    site_names[index] = name;
+    return (uint16_t)index;
+}
+
+void add(uint16_t site, uint8_t core, uint32_t duration) {
+    if (site >= MAX_SITES) {
+        return;
+    }
+    Histogram& h = histograms[core][site];
+    uint32_t bucket = duration ? 31 - __builtin_clz(duration) : 0;
+
+    __atomic_fetch_add(&h.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h.buckets[bucket], 1, __ATOMIC_RELAXED);
+    h.total += duration;
+    if (duration > h.max) {
+        h.max = duration;
+    }
+}
+
+void add_migrated() {
+    __atomic_fetch_add(&migrated, 1, __ATOMIC_RELAXED);
+}
+
+size_t site_count() {
+    uint32_t count = __atomic_load_n(&registered, __ATOMIC_ACQUIRE);
+    return count < MAX_SITES ? count : MAX_SITES;
+}
+
+bool get(uint16_t site, const char** name, Histogram* out) {
+    if (site >= site_count() || !site_names[site]) {
+        return false;
+    }
+    memset(out, 0, sizeof(*out));
+    for (size_t c = 0; c < CORES; c++) {
+        const Histogram& h = histograms[c][site];
+        out->count += h.count;
+        out->total += h.total;
+        if (h.max > out->max) {
+            out->max = h.max;
+        }
+        for (size_t b = 0; b < BUCKETS; b++) {
+            out->buckets[b] += h.buckets[b];
+        }
+    }
+    *name = site_names[site];
+    return true;
+}
+
+#if defined(ESP_PLATFORM)
+double cycles_per_us() {
+    return esp_clk_cpu_freq() / 1e6;
+}
+#else
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The TSC rate is not exposed portably; measure it once against the clock
+double cycles_per_us() {
+#if defined(__x86_64__) || defined(__i386__)
+    static double rate = 0;
+    if (rate == 0) {
+        uint64_t start_ns = monotonic_ns();
+        uint64_t start = __rdtsc();
+        while (monotonic_ns() - start_ns < 20000000) {
+        }
+        rate = (double)(__rdtsc() - start) * 1000.0 / (monotonic_ns() - start_ns);
+    }
+    return rate;
+#else
+    return 1000.0;
+#endif
+}
+#endif
+
+// Geometric middle of the bucket holding the given fraction of samples
+static double percentile_cycles(const Histogram& h, double fraction) {
+    uint64_t target = (uint64_t)(fraction * h.count + 0.5);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUCKETS; b++) {
+        seen += h.buckets[b];
+        if (seen >= target && h.buckets[b]) {
+            return (double)(1u << b) * 1.41421356;
+        }
+    }
+    return h.max;
+}
+
+void dump() {
+    double rate = cycles_per_us();
+    size_t count = site_count();
+    printf("{\"prof\":\"info\",\"enabled\":%s,\"cycles_per_us\":%.1f,\"sites\":%u,\"migrated\":%u}\n",
+           PROFILE_ENABLED ? "true" : "false", rate, (unsigned int)count, (unsigned int)migrated);
+
+    for (uint16_t site = 0; site < count; site++) {
+        const char* name;
+        Histogram h;
+        if (!get(site, &name, &h)) {
+            continue;
+        }
+        double mean = h.count ? (double)h.total / h.count : 0;
+        printf("{\"prof\":\"%s\",\"count\":%u,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,"
+               "\"buckets\":{",
+               name, (unsigned int)h.count, mean / rate, percentile_cycles(h, 0.5) / rate,
+               percentile_cycles(h, 0.99) / rate, h.max / rate);
+        bool first = true;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            if (h.buckets[b]) {
+                printf("%s\"%u\":%u", first ? "" : ",", (unsigned int)b, (unsigned int)h.buckets[b]);
+                first = false;
+            }
+        }
+        printf("}}\n");
+    }
+}
+
+void reset() {
+    memset(histograms, 0, sizeof(histograms));
+    migrated = 0;
+}
+
+bool execute(const char* command) {
+    if (strcmp(command, "dump") == 0) {
+        dump();
+    } else if (strcmp(command, "reset") == 0) {
+        reset();
+        printf("{\"prof\":\"reset\"}\n");
+    } else if (strcmp(command, "dump,reset") == 0) {
+        dump();
+        reset();
+    } else {
+        printf("{\"prof\":\"error\",\"usage\":\"dump|reset|dump,reset\"}\n");
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,72 @@
+/**
+ * @file sync_clock.cpp
+ * @brief Local esp_timer time mapped onto the bus time master's clock
+ * @version 1.0
+ *
+ * The mapping is published with a sequence lock: the writer makes the
+ * sequence odd while it copies the parameters and readers retry until they
+ * see the same even sequence before and after reading. Readers on either
+ * core never block the J1939 receiver that writes it.
+ *
+ */
+
+#include "sync_clock.h"
+
+namespace SyncClock {
+
+struct Mapping {
+    int64_t local_ref_us;
+    int64_t sync_ref_us;
+    int32_t drift_ppb;
+    bool synced;
+};
+
+static Mapping mapping = {0, 0, 0, false};
+static uint32_t sequence = 0;
+
+static Mapping load() {
+    Mapping copy;
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+        copy = mapping;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return copy;
+}
+
+static void store(const Mapping& next) {
+    uint32_t s = __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&sequence, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    mapping = next;
+    __atomic_store_n(&sequence, s + 2, __ATOMIC_RELEASE);
+}
+
+bool is_synced() {
+    return load().synced;
+}
+
+int64_t to_sync(int64_t local_us) {
+    Mapping m = load();
+    if (!m.synced) {
+        return local_us;
+    }
+    int64_t elapsed = local_us - m.local_ref_us;
+    return m.sync_ref_us + elapsed + elapsed * m.drift_ppb / 1000000000;
+}
+
+void set(int64_t local_ref_us, int64_t sync_ref_us, int32_t drift_ppb) {
+    store({local_ref_us, sync_ref_us, drift_ppb, true});
+}
+
+void set_master() {
+    store({0, 0, 0, true});
+}
+
+void reset() {
+    store({0, 0, 0, false});
+}
+
+}
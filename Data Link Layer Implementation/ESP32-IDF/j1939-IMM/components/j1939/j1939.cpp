@@ -12,6 +12,7 @@
  * - Complete J1939 transport protocol implementation (TP.BAM)
  * - Multi-session support with up to 6 concurrent sessions
  * - Automatic session management and timeout handling
+ * - Per-source reassembly quotas and a heap budget with eviction
  * - JSON-formatted message output for received frames
  * - Bus availability management to prevent collisions
  * - Robust error handling and recovery mechanisms
@@ -42,18 +43,57 @@
 #include "j1939.h"
 #include "mcp2515/mcp2515.h"
 #include "mcp2515/can.h"
+#include "profile.h"
+#include "sched_trace.h"
+#include "metrics.h"
+#include "hot_path.h"
+#include "sync_clock.h"
 #include <inttypes.h>
 
 static const char *TAG = "j1939";
 
+Budget::Account J1939::heap("j1939", J1939::HEAP_BUDGET);
+
+static Metrics::Counter rx_frames("j1939", "rx_frames");
+static Metrics::Counter rx_single("j1939", "rx_single");
+static Metrics::Counter rx_other_da("j1939", "rx_other_da");
+static Metrics::Counter bam_started("j1939", "bam_started");
+static Metrics::Counter bam_completed("j1939", "bam_completed");
+static Metrics::Counter bam_dropped("j1939", "bam_dropped");
+static Metrics::Counter sessions_stale("j1939", "sessions_stale");
+static Metrics::Counter sessions_no_data("j1939", "sessions_no_data");
+static Metrics::Counter sessions_evicted("j1939", "sessions_evicted");
+static Metrics::Counter bam_over_quota("j1939", "bam_over_quota");
+static Metrics::Counter bam_over_budget("j1939", "bam_over_budget");
+static Metrics::Counter bus_busy_expired("j1939", "bus_busy_expired");
+static Metrics::Counter tx_single("j1939", "tx_single");
+static Metrics::Counter tx_bam("j1939", "tx_bam");
+static Metrics::Counter tx_failed("j1939", "tx_failed");
+static Metrics::Gauge sessions("j1939", "sessions");
+
+static const uint32_t MESSAGE_BYTES[] = {16, 32, 64, 128, 256, 512, 1024};
+static Metrics::Histogram rx_message_bytes("j1939", "rx_message_bytes", MESSAGE_BYTES);
+static const uint32_t REASSEMBLY_MS[] = {10, 20, 50, 100, 200, 500, 1000, 2000};
+static Metrics::Histogram reassembly_ms("j1939", "reassembly_ms", REASSEMBLY_MS);
+
 namespace J1939 {
 
-Controller::Controller(MCP2515* mcp, uint8_t source_addr)
+// Sessions announced without data time out after FIRST_PACKET_TIMEOUT_MS
+static bool is_stale(const MultiFrameMessage &mfm, uint32_t current_time) {
+    uint32_t timeout = mfm.packets_received ? SESSION_TIMEOUT_MS : FIRST_PACKET_TIMEOUT_MS;
+    return current_time - mfm.last_activity_time > timeout;
+}
+
+Controller::Controller(CanController* mcp, uint8_t source_addr)
     : mcp2515(mcp),
       source_address(source_addr),
+      address_filter(false),
       bus_busy(false),
-      bus_busy_timeout(0) {
-    bus_state_mutex = xSemaphoreCreateMutex();
+      bus_busy_timeout(0),
+      message_sink(NULL),
+      sink_context(NULL) {
+    memset(abandoned_sources, 0, sizeof(abandoned_sources));
+    bus_state_mutex = bus_state_mutex_memory.create();
 }
 
 Controller::~Controller() {
@@ -63,6 +103,7 @@ Controller::~Controller() {
 }
 
 bool Controller::init() {
+    SchedTrace::watch(bus_state_mutex, "bus_state_mutex");
     return (bus_state_mutex != NULL);
 }
 
@@ -110,7 +151,68 @@ const char* Controller::pgn_to_string(uint32_t pgn) {
     }
 }
 
-bool Controller::is_bus_available() {
+uint32_t Controller::make_can_id(uint32_t pgn, uint8_t dst, uint8_t src, uint8_t priority) {
+    uint8_t pdu_format = (pgn >> 8) & 0xFF;
+    uint8_t pdu_specific = (pdu_format < 240) ? dst : (pgn & 0xFF);
+
+    return ((uint32_t)(priority & 0x07) << 26) | ((pgn & 0x30000) << 8) | ((uint32_t)pdu_format << 16) |
+           ((uint32_t)pdu_specific << 8) | src | CAN_EFF_FLAG;
+}
+
+// MASK0 compares the PDU specific byte: RXF0 this node, RXF1 global. MASK1
+// compares the top four PF bits, which are all set for PDU2 (PF >= 240):
+// RXF2-5. Filters match extended frames only.
+bool Controller::set_address_filter(bool enable) {
+    const uint32_t ps_mask = enable ? 0x0000FF00 : 0;
+    const uint32_t pdu2_mask = enable ? 0x00F00000 : 0;
+    const uint32_t pdu2 = 0x00F00000;
+
+    bool ok = mcp2515->setFilterMask(CanController::MASK0, true, ps_mask) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF0, true, (uint32_t)source_address << 8) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF1, true, (uint32_t)GLOBAL_ADDRESS << 8) == CanController::ERROR_OK &&
+              mcp2515->setFilterMask(CanController::MASK1, true, pdu2_mask) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF2, true, pdu2) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF3, true, pdu2) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF4, true, pdu2) == CanController::ERROR_OK &&
+              mcp2515->setFilter(CanController::RXF5, true, pdu2) == CanController::ERROR_OK;
+
+    // Back to normal mode even if a filter failed, so the node keeps running
+    ok = (mcp2515->setNormalMode() == CanController::ERROR_OK) && ok;
+    address_filter = enable && ok;
+    return ok;
+}
+
+void Controller::set_message_sink(MessageSink sink, void* context) {
+    message_sink = sink;
+    sink_context = context;
+}
+
+void Controller::print_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len) {
+    PROFILE_SCOPE("j1939_print_message");
+
+    // One line from several printf calls, which receive lanes could
+    // otherwise interleave
+    flockfile(stdout);
+    if (len <= 8) {
+        printf("{\"pgn\":\"%05" PRIx32 "\",\"sender\":%02X,\"size\":\"SF\",\"data\":\"", pgn, src_addr);
+    } else {
+        printf("{\"pgn\":\"%05" PRIx32 "\",\"sender\":%02X,\"size\":%u,\"data\":\"", pgn, src_addr, (unsigned int)len);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        printf("%02X", data[i]);
+    }
+
+    if (SyncClock::is_synced()) {
+        int64_t t = SyncClock::now();
+        printf("\",\"t\":%" PRId64 ".%06" PRId64 "}\n", t / 1000000, t % 1000000);
+    } else {
+        printf("\"}\n");
+    }
+    funlockfile(stdout);
+}
+
+bool HOT_PATH Controller::is_bus_available() {
     bool available = true;
 
     if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
@@ -118,6 +220,7 @@ bool Controller::is_bus_available() {
             uint32_t current_time = esp_log_timestamp();
             if (current_time > bus_busy_timeout) {
                 ESP_LOGW(TAG, "BAM session timed out, releasing bus");
+                bus_busy_expired.inc();
                 bus_busy = false;
                 active_bam_sessions.clear();
                 available = true;
@@ -133,7 +236,7 @@ bool Controller::is_bus_available() {
     return available;
 }
 
-bool Controller::is_session_valid(uint8_t session_number, uint8_t src_addr) {
+bool HOT_PATH Controller::is_session_valid(uint8_t session_number, uint8_t src_addr) {
     if (!is_valid_session(session_number)) {
         return false;
     }
@@ -145,56 +248,139 @@ bool Controller::is_session_valid(uint8_t session_number, uint8_t src_addr) {
         return true;
     }
 
-    uint32_t current_time = esp_log_timestamp();
-    if (current_time - it->second.last_activity_time > SESSION_TIMEOUT_MS) {
+    if (is_stale(it->second, esp_log_timestamp())) {
         multi_frame_messages.erase(it);
+        release_session(session_id);
+        return true;
+    }
+    return false;
+}
 
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
-                active_bam_sessions.erase(session_id);
+void Controller::release_session(uint16_t session_id) {
+    if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
+            active_bam_sessions.erase(session_id);
 
-                if (active_bam_sessions.empty()) {
-                    bus_busy = false;
-                }
+            if (active_bam_sessions.empty()) {
+                bus_busy = false;
             }
-            xSemaphoreGive(bus_state_mutex);
         }
-        return true;
+        xSemaphoreGive(bus_state_mutex);
     }
-    return false;
+}
+
+// Admits a new reassembly session of src_addr against its quota and the heap
+// budget. When the budget is short, sessions are evicted in order of least
+// progress (share of packets received, then the longest idle); sessions
+// still receiving data are not evicted. Evicting a session that never got
+// data marks its source abandoned, as its timeout would have.
+bool Controller::admit_session(uint8_t src_addr, uint16_t message_size) {
+    size_t cost = message_size + SESSION_OVERHEAD;
+    size_t total = 0;
+    size_t source_bytes = 0;
+    uint8_t source_sessions = 0;
+
+    for (const auto &item : multi_frame_messages) {
+        size_t item_cost = item.second.total_size + SESSION_OVERHEAD;
+        total += item_cost;
+        if (item.second.source_addr == src_addr) {
+            source_sessions++;
+            source_bytes += item_cost;
+        }
+    }
+
+    if (source_sessions >= MAX_SESSIONS_PER_SOURCE || source_bytes + cost > MAX_BYTES_PER_SOURCE) {
+        ESP_LOGW(TAG, "Source 0x%02X over its reassembly quota (%u sessions, %u bytes)",
+                src_addr, source_sessions, (unsigned int)source_bytes);
+        bam_over_quota.inc();
+        return false;
+    }
+
+    uint32_t current_time = esp_log_timestamp();
+    while (total + cost > HEAP_BUDGET) {
+        auto victim = multi_frame_messages.end();
+        for (auto it = multi_frame_messages.begin(); it != multi_frame_messages.end(); ++it) {
+            const MultiFrameMessage &mfm = it->second;
+            if (mfm.packets_received > 0 && current_time - mfm.last_activity_time <= FIRST_PACKET_TIMEOUT_MS) {
+                continue;
+            }
+            if (victim == multi_frame_messages.end()) {
+                victim = it;
+                continue;
+            }
+            const MultiFrameMessage &least = victim->second;
+            uint32_t progress = (uint32_t)mfm.packets_received * least.total_packets;
+            uint32_t least_progress = (uint32_t)least.packets_received * mfm.total_packets;
+            if (progress < least_progress ||
+                (progress == least_progress && (int32_t)(mfm.last_activity_time - least.last_activity_time) < 0)) {
+                victim = it;
+            }
+        }
+
+        if (victim == multi_frame_messages.end()) {
+            ESP_LOGW(TAG, "Reassembly budget full, dropping %u byte message from src 0x%02X",
+                    message_size, src_addr);
+            bam_over_budget.inc();
+            return false;
+        }
+
+        uint16_t session_id = victim->first;
+        uint8_t victim_src = victim->second.source_addr;
+        ESP_LOGW(TAG, "Evicting session %s from src 0x%02X at %u/%u packets",
+                session_name(victim->second.session_number), victim_src,
+                victim->second.packets_received, victim->second.total_packets);
+        if (victim->second.packets_received == 0) {
+            abandoned_sources[victim_src >> 5] |= 1u << (victim_src & 31);
+        }
+        total -= victim->second.total_size + SESSION_OVERHEAD;
+        multi_frame_messages.erase(victim);
+        release_session(session_id);
+        sessions_evicted.inc();
+    }
+    return true;
 }
 
 void Controller::cleanup_stale_sessions() {
+    PROFILE_SCOPE("j1939_cleanup_stale_sessions");
+
     uint32_t current_time = esp_log_timestamp();
     std::vector<uint16_t> sessions_to_remove;
 
     for (const auto &item : multi_frame_messages) {
-        if (current_time - item.second.last_activity_time > SESSION_TIMEOUT_MS) {
+        if (is_stale(item.second, current_time)) {
             uint8_t session = (item.first >> 8) & 0xFF;
             uint8_t src = item.first & 0xFF;
             ESP_LOGW(TAG, "Removing stale session %s (0x%X) from src 0x%02X",
                     session_name(session), session, src);
             sessions_to_remove.push_back(item.first);
+            sessions_stale.inc();
+            if (item.second.packets_received == 0) {
+                sessions_no_data.inc();
+            }
+            abandoned_sources[src >> 5] |= 1u << (src & 31);
         }
     }
 
     for (uint16_t session_id : sessions_to_remove) {
         multi_frame_messages.erase(session_id);
-
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
-                active_bam_sessions.erase(session_id);
-
-                if (active_bam_sessions.empty()) {
-                    bus_busy = false;
-                }
-            }
-            xSemaphoreGive(bus_state_mutex);
-        }
+        release_session(session_id);
     }
 }
 
 void Controller::process_complete_message(const MultiFrameMessage &mfm) {
+    PROFILE_SCOPE("j1939_complete_message");
+
+    bam_completed.inc();
+    rx_message_bytes.record(mfm.data.size());
+    reassembly_ms.record(esp_log_timestamp() - mfm.start_time);
+
+    if (message_sink) {
+        message_sink(sink_context, mfm.pgn, mfm.source_addr, mfm.data.data(), mfm.data.size());
+        Trace::record(Trace::Stage::SINK, mfm.trace_id);
+        return;
+    }
+
+    flockfile(stdout);
     printf("{\"pgn\":\"%05" PRIx32 "\",\"sender\":%02X,\"size\":%u,\"data\":\"", 
            mfm.pgn, mfm.source_addr, (unsigned int)mfm.total_size);
 
@@ -203,9 +389,11 @@ void Controller::process_complete_message(const MultiFrameMessage &mfm) {
     }
 
     printf("\"}\n");
+    funlockfile(stdout);
+    Trace::record(Trace::Stage::SINK, mfm.trace_id);
 }
 
-void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
+void HOT_PATH Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
     uint8_t control_byte = frame->data[0];
     uint8_t session_number = (control_byte >> 4) & 0x0F;
     const char *session_id_name = session_name(session_number);
@@ -214,6 +402,7 @@ void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
     if (!is_session_valid(session_number, src_addr)) {
         ESP_LOGW(TAG, "Invalid or busy session: %s (0x%X) from src 0x%02X",
                 session_id_name, session_number, src_addr);
+        bam_dropped.inc();
         return;
     }
 
@@ -233,10 +422,19 @@ void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
         if (message_size == 0 || calculated_packets == 0) {
             ESP_LOGW(TAG, "Invalid BAM parameters: size=%u, packets=%u",
                     message_size, calculated_packets);
+            bam_dropped.inc();
+            return;
+        }
+
+        if (!admit_session(src_addr, message_size)) {
             return;
         }
 
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        // Only BAMs to everyone hold our transmitter back; an addressed
+        // transfer's receiver may answer while it is in progress
+        bool broadcast = ((frame->can_id >> 8) & 0xFF) == GLOBAL_ADDRESS;
+        bool abandoned = abandoned_sources[src_addr >> 5] & (1u << (src_addr & 31));
+        if (broadcast && !abandoned && xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
             bus_busy = true;
             bus_busy_timeout = esp_log_timestamp() + (total_packets * 200) + 500;
             active_bam_sessions[session_id] = true;
@@ -254,11 +452,18 @@ void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
         mfm.total_packets = total_packets;
         mfm.complete = false;
         mfm.last_activity_time = esp_log_timestamp();
+        mfm.start_time = mfm.last_activity_time;
+        mfm.trace_id = Trace::from_tag(src_addr, frame->data[4]);
+        bam_started.inc();
+
+        Trace::record_at(Trace::Stage::RX_ISR, mfm.trace_id, 0, Trace::last_isr_time());
+        Trace::record(Trace::Stage::RX_ANNOUNCE, mfm.trace_id);
     }
     else if ((control_byte & 0x0F) == 0x01) {
         uint16_t message_size = frame->data[1] | (frame->data[2] << 8);
         uint16_t total_packets = frame->data[3];
-        uint8_t max_packets = frame->data[4];
+        // data[4], the most packets per CTS, only matters to the node that
+        // answers with CTS; the RTS session is followed, not answered
         uint32_t pgn = frame->data[5] | (frame->data[6] << 8) | (frame->data[7] << 16);
 
         uint16_t calculated_packets = (message_size + 6) / 7;
@@ -267,6 +472,10 @@ void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
             total_packets = calculated_packets;
         }
 
+        if (!admit_session(src_addr, message_size)) {
+            return;
+        }
+
         MultiFrameMessage &mfm = multi_frame_messages[session_id];
         mfm.data.clear();
         mfm.data.reserve(message_size);
@@ -278,26 +487,20 @@ void Controller::parse_tp_cm(const can_frame *frame, uint8_t src_addr) {
         mfm.total_packets = total_packets;
         mfm.complete = false;
         mfm.last_activity_time = esp_log_timestamp();
+        mfm.start_time = mfm.last_activity_time;
+        mfm.trace_id = Trace::NO_TRACE;
+        bam_started.inc();
     }
     else if (control_byte == 255) {
         if (multi_frame_messages.find(session_id) != multi_frame_messages.end()) {
             multi_frame_messages.erase(session_id);
+            bam_dropped.inc();
         }
-
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
-                active_bam_sessions.erase(session_id);
-
-                if (active_bam_sessions.empty()) {
-                    bus_busy = false;
-                }
-            }
-            xSemaphoreGive(bus_state_mutex);
-        }
+        release_session(session_id);
     }
 }
 
-void Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
+void HOT_PATH Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
     uint8_t first_byte = frame->data[0];
     uint8_t sequence_number = first_byte & 0x0F;
     uint8_t session_number = (first_byte >> 4) & 0x0F;
@@ -312,6 +515,7 @@ void Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
     if (it == multi_frame_messages.end()) {
         ESP_LOGW(TAG, "Received TP.DT for unknown session: %s (0x%X)",
                 session_name(session_number), session_number);
+        bam_dropped.inc();
         return;
     }
 
@@ -329,17 +533,8 @@ void Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
         ESP_LOGW(TAG, "Out of sequence packet: got %u, expected %u",
                 sequence_number, expected_seq);
         multi_frame_messages.erase(it);
-
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
-                active_bam_sessions.erase(session_id);
-
-                if (active_bam_sessions.empty()) {
-                    bus_busy = false;
-                }
-            }
-            xSemaphoreGive(bus_state_mutex);
-        }
+        bam_dropped.inc();
+        release_session(session_id);
         return;
     }
 
@@ -347,6 +542,8 @@ void Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
     if (start_pos >= mfm.total_size) {
         ESP_LOGW(TAG, "Data position exceeds message size");
         multi_frame_messages.erase(it);
+        bam_dropped.inc();
+        release_session(session_id);
         return;
     }
 
@@ -358,28 +555,25 @@ void Controller::parse_tp_dt(const can_frame *frame, uint8_t src_addr) {
 
     memcpy(mfm.data.data() + start_pos, frame->data + 1, bytes_to_copy);
     mfm.packets_received++;
+    Trace::record_at(Trace::Stage::RX_ISR, mfm.trace_id, mfm.packets_received, Trace::last_isr_time());
+    Trace::record(Trace::Stage::RX_DT, mfm.trace_id, mfm.packets_received);
 
     if (mfm.packets_received >= mfm.total_packets) {
+        Trace::record(Trace::Stage::REASSEMBLED, mfm.trace_id);
         process_complete_message(mfm);
         multi_frame_messages.erase(it);
-
-        if (xSemaphoreTake(bus_state_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (active_bam_sessions.find(session_id) != active_bam_sessions.end()) {
-                active_bam_sessions.erase(session_id);
-
-                if (active_bam_sessions.empty()) {
-                    bus_busy = false;
-                }
-            }
-            xSemaphoreGive(bus_state_mutex);
-        }
+        abandoned_sources[src_addr >> 5] &= ~(1u << (src_addr & 31));
+        release_session(session_id);
     }
 }
 
-void Controller::decode_j1939_message(const struct can_frame *frame) {
+void HOT_PATH Controller::decode_j1939_message(const struct can_frame *frame) {
+    PROFILE_SCOPE("j1939_decode");
+
     if (!(frame->can_id & CAN_EFF_FLAG)) {
         return;
     }
+    rx_frames.inc_shared();
 
     uint32_t id = frame->can_id & CAN_EFF_MASK;
     uint8_t src_addr = id & 0xFF;
@@ -390,6 +584,10 @@ void Controller::decode_j1939_message(const struct can_frame *frame) {
     bool is_pdu1 = pdu_format < 240;
 
     if (is_pdu1) {
+        if (address_filter && pdu_specific != source_address && pdu_specific != GLOBAL_ADDRESS) {
+            rx_other_da.inc_shared();
+            return;
+        }
         pgn &= 0x3FF00;
     }
 
@@ -397,21 +595,21 @@ void Controller::decode_j1939_message(const struct can_frame *frame) {
 
     if (pgn == PGN_TP_CM) {
         parse_tp_cm(frame, src_addr);
+        sessions.set(multi_frame_messages.size());
     } else if (pgn == PGN_TP_DT) {
         parse_tp_dt(frame, src_addr);
+        sessions.set(multi_frame_messages.size());
     } else if (pgn == PGN_REQUEST) {
+    } else if (message_sink) {
+        rx_single.inc_shared();
+        message_sink(sink_context, pgn, src_addr, frame->data, frame->can_dlc);
     } else {
-        printf("{\"pgn\":\"%05" PRIx32 "\",\"sender\":%02X,\"size\":\"SF\",\"data\":\"", pgn, src_addr);
-
-        for (int i = 0; i < frame->can_dlc; i++) {
-            printf("%02X", frame->data[i]);
-        }
-
-        printf("\"}\n");
+        rx_single.inc_shared();
+        print_message(pgn, src_addr, frame->data, frame->can_dlc);
     }
 }
 
-bool Controller::send_single_frame_message(uint32_t pgn, uint8_t dst, const uint8_t *data, uint8_t len) {
+bool HOT_PATH Controller::send_single_frame_message(uint32_t pgn, uint8_t dst, const uint8_t *data, uint8_t len, uint16_t trace_id) {
     if (!is_bus_available()) {
         ESP_LOGW(TAG, "Bus is busy with BAM session, delaying single frame send");
         for (int i = 0; i < 5; i++) {
@@ -422,6 +620,7 @@ bool Controller::send_single_frame_message(uint32_t pgn, uint8_t dst, const uint
 
             if (i == 4) {
                 ESP_LOGE(TAG, "Bus still busy after retry, aborting single frame send");
+                tx_failed.inc();
                 return false;
             }
         }
@@ -429,22 +628,26 @@ bool Controller::send_single_frame_message(uint32_t pgn, uint8_t dst, const uint
 
     if (len > 8) {
         ESP_LOGE(TAG, "Single frame message cannot exceed 8 bytes");
+        tx_failed.inc();
         return false;
     }
 
     can_frame frame;
 
-    uint8_t pdu_format = (pgn >> 8) & 0xFF;
-    uint8_t pdu_specific = pgn & 0xFF;
-
-    frame.can_id = (0x18000000 | ((uint32_t)pdu_format << 16) | ((uint32_t)pdu_specific << 8) | source_address) | CAN_EFF_FLAG;
+    frame.can_id = make_can_id(pgn, dst, source_address);
     frame.can_dlc = len;
     memcpy(frame.data, data, len);
 
-    return (mcp2515->sendMessage(&frame) == MCP2515::ERROR_OK);
+    if (mcp2515->sendMessage(&frame) != CanController::ERROR_OK) {
+        tx_failed.inc();
+        return false;
+    }
+    tx_single.inc();
+    Trace::record(Trace::Stage::SINGLE_FRAME, trace_id);
+    return true;
 }
 
-bool Controller::send_data_packet(uint8_t seq_num, uint8_t dst, const uint8_t *data, uint8_t len, uint8_t session_number) {
+bool HOT_PATH Controller::send_data_packet(uint8_t seq_num, uint8_t dst, const uint8_t *data, uint8_t len, uint8_t session_number) {
     can_frame frame;
 
     frame.data[0] = seq_num | ((session_number & 0x0F) << 4);
@@ -457,12 +660,12 @@ bool Controller::send_data_packet(uint8_t seq_num, uint8_t dst, const uint8_t *d
     }
 
     frame.can_dlc = 8;
-    frame.can_id = (0x18EB0000 | (dst << 8) | source_address) | CAN_EFF_FLAG;
+    frame.can_id = make_can_id(PGN_TP_DT, dst, source_address);
 
-    return (mcp2515->sendMessage(&frame) == MCP2515::ERROR_OK);
+    return (mcp2515->sendMessage(&frame) == CanController::ERROR_OK);
 }
 
-bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uint16_t size) {
+bool Controller::send_multi_frame_message(uint32_t pgn, uint8_t dst, const uint8_t *data, uint16_t size, uint16_t trace_id) {
     if (!is_bus_available()) {
         ESP_LOGW(TAG, "Bus is busy with another BAM session, delaying multi-frame send");
         for (int i = 0; i < 10; i++) {
@@ -473,6 +676,7 @@ bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uin
 
             if (i == 9) {
                 ESP_LOGE(TAG, "Bus still busy after extended retry, aborting multi-frame send");
+                tx_failed.inc();
                 return false;
             }
         }
@@ -498,17 +702,24 @@ bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uin
         bam_frame.data[3] = total_packets & 0xFF;
     }
 
-    bam_frame.data[4] = 0xFF;
+    // The announced PGN of a PDU1 message has no destination in it; the
+    // destination is in the TP.CM and TP.DT identifiers
+    if (((pgn >> 8) & 0xFF) < 240) {
+        pgn &= 0x3FF00;
+    }
+
+    bam_frame.data[4] = Trace::tag(trace_id);
     bam_frame.data[5] = pgn & 0xFF;
     bam_frame.data[6] = (pgn >> 8) & 0xFF;
     bam_frame.data[7] = (pgn >> 16) & 0xFF;
 
     bam_frame.can_dlc = 8;
-    bam_frame.can_id = (0x18EC0000 | (0xFF << 8) | source_address) | CAN_EFF_FLAG;
+    bam_frame.can_id = make_can_id(PGN_TP_CM, dst, source_address);
+    uint32_t packet_gap_ms = (dst == GLOBAL_ADDRESS) ? BAM_PACKET_GAP_MS : ADDRESSED_PACKET_GAP_MS;
 
     bool bam_sent = false;
     for (int retry = 0; retry < 3 && !bam_sent; retry++) {
-        if (mcp2515->sendMessage(&bam_frame) == MCP2515::ERROR_OK) {
+        if (mcp2515->sendMessage(&bam_frame) == CanController::ERROR_OK) {
             bam_sent = true;
         } else {
             ESP_LOGW(TAG, "Failed to send BAM, retry %d", retry);
@@ -518,8 +729,10 @@ bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uin
 
     if (!bam_sent) {
         ESP_LOGE(TAG, "Failed to send BAM");
+        tx_failed.inc();
         return false;
     }
+    Trace::record(Trace::Stage::BAM_ANNOUNCE, trace_id);
 
     vTaskDelay(10 / portTICK_PERIOD_MS);
 
@@ -552,11 +765,11 @@ bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uin
         }
 
         frame.can_dlc = 8;
-        frame.can_id = (0x18EB0000 | (0xFF << 8) | source_address) | CAN_EFF_FLAG;
+        frame.can_id = make_can_id(PGN_TP_DT, dst, source_address);
 
         bool sent = false;
         for (int retry = 0; retry < 3 && !sent; retry++) {
-            if (mcp2515->sendMessage(&frame) == MCP2515::ERROR_OK) {
+            if (mcp2515->sendMessage(&frame) == CanController::ERROR_OK) {
                 sent = true;
             } else {
                 ESP_LOGW(TAG, "Failed to send packet %d, retry %d", seq, retry);
@@ -566,12 +779,15 @@ bool Controller::send_multi_frame_message(uint32_t pgn, const uint8_t *data, uin
 
         if (!sent) {
             ESP_LOGE(TAG, "Failed to send data packet %d after retries", seq);
+            tx_failed.inc();
             return false;
         }
+        Trace::record(Trace::Stage::TP_DT, trace_id, seq);
 
-        vTaskDelay(50 / portTICK_PERIOD_MS);
+        vTaskDelay(packet_gap_ms / portTICK_PERIOD_MS);
     }
     
+    tx_bam.inc();
     return true;
 }
 
@@ -4,18 +4,32 @@
 #include "freertos/task.h"
 
 #include "mcp2515.h"
+#include "profile.h"
+#include "metrics.h"
+#include "hot_path.h"
 
-const struct MCP2515::TXBn_REGS MCP2515::TXB[MCP2515::N_TXBUFFERS] = {
+HOT_DATA const struct MCP2515::TXBn_REGS MCP2515::TXB[MCP2515::N_TXBUFFERS] = {
     {MCP_TXB0CTRL, MCP_TXB0SIDH, MCP_TXB0DATA, INSTRUCTION_RTS_TX0},
     {MCP_TXB1CTRL, MCP_TXB1SIDH, MCP_TXB1DATA, INSTRUCTION_RTS_TX1},
     {MCP_TXB2CTRL, MCP_TXB2SIDH, MCP_TXB2DATA, INSTRUCTION_RTS_TX0},
 };
 
-const struct MCP2515::RXBn_REGS MCP2515::RXB[N_RXBUFFERS] = {
+HOT_DATA const struct MCP2515::RXBn_REGS MCP2515::RXB[N_RXBUFFERS] = {
     {MCP_RXB0CTRL, MCP_RXB0SIDH, MCP_RXB0DATA, CANINTF_RX0IF},
     {MCP_RXB1CTRL, MCP_RXB1SIDH, MCP_RXB1DATA, CANINTF_RX1IF}
 };
 
+static Metrics::Counter tx_frames("driver", "tx_frames");
+static Metrics::Counter tx_errors("driver", "tx_errors");
+static Metrics::Counter tx_all_busy("driver", "tx_all_busy");
+static Metrics::Counter rx_frames("driver", "rx_frames");
+static Metrics::Counter rx_errors("driver", "rx_errors");
+static Metrics::Counter spi_errors("driver", "spi_errors");
+static Metrics::Counter tx_wait_edge("driver", "tx_wait_edge");
+static Metrics::Counter tx_wait_polled("driver", "tx_wait_polled");
+
+volatile uint32_t MCP2515::interrupt_time_low = 0;
+
 MCP2515::MCP2515()
 {
     MCP2515(NULL);
@@ -45,6 +59,7 @@ MCP2515::ERROR MCP2515::reset(void)
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 
@@ -93,8 +108,10 @@ MCP2515::ERROR MCP2515::reset(void)
     return ERROR_OK;
 }
 
-uint8_t MCP2515::readRegister(const REGISTER reg)
+uint8_t HOT_PATH MCP2515::readRegister(const REGISTER reg)
 {
+    PROFILE_SCOPE("mcp2515_read_register");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_READ);
     // SPI.transfer(reg);
@@ -113,14 +130,17 @@ uint8_t MCP2515::readRegister(const REGISTER reg)
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 
     return trans.rx_data[2];
 }
 
-void MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t n)
+void HOT_PATH MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t n)
 {
+    PROFILE_SCOPE("mcp2515_read_registers");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_READ);
     // SPI.transfer(reg);
@@ -145,6 +165,7 @@ void MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 
@@ -153,8 +174,10 @@ void MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t
     }
 }
 
-void MCP2515::setRegister(const REGISTER reg, const uint8_t value)
+void HOT_PATH MCP2515::setRegister(const REGISTER reg, const uint8_t value)
 {
+    PROFILE_SCOPE("mcp2515_set_register");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_WRITE);
     // SPI.transfer(reg);
@@ -170,12 +193,15 @@ void MCP2515::setRegister(const REGISTER reg, const uint8_t value)
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 }
 
-void MCP2515::setRegisters(const REGISTER reg, const uint8_t values[], const uint8_t n)
+void HOT_PATH MCP2515::setRegisters(const REGISTER reg, const uint8_t values[], const uint8_t n)
 {
+    PROFILE_SCOPE("mcp2515_set_registers");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_WRITE);
     // SPI.transfer(reg);
@@ -200,12 +226,15 @@ void MCP2515::setRegisters(const REGISTER reg, const uint8_t values[], const uin
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 }
 
-void MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data)
+void HOT_PATH MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data)
 {
+    PROFILE_SCOPE("mcp2515_modify_register");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_BITMOD);
     // SPI.transfer(reg);
@@ -224,12 +253,15 @@ void MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 }
 
-uint8_t MCP2515::getStatus(void)
+uint8_t HOT_PATH MCP2515::getStatus(void)
 {
+    PROFILE_SCOPE("mcp2515_get_status");
+
     // startSPI();
     // SPI.transfer(INSTRUCTION_READ_STATUS);
     // uint8_t i = SPI.transfer(0x00);
@@ -247,6 +279,7 @@ uint8_t MCP2515::getStatus(void)
 
     esp_err_t ret = spi_device_transmit(*spi, &trans);
     if (ret != ESP_OK) {
+        spi_errors.inc();
         printf("spi_device_transmit failed\n");
     }
 
@@ -634,7 +667,7 @@ MCP2515::ERROR MCP2515::setClkOut(const CAN_CLKOUT divisor)
     return ERROR_OK;
 }
 
-void MCP2515::prepareId(uint8_t *buffer, const bool ext, const uint32_t id)
+void HOT_PATH MCP2515::prepareId(uint8_t *buffer, const bool ext, const uint32_t id)
 {
     uint16_t canid = (uint16_t)(id & 0x0FFFF);
 
@@ -708,8 +741,10 @@ MCP2515::ERROR MCP2515::setFilter(const RXF num, const bool ext, const uint32_t
     return ERROR_OK;
 }
 
-MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *frame)
+MCP2515::ERROR HOT_PATH MCP2515::sendMessage(const TXBn txbn, const struct can_frame *frame)
 {
+    PROFILE_SCOPE("mcp2515_send_message");
+
     if (frame->can_dlc > CAN_MAX_DLEN) {
         return ERROR_FAILTX;
     }
@@ -734,8 +769,10 @@ MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *fra
 
     uint8_t ctrl = readRegister(txbuf->CTRL);
     if ((ctrl & (TXB_ABTF | TXB_MLOA | TXB_TXERR)) != 0) {
+        tx_errors.inc();
         return ERROR_FAILTX;
     }
+    tx_frames.inc();
     return ERROR_OK;
 }
 
@@ -793,10 +830,11 @@ MCP2515::ERROR MCP2515::sendMessageSkipStatus(const TXBn txbn, const struct can_
         return ERROR_FAILTX;
     }
 
+    tx_frames.inc();
     return ERROR_OK;
 }
 
-MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
+MCP2515::ERROR HOT_PATH MCP2515::sendMessage(const struct can_frame *frame)
 {
     if (frame->can_dlc > CAN_MAX_DLEN) {
         return ERROR_FAILTX;
@@ -812,6 +850,7 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
         }
     }
 
+    tx_all_busy.inc();
     return ERROR_ALLTXBUSY;
 }
 
@@ -831,11 +870,60 @@ MCP2515::ERROR MCP2515::sendMessageSkipStatus(const struct can_frame *frame)
         }
     }
 
+    tx_all_busy.inc();
     return ERROR_ALLTXBUSY;
 }
 
-MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+MCP2515::ERROR MCP2515::sendMessageAndWait(const struct can_frame *frame, uint32_t timeout_us, int64_t *done_us)
 {
+    if (readRegister(MCP_TXB2CTRL) & TXB_TXREQ) {
+        tx_all_busy.inc();
+        return ERROR_ALLTXBUSY;
+    }
+
+    modifyRegister(MCP_CANINTF, CANINTF_TX2IF, 0);
+    modifyRegister(MCP_CANINTE, CANINTF_TX2IF, CANINTF_TX2IF);
+
+    int64_t start = esp_timer_get_time();
+    ERROR err = sendMessage(TXB2, frame);
+    uint8_t flags = 0;
+    int64_t now = start;
+    while (err == ERROR_OK) {
+        flags = getInterrupts();
+        now = esp_timer_get_time();
+        if (flags & CANINTF_TX2IF) {
+            break;
+        }
+        if (now - start > (int64_t)timeout_us) {
+            modifyRegister(MCP_TXB2CTRL, TXB_TXREQ, 0);
+            tx_errors.inc();
+            err = ERROR_FAILTX;
+        }
+    }
+
+    modifyRegister(MCP_CANINTE, CANINTF_TX2IF, 0);
+    modifyRegister(MCP_CANINTF, CANINTF_TX2IF, 0);
+    if (err != ERROR_OK) {
+        return err;
+    }
+
+    // INT only falls for TX2IF if no receive flag was set; the caller holds
+    // the SPI bus, so nothing cleared one in between
+    int64_t edge = now - (uint32_t)((uint32_t)now - interrupt_time_low);
+    if ((flags & (CANINTF_RX0IF | CANINTF_RX1IF)) == 0 && edge >= start) {
+        *done_us = edge;
+        tx_wait_edge.inc();
+    } else {
+        *done_us = now;
+        tx_wait_polled.inc();
+    }
+    return ERROR_OK;
+}
+
+MCP2515::ERROR HOT_PATH MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+{
+    PROFILE_SCOPE("mcp2515_read_message");
+
     const struct RXBn_REGS *rxb = &RXB[rxbn];
 
     uint8_t tbufdata[5];
@@ -853,6 +941,7 @@ MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
 
     uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
     if (dlc > CAN_MAX_DLEN) {
+        rx_errors.inc();
         return ERROR_FAIL;
     }
 
@@ -868,10 +957,11 @@ MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
 
     modifyRegister(MCP_CANINTF, rxb->CANINTF_RXnIF, 0);
 
+    rx_frames.inc();
     return ERROR_OK;
 }
 
-MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame)
+MCP2515::ERROR HOT_PATH MCP2515::readMessage(struct can_frame *frame)
 {
     ERROR rc;
     uint8_t stat = getStatus();
@@ -887,7 +977,7 @@ MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame)
     return rc;
 }
 
-bool MCP2515::checkReceive(void)
+bool HOT_PATH MCP2515::checkReceive(void)
 {
     uint8_t res = getStatus();
     if ( res & STAT_RXIF_MASK ) {
@@ -938,7 +1028,7 @@ void MCP2515::clearTXInterrupts(void)
     modifyRegister(MCP_CANINTF, (CANINTF_TX0IF | CANINTF_TX1IF | CANINTF_TX2IF), 0);
 }
 
-void MCP2515::clearRXInterrupts(void)
+void HOT_PATH MCP2515::clearRXInterrupts(void)
 {
     modifyRegister(MCP_CANINTF, (CANINTF_RX0IF | CANINTF_RX1IF), 0);
 }
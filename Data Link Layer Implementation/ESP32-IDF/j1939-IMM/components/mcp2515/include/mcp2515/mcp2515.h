@@ -3,6 +3,8 @@
 
 #include "driver/spi_master.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 
 #include "can.h"
 
@@ -483,6 +485,10 @@ class MCP2515
         // Skip the step to look up TX status
         // Slightly faster than sendMessage
         ERROR sendMessageSkipStatus(const struct can_frame *frame);
+        // Sends from TXB2 and waits until the frame is on the bus. done_us is
+        // when the TX2IF interrupt pulled INT low, taken by onInterrupt(), or
+        // when the flag was polled if a receive flag already held INT low.
+        ERROR sendMessageAndWait(const struct can_frame *frame, uint32_t timeout_us, int64_t *done_us);
         ERROR readMessage(const RXBn rxbn, struct can_frame *frame);
         ERROR readMessage(struct can_frame *frame);
         bool checkReceive(void);
@@ -498,6 +504,13 @@ class MCP2515
         void clearRXnOVR(void);
         void clearMERR();
         void clearERRIF();
+
+        // Called from the INT pin interrupt handler; a 32-bit store cannot
+        // tear when read from a task
+        static volatile uint32_t interrupt_time_low;
+        static inline void IRAM_ATTR onInterrupt() {
+            interrupt_time_low = (uint32_t)esp_timer_get_time();
+        }
 };
 
 #endif
\ No newline at end of file
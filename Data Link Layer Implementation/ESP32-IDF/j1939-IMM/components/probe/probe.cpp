@@ -0,0 +1,301 @@
+/**
+ * @file probe.cpp
+ * @brief Ping generator and echo responder for on-bus latency measurement
+ * @version 1.0
+ *
+ * Measures the round trip between two nodes over CAN only, without the two
+ * serial links and the Python stack of Test scripts/complete_latency_test.py:
+ *
+ *   {"c":"ping","d":"50,200,100"}   50 requests of 200 bytes, 100 ms apart
+ *   {"c":"ping","d":"stop"}
+ *   {"c":"echo","d":"off"}          stop answering requests (on by default)
+ *
+ * A run prints the CSV header, one line per reply and a summary line
+ * {"probe":"done",...}. Test scripts/bus_latency_test.py stores the lines as
+ * results/bus_latency_<size>_bytes.csv for plot_latency.py.
+ *
+ */
+
+#include "probe.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* TAG = "Probe";
+
+namespace Probe {
+
+// Payload copies waiting in the job queue
+static Budget::Account heap("probe", JOB_QUEUE_LEN * MAX_SIZE);
+
+static uint8_t pattern_byte(size_t index, uint16_t seq) {
+    return (uint8_t)(index * 7 + seq);
+}
+
+Prober::Prober(J1939::Controller* controller, SemaphoreHandle_t spi_mutex, uint8_t source_addr)
+    : j1939(controller),
+      spi_mutex(spi_mutex),
+      source_address(source_addr),
+      jobs(NULL),
+      task(NULL),
+      echo_enabled(true),
+      echo_dropped(0) {
+    memset(&run, 0, sizeof(run));
+}
+
+Prober::~Prober() {
+    if (task) {
+        vTaskDelete(task);
+    }
+    if (jobs) {
+        vQueueDelete(jobs);
+    }
+}
+
+bool Prober::init() {
+    jobs = jobs_memory.create();
+    if (!jobs) {
+        ESP_LOGE(TAG, "Failed to create job queue");
+        return false;
+    }
+    task = task_memory.create(task_entry, "probe", this, TASK_PRIORITY);
+    if (!task) {
+        ESP_LOGE(TAG, "Failed to create probe task");
+        return false;
+    }
+    return true;
+}
+
+bool Prober::on_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len) {
+    if (pgn == PGN_PROBE_REQUEST) {
+        if (echo_enabled && len >= MIN_SIZE && len <= MAX_SIZE) {
+            queue_payload(JobType::REQUEST, src_addr, data, len);
+        }
+        return true;
+    }
+    if (pgn == PGN_PROBE_REPLY) {
+        // Replies are broadcast; only those to our requests are of interest
+        if (len >= MIN_SIZE && len <= MAX_SIZE && data[2] == source_address) {
+            queue_payload(JobType::REPLY, src_addr, data, len);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Prober::queue_payload(JobType type, uint8_t src_addr, const uint8_t* data, size_t len) {
+    Job job = {};
+    job.type = type;
+    job.src_addr = src_addr;
+    job.len = (uint16_t)len;
+    job.rx_us = esp_timer_get_time();
+    job.data = (uint8_t*)heap.malloc(len);
+    if (!job.data) {
+        echo_dropped++;
+        return false;
+    }
+    memcpy(job.data, data, len);
+
+    if (xQueueSend(jobs, &job, 0) != pdTRUE) {
+        heap.free(job.data);
+        echo_dropped++;
+        return false;
+    }
+    return true;
+}
+
+bool Prober::start(uint16_t count, uint16_t size, uint32_t interval_ms) {
+    if (count == 0 || size < MIN_SIZE || size > MAX_SIZE) {
+        return false;
+    }
+    Job job = {};
+    job.type = JobType::START;
+    job.len = size;
+    job.count = count;
+    job.interval_ms = interval_ms;
+    return xQueueSend(jobs, &job, pdMS_TO_TICKS(100)) == pdTRUE;
+}
+
+void Prober::stop() {
+    Job job = {};
+    job.type = JobType::STOP;
+    xQueueSend(jobs, &job, pdMS_TO_TICKS(100));
+}
+
+void Prober::task_entry(void* arg) {
+    ((Prober*)arg)->task_loop();
+}
+
+void Prober::task_loop() {
+    Job job;
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+        if (run.active) {
+            int64_t due = run.waiting ? run.tx_us + run.timeout_us : run.next_send_us;
+            int64_t left_us = due - esp_timer_get_time();
+            wait = left_us > 0 ? pdMS_TO_TICKS((left_us + 999) / 1000) : 0;
+            if (left_us > 0 && wait == 0) {
+                wait = 1;
+            }
+        }
+
+        if (xQueueReceive(jobs, &job, wait) == pdTRUE) {
+            switch (job.type) {
+            case JobType::REQUEST:
+                send_echo(job);
+                break;
+            case JobType::REPLY:
+                handle_reply(job);
+                break;
+            case JobType::START:
+                begin_run(job);
+                break;
+            case JobType::STOP:
+                if (run.active) {
+                    end_run();
+                }
+                break;
+            }
+            heap.free(job.data);
+        }
+
+        if (run.active) {
+            step_run(esp_timer_get_time());
+        }
+    }
+}
+
+void Prober::begin_run(const Job& job) {
+    if (run.active) {
+        end_run();
+    }
+    uint32_t packets = job.len > 8 ? (job.len + 6) / 7 : 0;
+
+    memset(&run, 0, sizeof(run));
+    run.active = true;
+    run.count = job.count;
+    run.size = job.len;
+    run.interval_ms = job.interval_ms;
+    run.timeout_us = (BASE_TIMEOUT_MS + packets * TIMEOUT_PER_PACKET_MS) * 1000;
+    run.next_send_us = esp_timer_get_time();
+
+    printf("%s\n", CSV_HEADER);
+}
+
+void Prober::end_run() {
+    printf("{\"probe\":\"done\",\"size\":%u,\"sent\":%u,\"received\":%u,\"timeouts\":%u,\"corrupt\":%u,"
+           "\"echo_dropped\":%" PRIu32 "}\n",
+           run.size, run.sent, run.received, run.timeouts, run.corrupt, echo_dropped);
+    run.active = false;
+}
+
+void Prober::step_run(int64_t now_us) {
+    if (run.waiting) {
+        if (now_us - run.tx_us < (int64_t)run.timeout_us) {
+            return;
+        }
+        ESP_LOGW(TAG, "No reply to probe %u", run.seq);
+        run.timeouts++;
+        run.waiting = false;
+    }
+
+    if (run.sent >= run.count) {
+        end_run();
+    } else if (now_us >= run.next_send_us) {
+        send_request();
+    }
+}
+
+void Prober::send_request() {
+    run.seq++;
+    buffer[0] = run.seq & 0xFF;
+    buffer[1] = run.seq >> 8;
+    for (size_t i = 2; i < run.size; i++) {
+        buffer[i] = pattern_byte(i, run.seq);
+    }
+
+    bool sent = false;
+    int64_t start_us = esp_timer_get_time();
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        // The round trip starts when the request can go out, not while the
+        // receiver task holds the SPI bus
+        start_us = esp_timer_get_time();
+        sent = send(PGN_PROBE_REQUEST, buffer, run.size);
+        xSemaphoreGive(spi_mutex);
+    }
+    int64_t end_us = esp_timer_get_time();
+
+    run.sent++;
+    run.next_send_us = start_us + (int64_t)run.interval_ms * 1000;
+    if (!sent) {
+        ESP_LOGW(TAG, "Failed to send probe %u", run.seq);
+        run.timeouts++;
+        return;
+    }
+    run.tx_us = start_us;
+    run.send_us = end_us - start_us;
+    run.waiting = true;
+}
+
+void Prober::handle_reply(const Job& job) {
+    uint16_t seq = job.data[0] | (job.data[1] << 8);
+    if (!run.active || !run.waiting || seq != run.seq) {
+        ESP_LOGD(TAG, "Late or duplicate reply %u from 0x%02X", seq, job.src_addr);
+        return;
+    }
+    run.waiting = false;
+
+    bool intact = job.len == run.size;
+    for (size_t i = HEADER_SIZE; intact && i < job.len; i++) {
+        intact = job.data[i] == pattern_byte(i, seq);
+    }
+    if (!intact) {
+        ESP_LOGW(TAG, "Corrupt reply %u from 0x%02X", seq, job.src_addr);
+        run.corrupt++;
+        return;
+    }
+    run.received++;
+
+    uint32_t turnaround_us = job.data[3] | (job.data[4] << 8) | ((uint32_t)job.data[5] << 16);
+    int64_t rtt_us = job.rx_us - run.tx_us;
+    double one_way_us = (rtt_us - (int64_t)turnaround_us) / 2.0;
+
+    printf("%u,%.3f,%.3f,%.3f,%.3f,%.3f,%u,%" PRId64 ",%" PRId64 "\n",
+           seq, rtt_us / 1000.0, 0.0, turnaround_us / 1000.0, one_way_us / 1000.0,
+           run.send_us / 1000.0, run.size, run.tx_us, job.rx_us);
+}
+
+void Prober::send_echo(const Job& job) {
+    memcpy(buffer, job.data, job.len);
+    buffer[2] = job.src_addr;
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        echo_dropped++;
+        return;
+    }
+    // Turnaround runs from the request's arrival to the reply leaving
+    int64_t turnaround_us = esp_timer_get_time() - job.rx_us;
+    if (turnaround_us > MAX_TURNAROUND_US) {
+        turnaround_us = MAX_TURNAROUND_US;
+    }
+    buffer[3] = turnaround_us & 0xFF;
+    buffer[4] = (turnaround_us >> 8) & 0xFF;
+    buffer[5] = (turnaround_us >> 16) & 0xFF;
+
+    if (!send(PGN_PROBE_REPLY, buffer, job.len)) {
+        echo_dropped++;
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+bool Prober::send(uint32_t pgn, const uint8_t* data, size_t len) {
+    if (len <= 8) {
+        return j1939->send_single_frame_message(pgn, J1939::GLOBAL_ADDRESS, data, (uint8_t)len);
+    }
+    return j1939->send_multi_frame_message(pgn, J1939::GLOBAL_ADDRESS, data, (uint16_t)len);
+}
+
+}
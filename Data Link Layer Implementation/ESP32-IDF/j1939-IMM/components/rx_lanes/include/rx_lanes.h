@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "j1939.h"
+#include "budget.h"
+
+namespace RxLanes {
+
+    enum class Lane : uint8_t {
+        CRITICAL,           // J1939 priority up to critical_priority, or a PGN set critical
+        NORMAL,             // other single frames
+        BULK                // TP.CM and TP.DT, priority 7, or a PGN set bulk
+    };
+    constexpr size_t LANE_COUNT = 3;
+
+    // J1939 priorities 0-2 are the control messages of J1939-71 (e.g.
+    // torque and brake commands); the default traffic is 6 and TP.DT 7
+    constexpr uint8_t DEFAULT_CRITICAL_PRIORITY = 2;
+    constexpr uint8_t BULK_PRIORITY = 7;
+
+    // Frames each lane can hold. A lane that is full drops what arrives for
+    // it and no other, so bulk traffic never takes the critical lane's room.
+    constexpr size_t CRITICAL_DEPTH = 16;
+    constexpr size_t NORMAL_DEPTH = 32;
+    constexpr size_t BULK_DEPTH = 64;
+
+    // One consumer task per lane, critical highest: below the J1939
+    // receiver (10) and above everything else; bulk below the sender (5)
+    constexpr uint32_t TASK_STACK_SIZE = 4096;
+    constexpr UBaseType_t CRITICAL_TASK_PRIORITY = 9;
+    constexpr UBaseType_t NORMAL_TASK_PRIORITY = 6;
+    constexpr UBaseType_t BULK_TASK_PRIORITY = 4;
+
+    // The bulk lane owns reassembly, and drops stale sessions at least this
+    // often when no transport frames arrive
+    constexpr uint32_t CLEANUP_INTERVAL_MS = 100;
+
+    // PGNs given a lane other than their priority's, e.g. by "lanes"
+    constexpr size_t MAX_RULES = 8;
+
+    // Receive lanes between the controller drain and the J1939 decoder.
+    //
+    // The receiver task reads the controller under the SPI mutex as before,
+    // but only classifies each frame and queues it for its lane. Each lane
+    // has its own queue and task, which decodes its frames and hands them to
+    // the message sink, so a critical frame does not wait behind a BAM being
+    // reassembled, a 1785-byte message being printed or the frames queued
+    // before it; at most behind the line the UART is writing when it
+    // arrives. Transport frames always take the bulk lane, which alone
+    // touches the reassembly sessions.
+    //
+    // A PGN set to a lane keeps to it whatever its priority; single frames
+    // and transport messages of one PGN still arrive on different lanes, so
+    // a sink taking both (the OTA updater) has its PGN set to bulk.
+    class Dispatcher {
+    public:
+        Dispatcher(J1939::Controller* controller, SemaphoreHandle_t spi_mutex);
+        ~Dispatcher();
+
+        bool init();
+
+        // Receiver task, under the SPI mutex, after the frame hooks. rx_us
+        // is the interrupt time of the frame, 0 for the time of the call.
+        // Never blocks; false if the lane was full and the frame dropped.
+        bool submit(const can_frame* frame, int64_t rx_us);
+
+        Lane classify(const can_frame* frame) const;
+
+        // Under the SPI mutex, like submit(); false if the table is full
+        bool set_rule(uint32_t pgn, Lane lane);
+        void clear_rule(uint32_t pgn);
+
+        // From {"c":"lanes","d":"..."}: "status", "critical,<PGN hex>",
+        // "normal,<PGN>", "bulk,<PGN>", "clear,<PGN>" or "priority,<0-7>"
+        bool execute(const char* command);
+
+        static const char* lane_name(Lane lane);
+
+    private:
+        struct Entry {
+            can_frame frame;
+            int64_t rx_us;
+        };
+
+        struct Rule {
+            uint32_t pgn;
+            Lane lane;
+            bool in_use;
+        };
+
+        struct Consumer {
+            Dispatcher* owner;
+            Lane lane;
+            QueueHandle_t queue;
+            TaskHandle_t task;
+        };
+
+        static void task_entry(void* arg);
+        void consume(Consumer& consumer);
+        void print_status();
+
+        J1939::Controller* j1939;
+        SemaphoreHandle_t spi_mutex;
+        volatile uint8_t critical_priority;
+        Rule rules[MAX_RULES];
+        Consumer consumers[LANE_COUNT];
+
+        Budget::StaticQueue<Entry, CRITICAL_DEPTH> critical_memory;
+        Budget::StaticQueue<Entry, NORMAL_DEPTH> normal_memory;
+        Budget::StaticQueue<Entry, BULK_DEPTH> bulk_memory;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory[LANE_COUNT];
+    };
+
+}
@@ -0,0 +1,627 @@
+/**
+ * @file heartbeat.cpp
+ * @brief Authenticated node heartbeats and peer liveness monitoring
+ * @version 1.0
+ *
+ * Every node sends an 8-byte heartbeat each period and watches the others:
+ *
+ *   {"c":"hb","d":"status"}
+ *   {"heartbeat":"status","sa":"22","keyed":true,"publishing":true,"period_ms":500,
+ *    "effective_ms":500,...,"load_ppm":..,"budget_ppm":10000,"bound_ms":1550,
+ *    "peers":[{"sa":"32","state":"alive","period_ms":500,"age_ms":120,...}]}
+ *   {"c":"hb","d":"period,200"}     stretched to the node's share of the budget
+ *   {"c":"hb","d":"expect,32"}      report 32 missing even if it is never heard
+ *
+ * Alerts are JSON lines in the form of the sniffer's:
+ *
+ *   {"alert":"heartbeat","reason":"missing","sender":"32","silent_ms":1530}
+ *
+ * with "t" in bus time once the node is synchronised. bound_ms is the
+ * longest a stopped peer can go unreported; load_ppm is the bus share of
+ * the heartbeats of this node and all peers in the table, held under
+ * budget_ppm by stretching the period as peers appear (effective_ms). "heartbeat" in
+ * "stats" counts what was sent and received, the alerts and the silence
+ * at which missing peers were reported. host/tools/can_sim measures both
+ * on the simulated bus with --heartbeat-ms, --kill and --swap.
+ *
+ * Until a bus key is provisioned the node runs on the built-in default,
+ * which any unit can use to make valid tokens. Its status then has
+ * "keyed":false, and peers it hears are "unverified" rather than
+ * "alive". Missing alerts still go out, because silence can't be forged,
+ * but "recovered" alerts do not. "unkeyed" in "stats" counts the
+ * heartbeats accepted that way.
+ *
+ * The table is in RAM, so each peer's counter is also saved in NVS
+ * ("hb_<SA>") when the peer starts a new epoch: at most one write per
+ * restart of the peer. After this node restarts, a peer's first heartbeat
+ * must be newer than its saved counter, otherwise it is a "replay". That
+ * rejects everything recorded before the peer's current epoch was first
+ * seen; "forget" drops the saved counter of a replaced node. The host
+ * simulation keeps nothing across runs.
+ *
+ */
+
+#include "heartbeat.h"
+#include "j1939.h"
+#include "sync_clock.h"
+#include "metrics.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#if defined(ESP_PLATFORM)
+#include "bus_key.h"
+#include "nvs.h"
+#endif
+
+static const char* TAG = "Heartbeat";
+
+namespace Heartbeat {
+
+static Metrics::Counter sent("heartbeat", "sent");
+static Metrics::Counter tx_failed("heartbeat", "tx_failed");
+static Metrics::Counter received("heartbeat", "received");
+static Metrics::Counter bad_token("heartbeat", "bad_token");
+static Metrics::Counter replays("heartbeat", "replays");
+static Metrics::Counter missing("heartbeat", "missing");
+static Metrics::Counter restarts("heartbeat", "restarts");
+static Metrics::Counter table_full("heartbeat", "table_full");
+static Metrics::Counter unkeyed("heartbeat", "unkeyed");         // valid under an untrusted key: no verdict
+static Metrics::Gauge peer_count("heartbeat", "peers");
+static const uint32_t SILENT_MS[] = {200, 500, 1000, 1500, 2000, 3000, 5000, 8000};
+static Metrics::Histogram silent_ms("heartbeat", "silent_ms", SILENT_MS);     // when reported missing
+
+static const char* const STATE_NAMES[] = {"expected", "alive", "missing", "unverified"};
+
+static constexpr uint32_t COUNTER_MASK = 0xFFFFFF;
+
+// Serial number arithmetic on the 24-bit (epoch, seq) counter
+static bool is_newer(uint32_t counter, uint32_t last) {
+    uint32_t diff = (counter - last) & COUNTER_MASK;
+    return diff != 0 && diff < (COUNTER_MASK + 1) / 2;
+}
+
+#if defined(ESP_PLATFORM)
+static const char* NVS_NAMESPACE = "security";
+static const char* NVS_EPOCH = "hb_epoch";
+
+static uint8_t load_epoch() {
+    nvs_handle_t nvs;
+    uint32_t value = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, NVS_EPOCH, &value);
+        nvs_close(nvs);
+    }
+    return (uint8_t)value;
+}
+
+static void save_epoch(uint8_t epoch) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_u32(nvs, NVS_EPOCH, epoch);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+// Last counter of a peer saved before this node restarted
+static bool load_peer_counter(uint8_t address, uint32_t* counter) {
+    char name[8];
+    snprintf(name, sizeof(name), "hb_%02X", address);
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    bool found = nvs_get_u32(nvs, name, counter) == ESP_OK;
+    nvs_close(nvs);
+    return found;
+}
+
+static void save_peer_counter(uint8_t address, uint32_t counter) {
+    char name[8];
+    snprintf(name, sizeof(name), "hb_%02X", address);
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_u32(nvs, name, counter);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+static void erase_peer_counter(uint8_t address) {
+    char name[8];
+    snprintf(name, sizeof(name), "hb_%02X", address);
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, name);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+#endif
+
+Monitor::Monitor(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr, uint32_t bitrate)
+    : can(can),
+      spi_mutex(spi_mutex),
+      source_address(source_addr),
+      bitrate(bitrate),
+      keyed(false),
+      trusted_key(false),
+#if defined(ESP_PLATFORM)
+      task(NULL),
+#endif
+      publishing(false),
+      period_ms(DEFAULT_PERIOD_MS),
+      epoch(0),
+      seq(0),
+      next_publish_ms(0),
+      alert_sink(NULL),
+      sink_context(NULL),
+      last_stranger_alert_ms(0) {
+    memset(key, 0, sizeof(key));
+    memset(peers, 0, sizeof(peers));
+}
+
+Monitor::~Monitor() {
+#if defined(ESP_PLATFORM)
+    if (task) {
+        vTaskDelete(task);
+    }
+#endif
+    memset(key, 0, sizeof(key));
+}
+
+#if defined(ESP_PLATFORM)
+bool Monitor::init(bool publish) {
+    uint8_t bus_key[SipHash::KEY_SIZE];
+    BusKey::State key_state = BusKey::load(bus_key);
+    if (key_state == BusKey::State::NONE) {
+        return false;
+    }
+    // A new epoch per start, saved before the first heartbeat uses it
+    uint8_t next = load_epoch() + 1;
+    save_epoch(next);
+    start(bus_key, next, publish, BusKey::trusted(key_state));
+    memset(bus_key, 0, sizeof(bus_key));
+
+    task = task_memory.create(task_entry, "heartbeat", this, TASK_PRIORITY);
+    if (!task) {
+        ESP_LOGE(TAG, "Failed to create heartbeat task");
+        return false;
+    }
+    return true;
+}
+
+void Monitor::task_entry(void* arg) {
+    ((Monitor*)arg)->task_loop();
+}
+
+void Monitor::task_loop() {
+    for (;;) {
+        uint32_t wait_ms = publish();
+        check();
+        save_peers();
+        if (wait_ms > CHECK_INTERVAL_MS) {
+            wait_ms = CHECK_INTERVAL_MS;
+        }
+        TickType_t ticks = pdMS_TO_TICKS(wait_ms);
+        vTaskDelay(ticks ? ticks : 1);
+    }
+}
+
+// Saves the counters of peers that started a new epoch. The NVS writes
+// happen outside the SPI mutex, so they never hold up the receiver.
+void Monitor::save_peers() {
+    uint8_t addresses[MAX_PEERS];
+    uint32_t counters[MAX_PEERS];
+    size_t count = 0;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return;
+    }
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use && peers[i].save_pending) {
+            peers[i].save_pending = false;
+            addresses[count] = peers[i].address;
+            counters[count] = peers[i].counter;
+            count++;
+        }
+    }
+    xSemaphoreGive(spi_mutex);
+    for (size_t i = 0; i < count; i++) {
+        save_peer_counter(addresses[i], counters[i]);
+    }
+}
+#endif
+
+void Monitor::start(const uint8_t bus_key[SipHash::KEY_SIZE], uint8_t start_epoch, bool publish, bool trusted) {
+    memcpy(key, bus_key, SipHash::KEY_SIZE);
+    keyed = true;
+    trusted_key = trusted;
+    epoch = start_epoch;
+    seq = 0;
+    next_publish_ms = esp_log_timestamp();
+    publishing = publish;
+}
+
+void Monitor::set_alert_sink(AlertSink sink, void* context) {
+    alert_sink = sink;
+    sink_context = context;
+}
+
+const char* Monitor::alert_name(Alert alert) {
+    switch (alert) {
+    case Alert::MISSING: return "missing";
+    case Alert::BAD_TOKEN: return "bad_token";
+    case Alert::REPLAY: return "replay";
+    case Alert::RECOVERED: return "recovered";
+    case Alert::RESTARTED: return "restarted";
+    }
+    return "unknown";
+}
+
+uint32_t Monitor::token(uint8_t address, const uint8_t* data) const {
+    uint8_t message[1 + FRAME_SIZE - TOKEN_SIZE];
+    message[0] = address;
+    memcpy(message + 1, data, FRAME_SIZE - TOKEN_SIZE);
+    return (uint32_t)SipHash::mac(key, message, sizeof(message));
+}
+
+uint32_t Monitor::publish() {
+    uint32_t now_ms = esp_log_timestamp();
+    int32_t due_in = (int32_t)(next_publish_ms - now_ms);
+    if (!publishing || !keyed) {
+        return period_ms;
+    }
+    if (due_in > 0) {
+        return (uint32_t)due_in;
+    }
+
+    uint32_t period = effective_period_ms();
+    can_frame frame = {};
+    frame.can_id = J1939::Controller::make_can_id(PGN_HEARTBEAT, J1939::GLOBAL_ADDRESS, source_address, PRIORITY);
+    frame.can_dlc = FRAME_SIZE;
+    frame.data[0] = (uint8_t)(period / PERIOD_UNIT_MS);
+    frame.data[1] = epoch;
+    frame.data[2] = seq & 0xFF;
+    frame.data[3] = seq >> 8;
+    uint32_t tag = token(source_address, frame.data);
+    for (size_t i = 0; i < TOKEN_SIZE; i++) {
+        frame.data[FRAME_SIZE - TOKEN_SIZE + i] = (uint8_t)(tag >> (8 * i));
+    }
+
+    CanController::ERROR err = CanController::ERROR_FAIL;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        err = can->sendMessage(&frame);
+        xSemaphoreGive(spi_mutex);
+    }
+    if (err == CanController::ERROR_OK) {
+        sent.inc();
+    } else {
+        tx_failed.inc();
+    }
+
+    // The counter advances even for a heartbeat that was not sent
+    if (++seq == 0) {
+        epoch++;
+#if defined(ESP_PLATFORM)
+        save_epoch(epoch);
+#endif
+    }
+    next_publish_ms += period;
+    if ((int32_t)(next_publish_ms - now_ms) <= 0) {
+        next_publish_ms = now_ms + period;
+    }
+    return next_publish_ms - now_ms;
+}
+
+Monitor::Peer* Monitor::find_peer(uint8_t address) {
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use && peers[i].address == address) {
+            return &peers[i];
+        }
+    }
+    return NULL;
+}
+
+Monitor::Peer* Monitor::add_peer(uint8_t address) {
+    Peer* free_peer = NULL;
+    for (size_t i = 0; i < MAX_PEERS && !free_peer; i++) {
+        if (!peers[i].in_use) {
+            free_peer = &peers[i];
+        }
+    }
+    if (!free_peer) {
+        table_full.inc();
+        return NULL;
+    }
+    memset(free_peer, 0, sizeof(Peer));
+    free_peer->in_use = true;
+    free_peer->address = address;
+    peer_count.add(1);
+    return free_peer;
+}
+
+uint32_t Monitor::peer_period_ms(const Peer& peer) const {
+    return peer.period_units ? peer.period_units * PERIOD_UNIT_MS : DEFAULT_PERIOD_MS;
+}
+
+void Monitor::raise(uint8_t address, Alert alert, uint32_t silent) {
+    if (alert_sink) {
+        alert_sink(sink_context, alert, address, silent);
+        return;
+    }
+    printf("{\"alert\":\"heartbeat\",\"reason\":\"%s\",\"sender\":\"%02X\",\"silent_ms\":%" PRIu32,
+           alert_name(alert), address, silent);
+    if (SyncClock::is_synced()) {
+        int64_t t = SyncClock::now();
+        printf(",\"t\":%" PRId64 ".%06" PRId64 "}\n", t / 1000000, t % 1000000);
+    } else {
+        printf("}\n");
+    }
+}
+
+bool Monitor::on_frame(const can_frame* frame) {
+    if (!(frame->can_id & CAN_EFF_FLAG) || frame->can_dlc != FRAME_SIZE) {
+        return false;
+    }
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    if (((id >> 8) & 0x3FFFF) != PGN_HEARTBEAT) {
+        return false;
+    }
+    if (!keyed) {
+        return true;
+    }
+    received.inc();
+
+    uint8_t src_addr = id & 0xFF;
+    uint32_t now_ms = esp_log_timestamp();
+    const uint8_t* data = frame->data;
+    uint32_t tag = 0;
+    for (size_t i = 0; i < TOKEN_SIZE; i++) {
+        tag |= (uint32_t)data[FRAME_SIZE - TOKEN_SIZE + i] << (8 * i);
+    }
+    Peer* peer = find_peer(src_addr);
+
+    // Our own address on someone else's heartbeat is a unit claiming to be
+    // this one: reported like a bad token whatever it carries
+    bool valid = src_addr != source_address && tag == token(src_addr, data);
+    if (!valid) {
+        bad_token.inc();
+        // A bad token does not count as a sign of life: a unit swapped in
+        // for a peer is reported as both missing and a bad token
+        if (peer) {
+            peer->bad_tokens++;
+            if (now_ms - peer->last_alert_ms >= ALERT_HOLDOFF_MS) {
+                peer->last_alert_ms = now_ms;
+                raise(src_addr, Alert::BAD_TOKEN, now_ms - peer->last_seen_ms);
+            }
+        } else if (now_ms - last_stranger_alert_ms >= ALERT_HOLDOFF_MS) {
+            // Unauthenticated addresses never enter the table, so a flood
+            // of them cannot push out the real peers
+            last_stranger_alert_ms = now_ms;
+            raise(src_addr, Alert::BAD_TOKEN, 0);
+        }
+        return true;
+    }
+
+    // Under the default key a valid token proves nothing about the sender
+    PeerState heard = trusted_key ? PeerState::ALIVE : PeerState::UNVERIFIED;
+    if (!trusted_key) {
+        unkeyed.inc();
+    }
+
+    uint32_t counter = ((uint32_t)data[1] << 16) | ((uint32_t)data[3] << 8) | data[2];
+#if defined(ESP_PLATFORM)
+    // The first heartbeat since this node started has nothing in RAM to be
+    // newer than; the counter saved before the restart stands in
+    uint32_t saved = 0;
+    if ((!peer || peer->state == PeerState::EXPECTED) && load_peer_counter(src_addr, &saved) &&
+        !is_newer(counter, saved)) {
+        replays.inc();
+        uint32_t* last_alert_ms = peer ? &peer->last_alert_ms : &last_stranger_alert_ms;
+        if (peer) {
+            peer->replays++;
+        }
+        if (now_ms - *last_alert_ms >= ALERT_HOLDOFF_MS) {
+            *last_alert_ms = now_ms;
+            raise(src_addr, Alert::REPLAY, peer ? now_ms - peer->last_seen_ms : 0);
+        }
+        return true;
+    }
+#endif
+    if (!peer) {
+        peer = add_peer(src_addr);
+        if (!peer) {
+            return true;
+        }
+        ESP_LOGI(TAG, "Tracking peer %02X", src_addr);
+        peer->state = heard;
+        peer->save_pending = true;
+    } else if (peer->state == PeerState::EXPECTED) {
+        peer->state = heard;
+        peer->save_pending = true;
+    } else {
+        if (!is_newer(counter, peer->counter)) {
+            replays.inc();
+            peer->replays++;
+            if (now_ms - peer->last_alert_ms >= ALERT_HOLDOFF_MS) {
+                peer->last_alert_ms = now_ms;
+                raise(src_addr, Alert::REPLAY, now_ms - peer->last_seen_ms);
+            }
+            return true;
+        }
+
+        uint32_t silent = now_ms - peer->last_seen_ms;
+        if (peer->state == PeerState::MISSING && trusted_key) {
+            raise(src_addr, Alert::RECOVERED, silent);
+        }
+        peer->state = heard;
+
+        // A new epoch is a restart, unless seq just carried into it
+        uint8_t last_epoch = peer->counter >> 16;
+        uint16_t last_seq = peer->counter & 0xFFFF;
+        uint16_t next_seq = counter & 0xFFFF;
+        bool carry = (uint8_t)(last_epoch + 1) == data[1] && last_seq > 0xFFF0 && next_seq < 0x10;
+        if (data[1] != last_epoch && !carry) {
+            restarts.inc();
+            peer->restarts++;
+            raise(src_addr, Alert::RESTARTED, silent);
+        }
+        if (data[1] != last_epoch) {
+            peer->save_pending = true;
+        }
+    }
+    peer->counter = counter;
+    peer->period_units = data[0];
+    peer->last_seen_ms = now_ms;
+    return true;
+}
+
+void Monitor::check() {
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return;
+    }
+    uint32_t now_ms = esp_log_timestamp();
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        Peer& peer = peers[i];
+        if (!peer.in_use || peer.state == PeerState::MISSING) {
+            continue;
+        }
+        uint32_t silent = now_ms - peer.last_seen_ms;
+        if (silent > MISS_LIMIT * peer_period_ms(peer)) {
+            peer.state = PeerState::MISSING;
+            missing.inc();
+            silent_ms.record(silent);
+            raise(peer.address, Alert::MISSING, silent);
+        }
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+bool Monitor::set_period(uint32_t ms) {
+    uint32_t period = ms / PERIOD_UNIT_MS * PERIOD_UNIT_MS;
+    if (period < MIN_PERIOD_MS || period > MAX_PERIOD_MS) {
+        return false;
+    }
+    period_ms = period;
+    return true;
+}
+
+uint32_t Monitor::effective_period_ms() const {
+    uint64_t nodes = 1;
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use) {
+            nodes++;
+        }
+    }
+    // Shortest period at which n such nodes stay within the budget, in whole units
+    uint64_t share_ms = (nodes * FRAME_BITS * 1000 * 1000000 + (uint64_t)LOAD_BUDGET_PPM * bitrate - 1) /
+                        ((uint64_t)LOAD_BUDGET_PPM * bitrate);
+    share_ms = (share_ms + PERIOD_UNIT_MS - 1) / PERIOD_UNIT_MS * PERIOD_UNIT_MS;
+    if (share_ms > MAX_PERIOD_MS) {
+        share_ms = MAX_PERIOD_MS;
+    }
+    return share_ms > period_ms ? (uint32_t)share_ms : period_ms;
+}
+
+// Bits per second of one heartbeat stream, in ppm of the bitrate
+uint32_t Monitor::stream_ppm(uint32_t period) const {
+    return (uint32_t)((uint64_t)FRAME_BITS * 1000 * 1000000 / ((uint64_t)period * bitrate));
+}
+
+uint32_t Monitor::load_ppm() const {
+    uint32_t ppm = publishing ? stream_ppm(effective_period_ms()) : 0;
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use) {
+            ppm += stream_ppm(peer_period_ms(peers[i]));
+        }
+    }
+    return ppm;
+}
+
+uint32_t Monitor::bound_ms() const {
+    uint32_t longest = 0;
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].in_use) {
+            uint32_t bound = MISS_LIMIT * peer_period_ms(peers[i]) + CHECK_INTERVAL_MS;
+            longest = bound > longest ? bound : longest;
+        }
+    }
+    return longest;
+}
+
+void Monitor::print_status() {
+    uint32_t now_ms = esp_log_timestamp();
+    printf("{\"heartbeat\":\"status\",\"sa\":\"%02X\",\"keyed\":%s,\"publishing\":%s,\"period_ms\":%" PRIu32
+           ",\"effective_ms\":%" PRIu32 ",\"epoch\":%u,\"seq\":%u,\"load_ppm\":%" PRIu32 ",\"budget_ppm\":%" PRIu32
+           ",\"bound_ms\":%" PRIu32 ",\"peers\":[",
+           source_address, keyed && trusted_key ? "true" : "false", publishing ? "true" : "false", period_ms, effective_period_ms(), epoch, seq, load_ppm(),
+           LOAD_BUDGET_PPM, bound_ms());
+    bool first = true;
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        const Peer& peer = peers[i];
+        if (!peer.in_use) {
+            continue;
+        }
+        printf("%s{\"sa\":\"%02X\",\"state\":\"%s\",\"period_ms\":%" PRIu32 ",\"age_ms\":%" PRIu32
+               ",\"bad_tokens\":%u,\"replays\":%u,\"restarts\":%u}",
+               first ? "" : ",", peer.address, STATE_NAMES[(size_t)peer.state], peer_period_ms(peer),
+               now_ms - peer.last_seen_ms, peer.bad_tokens, peer.replays, peer.restarts);
+        first = false;
+    }
+    printf("]}\n");
+}
+
+bool Monitor::execute(const char* command) {
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        printf("{\"heartbeat\":\"error\",\"reason\":\"busy\"}\n");
+        return false;
+    }
+
+    bool ok = true;
+    if (strncmp(command, "period,", 7) == 0) {
+        ok = set_period((uint32_t)strtoul(command + 7, NULL, 10));
+        if (!ok) {
+            printf("{\"heartbeat\":\"error\",\"reason\":\"period %" PRIu32 "..%" PRIu32 " ms\"}\n",
+                   MIN_PERIOD_MS, MAX_PERIOD_MS);
+        }
+    } else if (strcmp(command, "on") == 0) {
+        publishing = true;
+    } else if (strcmp(command, "off") == 0) {
+        publishing = false;
+    } else if (strncmp(command, "expect,", 7) == 0 || strncmp(command, "forget,", 7) == 0) {
+        uint8_t address = (uint8_t)strtoul(command + 7, NULL, 16);
+        Peer* peer = find_peer(address);
+        if (command[0] == 'f') {
+            if (peer) {
+                peer->in_use = false;
+                peer_count.add(-1);
+            }
+#if defined(ESP_PLATFORM)
+            erase_peer_counter(address);
+#endif
+        } else if (!peer && address != source_address) {
+            // Counted from now, so it is reported if it never appears
+            peer = add_peer(address);
+            if (peer) {
+                peer->state = PeerState::EXPECTED;
+                peer->last_seen_ms = esp_log_timestamp();
+            } else {
+                printf("{\"heartbeat\":\"error\",\"reason\":\"peer table full\"}\n");
+                ok = false;
+            }
+        }
+    } else if (strcmp(command, "status") != 0) {
+        printf("{\"heartbeat\":\"error\",\"usage\":\"status|period,<ms>|on|off|expect,<sa>|forget,<sa>\"}\n");
+        ok = false;
+    }
+
+    if (ok) {
+        print_status();
+    }
+    xSemaphoreGive(spi_mutex);
+    return ok;
+}
+
+}
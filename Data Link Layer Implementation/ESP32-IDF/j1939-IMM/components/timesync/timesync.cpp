@@ -0,0 +1,313 @@
+/**
+ * @file timesync.cpp
+ * @brief Bus time master and follower over J1939 SYNC / FOLLOW_UP frames
+ * @version 1.0
+ *
+ * One node is the time master and every other node follows it:
+ *
+ *   {"c":"time","d":"master,1000"}  send SYNC every second from this node
+ *   {"c":"time","d":"follow"}       follow whichever master is on the bus
+ *   {"c":"time","d":"status"}
+ *   {"timesync":"status","role":"follower","master":"52","synced":true,
+ *    "time_us":..,"offset_us":..,"drift_ppb":..,"error_us":..,"samples":..,"age_ms":..}
+ *
+ * error_us is how far the follower's clock was from the master's at the
+ * last SYNC, before that sample corrected it: the achieved sync error. The
+ * "timesync" group in "stats" has its histogram, with the samples, steps
+ * and the SYNCs that could not be used. Once synchronised, received
+ * messages carry the bus time in "t", trace dumps are in bus time and the
+ * sniffer's alerts are stamped with it.
+ *
+ */
+
+#include "timesync.h"
+#include "j1939.h"
+#include "sync_clock.h"
+#include "metrics.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* TAG = "TimeSync";
+
+namespace TimeSync {
+
+static Metrics::Counter sent("timesync", "sent");
+static Metrics::Counter tx_failed("timesync", "tx_failed");
+static Metrics::Counter samples("timesync", "samples");
+static Metrics::Counter steps("timesync", "steps");
+static Metrics::Counter late_rx("timesync", "late_rx");         // SYNC without its own interrupt time
+static Metrics::Counter unmatched("timesync", "unmatched");     // FOLLOW_UP for another SYNC
+static Metrics::Counter foreign("timesync", "foreign");         // SYNC from a node that is not our master
+static Metrics::Counter implausible("timesync", "implausible"); // sample pair beyond MAX_DRIFT_PPB
+static Metrics::Gauge drift("timesync", "drift_ppb");
+static const uint32_t ERROR_US[] = {2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000};
+static Metrics::Histogram error_us("timesync", "error_us", ERROR_US);
+
+static const char* const ROLE_NAMES[] = {"off", "master", "follower"};
+
+static constexpr uint8_t NO_MASTER = J1939::GLOBAL_ADDRESS;
+
+static int64_t clamp_drift(int64_t ppb) {
+    if (ppb > MAX_DRIFT_PPB) {
+        return MAX_DRIFT_PPB;
+    }
+    if (ppb < -MAX_DRIFT_PPB) {
+        return -MAX_DRIFT_PPB;
+    }
+    return ppb;
+}
+
+Synchronizer::Synchronizer(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr)
+    : can(can),
+      spi_mutex(spi_mutex),
+      source_address(source_addr),
+      task(NULL),
+      role(Role::OFF),
+      period_ms(DEFAULT_PERIOD_MS),
+      seq(0),
+      master(NO_MASTER),
+      last_sample_ms(0),
+      pending(false),
+      pending_seq(0),
+      pending_rx_us(0),
+      locked(false),
+      have_previous(false),
+      last_local_us(0),
+      last_master_us(0),
+      drift_ppb(0),
+      last_error_us(0),
+      sample_count(0) {
+}
+
+Synchronizer::~Synchronizer() {
+    if (task) {
+        vTaskDelete(task);
+    }
+}
+
+bool Synchronizer::init(Role initial) {
+    set_role(initial);
+    task = task_memory.create(task_entry, "timesync", this, TASK_PRIORITY);
+    if (!task) {
+        ESP_LOGE(TAG, "Failed to create time sync task");
+        return false;
+    }
+    return true;
+}
+
+void Synchronizer::task_entry(void* arg) {
+    ((Synchronizer*)arg)->task_loop();
+}
+
+void Synchronizer::task_loop() {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(period_ms));
+        if (role == Role::MASTER) {
+            send_sync();
+        }
+    }
+}
+
+void Synchronizer::send_sync() {
+    can_frame frame = {};
+    frame.can_id = J1939::Controller::make_can_id(PGN_SYNC, J1939::GLOBAL_ADDRESS, source_address, PRIORITY);
+    frame.can_dlc = FRAME_SIZE;
+    memset(frame.data, 0xFF, FRAME_SIZE);
+    frame.data[0] = seq;
+
+    // Sent past the J1939 bus busy state: a SYNC delayed by a BAM is no
+    // less accurate, since the master's time is taken when it completes
+    CanController::ERROR err = CanController::ERROR_FAIL;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        int64_t done_us = 0;
+        if (role == Role::MASTER) {
+            err = can->sendMessageAndWait(&frame, TX_TIMEOUT_US, &done_us);
+        }
+        if (err == CanController::ERROR_OK) {
+            frame.can_id = J1939::Controller::make_can_id(PGN_FOLLOW_UP, J1939::GLOBAL_ADDRESS, source_address, PRIORITY);
+            for (size_t i = 0; i < FRAME_SIZE - 1; i++) {
+                frame.data[1 + i] = (uint8_t)(done_us >> (8 * i));
+            }
+            err = can->sendMessage(&frame);
+        }
+        xSemaphoreGive(spi_mutex);
+    }
+
+    if (err == CanController::ERROR_OK) {
+        sent.inc();
+    } else {
+        tx_failed.inc();
+    }
+    seq++;
+}
+
+bool Synchronizer::on_frame(const can_frame* frame, int64_t rx_us) {
+    if (!(frame->can_id & CAN_EFF_FLAG) || frame->can_dlc != FRAME_SIZE) {
+        return false;
+    }
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    if (pgn != PGN_SYNC && pgn != PGN_FOLLOW_UP) {
+        return false;
+    }
+    uint8_t src_addr = id & 0xFF;
+
+    if (role != Role::FOLLOWER) {
+        if (role == Role::MASTER && pgn == PGN_SYNC) {
+            foreign.inc();
+        }
+        return true;
+    }
+
+    uint32_t now_ms = esp_log_timestamp();
+    if (src_addr != master) {
+        if (master != NO_MASTER && now_ms - last_sample_ms < MASTER_TIMEOUT_MS) {
+            if (pgn == PGN_SYNC) {
+                foreign.inc();
+            }
+            return true;
+        }
+        // First master, or the previous one went quiet: start over, keeping
+        // the old mapping until the new master's first drift estimate
+        ESP_LOGI(TAG, "Following time master %02X", src_addr);
+        master = src_addr;
+        last_sample_ms = now_ms;
+        pending = false;
+        locked = false;
+        have_previous = false;
+    }
+
+    if (pgn == PGN_SYNC) {
+        pending = true;
+        pending_seq = frame->data[0];
+        pending_rx_us = rx_us;
+        if (rx_us == 0) {
+            late_rx.inc();
+        }
+        return true;
+    }
+
+    if (!pending || frame->data[0] != pending_seq) {
+        unmatched.inc();
+    } else if (pending_rx_us != 0) {
+        int64_t master_us = 0;
+        for (size_t i = FRAME_SIZE - 1; i > 0; i--) {
+            master_us = (master_us << 8) | frame->data[i];
+        }
+        sample(pending_rx_us, master_us);
+        last_sample_ms = now_ms;
+    }
+    pending = false;
+    return true;
+}
+
+void Synchronizer::sample(int64_t rx_local_us, int64_t master_us) {
+    samples.inc();
+    sample_count++;
+    int64_t interval_us = rx_local_us - last_local_us;
+
+    if (!locked) {
+        // Two samples give the drift; until then SyncClock keeps what it had
+        if (have_previous && interval_us > 0 && interval_us < (int64_t)MAX_SAMPLE_INTERVAL_MS * 1000) {
+            // A master that restarted or stepped in between gives an interval
+            // that is no drift measurement and may overflow the scaling below;
+            // this sample starts a new pair instead
+            int64_t deviation_us = master_us - last_master_us - interval_us;
+            int64_t max_deviation_us = interval_us * MAX_DRIFT_PPB / 1000000000;
+            if (deviation_us > max_deviation_us || deviation_us < -max_deviation_us) {
+                implausible.inc();
+            } else {
+                drift_ppb = clamp_drift(deviation_us * 1000000000 / interval_us);
+                SyncClock::set(rx_local_us, master_us, (int32_t)drift_ppb);
+                steps.inc();
+                locked = true;
+            }
+        }
+    } else {
+        int64_t predicted_us = SyncClock::to_sync(rx_local_us);
+        int64_t error = master_us - predicted_us;
+        last_error_us = error;
+        error_us.record((uint32_t)(error < 0 ? -error : error));
+
+        if (error > STEP_THRESHOLD_US || error < -STEP_THRESHOLD_US || interval_us <= 0) {
+            SyncClock::set(rx_local_us, master_us, (int32_t)drift_ppb);
+            steps.inc();
+        } else {
+            drift_ppb = clamp_drift(drift_ppb + error * 1000000000 / interval_us / KI_DIVISOR);
+            SyncClock::set(rx_local_us, predicted_us + error / KP_DIVISOR, (int32_t)drift_ppb);
+        }
+    }
+
+    drift.set((int32_t)drift_ppb);
+    have_previous = true;
+    last_local_us = rx_local_us;
+    last_master_us = master_us;
+}
+
+void Synchronizer::set_role(Role next) {
+    role = next;
+    master = next == Role::MASTER ? source_address : NO_MASTER;
+    pending = false;
+    locked = false;
+    have_previous = false;
+    drift_ppb = 0;
+    last_error_us = 0;
+    sample_count = 0;
+    if (next == Role::MASTER) {
+        SyncClock::set_master();
+    } else {
+        SyncClock::reset();
+    }
+    drift.set(0);
+}
+
+void Synchronizer::print_status() {
+    int64_t local_us = esp_timer_get_time();
+    int64_t sync_us = SyncClock::to_sync(local_us);
+    uint32_t age_ms = role == Role::FOLLOWER && sample_count > 0 ? esp_log_timestamp() - last_sample_ms : 0;
+    printf("{\"timesync\":\"status\",\"role\":\"%s\",\"master\":\"%02X\",\"synced\":%s,\"time_us\":%" PRId64
+           ",\"offset_us\":%" PRId64 ",\"drift_ppb\":%" PRId64 ",\"error_us\":%" PRId64 ",\"samples\":%" PRIu32
+           ",\"age_ms\":%" PRIu32 "}\n",
+           ROLE_NAMES[(size_t)role], master, SyncClock::is_synced() ? "true" : "false", sync_us,
+           sync_us - local_us, drift_ppb, last_error_us, sample_count, age_ms);
+}
+
+bool Synchronizer::execute(const char* command) {
+    bool change = true;
+    Role next = role;
+    if (strncmp(command, "master", 6) == 0 && (command[6] == '\0' || command[6] == ',')) {
+        uint32_t period = command[6] == ',' ? (uint32_t)strtoul(command + 7, NULL, 10) : DEFAULT_PERIOD_MS;
+        if (period < MIN_PERIOD_MS) {
+            printf("{\"timesync\":\"error\",\"reason\":\"period below %" PRIu32 " ms\"}\n", MIN_PERIOD_MS);
+            return false;
+        }
+        period_ms = period;
+        next = Role::MASTER;
+    } else if (strcmp(command, "follow") == 0) {
+        next = Role::FOLLOWER;
+    } else if (strcmp(command, "off") == 0) {
+        next = Role::OFF;
+    } else if (strcmp(command, "status") == 0) {
+        change = false;
+    } else {
+        printf("{\"timesync\":\"error\",\"usage\":\"master[,<period ms>]|follow|off|status\"}\n");
+        return false;
+    }
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        printf("{\"timesync\":\"error\",\"reason\":\"busy\"}\n");
+        return false;
+    }
+    if (change) {
+        set_role(next);
+    }
+    print_status();
+    xSemaphoreGive(spi_mutex);
+    return true;
+}
+
+}
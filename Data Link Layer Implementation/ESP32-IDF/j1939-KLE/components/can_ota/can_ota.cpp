@@ -0,0 +1,739 @@
+/**
+ * @file can_ota.cpp
+ * @brief Firmware update over CAN into the inactive OTA partition
+ * @version 1.0
+ *
+ * A node on the host's serial port is the gateway; the node to update only
+ * needs to be on the bus. Test scripts/ota_push.py drives the gateway:
+ *
+ *   {"c":"ota","d":"begin,10,1048576,7,<sha256 hex>"} version 7 for node 0x10
+ *   {"ota":"status","src":"10","status":"ready","offset":0}
+ *   {"c":"ota","d":"data,0,<base64 of 512 bytes>"}
+ *   {"ota":"status","src":"10","status":"ack","offset":512}
+ *   ...
+ *   {"c":"ota","d":"end,reboot"}
+ *   {"ota":"status","src":"10","status":"done","offset":1048576}
+ *   {"ota":"done","src":"10","bytes":1048576,"ms":..,"bytes_per_s":..}
+ *
+ * Chunks are addressed transport messages (J1939::Controller with the
+ * target's address), one in flight: the target acknowledges a chunk as soon
+ * as it is buffered and its sectors are erased, and programs it while the
+ * next one arrives. A BEGIN for the same image after an interruption
+ * continues at the last sector boundary written.
+ *
+ * The gateway signs each BEGIN with the bus key (components/security), and
+ * the target answers a BEGIN without a valid MAC with "bad_mac". The READY
+ * carries a random nonce that the gateway's END must sign, so a recorded
+ * transfer replayed later never reaches the boot partition, and a version
+ * below the last one installed is answered with "old_version". It answers
+ * "in_progress" to a BEGIN or ABORT from another node while a transfer is
+ * under way, unless that transfer has stalled. A node whose bus key differs
+ * from the gateway's can't be updated over CAN, and neither end takes part
+ * with only the default key (BusKey::trusted).
+ *
+ * The partition table (partitions.csv) has two OTA slots; a new image boots
+ * once on trial and confirm_running_image() keeps it.
+ *
+ */
+
+#include "can_ota.h"
+#include "bus_key.h"
+#include "metrics.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "mbedtls/base64.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+static const char* TAG = "CanOta";
+
+namespace CanOta {
+
+static const char* NVS_NAMESPACE = "can_ota";
+static const char* VERSION_NVS_NAMESPACE = "can_ota_ver";   // survives clear_progress()
+
+static Metrics::Counter chunks("ota", "chunks");
+static Metrics::Counter busy("ota", "busy");
+static Metrics::Counter bad_offset("ota", "bad_offset");
+static Metrics::Counter resumed("ota", "resumed");
+static Metrics::Counter updates("ota", "updates");
+static Metrics::Counter failures("ota", "failures");
+static Metrics::Counter bad_mac("ota", "bad_mac");
+static Metrics::Counter in_progress("ota", "in_progress");
+static Metrics::Counter old_version("ota", "old_version");
+static const uint32_t WRITE_US[] = {500, 1000, 2000, 5000, 10000, 20000, 50000};
+static Metrics::Histogram write_us("ota", "write_us", WRITE_US);
+static const uint32_t ERASE_MS[] = {10, 20, 50, 100, 200, 500, 1000};
+static Metrics::Histogram erase_ms("ota", "erase_ms", ERASE_MS);
+
+static const char* STATUS_NAMES[] = {
+    "ready", "ack", "busy", "bad_offset", "done", "not_started",
+    "too_large", "no_partition", "flash_error", "hash_mismatch", "invalid_image", "aborted",
+    "bad_mac", "in_progress", "old_version"
+};
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static void put_le64(uint8_t* p, uint64_t value) {
+    put_le32(p, (uint32_t)value);
+    put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+// MAC of a BEGIN: binds the image and its version to the gateway that
+// sends it and the node it is for
+static uint64_t begin_mac(const uint8_t* key, uint8_t gateway, uint8_t target, uint32_t size,
+                          uint32_t version, const uint8_t* hash) {
+    uint8_t message[2 + 4 + 4 + HASH_SIZE];
+    message[0] = gateway;
+    message[1] = target;
+    put_le32(message + 2, size);
+    put_le32(message + 6, version);
+    memcpy(message + 10, hash, HASH_SIZE);
+    return SipHash::mac(key, message, sizeof(message));
+}
+
+// MAC of an END: only valid for the transfer whose READY carried the nonce
+static uint64_t end_mac(const uint8_t* key, uint8_t gateway, uint8_t target, bool reboot,
+                        const uint8_t* nonce, uint32_t version, const uint8_t* hash) {
+    uint8_t message[3 + NONCE_SIZE + 4 + HASH_SIZE];
+    message[0] = gateway;
+    message[1] = target;
+    message[2] = reboot ? 1 : 0;
+    memcpy(message + 3, nonce, NONCE_SIZE);
+    put_le32(message + 3 + NONCE_SIZE, version);
+    memcpy(message + 7 + NONCE_SIZE, hash, HASH_SIZE);
+    return SipHash::mac(key, message, sizeof(message));
+}
+
+static bool parse_hash(const char* hex, uint8_t* hash) {
+    if (strlen(hex) != 2 * HASH_SIZE) {
+        return false;
+    }
+    for (size_t i = 0; i < HASH_SIZE; i++) {
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1])) {
+            return false;
+        }
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        hash[i] = (uint8_t)strtoul(byte, NULL, 16);
+    }
+    return true;
+}
+
+Updater::Updater(J1939::Controller* controller, SemaphoreHandle_t spi_mutex, uint8_t source_addr)
+    : j1939(controller),
+      spi_mutex(spi_mutex),
+      source_address(source_addr),
+      keyed(false),
+      jobs(NULL),
+      free_buffers(NULL),
+      task(NULL),
+      state(State::IDLE),
+      next_offset(0),
+      gateway(J1939::GLOBAL_ADDRESS),
+      last_chunk_us(0),
+      min_version(0),
+      partition(NULL),
+      image_size(0),
+      image_version(0),
+      written(0),
+      erased(0),
+      target(J1939::GLOBAL_ADDRESS),
+      target_size(0),
+      target_version(0),
+      have_nonce(false),
+      resumed_from(0),
+      begin_us(0) {
+    memset(image_hash, 0, sizeof(image_hash));
+    memset(nonce, 0, sizeof(nonce));
+    mbedtls_sha256_init(&sha);
+}
+
+Updater::~Updater() {
+    if (task) {
+        vTaskDelete(task);
+    }
+    mbedtls_sha256_free(&sha);
+}
+
+bool Updater::init() {
+    // The default key is public: a MAC under it proves nothing
+    keyed = BusKey::trusted(BusKey::load(key));
+    if (!keyed) {
+        ESP_LOGW(TAG, "No provisioned bus key: updates are refused");
+    }
+    nvs_handle_t nvs;
+    if (nvs_open(VERSION_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        uint32_t version = 0;
+        if (nvs_get_u32(nvs, "min", &version) == ESP_OK) {
+            min_version = version;
+        }
+        nvs_close(nvs);
+    }
+
+    jobs = jobs_memory.create();
+    free_buffers = free_buffers_memory.create();
+    if (!jobs || !free_buffers) {
+        ESP_LOGE(TAG, "Failed to create queues");
+        return false;
+    }
+    for (uint8_t i = 0; i < BUFFER_COUNT; i++) {
+        xQueueSend(free_buffers, &i, 0);
+    }
+    task = task_memory.create(task_entry, "can_ota", this, TASK_PRIORITY);
+    if (!task) {
+        ESP_LOGE(TAG, "Failed to create update task");
+        return false;
+    }
+    return true;
+}
+
+void Updater::confirm_running_image() {
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    esp_ota_img_states_t img_state;
+    if (running && esp_ota_get_state_partition(running, &img_state) == ESP_OK &&
+        img_state == ESP_OTA_IMG_PENDING_VERIFY) {
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "Image in %s confirmed", running->label);
+    }
+}
+
+bool Updater::on_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len) {
+    if (pgn != PGN_OTA) {
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    Job job = {};
+    job.src_addr = src_addr;
+
+    switch ((Op)data[0]) {
+    case Op::STATUS:
+        if (len >= 6) {
+            if ((Status)data[1] == Status::READY && len >= READY_SIZE && src_addr == target) {
+                memcpy(target_nonce, data + 6, NONCE_SIZE);
+                have_nonce = true;
+            }
+            print_status(src_addr, (Status)data[1], get_le32(data + 2));
+        }
+        break;
+
+    case Op::BEGIN: {
+        if (len != BEGIN_SIZE) {
+            break;
+        }
+        job.size = get_le32(data + 1);
+        job.version = get_le32(data + 5);
+        memcpy(job.hash, data + 9, HASH_SIZE);
+        uint8_t expected[MAC_SIZE];
+        if (keyed) {
+            put_le64(expected, begin_mac(key, src_addr, source_address, job.size, job.version, job.hash));
+        }
+        if (!keyed || memcmp(expected, data + 9 + HASH_SIZE, MAC_SIZE) != 0) {
+            bad_mac.inc();
+            queue_reply(src_addr, Status::BAD_MAC, 0);
+            break;
+        }
+        if (held_by_other(src_addr)) {
+            in_progress.inc();
+            queue_reply(src_addr, Status::IN_PROGRESS, 0);
+            break;
+        }
+        if (job.version < min_version) {
+            old_version.inc();
+            queue_reply(src_addr, Status::OLD_VERSION, min_version);
+            break;
+        }
+        // Stops taking chunks of an earlier transfer until the task has
+        // worked out where this one starts
+        gateway = src_addr;
+        last_chunk_us = esp_timer_get_time();
+        state = State::PREPARING;
+        job.type = JobType::BEGIN;
+        queue_job(job);
+        break;
+    }
+
+    case Op::DATA: {
+        if (len <= DATA_HEADER_SIZE || len > DATA_HEADER_SIZE + CHUNK_SIZE) {
+            break;
+        }
+        if (state != State::RECEIVING || src_addr != gateway) {
+            queue_reply(src_addr, Status::NOT_STARTED, 0);
+            break;
+        }
+        uint32_t offset = get_le32(data + 1);
+        uint16_t chunk_len = (uint16_t)(len - DATA_HEADER_SIZE);
+        if (offset != next_offset || offset + chunk_len > image_size) {
+            bad_offset.inc();
+            queue_reply(src_addr, Status::BAD_OFFSET, next_offset);
+            break;
+        }
+        uint8_t index;
+        if (xQueueReceive(free_buffers, &index, 0) != pdTRUE) {
+            busy.inc();
+            queue_reply(src_addr, Status::BUSY, next_offset);
+            break;
+        }
+        Buffer& buffer = buffers[index];
+        buffer.offset = offset;
+        buffer.len = chunk_len;
+        memcpy(buffer.data, data + DATA_HEADER_SIZE, chunk_len);
+
+        job.type = JobType::DATA;
+        job.buffer = index;
+        if (queue_job(job)) {
+            next_offset = offset + chunk_len;
+            last_chunk_us = esp_timer_get_time();
+        } else {
+            xQueueSend(free_buffers, &index, 0);
+        }
+        break;
+    }
+
+    case Op::END:
+        if (len != END_SIZE) {
+            break;
+        }
+        job.type = JobType::END;
+        job.reboot = data[1] == 1;
+        memcpy(job.mac, data + 2, MAC_SIZE);
+        queue_job(job);
+        break;
+
+    case Op::ABORT:
+        if (held_by_other(src_addr)) {
+            in_progress.inc();
+            queue_reply(src_addr, Status::IN_PROGRESS, 0);
+            break;
+        }
+        job.type = JobType::ABORT;
+        queue_job(job);
+        break;
+    }
+    return true;
+}
+
+bool Updater::queue_job(const Job& job) {
+    if (xQueueSend(jobs, &job, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Job queue full, dropping message from 0x%02X", job.src_addr);
+        return false;
+    }
+    return true;
+}
+
+// A transfer of another gateway that is still moving
+bool Updater::held_by_other(uint8_t src_addr) const {
+    if (state != State::PREPARING && state != State::RECEIVING) {
+        return false;
+    }
+    return src_addr != gateway && esp_timer_get_time() - last_chunk_us < (int64_t)TAKEOVER_MS * 1000;
+}
+
+void Updater::queue_reply(uint8_t dst, Status status, uint32_t offset) {
+    Job job = {};
+    job.type = JobType::REPLY;
+    job.src_addr = dst;
+    job.status = status;
+    job.offset = offset;
+    queue_job(job);
+}
+
+void Updater::task_entry(void* arg) {
+    ((Updater*)arg)->task_loop();
+}
+
+void Updater::task_loop() {
+    Job job;
+    for (;;) {
+        if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        switch (job.type) {
+        case JobType::BEGIN:
+            begin(job);
+            break;
+        case JobType::DATA:
+            write_chunk(job);
+            xQueueSend(free_buffers, &job.buffer, 0);
+            break;
+        case JobType::END:
+            finish(job);
+            break;
+        case JobType::ABORT:
+            abort_update(job);
+            break;
+        case JobType::REPLY:
+            reply(job.src_addr, job.status, job.offset);
+            break;
+        }
+    }
+}
+
+void Updater::begin(const Job& job) {
+    partition = esp_ota_get_next_update_partition(NULL);
+    if (!partition) {
+        state = State::IDLE;
+        reply(gateway, Status::NO_PARTITION, 0);
+        return;
+    }
+    if (job.size == 0 || job.size > partition->size) {
+        state = State::IDLE;
+        reply(gateway, Status::TOO_LARGE, partition->size);
+        return;
+    }
+
+    image_size = job.size;
+    image_version = job.version;
+    memcpy(image_hash, job.hash, HASH_SIZE);
+
+    uint32_t offset = load_resume_offset(job);
+    if (offset && !hash_flash(offset)) {
+        offset = 0;
+    }
+    if (offset == 0) {
+        mbedtls_sha256_free(&sha);
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts(&sha, 0);
+    } else {
+        resumed.inc();
+    }
+    ESP_LOGI(TAG, "Update of %" PRIu32 " bytes into %s from 0x%02X, starting at %" PRIu32,
+             image_size, partition->label, gateway, offset);
+
+    // Every BEGIN gets a new nonce, so only the END for this READY counts
+    esp_fill_random(nonce, NONCE_SIZE);
+    written = offset;
+    erased = offset;
+    next_offset = offset;
+    save_progress(offset, true);
+    state = State::RECEIVING;
+    reply(gateway, Status::READY, offset, nonce);
+}
+
+// Erases what the chunk needs and saves the progress before the
+// acknowledgement, while the gateway waits; programming and hashing
+// overlap with the next chunk arriving in the other buffer
+void Updater::write_chunk(const Job& job) {
+    const Buffer& buffer = buffers[job.buffer];
+    if (state != State::RECEIVING) {
+        return;
+    }
+    uint32_t end = buffer.offset + buffer.len;
+
+    if (end > erased) {
+        uint32_t erase_end = (end + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        int64_t start_us = esp_timer_get_time();
+        esp_err_t err = esp_partition_erase_range(partition, erased, erase_end - erased);
+        erase_ms.record((uint32_t)((esp_timer_get_time() - start_us) / 1000));
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Erase at %" PRIu32 " failed: %s", erased, esp_err_to_name(err));
+            state = State::FAILED;
+            failures.inc();
+            reply(gateway, Status::FLASH_ERROR, written);
+            return;
+        }
+        erased = erase_end;
+    }
+    if (buffer.offset % SECTOR_SIZE == 0) {
+        save_progress(buffer.offset, false);
+    }
+    reply(gateway, Status::ACK, end);
+
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = esp_partition_write(partition, buffer.offset, buffer.data, buffer.len);
+    write_us.record((uint32_t)(esp_timer_get_time() - start_us));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Write at %" PRIu32 " failed: %s", buffer.offset, esp_err_to_name(err));
+        state = State::FAILED;
+        failures.inc();
+        reply(gateway, Status::FLASH_ERROR, written);
+        return;
+    }
+    mbedtls_sha256_update(&sha, buffer.data, buffer.len);
+    written = end;
+    chunks.inc();
+}
+
+void Updater::finish(const Job& job) {
+    if (state != State::RECEIVING || job.src_addr != gateway) {
+        reply(job.src_addr, Status::NOT_STARTED, 0);
+        return;
+    }
+    uint8_t expected[MAC_SIZE];
+    put_le64(expected, end_mac(key, gateway, source_address, job.reboot, nonce, image_version, image_hash));
+    if (memcmp(expected, job.mac, MAC_SIZE) != 0) {
+        // Not the END for this READY: the transfer stays open for the real one
+        bad_mac.inc();
+        reply(gateway, Status::BAD_MAC, written);
+        return;
+    }
+    if (written != image_size) {
+        reply(gateway, Status::BAD_OFFSET, written);
+        return;
+    }
+
+    uint8_t hash[HASH_SIZE];
+    mbedtls_sha256_finish(&sha, hash);
+    state = State::IDLE;
+    clear_progress();
+
+    if (memcmp(hash, image_hash, HASH_SIZE) != 0) {
+        ESP_LOGE(TAG, "Image hash mismatch");
+        failures.inc();
+        reply(gateway, Status::HASH_MISMATCH, written);
+        return;
+    }
+    esp_err_t err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Image rejected: %s", esp_err_to_name(err));
+        failures.inc();
+        reply(gateway, Status::INVALID_IMAGE, written);
+        return;
+    }
+
+    if (image_version > min_version) {
+        save_min_version(image_version);
+    }
+    updates.inc();
+    reply(gateway, Status::DONE, written);
+    if (job.reboot) {
+        ESP_LOGI(TAG, "Restarting into %s", partition->label);
+        vTaskDelay(pdMS_TO_TICKS(RESTART_DELAY_MS));
+        esp_restart();
+    }
+}
+
+void Updater::abort_update(const Job& job) {
+    if (state != State::IDLE) {
+        ESP_LOGW(TAG, "Update aborted by 0x%02X at %" PRIu32, job.src_addr, written);
+    }
+    state = State::IDLE;
+    clear_progress();
+    reply(job.src_addr, Status::ABORTED, written);
+}
+
+// Where an interrupted transfer of the same image into the same partition
+// can continue: the last sector boundary written, or 0
+uint32_t Updater::load_resume_offset(const Job& job) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return 0;
+    }
+    uint32_t address = 0, size = 0, offset = 0;
+    uint8_t hash[HASH_SIZE];
+    size_t hash_len = sizeof(hash);
+    bool same = nvs_get_u32(nvs, "part", &address) == ESP_OK &&
+                nvs_get_u32(nvs, "size", &size) == ESP_OK &&
+                nvs_get_blob(nvs, "hash", hash, &hash_len) == ESP_OK &&
+                nvs_get_u32(nvs, "offset", &offset) == ESP_OK &&
+                address == partition->address && size == job.size &&
+                hash_len == HASH_SIZE && memcmp(hash, job.hash, HASH_SIZE) == 0;
+    nvs_close(nvs);
+
+    if (!same || offset > size || offset % SECTOR_SIZE != 0) {
+        return 0;
+    }
+    return offset;
+}
+
+// At the start of a transfer also which image the offset belongs to
+void Updater::save_progress(uint32_t offset, bool start) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (start) {
+        nvs_set_u32(nvs, "part", partition->address);
+        nvs_set_u32(nvs, "size", image_size);
+        nvs_set_blob(nvs, "hash", image_hash, HASH_SIZE);
+    }
+    nvs_set_u32(nvs, "offset", offset);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+void Updater::clear_progress() {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_all(nvs);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+// Lowest version a BEGIN may carry from now on; kept across restarts and
+// transfers
+void Updater::save_min_version(uint32_t version) {
+    min_version = version;
+    nvs_handle_t nvs;
+    if (nvs_open(VERSION_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Version %" PRIu32 " not saved", version);
+        return;
+    }
+    nvs_set_u32(nvs, "min", version);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// Hashes the part of the image already in flash; the buffers are free
+// while a BEGIN is handled
+bool Updater::hash_flash(uint32_t size) {
+    mbedtls_sha256_free(&sha);
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    uint8_t* block = buffers[0].data;
+    for (uint32_t offset = 0; offset < size; offset += CHUNK_SIZE) {
+        size_t n = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+        if (esp_partition_read(partition, offset, block, n) != ESP_OK) {
+            ESP_LOGW(TAG, "Read back at %" PRIu32 " failed, starting over", offset);
+            return false;
+        }
+        mbedtls_sha256_update(&sha, block, n);
+    }
+    return true;
+}
+
+// A single frame, except READY with its nonce
+void Updater::reply(uint8_t dst, Status status, uint32_t offset, const uint8_t* ready_nonce) {
+    uint8_t message[READY_SIZE] = {(uint8_t)Op::STATUS, (uint8_t)status, 0, 0, 0, 0, 0xFF, 0xFF};
+    put_le32(message + 2, offset);
+    size_t len = STATUS_SIZE;
+    if (ready_nonce) {
+        memcpy(message + 6, ready_nonce, NONCE_SIZE);
+        len = READY_SIZE;
+    }
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        ESP_LOGW(TAG, "No status sent to 0x%02X: SPI busy", dst);
+        return;
+    }
+    bool sent = len <= 8 ? j1939->send_single_frame_message(PGN_OTA, dst, message, (uint8_t)len)
+                         : j1939->send_multi_frame_message(PGN_OTA, dst, message, (uint16_t)len);
+    if (!sent) {
+        ESP_LOGW(TAG, "No status sent to 0x%02X", dst);
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+bool Updater::execute(const char* command) {
+    uint8_t message[DATA_HEADER_SIZE + CHUNK_SIZE];
+    size_t len = 0;
+
+    if (strncmp(command, "begin,", 6) == 0) {
+        unsigned int dst = 0;
+        unsigned long size = 0, version = 0;
+        char hex[2 * HASH_SIZE + 2] = {};
+        if (!keyed) {
+            printf("{\"ota\":\"error\",\"reason\":\"no provisioned bus key\"}\n");
+            return false;
+        }
+        if (sscanf(command + 6, "%x,%lu,%lu,%65s", &dst, &size, &version, hex) == 4 &&
+            dst < J1939::GLOBAL_ADDRESS && size > 0 && parse_hash(hex, message + 9)) {
+            message[0] = (uint8_t)Op::BEGIN;
+            put_le32(message + 1, (uint32_t)size);
+            put_le32(message + 5, (uint32_t)version);
+            put_le64(message + 9 + HASH_SIZE,
+                     begin_mac(key, source_address, (uint8_t)dst, (uint32_t)size, (uint32_t)version, message + 9));
+            len = BEGIN_SIZE;
+            target = (uint8_t)dst;
+            target_size = (uint32_t)size;
+            target_version = (uint32_t)version;
+            memcpy(target_hash, message + 9, HASH_SIZE);
+            have_nonce = false;
+            resumed_from = 0;
+            begin_us = esp_timer_get_time();
+        }
+    } else if (strncmp(command, "data,", 5) == 0 && target != J1939::GLOBAL_ADDRESS) {
+        char* end;
+        unsigned long offset = strtoul(command + 5, &end, 10);
+        size_t decoded = 0;
+        if (end != command + 5 && *end == ',' &&
+            mbedtls_base64_decode(message + DATA_HEADER_SIZE, CHUNK_SIZE, &decoded,
+                                  (const unsigned char*)end + 1, strlen(end + 1)) == 0 && decoded > 0) {
+            message[0] = (uint8_t)Op::DATA;
+            put_le32(message + 1, (uint32_t)offset);
+            len = DATA_HEADER_SIZE + decoded;
+        }
+    } else if ((strcmp(command, "end") == 0 || strcmp(command, "end,reboot") == 0) &&
+               target != J1939::GLOBAL_ADDRESS) {
+        if (!have_nonce) {
+            printf("{\"ota\":\"error\",\"reason\":\"no ready from target\"}\n");
+            return false;
+        }
+        bool reboot = strcmp(command, "end,reboot") == 0;
+        message[0] = (uint8_t)Op::END;
+        message[1] = reboot ? 1 : 0;
+        put_le64(message + 2,
+                 end_mac(key, source_address, target, reboot, target_nonce, target_version, target_hash));
+        len = END_SIZE;
+    } else if (strcmp(command, "abort") == 0 && target != J1939::GLOBAL_ADDRESS) {
+        message[0] = (uint8_t)Op::ABORT;
+        len = 1;
+    }
+
+    if (len == 0) {
+        printf("{\"ota\":\"error\",\"usage\":\"begin,<dst hex>,<size>,<version>,<sha256 hex>|data,<offset>,<base64>|end[,reboot]|abort\"}\n");
+        return false;
+    }
+    if (!send(message, len)) {
+        printf("{\"ota\":\"error\",\"reason\":\"send\"}\n");
+        return false;
+    }
+    return true;
+}
+
+bool Updater::send(const uint8_t* data, size_t len) {
+    bool sent = false;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        if (len <= 8) {
+            sent = j1939->send_single_frame_message(PGN_OTA, target, data, (uint8_t)len);
+        } else {
+            sent = j1939->send_multi_frame_message(PGN_OTA, target, data, (uint16_t)len);
+        }
+        xSemaphoreGive(spi_mutex);
+    }
+    return sent;
+}
+
+void Updater::print_status(uint8_t src_addr, Status status, uint32_t offset) {
+    size_t index = (size_t)status;
+    const char* name = index < sizeof(STATUS_NAMES) / sizeof(STATUS_NAMES[0]) ? STATUS_NAMES[index] : "unknown";
+    printf("{\"ota\":\"status\",\"src\":\"%02X\",\"status\":\"%s\",\"offset\":%" PRIu32 "}\n", src_addr, name, offset);
+
+    if (src_addr != target) {
+        return;
+    }
+    if (status == Status::READY) {
+        resumed_from = offset;
+    } else if (status == Status::DONE) {
+        // Effective rate of this transfer, from the BEGIN command to the
+        // verified image, over the bytes it actually sent
+        int64_t elapsed_us = esp_timer_get_time() - begin_us;
+        uint32_t bytes = target_size - resumed_from;
+        printf("{\"ota\":\"done\",\"src\":\"%02X\",\"bytes\":%" PRIu32 ",\"resumed_from\":%" PRIu32
+               ",\"ms\":%" PRId64 ",\"bytes_per_s\":%" PRIu32 "}\n",
+               src_addr, bytes, resumed_from, elapsed_us / 1000,
+               elapsed_us > 0 ? (uint32_t)(bytes * 1000000LL / elapsed_us) : 0);
+    }
+}
+
+}
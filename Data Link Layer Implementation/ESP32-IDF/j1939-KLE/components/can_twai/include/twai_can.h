@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/twai.h"
+#include "mcp2515/mcp2515.h"
+#include "budget.h"
+
+// The ESP32's own CAN controller behind the MCP2515 driver's interface, so
+// J1939, the traffic generator and SLCAN run on it unchanged (see
+// can_controller.h). Frames go through the driver's queues and FIFO, with no
+// SPI transfer per register.
+//
+// Like the MCP2515, bitrate and filters are set in configuration mode and
+// take effect with the next setNormalMode()/setListenOnlyMode(), which
+// installs and starts the driver.
+class TwaiCan
+{
+    public:
+        typedef MCP2515::ERROR ERROR;
+        static constexpr ERROR ERROR_OK = MCP2515::ERROR_OK;
+        static constexpr ERROR ERROR_FAIL = MCP2515::ERROR_FAIL;
+        static constexpr ERROR ERROR_ALLTXBUSY = MCP2515::ERROR_ALLTXBUSY;
+        static constexpr ERROR ERROR_FAILINIT = MCP2515::ERROR_FAILINIT;
+        static constexpr ERROR ERROR_FAILTX = MCP2515::ERROR_FAILTX;
+        static constexpr ERROR ERROR_NOMSG = MCP2515::ERROR_NOMSG;
+
+        typedef MCP2515::MASK MASK;
+        static constexpr MASK MASK0 = MCP2515::MASK0;
+        static constexpr MASK MASK1 = MCP2515::MASK1;
+
+        typedef MCP2515::RXF RXF;
+        static constexpr RXF RXF0 = MCP2515::RXF0;
+        static constexpr RXF RXF1 = MCP2515::RXF1;
+        static constexpr RXF RXF2 = MCP2515::RXF2;
+        static constexpr RXF RXF3 = MCP2515::RXF3;
+        static constexpr RXF RXF4 = MCP2515::RXF4;
+        static constexpr RXF RXF5 = MCP2515::RXF5;
+
+        // Interrupt and error flag bits as the MCP2515 reports them
+        static constexpr uint8_t CANINTF_RX0IF = MCP2515::CANINTF_RX0IF;
+        static constexpr uint8_t CANINTF_RX1IF = MCP2515::CANINTF_RX1IF;
+        static constexpr uint8_t EFLG_RX1OVR = MCP2515::EFLG_RX1OVR;
+        static constexpr uint8_t EFLG_RX0OVR = MCP2515::EFLG_RX0OVR;
+        static constexpr uint8_t EFLG_TXBO = MCP2515::EFLG_TXBO;
+        static constexpr uint8_t EFLG_TXEP = MCP2515::EFLG_TXEP;
+        static constexpr uint8_t EFLG_RXEP = MCP2515::EFLG_RXEP;
+        static constexpr uint8_t EFLG_TXWAR = MCP2515::EFLG_TXWAR;
+        static constexpr uint8_t EFLG_RXWAR = MCP2515::EFLG_RXWAR;
+        static constexpr uint8_t EFLG_EWARN = MCP2515::EFLG_EWARN;
+
+        // Called from the alert task when frames have arrived, with the time
+        // the receive alert was taken; it stands in for the MCP2515 INT pin
+        typedef void (*ReceiveNotify)(void* arg, int64_t time_us);
+
+        static constexpr UBaseType_t ALERT_TASK_PRIORITY = 11;      // above the J1939 receiver
+        static constexpr size_t ALERT_TASK_STACK_SIZE = 3072;
+        static constexpr uint32_t ALERT_WAIT_MS = 100;
+
+        TwaiCan();
+        ~TwaiCan();
+
+        void setReceiveNotify(ReceiveNotify notify, void* arg);
+
+        ERROR reset(void);
+        ERROR setConfigMode();
+        ERROR setListenOnlyMode();
+        ERROR setLoopbackMode();
+        ERROR setNormalMode();
+        ERROR setBitrate(const CAN_SPEED canSpeed);
+        ERROR setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
+        void setInterruptMask(const uint8_t mask);
+        ERROR setFilterMask(const MASK num, const bool ext, const uint32_t ulData);
+        ERROR setFilter(const RXF num, const bool ext, const uint32_t ulData);
+        ERROR sendMessage(const struct can_frame *frame);
+        // Sends with an empty transmit queue and waits for the driver's
+        // transmit success alert; done_us is when the alert task took it
+        ERROR sendMessageAndWait(const struct can_frame *frame, uint32_t timeout_us, int64_t *done_us);
+        ERROR readMessage(struct can_frame *frame);
+        bool checkReceive(void);
+        bool checkError(void);
+        uint8_t getErrorFlags(void);
+        void clearRXInterrupts(void);
+        void clearRXnOVR(void);
+
+    private:
+        static constexpr size_t FILTER_COUNT = 6;
+        static constexpr size_t MASK_COUNT = 2;
+
+        ERROR start(twai_mode_t mode);
+        ERROR stop();
+        twai_filter_config_t merged_filter() const;
+
+        static void alert_task_entry(void* arg);
+        void alert_task_loop();
+
+        twai_timing_config_t timing;
+        volatile bool installed;
+
+        // Held by the alert task while it waits on the driver, which must
+        // not be uninstalled under it
+        SemaphoreHandle_t driver_mutex;
+        Budget::StaticMutex driver_mutex_memory;
+        volatile bool reconfiguring;
+
+        // Filters and masks in 29-bit identifier space (standard IDs in the
+        // top 11 bits, as the MCP2515 compares them)
+        uint32_t masks[MASK_COUNT];
+        uint32_t filters[FILTER_COUNT];
+
+        // Receive overruns already reported by getErrorFlags()
+        uint32_t overruns_seen;
+
+        // Transmit success alerts while sendMessageAndWait() has them on
+        volatile uint32_t tx_done_count;
+        volatile int64_t tx_done_us;
+
+        ReceiveNotify notify;
+        void* notify_arg;
+        TaskHandle_t alert_task;
+        Budget::StaticTask<ALERT_TASK_STACK_SIZE> alert_task_memory;
+};
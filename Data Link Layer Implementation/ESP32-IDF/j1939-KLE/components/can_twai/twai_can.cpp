@@ -0,0 +1,419 @@
+/**
+ * @file twai_can.cpp
+ * @brief ESP32 TWAI controller backend with the MCP2515 driver's interface
+ * @version 1.0
+ *
+ * Selected with CAN controller -> Controller -> Built-in TWAI controller in
+ * menuconfig; needs a 3.3 V transceiver (SN65HVD230 or similar) on
+ * CONFIG_CAN_TWAI_TX_GPIO / CONFIG_CAN_TWAI_RX_GPIO instead of the MCP2515.
+ *
+ * A high priority alert task waits for the driver's receive alert and calls
+ * the receive notify, which queues the time for the J1939 receiver as the
+ * MCP2515 interrupt handler does. The same task counts bus errors, lost
+ * arbitrations and receive overruns, and recovers from bus-off.
+ *
+ * The driver counters keep the MCP2515 names ("driver" in "stats") and the
+ * profiler sites are twai_read_message / twai_send_message, so the two
+ * backends compare directly: with a CONFIG_DIAG_PROFILE build of each,
+ * run {"c":"gen","d":"sweep,..."} from another node, then "prof" and
+ * "stats" on this one for the cycles per frame and the frame rate at which
+ * rx_frames stops following the generator.
+ *
+ */
+
+#include "twai_can.h"
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "metrics.h"
+#include "profile.h"
+#include <string.h>
+
+static const char* TAG = "TWAI";
+
+static Metrics::Counter tx_frames("driver", "tx_frames");
+static Metrics::Counter tx_errors("driver", "tx_errors");
+static Metrics::Counter tx_all_busy("driver", "tx_all_busy");
+static Metrics::Counter rx_frames("driver", "rx_frames");
+static Metrics::Counter rx_errors("driver", "rx_errors");
+
+static int32_t error_counter(void* tx) {
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK) {
+        return 0;
+    }
+    return (int32_t)(tx ? status.tx_error_counter : status.rx_error_counter);
+}
+
+static int tx_side = 1;
+static Metrics::Gauge tx_error_counter("twai", "tec", error_counter, &tx_side);
+static Metrics::Gauge rx_error_counter("twai", "rec", error_counter, NULL);
+static Metrics::Counter bus_errors("twai", "bus_errors");
+static Metrics::Counter arb_lost("twai", "arb_lost");
+static Metrics::Counter error_passive("twai", "error_passive");
+static Metrics::Counter bus_off("twai", "bus_off");
+static Metrics::Counter rx_queue_full("twai", "rx_queue_full");
+static Metrics::Counter rx_fifo_overrun("twai", "rx_fifo_overrun");
+
+static const uint32_t ALERTS = TWAI_ALERT_RX_DATA | TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ARB_LOST |
+                               TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED |
+                               TWAI_ALERT_RX_QUEUE_FULL | TWAI_ALERT_RX_FIFO_OVERRUN;
+
+TwaiCan::TwaiCan()
+    : timing(TWAI_TIMING_CONFIG_500KBITS()),
+      installed(false),
+      driver_mutex(NULL),
+      reconfiguring(false),
+      masks{},
+      filters{},
+      overruns_seen(0),
+      tx_done_count(0),
+      tx_done_us(0),
+      notify(NULL),
+      notify_arg(NULL),
+      alert_task(NULL) {
+    driver_mutex = driver_mutex_memory.create();
+}
+
+TwaiCan::~TwaiCan() {
+    setConfigMode();
+    if (alert_task) {
+        vTaskDelete(alert_task);
+    }
+}
+
+void TwaiCan::setReceiveNotify(ReceiveNotify callback, void* arg) {
+    notify_arg = arg;
+    notify = callback;
+}
+
+TwaiCan::ERROR TwaiCan::reset(void) {
+    ERROR res = setConfigMode();
+    memset(masks, 0, sizeof(masks));
+    memset(filters, 0, sizeof(filters));
+    return res;
+}
+
+TwaiCan::ERROR TwaiCan::setConfigMode() {
+    if (!installed) {
+        return ERROR_OK;
+    }
+    reconfiguring = true;
+    xSemaphoreTake(driver_mutex, portMAX_DELAY);
+    ERROR res = stop();
+    xSemaphoreGive(driver_mutex);
+    reconfiguring = false;
+    return res;
+}
+
+TwaiCan::ERROR TwaiCan::stop() {
+    twai_stop();
+    if (twai_driver_uninstall() != ESP_OK) {
+        return ERROR_FAIL;
+    }
+    installed = false;
+    return ERROR_OK;
+}
+
+TwaiCan::ERROR TwaiCan::setNormalMode() {
+    return start(TWAI_MODE_NORMAL);
+}
+
+TwaiCan::ERROR TwaiCan::setListenOnlyMode() {
+    return start(TWAI_MODE_LISTEN_ONLY);
+}
+
+// Self test: frames are not acknowledged by other nodes and are received
+// back, the closest TWAI mode to the MCP2515 loopback
+TwaiCan::ERROR TwaiCan::setLoopbackMode() {
+    return start(TWAI_MODE_NO_ACK);
+}
+
+TwaiCan::ERROR TwaiCan::start(twai_mode_t mode) {
+    ERROR res = setConfigMode();
+    if (res != ERROR_OK) {
+        return res;
+    }
+
+    twai_general_config_t general = TWAI_GENERAL_CONFIG_DEFAULT((gpio_num_t)CONFIG_CAN_TWAI_TX_GPIO,
+                                                                (gpio_num_t)CONFIG_CAN_TWAI_RX_GPIO, mode);
+    general.tx_queue_len = CONFIG_CAN_TWAI_TX_QUEUE_LEN;
+    general.rx_queue_len = CONFIG_CAN_TWAI_RX_QUEUE_LEN;
+    general.alerts_enabled = ALERTS;
+    twai_filter_config_t filter = merged_filter();
+
+    if (twai_driver_install(&general, &timing, &filter) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to install driver");
+        return ERROR_FAILINIT;
+    }
+    if (twai_start() != ESP_OK) {
+        twai_driver_uninstall();
+        return ERROR_FAILINIT;
+    }
+    installed = true;
+    clearRXnOVR();
+
+    if (!alert_task) {
+        alert_task = alert_task_memory.create(alert_task_entry, "twai_alerts", this, ALERT_TASK_PRIORITY);
+        if (!alert_task) {
+            return ERROR_FAILINIT;
+        }
+    }
+    return ERROR_OK;
+}
+
+TwaiCan::ERROR TwaiCan::setBitrate(const CAN_SPEED canSpeed) {
+    ERROR res = setConfigMode();
+    if (res != ERROR_OK) {
+        return res;
+    }
+
+    switch (canSpeed) {
+        case CAN_50KBPS:   timing = TWAI_TIMING_CONFIG_50KBITS();  break;
+        case CAN_100KBPS:  timing = TWAI_TIMING_CONFIG_100KBITS(); break;
+        case CAN_125KBPS:  timing = TWAI_TIMING_CONFIG_125KBITS(); break;
+        case CAN_250KBPS:  timing = TWAI_TIMING_CONFIG_250KBITS(); break;
+        case CAN_500KBPS:  timing = TWAI_TIMING_CONFIG_500KBITS(); break;
+        case CAN_1000KBPS: timing = TWAI_TIMING_CONFIG_1MBITS();   break;
+        default:
+            return ERROR_FAIL;
+    }
+    return ERROR_OK;
+}
+
+// The TWAI clock is the APB clock; the MCP2515 crystal has no meaning here
+TwaiCan::ERROR TwaiCan::setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock) {
+    return setBitrate(canSpeed);
+}
+
+void TwaiCan::setInterruptMask(const uint8_t mask) {
+}
+
+TwaiCan::ERROR TwaiCan::setFilterMask(const MASK num, const bool ext, const uint32_t ulData) {
+    if ((size_t)num >= MASK_COUNT) {
+        return ERROR_FAIL;
+    }
+    ERROR res = setConfigMode();
+    if (res != ERROR_OK) {
+        return res;
+    }
+    masks[num] = ext ? (ulData & CAN_EFF_MASK) : ((ulData & CAN_SFF_MASK) << 18);
+    return ERROR_OK;
+}
+
+TwaiCan::ERROR TwaiCan::setFilter(const RXF num, const bool ext, const uint32_t ulData) {
+    if ((size_t)num >= FILTER_COUNT) {
+        return ERROR_FAIL;
+    }
+    ERROR res = setConfigMode();
+    if (res != ERROR_OK) {
+        return res;
+    }
+    filters[num] = ext ? (ulData & CAN_EFF_MASK) : ((ulData & CAN_SFF_MASK) << 18);
+    return ERROR_OK;
+}
+
+// The controller has one acceptance filter where the MCP2515 has six
+// filters on two masks (RXF0-1 on MASK0, RXF2-5 on MASK1). The merged
+// filter compares only the bits that every filter compares and that have
+// the same value in all of them, so it accepts at least what any of the six
+// accepts; software drops the rest. Standard frames meet the same code in
+// their 11 identifier bits, and the low 18 bits in RTR and data bytes.
+twai_filter_config_t TwaiCan::merged_filter() const {
+    uint32_t compared = CAN_EFF_MASK;
+    for (size_t i = 0; i < FILTER_COUNT; i++) {
+        uint32_t mask = masks[i < 2 ? 0 : 1];
+        compared &= mask & ~(filters[i] ^ filters[0]);
+    }
+
+    twai_filter_config_t filter;
+    filter.acceptance_code = (filters[0] & compared) << 3;
+    filter.acceptance_mask = ~(compared << 3);
+    filter.single_filter = true;
+    return filter;
+}
+
+TwaiCan::ERROR TwaiCan::sendMessage(const struct can_frame *frame) {
+    PROFILE_SCOPE("twai_send_message");
+
+    if (frame->can_dlc > CAN_MAX_DLEN) {
+        return ERROR_FAILTX;
+    }
+
+    twai_message_t message = {};
+    message.extd = (frame->can_id & CAN_EFF_FLAG) ? 1 : 0;
+    message.rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+    message.identifier = frame->can_id & (message.extd ? CAN_EFF_MASK : CAN_SFF_MASK);
+    message.data_length_code = frame->can_dlc;
+    memcpy(message.data, frame->data, frame->can_dlc);
+
+    esp_err_t err = twai_transmit(&message, 0);
+    if (err == ESP_OK) {
+        tx_frames.inc();
+        return ERROR_OK;
+    }
+    if (err == ESP_ERR_TIMEOUT) {
+        tx_all_busy.inc();
+        return ERROR_ALLTXBUSY;
+    }
+    tx_errors.inc();
+    return ERROR_FAILTX;
+}
+
+TwaiCan::ERROR TwaiCan::readMessage(struct can_frame *frame) {
+    PROFILE_SCOPE("twai_read_message");
+
+    twai_message_t message;
+    if (!installed || twai_receive(&message, 0) != ESP_OK) {
+        return ERROR_NOMSG;
+    }
+    if (message.data_length_code > CAN_MAX_DLEN) {
+        rx_errors.inc();
+        return ERROR_FAIL;
+    }
+
+    uint32_t id = message.identifier;
+    if (message.extd) {
+        id |= CAN_EFF_FLAG;
+    }
+    if (message.rtr) {
+        id |= CAN_RTR_FLAG;
+    }
+    frame->can_id = id;
+    frame->can_dlc = message.data_length_code;
+    memcpy(frame->data, message.data, message.data_length_code);
+
+    rx_frames.inc();
+    return ERROR_OK;
+}
+
+TwaiCan::ERROR TwaiCan::sendMessageAndWait(const struct can_frame *frame, uint32_t timeout_us, int64_t *done_us) {
+    // With frames ahead of it the next success alert would not be this one
+    twai_status_info_t status;
+    if (!installed || twai_get_status_info(&status) != ESP_OK) {
+        return ERROR_FAILTX;
+    }
+    if (status.msgs_to_tx > 0) {
+        tx_all_busy.inc();
+        return ERROR_ALLTXBUSY;
+    }
+
+    // Only on for this frame, so other transmits do not wake the alert task
+    twai_reconfigure_alerts(ALERTS | TWAI_ALERT_TX_SUCCESS, NULL);
+    uint32_t count = tx_done_count;
+    int64_t start = esp_timer_get_time();
+    ERROR err = sendMessage(frame);
+    while (err == ERROR_OK && tx_done_count == count) {
+        if (esp_timer_get_time() - start > (int64_t)timeout_us) {
+            err = ERROR_FAILTX;
+        }
+    }
+    twai_reconfigure_alerts(ALERTS, NULL);
+
+    if (err == ERROR_OK) {
+        *done_us = tx_done_us;
+    }
+    return err;
+}
+
+bool TwaiCan::checkReceive(void) {
+    twai_status_info_t status;
+    return installed && twai_get_status_info(&status) == ESP_OK && status.msgs_to_rx > 0;
+}
+
+bool TwaiCan::checkError(void) {
+    return (getErrorFlags() & (EFLG_RX1OVR | EFLG_RX0OVR | EFLG_TXBO | EFLG_TXEP | EFLG_RXEP)) != 0;
+}
+
+// Error state in MCP2515 EFLG bits; a receive overrun is reported until
+// clearRXnOVR()
+uint8_t TwaiCan::getErrorFlags(void) {
+    twai_status_info_t status;
+    if (!installed || twai_get_status_info(&status) != ESP_OK) {
+        return 0;
+    }
+
+    uint8_t flags = 0;
+    if (status.state == TWAI_STATE_BUS_OFF || status.state == TWAI_STATE_RECOVERING) {
+        flags |= EFLG_TXBO;
+    }
+    if (status.tx_error_counter >= 128) {
+        flags |= EFLG_TXEP;
+    }
+    if (status.rx_error_counter >= 128) {
+        flags |= EFLG_RXEP;
+    }
+    if (status.tx_error_counter >= 96) {
+        flags |= EFLG_TXWAR | EFLG_EWARN;
+    }
+    if (status.rx_error_counter >= 96) {
+        flags |= EFLG_RXWAR | EFLG_EWARN;
+    }
+    if (status.rx_missed_count + status.rx_overrun_count != overruns_seen) {
+        flags |= EFLG_RX0OVR;
+    }
+    return flags;
+}
+
+void TwaiCan::clearRXInterrupts(void) {
+}
+
+void TwaiCan::clearRXnOVR(void) {
+    twai_status_info_t status;
+    if (installed && twai_get_status_info(&status) == ESP_OK) {
+        overruns_seen = status.rx_missed_count + status.rx_overrun_count;
+    }
+}
+
+void TwaiCan::alert_task_entry(void* arg) {
+    ((TwaiCan*)arg)->alert_task_loop();
+}
+
+void TwaiCan::alert_task_loop() {
+    for (;;) {
+        uint32_t alerts = 0;
+        xSemaphoreTake(driver_mutex, portMAX_DELAY);
+        esp_err_t err = installed ? twai_read_alerts(&alerts, pdMS_TO_TICKS(ALERT_WAIT_MS)) : ESP_ERR_INVALID_STATE;
+        xSemaphoreGive(driver_mutex);
+
+        // Let a mode change in; this task would otherwise take the mutex
+        // straight back
+        if (err == ESP_ERR_INVALID_STATE || reconfiguring) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        if (err != ESP_OK) {
+            continue;
+        }
+
+        if (alerts & TWAI_ALERT_TX_SUCCESS) {
+            tx_done_us = esp_timer_get_time();
+            tx_done_count = tx_done_count + 1;
+        }
+        if ((alerts & TWAI_ALERT_RX_DATA) && notify) {
+            notify(notify_arg, esp_timer_get_time());
+        }
+        if (alerts & TWAI_ALERT_BUS_ERROR) {
+            bus_errors.inc();
+        }
+        if (alerts & TWAI_ALERT_ARB_LOST) {
+            arb_lost.inc();
+        }
+        if (alerts & TWAI_ALERT_ERR_PASS) {
+            error_passive.inc();
+        }
+        if (alerts & TWAI_ALERT_RX_QUEUE_FULL) {
+            rx_queue_full.inc();
+        }
+        if (alerts & TWAI_ALERT_RX_FIFO_OVERRUN) {
+            rx_fifo_overrun.inc();
+        }
+        if (alerts & TWAI_ALERT_BUS_OFF) {
+            bus_off.inc();
+            ESP_LOGW(TAG, "Bus off, recovering");
+            twai_initiate_recovery();
+        }
+        if (alerts & TWAI_ALERT_BUS_RECOVERED) {
+            twai_start();
+        }
+    }
+}
@@ -0,0 +1,143 @@
+/**
+ * @file flash_stress.cpp
+ * @brief Background NVS writer for receive latency measurements under flash load
+ * @version 1.0
+ *
+ * While flash is written or erased the cache is off and code running from
+ * flash stalls; this is what CONFIG_DIAG_HOT_PATH_IRAM (hot_path.h) is meant
+ * to avoid on the receive path. Measure the worst case with and without it:
+ *
+ *   {"c":"stats","d":"reset"}
+ *   {"c":"flash","d":"start,20"}    one 2 KiB NVS write every 20 ms
+ *   ... traffic from another node, e.g. {"c":"gen","d":"mix"} ...
+ *   {"c":"flash","d":"stop"}
+ *   {"c":"stats","d":"dump"}        "rx" latency_us and "flash" write_ms
+ *
+ * The blob goes to its own NVS namespace and is erased on stop.
+ *
+ */
+
+#include "flash_stress.h"
+#include "budget.h"
+#include "metrics.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace FlashStress {
+
+static const char* NVS_NAMESPACE = "flash_stress";
+static const char* NVS_KEY = "blob";
+
+static const uint32_t WRITE_MS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+static Metrics::Counter writes("flash", "writes");
+static Metrics::Counter errors("flash", "errors");
+static Metrics::Histogram write_ms("flash", "write_ms", WRITE_MS);
+
+static volatile uint32_t period = 0;
+static TaskHandle_t task = NULL;
+static Budget::StaticTask<3072> task_memory;
+static uint8_t blob[BLOB_SIZE];
+
+static bool write_once(uint32_t cycle) {
+    memset(blob, (uint8_t)cycle, sizeof(blob));
+    memcpy(blob, &cycle, sizeof(cycle));
+
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return false;
+    }
+    int64_t begin = esp_timer_get_time();
+    esp_err_t err = nvs_set_blob(nvs, NVS_KEY, blob, sizeof(blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    write_ms.record((uint32_t)((esp_timer_get_time() - begin) / 1000));
+    nvs_close(nvs);
+    return err == ESP_OK;
+}
+
+static void erase_blob() {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, NVS_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+static void task_main(void* arg) {
+    uint32_t cycle = 0;
+    bool written = false;
+    for (;;) {
+        uint32_t period_ms = period;
+        if (!period_ms) {
+            if (written) {
+                erase_blob();
+                written = false;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (write_once(++cycle)) {
+            writes.inc();
+            written = true;
+        } else {
+            errors.inc();
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(period_ms));
+    }
+}
+
+bool start(uint32_t period_ms) {
+    if (period_ms < MIN_PERIOD_MS) {
+        return false;
+    }
+    period = period_ms;
+    if (!task) {
+        task = task_memory.create(task_main, "flash_stress", NULL, 1);
+        return task != NULL;
+    }
+    xTaskNotifyGive(task);
+    return true;
+}
+
+void stop() {
+    period = 0;
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+bool execute(const char* command) {
+    if (strcmp(command, "stop") == 0) {
+        stop();
+        printf("{\"flash\":\"stop\",\"writes\":%u,\"errors\":%u}\n",
+               (unsigned int)writes.value(), (unsigned int)errors.value());
+        return true;
+    }
+    if (strncmp(command, "start", 5) == 0) {
+        unsigned long period_ms = DEFAULT_PERIOD_MS;
+        if (command[5] == ',') {
+            char* end;
+            period_ms = strtoul(command + 6, &end, 10);
+            if (end == command + 6 || *end != '\0') {
+                period_ms = 0;
+            }
+        } else if (command[5] != '\0') {
+            period_ms = 0;
+        }
+        if (start((uint32_t)period_ms)) {
+            printf("{\"flash\":\"start\",\"period_ms\":%lu,\"blob\":%u}\n", period_ms, (unsigned int)BLOB_SIZE);
+            return true;
+        }
+    }
+    printf("{\"flash\":\"error\",\"usage\":\"start[,<ms>] with ms >= %u|stop\"}\n", (unsigned int)MIN_PERIOD_MS);
+    return false;
+}
+
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_cpu.h"
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// PROFILE_SCOPE("name") times the rest of the enclosing scope in CPU cycles
+// and adds it to the log2 histogram of that site. Without
+// CONFIG_DIAG_PROFILE (menuconfig, or -DDIAG_PROFILE=ON on the host build)
+// the macro expands to nothing.
+#if defined(CONFIG_DIAG_PROFILE) && CONFIG_DIAG_PROFILE
+#define PROFILE_ENABLED 1
+#else
+#define PROFILE_ENABLED 0
+#endif
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#if PROFILE_ENABLED
+#define PROFILE_SCOPE(name)                                                                     \
+    static const uint16_t PROFILE_CONCAT(profile_site_, __LINE__) = Profile::register_site(name); \
+    Profile::Scope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_site_, __LINE__))
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#endif
+
+namespace Profile {
+
+    constexpr size_t MAX_SITES = 32;
+    constexpr size_t BUCKETS = 32;              // bucket b holds durations of [2^b, 2^(b+1)) cycles
+    constexpr uint16_t NO_SITE = 0xFFFF;
+
+#if defined(ESP_PLATFORM)
+    constexpr size_t CORES = portNUM_PROCESSORS;
+
+    inline uint32_t cycles() {
+        return esp_cpu_get_cycle_count();
+    }
+
+    inline uint8_t core() {
+        return (uint8_t)xPortGetCoreID();
+    }
+#else
+    // Simulated tasks run one at a time on the host
+    constexpr size_t CORES = 1;
+
+    inline uint32_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return (uint32_t)__rdtsc();
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+    }
+
+    inline uint8_t core() {
+        return 0;
+    }
+#endif
+
+    struct Histogram {
+        uint32_t count;
+        uint32_t max;
+        uint64_t total;
+        uint32_t buckets[BUCKETS];
+    };
+
+    // Returns the index of a named site, the same index for the same name.
+    // NO_SITE once MAX_SITES are taken; such scopes are not recorded.
+    uint16_t register_site(const char* name);
+
+    // Adds one duration to the site's histogram of the given core. Only the
+    // owning core writes its histograms; a task preempted on the same core
+    // in the middle of an update can lose that one sample's total or max.
+    void add(uint16_t site, uint8_t core, uint32_t duration);
+
+    // Samples whose scope started on one core and ended on the other; the
+    // cycle counters of the two cores are not synchronised
+    void add_migrated();
+
+    class Scope {
+    public:
+        explicit Scope(uint16_t site) : site(site), start_core(core()), start(cycles()) {}
+
+        ~Scope() {
+            uint32_t end = cycles();
+            if (core() == start_core) {
+                add(site, start_core, end - start);
+            } else {
+                add_migrated();
+            }
+        }
+
+    private:
+        uint16_t site;
+        uint8_t start_core;
+        uint32_t start;
+    };
+
+    // Site histogram summed over all cores
+    bool get(uint16_t site, const char** name, Histogram* out);
+    size_t site_count();
+    double cycles_per_us();
+
+    // One JSON line per site with count, mean, p50, p99 and max in µs and the
+    // non-empty log2 buckets
+    void dump();
+    void reset();
+
+    // "dump", "reset" or "dump,reset", from {"c":"prof","d":"..."}
+    bool execute(const char* command);
+
+}
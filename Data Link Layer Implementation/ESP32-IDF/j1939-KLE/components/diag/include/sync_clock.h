@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_timer.h"
+
+namespace SyncClock {
+
+    // Bus-wide time in µs: the time master's esp_timer clock, which the
+    // timesync component on every other node follows. Until a node has
+    // synchronised it is its own esp_timer time and is_synced() is false.
+    //
+    //   sync = sync_ref + (local - local_ref) * (1 + drift_ppb / 10^9)
+    //
+    // One task updates the mapping (the J1939 receiver); any task can read
+    // it without locking.
+    bool is_synced();
+    int64_t to_sync(int64_t local_us);
+
+    inline int64_t now() {
+        return to_sync(esp_timer_get_time());
+    }
+
+    // From the synchroniser: a follower's new mapping, the master's own
+    // clock, or back to unsynchronised local time
+    void set(int64_t local_ref_us, int64_t sync_ref_us, int32_t drift_ppb);
+    void set_master();
+    void reset();
+
+}
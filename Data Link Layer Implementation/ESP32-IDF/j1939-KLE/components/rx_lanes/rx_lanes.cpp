@@ -0,0 +1,273 @@
+/**
+ * @file rx_lanes.cpp
+ * @brief Priority receive lanes between the CAN drain and the J1939 decoder
+ * @version 1.0
+ *
+ * Received frames are split by PGN and J1939 priority into a critical, a
+ * normal and a bulk lane, each with its own queue and task:
+ *
+ *   {"c":"lanes","d":"status"}
+ *   {"lanes":"status","critical_priority":2,"queues":[{"lane":"critical","capacity":16,
+ *    "queued":0,"frames":..,"dropped":0},...],"rules":[{"pgn":"1EF00","lane":"bulk"}]}
+ *   {"c":"lanes","d":"critical,EF00"}   peer-to-peer commands ahead of everything else
+ *   {"c":"lanes","d":"priority,3"}      priorities 0-3 are critical
+ *
+ * The "lanes" group in "stats" has each lane's frames, drops, queue depth
+ * and the latency from the receive interrupt to the message sink's return
+ * (critical_us, normal_us, bulk_us). To check that the critical lane holds
+ * while bulk traffic fills the bus, load it from another node with BAMs
+ * and a priority 1 stream and compare the histograms:
+ *
+ *   {"c":"gen","d":"add,bam,EF20,20,20,1785"}
+ *   {"c":"gen","d":"add,sf,EF00,21,50,8,0,counter,1"}
+ *   {"c":"gen","d":"start,30"}
+ *
+ */
+
+#include "rx_lanes.h"
+#include "metrics.h"
+#include "sched_trace.h"
+#include "mcp2515/can.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* TAG = "RxLanes";
+
+namespace RxLanes {
+
+static QueueHandle_t lane_queues[LANE_COUNT];
+
+static int32_t queue_depth(void* queue) {
+    QueueHandle_t handle = *(QueueHandle_t*)queue;
+    return handle ? (int32_t)uxQueueMessagesWaiting(handle) : 0;
+}
+
+// Frames and drops are counted by the receiver task, latencies by each lane
+static Metrics::Counter critical_frames("lanes", "critical");
+static Metrics::Counter normal_frames("lanes", "normal");
+static Metrics::Counter bulk_frames("lanes", "bulk");
+static Metrics::Counter critical_dropped("lanes", "critical_dropped");
+static Metrics::Counter normal_dropped("lanes", "normal_dropped");
+static Metrics::Counter bulk_dropped("lanes", "bulk_dropped");
+static Metrics::Gauge critical_depth("lanes", "critical_depth", queue_depth, &lane_queues[0]);
+static Metrics::Gauge normal_depth("lanes", "normal_depth", queue_depth, &lane_queues[1]);
+static Metrics::Gauge bulk_depth("lanes", "bulk_depth", queue_depth, &lane_queues[2]);
+static const uint32_t LATENCY_US[] = {200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000};
+static Metrics::Histogram critical_us("lanes", "critical_us", LATENCY_US);
+static Metrics::Histogram normal_us("lanes", "normal_us", LATENCY_US);
+static Metrics::Histogram bulk_us("lanes", "bulk_us", LATENCY_US);
+
+static Metrics::Counter* const FRAMES[LANE_COUNT] = {&critical_frames, &normal_frames, &bulk_frames};
+static Metrics::Counter* const DROPPED[LANE_COUNT] = {&critical_dropped, &normal_dropped, &bulk_dropped};
+static Metrics::Histogram* const LATENCY[LANE_COUNT] = {&critical_us, &normal_us, &bulk_us};
+
+static const char* const TASK_NAMES[LANE_COUNT] = {"rx_critical", "rx_normal", "rx_bulk"};
+static const UBaseType_t TASK_PRIORITIES[LANE_COUNT] = {CRITICAL_TASK_PRIORITY, NORMAL_TASK_PRIORITY,
+                                                        BULK_TASK_PRIORITY};
+static const size_t CAPACITIES[LANE_COUNT] = {CRITICAL_DEPTH, NORMAL_DEPTH, BULK_DEPTH};
+
+// The PGN as the decoder sees it: PDU1 without the destination address
+static uint32_t frame_pgn(uint32_t id) {
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    if (((id >> 16) & 0xFF) < 240) {
+        pgn &= 0x3FF00;
+    }
+    return pgn;
+}
+
+Dispatcher::Dispatcher(J1939::Controller* controller, SemaphoreHandle_t spi_mutex)
+    : j1939(controller),
+      spi_mutex(spi_mutex),
+      critical_priority(DEFAULT_CRITICAL_PRIORITY) {
+    memset(rules, 0, sizeof(rules));
+    memset(consumers, 0, sizeof(consumers));
+}
+
+Dispatcher::~Dispatcher() {
+    for (size_t i = 0; i < LANE_COUNT; i++) {
+        if (consumers[i].task) {
+            vTaskDelete(consumers[i].task);
+        }
+    }
+}
+
+bool Dispatcher::init() {
+    consumers[0].queue = critical_memory.create();
+    consumers[1].queue = normal_memory.create();
+    consumers[2].queue = bulk_memory.create();
+
+    for (size_t i = 0; i < LANE_COUNT; i++) {
+        Consumer& consumer = consumers[i];
+        consumer.owner = this;
+        consumer.lane = (Lane)i;
+        lane_queues[i] = consumer.queue;
+        if (!consumer.queue) {
+            ESP_LOGE(TAG, "Failed to create %s queue", TASK_NAMES[i]);
+            return false;
+        }
+        SchedTrace::watch(consumer.queue, TASK_NAMES[i]);
+        consumer.task = task_memory[i].create(task_entry, TASK_NAMES[i], &consumer, TASK_PRIORITIES[i]);
+        if (!consumer.task) {
+            ESP_LOGE(TAG, "Failed to create %s task", TASK_NAMES[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+const char* Dispatcher::lane_name(Lane lane) {
+    switch (lane) {
+    case Lane::CRITICAL: return "critical";
+    case Lane::NORMAL: return "normal";
+    case Lane::BULK: return "bulk";
+    }
+    return "unknown";
+}
+
+Lane Dispatcher::classify(const can_frame* frame) const {
+    if (!(frame->can_id & CAN_EFF_FLAG)) {
+        return Lane::NORMAL;
+    }
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint32_t pgn = frame_pgn(id);
+    if (pgn == J1939::PGN_TP_CM || pgn == J1939::PGN_TP_DT) {
+        return Lane::BULK;
+    }
+    for (size_t i = 0; i < MAX_RULES; i++) {
+        if (rules[i].in_use && rules[i].pgn == pgn) {
+            return rules[i].lane;
+        }
+    }
+    uint8_t priority = (id >> 26) & 0x07;
+    if (priority <= critical_priority) {
+        return Lane::CRITICAL;
+    }
+    return priority >= BULK_PRIORITY ? Lane::BULK : Lane::NORMAL;
+}
+
+bool Dispatcher::submit(const can_frame* frame, int64_t rx_us) {
+    size_t lane = (size_t)classify(frame);
+    Entry entry;
+    entry.frame = *frame;
+    entry.rx_us = rx_us ? rx_us : esp_timer_get_time();
+    if (xQueueSend(consumers[lane].queue, &entry, 0) != pdTRUE) {
+        DROPPED[lane]->inc();
+        return false;
+    }
+    FRAMES[lane]->inc();
+    return true;
+}
+
+void Dispatcher::task_entry(void* arg) {
+    Consumer* consumer = (Consumer*)arg;
+    consumer->owner->consume(*consumer);
+}
+
+void Dispatcher::consume(Consumer& consumer) {
+    size_t lane = (size_t)consumer.lane;
+    bool bulk = consumer.lane == Lane::BULK;
+    TickType_t wait = bulk ? pdMS_TO_TICKS(CLEANUP_INTERVAL_MS) : portMAX_DELAY;
+    uint32_t last_cleanup_ms = esp_log_timestamp();
+    Entry entry;
+
+    for (;;) {
+        if (xQueueReceive(consumer.queue, &entry, wait) == pdTRUE) {
+            j1939->decode_j1939_message(&entry.frame);
+            LATENCY[lane]->record((uint32_t)(esp_timer_get_time() - entry.rx_us));
+        }
+        if (bulk && esp_log_timestamp() - last_cleanup_ms >= CLEANUP_INTERVAL_MS) {
+            j1939->cleanup_stale_sessions();
+            last_cleanup_ms = esp_log_timestamp();
+        }
+    }
+}
+
+bool Dispatcher::set_rule(uint32_t pgn, Lane lane) {
+    Rule* free_rule = NULL;
+    for (size_t i = 0; i < MAX_RULES; i++) {
+        if (rules[i].in_use && rules[i].pgn == pgn) {
+            rules[i].lane = lane;
+            return true;
+        }
+        if (!rules[i].in_use && !free_rule) {
+            free_rule = &rules[i];
+        }
+    }
+    if (!free_rule) {
+        return false;
+    }
+    free_rule->pgn = pgn;
+    free_rule->lane = lane;
+    free_rule->in_use = true;
+    return true;
+}
+
+void Dispatcher::clear_rule(uint32_t pgn) {
+    for (size_t i = 0; i < MAX_RULES; i++) {
+        if (rules[i].in_use && rules[i].pgn == pgn) {
+            rules[i].in_use = false;
+        }
+    }
+}
+
+void Dispatcher::print_status() {
+    printf("{\"lanes\":\"status\",\"critical_priority\":%u,\"queues\":[", critical_priority);
+    for (size_t i = 0; i < LANE_COUNT; i++) {
+        printf("%s{\"lane\":\"%s\",\"capacity\":%u,\"queued\":%u,\"frames\":%" PRIu32 ",\"dropped\":%" PRIu32 "}",
+               i ? "," : "", lane_name((Lane)i), (unsigned int)CAPACITIES[i],
+               (unsigned int)uxQueueMessagesWaiting(consumers[i].queue), FRAMES[i]->value(), DROPPED[i]->value());
+    }
+    printf("],\"rules\":[");
+    bool first = true;
+    for (size_t i = 0; i < MAX_RULES; i++) {
+        if (rules[i].in_use) {
+            printf("%s{\"pgn\":\"%05" PRIX32 "\",\"lane\":\"%s\"}", first ? "" : ",", rules[i].pgn,
+                   lane_name(rules[i].lane));
+            first = false;
+        }
+    }
+    printf("]}\n");
+}
+
+bool Dispatcher::execute(const char* command) {
+    const char* comma = strchr(command, ',');
+    size_t verb_len = comma ? (size_t)(comma - command) : strlen(command);
+    uint32_t value = comma ? (uint32_t)strtoul(comma + 1, NULL, strncmp(command, "priority", 8) == 0 ? 10 : 16) : 0;
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        printf("{\"lanes\":\"error\",\"reason\":\"busy\"}\n");
+        return false;
+    }
+
+    bool ok = true;
+    if (comma && verb_len == 8 && strncmp(command, "critical", 8) == 0) {
+        ok = set_rule(value, Lane::CRITICAL);
+    } else if (comma && verb_len == 6 && strncmp(command, "normal", 6) == 0) {
+        ok = set_rule(value, Lane::NORMAL);
+    } else if (comma && verb_len == 4 && strncmp(command, "bulk", 4) == 0) {
+        ok = set_rule(value, Lane::BULK);
+    } else if (comma && verb_len == 5 && strncmp(command, "clear", 5) == 0) {
+        clear_rule(value);
+    } else if (comma && verb_len == 8 && strncmp(command, "priority", 8) == 0 && value < BULK_PRIORITY) {
+        critical_priority = (uint8_t)value;
+    } else if (strcmp(command, "status") != 0) {
+        printf("{\"lanes\":\"error\",\"usage\":\"status|critical,<pgn>|normal,<pgn>|bulk,<pgn>|clear,<pgn>|"
+               "priority,<0-6>\"}\n");
+        xSemaphoreGive(spi_mutex);
+        return false;
+    }
+
+    if (ok) {
+        print_status();
+    } else {
+        printf("{\"lanes\":\"error\",\"reason\":\"rule table full\"}\n");
+    }
+    xSemaphoreGive(spi_mutex);
+    return ok;
+}
+
+}
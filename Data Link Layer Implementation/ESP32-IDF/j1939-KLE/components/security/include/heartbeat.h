@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "can_controller.h"
+#include "mcp2515/can.h"
+#include "siphash.h"
+#if defined(ESP_PLATFORM)
+#include "budget.h"
+#endif
+
+namespace Heartbeat {
+
+    // Proprietary B, to all nodes, so address filters pass it. Priority 5
+    // puts it ahead of the default priority 6 messages and TP.DT (7): a
+    // loaded bus delays a heartbeat by a few frames, not by a transfer.
+    constexpr uint32_t PGN_HEARTBEAT = 0xFF62;
+    constexpr uint8_t PRIORITY = 5;
+
+    // period / PERIOD_UNIT_MS, epoch, seq (LE16), token (4 bytes): the start
+    // of SipHash-2-4 with the bus key over the sender's address and the
+    // first 4 bytes. epoch counts restarts in NVS and seq carries into it,
+    // so (epoch, seq) never repeats and a recorded heartbeat is stale.
+    constexpr size_t FRAME_SIZE = 8;
+    constexpr size_t TOKEN_SIZE = 4;
+    constexpr uint32_t PERIOD_UNIT_MS = 10;
+
+    constexpr uint32_t DEFAULT_PERIOD_MS = 500;
+    constexpr uint32_t MIN_PERIOD_MS = 100;
+    constexpr uint32_t MAX_PERIOD_MS = 255 * PERIOD_UNIT_MS;
+
+    // A peer is missing after MISS_LIMIT of its own periods without a valid
+    // heartbeat. Peers are checked every CHECK_INTERVAL_MS, so a node that
+    // stops is reported within MISS_LIMIT * period + CHECK_INTERVAL_MS.
+    constexpr uint32_t MISS_LIMIT = 3;
+    constexpr uint32_t CHECK_INTERVAL_MS = 50;
+
+    constexpr size_t MAX_PEERS = 16;
+
+    // Heartbeats of this node and all its peers together may take this much
+    // of the bus. Each node keeps to an even share: with n nodes in its
+    // table it publishes no more often than n * FRAME_BITS per
+    // LOAD_BUDGET_PPM of the bitrate, whatever period was set. FRAME_BITS
+    // is an 8-byte extended frame with worst-case stuffing.
+    constexpr uint32_t LOAD_BUDGET_PPM = 10000;         // 1 %
+    constexpr uint32_t FRAME_BITS = 160;
+
+    // Token and replay alerts for one peer are repeated at most this often
+    constexpr uint32_t ALERT_HOLDOFF_MS = 1000;
+
+    constexpr uint32_t TASK_STACK_SIZE = 3072;
+    constexpr UBaseType_t TASK_PRIORITY = 7;            // below the J1939 receiver
+
+    enum class Alert : uint8_t {
+        MISSING,        // no valid heartbeat for MISS_LIMIT periods
+        BAD_TOKEN,      // a heartbeat for a peer's address without the bus key
+        REPLAY,         // valid token, but (epoch, seq) not newer than the last
+        RECOVERED,      // a missing peer is back
+        RESTARTED       // epoch advanced: the peer restarted or was reconnected
+    };
+
+    // Called for every alert; by default they are printed as JSON lines
+    typedef void (*AlertSink)(void* context, Alert alert, uint8_t peer, uint32_t silent_ms);
+
+    // Liveness of the nodes on the bus, and units swapped in for them.
+    //
+    // Every node publishes a single frame heartbeat each period and tracks
+    // its peers in a fixed table, learned from their first valid heartbeat
+    // or set with "expect". A peer that goes silent is reported as missing;
+    // a heartbeat for a known address that does not carry a valid token
+    // comes from a unit without the bus key, e.g. one swapped in for the
+    // original, and one that repeats an old counter is a replay.
+    //
+    // A peer's counter is saved in NVS once per epoch of the peer, so after
+    // this node restarts the first heartbeat of a peer must still be newer
+    // than the one saved, and heartbeats recorded before it are replays.
+    //
+    // on_frame() runs on the receiver task under the SPI mutex, which also
+    // covers the heartbeat task and execute().
+    class Monitor {
+    public:
+        Monitor(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr, uint32_t bitrate);
+        ~Monitor();
+
+#if defined(ESP_PLATFORM)
+        // Bus key and restart count from NVS, then the heartbeat task.
+        // Without publish the node only watches its peers (the sniffer).
+        bool init(bool publish);
+#endif
+
+        // Starts without NVS or task, for the host simulation, which calls
+        // publish() and check() itself. With an untrusted key (the built-in
+        // default) anyone can make valid tokens: peers are tracked and
+        // reported missing, but never alive or recovered.
+        void start(const uint8_t key[SipHash::KEY_SIZE], uint8_t epoch, bool publish, bool trusted = true);
+
+        // Every received frame before it is decoded. Returns true for
+        // heartbeats.
+        bool on_frame(const can_frame* frame);
+
+        // Sends this node's heartbeat if it is due; returns the ms to the
+        // next one
+        uint32_t publish();
+        // Reports peers gone silent
+        void check();
+
+        void set_alert_sink(AlertSink sink, void* context);
+
+        // False if out of range; a crowded bus stretches it to the node's
+        // share of the budget
+        bool set_period(uint32_t ms);
+        uint32_t effective_period_ms() const;
+
+        // Bus share of the heartbeats of this node and all peers in the table
+        uint32_t load_ppm() const;
+        // Longest a peer in the table can stop before it is reported
+        uint32_t bound_ms() const;
+
+        // From {"c":"hb","d":"..."}: "status", "period,<ms>", "on", "off",
+        // "expect,<SA hex>", "forget,<SA hex>" (also drops the saved counter)
+        bool execute(const char* command);
+
+        static const char* alert_name(Alert alert);
+
+    private:
+        enum class PeerState : uint8_t {
+            EXPECTED,           // set with "expect", not heard yet
+            ALIVE,
+            MISSING,
+            UNVERIFIED          // heard, but under an untrusted key
+        };
+
+        struct Peer {
+            uint8_t address;
+            PeerState state;
+            uint8_t period_units;
+            bool in_use;
+            uint32_t counter;           // epoch << 16 | seq of the last valid heartbeat
+            uint32_t last_seen_ms;
+            uint32_t last_alert_ms;
+            uint16_t bad_tokens;
+            uint16_t replays;
+            uint16_t restarts;
+            bool save_pending;          // new epoch, counter not in NVS yet
+        };
+
+#if defined(ESP_PLATFORM)
+        static void task_entry(void* arg);
+        void task_loop();
+        static uint8_t next_epoch();
+        void save_peers();
+#endif
+
+        uint32_t token(uint8_t address, const uint8_t* data) const;
+        Peer* find_peer(uint8_t address);
+        Peer* add_peer(uint8_t address);
+        uint32_t peer_period_ms(const Peer& peer) const;
+        uint32_t stream_ppm(uint32_t period) const;
+        void raise(uint8_t address, Alert alert, uint32_t silent_ms);
+        void print_status();
+
+        CanController* can;
+        SemaphoreHandle_t spi_mutex;
+        uint8_t source_address;
+        uint32_t bitrate;
+        uint8_t key[SipHash::KEY_SIZE];
+        bool keyed;
+        bool trusted_key;
+#if defined(ESP_PLATFORM)
+        TaskHandle_t task;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory;
+#endif
+
+        volatile bool publishing;
+        volatile uint32_t period_ms;
+        uint8_t epoch;
+        uint16_t seq;
+        uint32_t next_publish_ms;
+
+        Peer peers[MAX_PEERS];
+        AlertSink alert_sink;
+        void* sink_context;
+        uint32_t last_stranger_alert_ms;    // bad tokens from addresses not in the table
+    };
+
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "can_controller.h"
+#include "budget.h"
+
+namespace Traffic {
+
+    constexpr size_t MAX_STREAMS = 16;
+    constexpr size_t MAX_BAM_SIZE = 1785;
+    constexpr size_t MAX_SWEEP_STEPS = 32;
+
+    constexpr uint8_t DEFAULT_PRIORITY = 6;
+    constexpr uint32_t DEFAULT_BAM_GAP_US = 50000;     // as J1939::Controller
+    constexpr uint32_t MIN_BAM_GAP_US = 1000;          // keeps TP.DT in order across TX buffers
+    constexpr uint32_t MIN_PERIOD_US = 500;
+    constexpr uint32_t RETRY_US = 200;                 // all TX buffers busy
+    constexpr uint32_t REPORT_PERIOD_US = 1000000;
+
+    constexpr uint32_t TASK_STACK_SIZE = 4096;
+    constexpr UBaseType_t TASK_PRIORITY = 8;
+
+    enum class Pattern : uint8_t {
+        COUNTER,        // message counter in every byte
+        RANDOM,
+        ZERO,
+        ONES
+    };
+
+    struct StreamConfig {
+        bool bam;
+        uint32_t pgn;
+        uint8_t sa;
+        uint8_t priority;
+        uint16_t size;              // DLC for single frames, 9..1785 for BAM
+        uint32_t period_us;         // nominal, before scaling to the target load
+        uint32_t jitter_us;         // uniform, +/-
+        Pattern pattern;
+    };
+
+    struct Report {
+        bool running;
+        uint8_t streams;
+        double requested_load;      // percent, 0 = nominal periods
+        double nominal_load;        // of the configured mix at nominal periods
+        double achieved_load;       // over the last report period
+        uint32_t frames;
+        uint32_t messages;
+        uint32_t tx_busy;           // attempts with all three TX buffers full
+        uint32_t late;              // messages skipped because a stream fell a period behind
+    };
+
+    // Generates mixed single frame and BAM traffic on the bus at a target load.
+    //
+    // Each stream has a PGN, source address, size, period and jitter; a
+    // target load scales all periods by the same factor, so the mix stays
+    // the same. Frames go straight into the controller's TX buffers from the
+    // generator task, which sleeps until the next frame is due on a one-shot
+    // esp_timer. When all buffers are busy the frame is retried shortly after
+    // and counted, so the achieved load shows when the bus or the SPI link
+    // saturates.
+    //
+    // The achieved load counts the generator's own frames with exact bit
+    // stuffing, plus intermission, against the configured bitrate. A JSON
+    // report is printed every second while running; a sweep runs a list of
+    // load steps and prints requested against achieved load for each.
+    class Generator {
+    public:
+        Generator(CanController* mcp, SemaphoreHandle_t spi_mutex, uint32_t bitrate);
+        ~Generator();
+
+        bool init();
+
+        // Runs one command from the UART ({"c":"gen","d":"..."}), see
+        // traffic.cpp; invalid commands are answered with an error line
+        bool execute(const char* command);
+
+        bool add_stream(const StreamConfig& config);
+        void clear_streams();
+        void add_default_mix();
+        void set_bam_gap_us(uint32_t gap_us);
+
+        bool set_target_load(double percent);
+        bool start(uint32_t duration_s = 0);
+        void stop();
+        bool sweep(double from, double to, double step, uint32_t seconds_per_step);
+
+        Report report();
+        double nominal_load() const;
+
+        // Bits on the wire for a frame, stuff bits and intermission included
+        static uint32_t frame_bits(const can_frame* frame);
+
+    private:
+        struct Stream {
+            StreamConfig config;
+            uint32_t period_us;
+            int64_t next_us;
+            int64_t message_us;         // start of the current BAM
+            uint16_t packet;            // 0 = TP.CM next, else TP.DT sequence
+            uint32_t counter;
+        };
+
+        static void timer_callback(void* arg);
+        static void task_entry(void* arg);
+        void task_loop();
+        int64_t service(int64_t now_us);
+        bool emit(Stream& stream, int64_t now_us);
+        void build_frame(const Stream& stream, can_frame* frame) const;
+        void schedule_next(Stream& stream, int64_t base_us, bool message_done);
+        void apply_load();
+        void print_report(const char* kind, int64_t elapsed_us);
+        void print_status();
+        void end_step(int64_t now_us);
+
+        CanController* mcp2515;
+        SemaphoreHandle_t spi_mutex;
+        SemaphoreHandle_t state_mutex;
+        uint32_t bitrate;
+        TaskHandle_t task;
+        Budget::StaticMutex state_mutex_memory;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory;
+        esp_timer_handle_t timer;
+
+        Stream streams[MAX_STREAMS];
+        size_t stream_count;
+        uint32_t bam_gap_us;
+        double target_load;
+        bool running;
+        int64_t stop_us;                // 0 = run until stopped
+
+        double sweep_steps[MAX_SWEEP_STEPS];
+        size_t sweep_count;
+        size_t sweep_index;
+        uint32_t sweep_step_us;
+        int64_t step_start_us;
+        uint64_t step_bits;
+
+        int64_t window_start_us;
+        uint64_t window_bits;
+        uint32_t frames;
+        uint32_t messages;
+        uint32_t tx_busy;
+        uint32_t late;
+        double last_load;
+    };
+
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// The CAN controller type J1939, the traffic generator and SLCAN are built
+// against, chosen in menuconfig under CAN controller. Both backends have the
+// MCP2515 driver's interface; only main.cpp creates one and knows which.
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#if CONFIG_CAN_BACKEND_TWAI
+#include "twai_can.h"
+typedef TwaiCan CanController;
+#else
+#include "mcp2515/mcp2515.h"
+typedef MCP2515 CanController;
+#endif
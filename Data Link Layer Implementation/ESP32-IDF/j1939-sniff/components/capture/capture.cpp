@@ -0,0 +1,175 @@
+/**
+ * @file capture.cpp
+ * @brief Standard capture encoders for the J1939 sniffer
+ * @version 1.0
+ *
+ * Encodes raw CAN frames into formats that existing tooling understands, so
+ * sniffer captures can be opened in Wireshark or replayed with can-utils:
+ *
+ * - candump log lines, as written by `candump -L`:
+ *     (0000012345.678901) can0 18EF0272#0102030405060708
+ * - PCAP records with LINKTYPE_CAN_SOCKETCAN (227), each carrying a 16 byte
+ *   Linux `struct can_frame` with the CAN ID in network byte order.
+ *
+ * Both encoders work from templates prepared once in the constructor (the
+ * interface field of the log line and the fixed part of the PCAP record
+ * header) and a 256 entry hex pair table, so a frame costs a handful of
+ * stores and no formatting calls.
+ *
+ */
+
+#include "capture.h"
+#include "mcp2515/can.h"
+#include <string.h>
+
+namespace Capture {
+
+static inline void put_le32(uint8_t *out, uint32_t value) {
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = (value >> 24) & 0xFF;
+}
+
+static inline void put_le16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+}
+
+static inline void put_be32(uint8_t *out, uint32_t value) {
+    out[0] = (value >> 24) & 0xFF;
+    out[1] = (value >> 16) & 0xFF;
+    out[2] = (value >> 8) & 0xFF;
+    out[3] = value & 0xFF;
+}
+
+static inline uint8_t *put_decimal(uint8_t *out, uint32_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = '0' + (value % 10);
+        value /= 10;
+    }
+    return out + width;
+}
+
+Encoder::Encoder(const char *interface_name) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 256; i++) {
+        hex_pairs[i][0] = digits[i >> 4];
+        hex_pairs[i][1] = digits[i & 0x0F];
+    }
+
+    size_t name_len = strnlen(interface_name, MAX_INTERFACE_NAME);
+    interface_field[0] = ')';
+    interface_field[1] = ' ';
+    memcpy(&interface_field[2], interface_name, name_len);
+    interface_field[2 + name_len] = ' ';
+    interface_field_len = name_len + 3;
+
+    memset(pcap_record_template, 0, sizeof(pcap_record_template));
+    put_le32(&pcap_record_template[8], SOCKETCAN_FRAME_SIZE);
+    put_le32(&pcap_record_template[12], SOCKETCAN_FRAME_SIZE);
+}
+
+size_t Encoder::encode_candump(const can_frame *frame, int64_t timestamp_us, uint8_t *out) const {
+    uint8_t *p = out;
+
+    *p++ = '(';
+    p = put_decimal(p, (uint32_t)(timestamp_us / 1000000), 10);
+    *p++ = '.';
+    p = put_decimal(p, (uint32_t)(timestamp_us % 1000000), 6);
+    memcpy(p, interface_field, interface_field_len);
+    p += interface_field_len;
+
+    uint32_t id = frame->can_id;
+    if (id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) {
+        // Extended and error frames use 8 hex digits; error frames keep the flag
+        uint32_t printed = (id & CAN_ERR_FLAG) ? (id & (CAN_ERR_MASK | CAN_ERR_FLAG)) : (id & CAN_EFF_MASK);
+        memcpy(p, hex_pairs[(printed >> 24) & 0xFF], 2);
+        memcpy(p + 2, hex_pairs[(printed >> 16) & 0xFF], 2);
+        memcpy(p + 4, hex_pairs[(printed >> 8) & 0xFF], 2);
+        memcpy(p + 6, hex_pairs[printed & 0xFF], 2);
+        p += 8;
+    } else {
+        uint32_t sid = id & CAN_SFF_MASK;
+        *p++ = hex_pairs[(sid >> 8) & 0x0F][1];
+        memcpy(p, hex_pairs[sid & 0xFF], 2);
+        p += 2;
+    }
+    *p++ = '#';
+
+    if (id & CAN_RTR_FLAG) {
+        *p++ = 'R';
+    } else {
+        uint8_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+        for (uint8_t i = 0; i < dlc; i++) {
+            memcpy(p, hex_pairs[frame->data[i]], 2);
+            p += 2;
+        }
+    }
+    *p++ = '\n';
+
+    return p - out;
+}
+
+size_t Encoder::encode_pcap_record(const can_frame *frame, int64_t timestamp_us, uint8_t *out) const {
+    memcpy(out, pcap_record_template, PCAP_RECORD_SIZE);
+
+    put_le32(&out[0], (uint32_t)(timestamp_us / 1000000));
+    put_le32(&out[4], (uint32_t)(timestamp_us % 1000000));
+
+    uint8_t *cf = out + PCAP_RECORD_HEADER_SIZE;
+    put_be32(&cf[0], (uint32_t)frame->can_id);
+    uint8_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+    cf[4] = dlc;
+    if (!(frame->can_id & CAN_RTR_FLAG)) {
+        memcpy(&cf[8], frame->data, dlc);
+    }
+
+    return PCAP_RECORD_SIZE;
+}
+
+size_t Encoder::encode(Format format, const can_frame *frame, int64_t timestamp_us, uint8_t *out) const {
+    switch (format) {
+    case Format::CANDUMP:
+        return encode_candump(frame, timestamp_us, out);
+    case Format::PCAP:
+        return encode_pcap_record(frame, timestamp_us, out);
+    default:
+        return 0;
+    }
+}
+
+size_t Encoder::pcap_global_header(uint8_t *out) {
+    put_le32(&out[0], PCAP_MAGIC_USEC);
+    put_le16(&out[4], PCAP_VERSION_MAJOR);
+    put_le16(&out[6], PCAP_VERSION_MINOR);
+    put_le32(&out[8], 0);
+    put_le32(&out[12], 0);
+    put_le32(&out[16], PCAP_SNAPLEN);
+    put_le32(&out[20], LINKTYPE_CAN_SOCKETCAN);
+    return PCAP_GLOBAL_HEADER_SIZE;
+}
+
+bool Encoder::parse_format(const char *name, Format *format) {
+    if (strcmp(name, "json") == 0) {
+        *format = Format::JSON;
+    } else if (strcmp(name, "candump") == 0) {
+        *format = Format::CANDUMP;
+    } else if (strcmp(name, "pcap") == 0) {
+        *format = Format::PCAP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *Encoder::format_name(Format format) {
+    switch (format) {
+    case Format::JSON: return "json";
+    case Format::CANDUMP: return "candump";
+    case Format::PCAP: return "pcap";
+    default: return "unknown";
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Forward declaration for MCP2515 frame type
+struct can_frame;
+
+namespace Capture {
+
+    // Output formats for frames streamed over the host link
+    enum class Format : uint8_t {
+        JSON,       // decoded J1939 messages (default)
+        CANDUMP,    // can-utils `candump -L` log lines
+        PCAP        // libpcap stream, LINKTYPE_CAN_SOCKETCAN
+    };
+
+    constexpr uint32_t PCAP_MAGIC_USEC = 0xA1B2C3D4;
+    constexpr uint16_t PCAP_VERSION_MAJOR = 2;
+    constexpr uint16_t PCAP_VERSION_MINOR = 4;
+    constexpr uint32_t PCAP_SNAPLEN = 65535;
+    constexpr uint32_t LINKTYPE_CAN_SOCKETCAN = 227;
+
+    constexpr size_t PCAP_GLOBAL_HEADER_SIZE = 24;
+    constexpr size_t PCAP_RECORD_HEADER_SIZE = 16;
+    constexpr size_t SOCKETCAN_FRAME_SIZE = 16;
+    constexpr size_t PCAP_RECORD_SIZE = PCAP_RECORD_HEADER_SIZE + SOCKETCAN_FRAME_SIZE;
+
+    // "(0000000000.000000) can0 1FFFFFFF#0011223344556677\n"
+    constexpr size_t MAX_INTERFACE_NAME = 15;
+    constexpr size_t CANDUMP_MAX_LINE = 20 + MAX_INTERFACE_NAME + 2 + 9 + 16 + 1;
+
+    // Stateless frame encoder. All per-frame work is table lookups and fixed
+    // width writes into a caller supplied buffer; nothing is allocated.
+    class Encoder {
+    public:
+        Encoder(const char* interface_name = "can0");
+
+        // Encode one frame, returning the number of bytes written to out.
+        // out must hold CANDUMP_MAX_LINE / PCAP_RECORD_SIZE bytes respectively.
+        size_t encode_candump(const can_frame* frame, int64_t timestamp_us, uint8_t* out) const;
+        size_t encode_pcap_record(const can_frame* frame, int64_t timestamp_us, uint8_t* out) const;
+        size_t encode(Format format, const can_frame* frame, int64_t timestamp_us, uint8_t* out) const;
+
+        // File header that must precede the first PCAP record of a stream
+        static size_t pcap_global_header(uint8_t* out);
+
+        static bool parse_format(const char* name, Format* format);
+        static const char* format_name(Format format);
+
+    private:
+        char hex_pairs[256][2];
+        char interface_field[MAX_INTERFACE_NAME + 3];   // ") can0 "
+        uint8_t interface_field_len;
+        uint8_t pcap_record_template[PCAP_RECORD_SIZE];
+    };
+
+}
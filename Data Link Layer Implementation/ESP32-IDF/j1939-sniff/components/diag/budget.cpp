@@ -0,0 +1,138 @@
+/**
+ * @file budget.cpp
+ * @brief Static task storage, per-subsystem heap accounts and memory report
+ * @version 1.0
+ *
+ * The firmware's tasks, queues and mutexes live in Budget::Static* objects,
+ * so their stacks and control blocks are counted in the image size rather
+ * than taken from the heap at startup. What still uses the heap (J1939
+ * reassembly, the sender backlog, cJSON, probe payloads) allocates through
+ * an Account with a limit chosen at compile time. "mem" reports both:
+ *
+ *   {"c":"mem","d":""}              heap, task stacks and accounts
+ *
+ */
+
+#include "budget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(ESP_PLATFORM)
+#include "esp_heap_caps.h"
+#else
+#include <malloc.h>
+#endif
+
+namespace Budget {
+
+static Account* accounts = NULL;
+static Account* last_account = NULL;
+
+Account::Account(const char* name, size_t limit)
+    : name(name), limit(limit), in_use(0), peak(0), allocs(0), frees(0), overruns(0), next(NULL) {
+    if (last_account) {
+        last_account->next = this;
+    } else {
+        accounts = this;
+    }
+    last_account = this;
+}
+
+void Account::charge(size_t bytes) {
+    uint32_t now = __atomic_add_fetch(&in_use, (uint32_t)bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    if (now > peak) {
+        peak = now;
+    }
+    if (now > limit) {
+        __atomic_fetch_add(&overruns, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void Account::release(size_t bytes) {
+    __atomic_fetch_sub(&in_use, (uint32_t)bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+}
+
+// The allocator rounds sizes up; charge what the block really occupies so
+// charges and releases match without storing the size
+static size_t block_size(void* ptr) {
+#if defined(ESP_PLATFORM)
+    return heap_caps_get_allocated_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+void* Account::malloc(size_t size) {
+    void* ptr = ::malloc(size);
+    if (ptr) {
+        charge(block_size(ptr));
+    }
+    return ptr;
+}
+
+void Account::free(void* ptr) {
+    if (ptr) {
+        release(block_size(ptr));
+        ::free(ptr);
+    }
+}
+
+#if defined(ESP_PLATFORM)
+static TaskRecord* tasks = NULL;
+static TaskRecord* last_task = NULL;
+
+void TaskRecord::add(const char* task_name, TaskHandle_t task) {
+    name = task_name;
+    handle = task;
+    if (!task || next || last_task == this) {
+        return;
+    }
+    if (last_task) {
+        last_task->next = this;
+    } else {
+        tasks = this;
+    }
+    last_task = this;
+}
+
+static void report_platform() {
+    printf("{\"mem\":\"heap\",\"free\":%u,\"min_free\":%u,\"largest_block\":%u,\"total\":%u}\n",
+           (unsigned int)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+           (unsigned int)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+           (unsigned int)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+           (unsigned int)heap_caps_get_total_size(MALLOC_CAP_8BIT));
+
+    // The high-water mark is in bytes on ESP-IDF, where StackType_t is a byte
+    for (TaskRecord* t = tasks; t; t = t->next) {
+        printf("{\"mem\":\"task\",\"name\":\"%s\",\"stack\":%u,\"min_free\":%u}\n",
+               t->name, (unsigned int)t->stack_bytes,
+               (unsigned int)(uxTaskGetStackHighWaterMark(t->handle) * sizeof(StackType_t)));
+    }
+}
+#else
+static void report_platform() {
+}
+#endif
+
+void report() {
+    report_platform();
+    for (Account* a = accounts; a; a = a->next) {
+        printf("{\"mem\":\"account\",\"name\":\"%s\",\"limit\":%u,\"in_use\":%u,\"peak\":%u,"
+               "\"allocs\":%u,\"frees\":%u,\"overruns\":%u}\n",
+               a->name, (unsigned int)a->limit, (unsigned int)a->in_use, (unsigned int)a->peak,
+               (unsigned int)a->allocs, (unsigned int)a->frees, (unsigned int)a->overruns);
+    }
+}
+
+bool execute(const char* command) {
+    if (command[0] == '\0' || strcmp(command, "report") == 0) {
+        report();
+        return true;
+    }
+    printf("{\"mem\":\"error\",\"usage\":\"report\"}\n");
+    return false;
+}
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace FlashStress {
+
+    // Rewritten on every cycle with new contents, so NVS always writes and
+    // from time to time erases a page to reclaim the old entries
+    constexpr size_t BLOB_SIZE = 2048;
+    constexpr uint32_t MIN_PERIOD_MS = 10;
+    constexpr uint32_t DEFAULT_PERIOD_MS = 50;
+
+    // Keeps the flash busy from a low priority task with one NVS blob write
+    // and commit every period_ms, like a logger or an OTA download would.
+    // Writes and their duration are in the "flash" metrics.
+    bool start(uint32_t period_ms);
+    void stop();
+
+    // "start[,<ms>]" or "stop", from {"c":"flash","d":"..."}
+    bool execute(const char* command);
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+namespace SchedTrace {
+
+    // Events per core, 16 bytes each; about half a second of a busy node
+    constexpr size_t RING_SIZE = 512;
+    constexpr size_t MAX_OBJECTS = 8;
+
+    enum class EventType : uint8_t {
+        SWITCH_IN,          // task = the task now running on the core
+        DELAY,
+        QUEUE_SEND,         // give, for a mutex
+        QUEUE_SEND_FROM_ISR,
+        QUEUE_RECEIVE,      // take, for a mutex
+        QUEUE_RECEIVE_FROM_ISR,
+        QUEUE_RECEIVE_FAILED,
+        BLOCK_SEND,
+        BLOCK_RECEIVE,
+        ISR_ENTER,
+        ISR_EXIT
+    };
+
+    // Records task switches, delays, blocking on any queue or mutex, and
+    // takes, gives and queue operations on the watched objects, from the
+    // FreeRTOS trace macros in sched_trace_hooks.h. Only compiled in with
+    // CONFIG_DIAG_SCHED_TRACE (idf.py -DSCHED_TRACE=ON build); otherwise the
+    // calls below do nothing and "sched" reports it.
+    //
+    // Each core appends to its own ring without locks, from the scheduler,
+    // ISRs and tasks alike; the recorder is in IRAM.
+
+    // Names a mutex or queue in the export and records its takes and gives.
+    // Blocking is recorded for every object.
+    void watch(void* handle, const char* name);
+
+    // Around the handlers of interrupts of interest (the MCP2515 GPIO)
+    void isr_enter();
+    void isr_exit();
+
+    void start();
+    void stop();
+
+    // Chrome trace JSON: per core, which task runs when; per task, how long
+    // it waited on which object, slept or held a watched mutex
+    void export_chrome();
+
+    // "start", "stop" or "dump", from {"c":"sched","d":"..."}
+    bool execute(const char* command);
+
+}
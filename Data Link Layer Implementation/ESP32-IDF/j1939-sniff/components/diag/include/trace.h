@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+namespace Trace {
+
+    // Stages of a message from the UART of one node to the output of another
+    enum class Stage : uint8_t {
+        UART_LINE,          // line complete on the sender
+        QUEUED,             // bus busy, waiting in the sender queue
+        SINGLE_FRAME,       // single frame written to the MCP2515
+        BAM_ANNOUNCE,       // TP.CM BAM written
+        TP_DT,              // arg = packet number
+        RX_ISR,             // interrupt that woke the receiver for the frame
+        RX_ANNOUNCE,        // TP.CM BAM decoded
+        RX_DT,              // arg = packet number
+        REASSEMBLED,
+        SINK,               // message printed or handed to the sink
+        COUNT
+    };
+
+    // A trace ID is the sender's address and an 8-bit tag. The tag travels in
+    // the reserved byte 4 of the TP.CM BAM, which is 0xFF when not tracing,
+    // so untraced nodes and sniffers see ordinary BAMs. Single frames have no
+    // spare byte and are traced on the sending node only.
+    constexpr uint8_t NO_TAG = 0xFF;
+    constexpr uint16_t NO_TRACE = 0xFFFF;
+
+    // Events per core, 24 bytes each; enough for a few 200-byte messages
+    constexpr size_t RING_SIZE = 256;
+
+    void init(uint8_t source_addr);
+    void enable(bool on);
+    bool is_enabled();
+
+    // New trace ID for a message leaving this node, NO_TRACE while disabled
+    uint16_t begin();
+
+    inline uint8_t tag(uint16_t id) {
+        return id == NO_TRACE ? NO_TAG : (uint8_t)(id & 0xFF);
+    }
+
+    inline uint16_t from_tag(uint8_t src_addr, uint8_t tag) {
+        return tag == NO_TAG ? NO_TRACE : (uint16_t)((src_addr << 8) | tag);
+    }
+
+    // Lock-free: each core appends to its own ring, so tasks and ISRs never
+    // wait for each other. The oldest events are overwritten.
+    void record(Stage stage, uint16_t id, uint16_t arg = 0);
+    void record_at(Stage stage, uint16_t id, uint16_t arg, int64_t ts_us);
+
+    // Low 32 bits of the time of the last CAN interrupt; a 32-bit store
+    // cannot tear when read from the receiver task
+    extern volatile uint32_t isr_time_low;
+    extern volatile bool enabled;
+
+    // Called from the MCP2515 interrupt handler
+    inline void IRAM_ATTR isr() {
+        if (enabled) {
+            isr_time_low = (uint32_t)esp_timer_get_time();
+        }
+    }
+
+    int64_t last_isr_time();
+
+    void clear();
+
+    // Prints the rings as Chrome trace JSON (chrome://tracing, Perfetto): one
+    // row per trace ID, each stage a slice from the previous stage of the
+    // same message on this node
+    void export_chrome();
+
+    // "on", "off", "clear" or "dump", from {"c":"trace","d":"..."}
+    bool execute(const char* command);
+
+}
@@ -0,0 +1,193 @@
+/**
+ * @file metrics.cpp
+ * @brief Registry of runtime counters, gauges and histograms
+ * @version 1.0
+ *
+ * The driver, J1939, queue, GPIO and GSM code keep their counters in
+ * Metrics objects next to the code that updates them; this file links them
+ * into one list and prints them for the host, grouped by subsystem:
+ *
+ *   {"c":"stats","d":"dump"}        one JSON line per subsystem
+ *   {"c":"stats","d":"dump,reset"}
+ *   {"c":"stats","d":"push,1000"}   dump every second, "push,0" stops
+ *
+ */
+
+#include "metrics.h"
+#include "budget.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "esp_timer.h"
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+namespace Metrics {
+
+static Metric* head = NULL;
+static Metric* tail = NULL;
+static uint32_t metric_count = 0;
+
+Metric::Metric(const char* subsystem, const char* name, Kind kind)
+    : subsystem(subsystem), name(name), kind(kind), next(NULL) {
+    if (tail) {
+        tail->next = this;
+    } else {
+        head = this;
+    }
+    tail = this;
+    metric_count++;
+}
+
+int32_t Gauge::value() {
+    if (sampler) {
+        set(sampler(arg));
+    }
+    return level;
+}
+
+void Histogram::reset() {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    sum = 0;
+    peak = 0;
+}
+
+void Histogram::print() const {
+    printf("{\"n\":%u,\"sum\":%u,\"max\":%u,\"le\":[", (unsigned int)count, (unsigned int)sum, (unsigned int)peak);
+    for (size_t b = 0; b < bound_count; b++) {
+        printf("%s%u", b ? "," : "", (unsigned int)bounds[b]);
+    }
+    printf("],\"b\":[");
+    for (size_t b = 0; b <= bound_count; b++) {
+        printf("%s%u", b ? "," : "", (unsigned int)buckets[b]);
+    }
+    printf("]}");
+}
+
+static void print_metric(Metric* m) {
+    switch (m->kind) {
+    case Kind::COUNTER:
+        printf("\"%s\":%u", m->name, (unsigned int)static_cast<Counter*>(m)->value());
+        break;
+    case Kind::GAUGE: {
+        Gauge* g = static_cast<Gauge*>(m);
+        int32_t value = g->value();
+        printf("\"%s\":%d,\"%s_max\":%d", m->name, (int)value, m->name, (int)g->max());
+        break;
+    }
+    case Kind::HISTOGRAM:
+        printf("\"%s\":", m->name);
+        static_cast<Histogram*>(m)->print();
+        break;
+    }
+}
+
+void dump() {
+    printf("{\"stats\":\"info\",\"uptime_ms\":%u,\"metrics\":%u}\n",
+           (unsigned int)(esp_timer_get_time() / 1000), (unsigned int)metric_count);
+
+    // Subsystems in the order they first registered, each on one line
+    for (Metric* first = head; first; first = first->next) {
+        bool seen = false;
+        for (Metric* m = head; m != first; m = m->next) {
+            if (strcmp(m->subsystem, first->subsystem) == 0) {
+                seen = true;
+                break;
+            }
+        }
+        if (seen) {
+            continue;
+        }
+        printf("{\"stats\":\"%s\"", first->subsystem);
+        for (Metric* m = first; m; m = m->next) {
+            if (strcmp(m->subsystem, first->subsystem) == 0) {
+                printf(",");
+                print_metric(m);
+            }
+        }
+        printf("}\n");
+    }
+}
+
+void reset() {
+    for (Metric* m = head; m; m = m->next) {
+        switch (m->kind) {
+        case Kind::COUNTER:
+            static_cast<Counter*>(m)->reset();
+            break;
+        case Kind::GAUGE:
+            static_cast<Gauge*>(m)->reset();
+            break;
+        case Kind::HISTOGRAM:
+            static_cast<Histogram*>(m)->reset();
+            break;
+        }
+    }
+}
+
+#if defined(ESP_PLATFORM)
+static volatile uint32_t push_period_ms = 0;
+static TaskHandle_t push_task = NULL;
+static Budget::StaticTask<3072> push_task_memory;
+
+static void push_task_main(void* arg) {
+    for (;;) {
+        uint32_t period = push_period_ms;
+        TickType_t wait = period ? pdMS_TO_TICKS(period) : portMAX_DELAY;
+        // A notification means the period changed; start over with the new one
+        if (ulTaskNotifyTake(pdTRUE, wait) == 0 && push_period_ms) {
+            dump();
+        }
+    }
+}
+
+bool set_push_period(uint32_t period_ms) {
+    push_period_ms = period_ms;
+    if (!push_task) {
+        if (!period_ms) {
+            return true;
+        }
+        push_task = push_task_memory.create(push_task_main, "metrics_push", NULL, 1);
+        return push_task != NULL;
+    }
+    xTaskNotifyGive(push_task);
+    return true;
+}
+#else
+bool set_push_period(uint32_t period_ms) {
+    return period_ms == 0;
+}
+#endif
+
+bool execute(const char* command) {
+    if (strcmp(command, "dump") == 0 || command[0] == '\0') {
+        dump();
+    } else if (strcmp(command, "reset") == 0) {
+        reset();
+        printf("{\"stats\":\"reset\"}\n");
+    } else if (strcmp(command, "dump,reset") == 0) {
+        dump();
+        reset();
+    } else if (strncmp(command, "push,", 5) == 0) {
+        char* end;
+        unsigned long period = strtoul(command + 5, &end, 10);
+        if (end == command + 5 || *end != '\0' || (period != 0 && period < 100)) {
+            printf("{\"stats\":\"error\",\"usage\":\"push,<ms> with ms 0 or >= 100\"}\n");
+            return false;
+        }
+        if (!set_push_period((uint32_t)period)) {
+            printf("{\"stats\":\"error\",\"reason\":\"cannot start push task\"}\n");
+            return false;
+        }
+        printf("{\"stats\":\"push\",\"period_ms\":%lu}\n", period);
+    } else {
+        printf("{\"stats\":\"error\",\"usage\":\"dump|reset|dump,reset|push,<ms>\"}\n");
+        return false;
+    }
+    return true;
+}
+
+}
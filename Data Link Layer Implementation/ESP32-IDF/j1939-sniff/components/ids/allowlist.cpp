@@ -0,0 +1,321 @@
+/**
+ * @file allowlist.cpp
+ * @brief Learned (SA, PGN, DLC) allowlist with a frozen perfect hash
+ * @version 1.0
+ *
+ * Nobody ships an allowlist of who sends what on a given vehicle, so the
+ * sniffer learns one:
+ *
+ * 1. LEARN: every (SA, PGN, DLC) tuple seen is recorded together with its
+ *    shortest and average interval in a bounded open-addressing table.
+ * 2. freeze(): the learned tuples are turned into a perfect hash using hash
+ *    and displace. Keys are split into buckets by one hash; buckets are
+ *    placed largest first, each trying 8 bit seeds for a second hash until
+ *    all of its keys land in free slots. The seeds and the slot array form
+ *    the blob that is stored in NVS.
+ * 3. ENFORCE: a frame is looked up with two hashes and one key compare, no
+ *    probing, so the cost is the same for every frame and every table.
+ *    Unknown tuples are reported as NEW_TUPLE, known ones arriving faster
+ *    than half their shortest learned interval as TOO_FAST.
+ *
+ * Memory is fixed at compile time: ALLOWLIST_MAX_ENTRIES tuples, a learning
+ * table and a frozen table each kept at most half full.
+ *
+ */
+
+#include "allowlist.h"
+#include "mcp2515/can.h"
+#include <string.h>
+
+namespace IDS {
+
+static constexpr uint16_t PERIOD_UNSEEN = 0xFFFF;
+
+static inline uint32_t mix(uint32_t key, uint32_t seed) {
+    uint32_t h = key ^ (seed * 0x9E3779B9UL);
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35UL;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t bucket_of(uint32_t key) {
+    return mix(key, 0) & (ALLOWLIST_BUCKETS - 1);
+}
+
+static inline uint32_t slot_of(uint32_t key, uint8_t seed) {
+    return mix(key, (uint32_t)seed + 1) & (ALLOWLIST_SLOTS - 1);
+}
+
+static void put_le(uint8_t *out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint32_t get_le(const uint8_t *in, int bytes) {
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+Allowlist::Allowlist() : mode(ModelMode::OFF) {
+    clear();
+}
+
+void Allowlist::clear() {
+    memset(learned, 0, sizeof(learned));
+    learn_count = 0;
+    overflow = 0;
+    memset(seeds, 0, sizeof(seeds));
+    memset(slots, 0, sizeof(slots));
+    memset(last_seen, 0, sizeof(last_seen));
+    frozen_count = 0;
+    frozen = false;
+    memset(alert_keys, 0, sizeof(alert_keys));
+    memset(alert_ms, 0, sizeof(alert_ms));
+}
+
+uint32_t Allowlist::key_of(const can_frame *frame) {
+    if (!(frame->can_id & CAN_EFF_FLAG) || (frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))) {
+        return 0;
+    }
+
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint8_t pdu_format = (id >> 16) & 0xFF;
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    if (pdu_format < 240) {
+        pgn &= 0x3FF00;
+    }
+    uint32_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+    return 0x80000000UL | (dlc << 26) | (pgn << 8) | (id & 0xFF);
+}
+
+void Allowlist::learn(uint32_t key, uint32_t now_ms) {
+    uint32_t index = mix(key, 0) & (ALLOWLIST_LEARN_SLOTS - 1);
+    for (size_t probe = 0; probe < ALLOWLIST_LEARN_SLOTS; probe++) {
+        Learned &e = learned[index];
+        if (e.key == key) {
+            uint32_t interval = now_ms - e.last_ms;
+            if (interval > PERIOD_UNSEEN - 1) {
+                interval = PERIOD_UNSEEN - 1;
+            }
+            if (interval < e.min_period_ms) {
+                e.min_period_ms = interval;
+            }
+            if (e.mean_period_ms == 0) {
+                e.mean_period_ms = interval;
+            } else {
+                e.mean_period_ms += ((int32_t)interval - (int32_t)e.mean_period_ms) / 8;
+            }
+            e.last_ms = now_ms;
+            return;
+        }
+        if (e.key == 0) {
+            if (learn_count >= ALLOWLIST_MAX_ENTRIES) {
+                overflow++;
+                return;
+            }
+            e.key = key;
+            e.last_ms = now_ms;
+            e.min_period_ms = PERIOD_UNSEEN;
+            e.mean_period_ms = 0;
+            learn_count++;
+            return;
+        }
+        index = (index + 1) & (ALLOWLIST_LEARN_SLOTS - 1);
+    }
+}
+
+bool Allowlist::freeze() {
+    memset(seeds, 0, sizeof(seeds));
+    memset(slots, 0, sizeof(slots));
+    memset(last_seen, 0, sizeof(last_seen));
+    frozen = false;
+    frozen_count = 0;
+
+    uint8_t bucket_size[ALLOWLIST_BUCKETS] = {0};
+    size_t largest = 0;
+    for (size_t i = 0; i < ALLOWLIST_LEARN_SLOTS; i++) {
+        if (learned[i].key) {
+            uint8_t size = ++bucket_size[bucket_of(learned[i].key)];
+            if (size > largest) {
+                largest = size;
+            }
+        }
+    }
+
+    uint16_t members[ALLOWLIST_MAX_ENTRIES];
+    uint16_t placed[ALLOWLIST_MAX_ENTRIES];
+    for (size_t size = largest; size > 0; size--) {
+        for (size_t b = 0; b < ALLOWLIST_BUCKETS; b++) {
+            if (bucket_size[b] != size) {
+                continue;
+            }
+
+            size_t n = 0;
+            for (size_t i = 0; i < ALLOWLIST_LEARN_SLOTS && n < size; i++) {
+                if (learned[i].key && bucket_of(learned[i].key) == b) {
+                    members[n++] = i;
+                }
+            }
+
+            bool found = false;
+            for (int seed = 0; seed < 256 && !found; seed++) {
+                found = true;
+                for (size_t m = 0; m < n && found; m++) {
+                    placed[m] = slot_of(learned[members[m]].key, seed);
+                    if (slots[placed[m]].key) {
+                        found = false;
+                    }
+                    for (size_t k = 0; k < m && found; k++) {
+                        if (placed[k] == placed[m]) {
+                            found = false;
+                        }
+                    }
+                }
+                if (found) {
+                    seeds[b] = seed;
+                }
+            }
+            if (!found) {
+                memset(slots, 0, sizeof(slots));
+                memset(seeds, 0, sizeof(seeds));
+                return false;
+            }
+
+            for (size_t m = 0; m < n; m++) {
+                const Learned &e = learned[members[m]];
+                slots[placed[m]].key = e.key;
+                slots[placed[m]].min_period_ms = e.min_period_ms;
+                slots[placed[m]].mean_period_ms = e.mean_period_ms;
+            }
+            frozen_count += n;
+        }
+    }
+
+    frozen = true;
+    return true;
+}
+
+int Allowlist::lookup(uint32_t key) const {
+    uint32_t slot = slot_of(key, seeds[bucket_of(key)]);
+    return slots[slot].key == key ? (int)slot : -1;
+}
+
+bool Allowlist::should_report(uint32_t key, uint32_t now_ms) {
+    uint32_t index = mix(key, 0) & (ALLOWLIST_ALERT_CACHE - 1);
+    if (alert_keys[index] == key && now_ms - alert_ms[index] < ALLOWLIST_ALERT_HOLDOFF_MS) {
+        return false;
+    }
+    alert_keys[index] = key;
+    alert_ms[index] = now_ms;
+    return true;
+}
+
+AllowVerdict Allowlist::process(const can_frame *frame, uint32_t now_ms) {
+    if (mode == ModelMode::OFF) {
+        return AllowVerdict::OK;
+    }
+
+    uint32_t key = key_of(frame);
+    if (key == 0) {
+        return AllowVerdict::OK;
+    }
+
+    if (mode == ModelMode::LEARN) {
+        learn(key, now_ms);
+        return AllowVerdict::OK;
+    }
+
+    if (!frozen) {
+        return AllowVerdict::OK;
+    }
+
+    int slot = lookup(key);
+    if (slot < 0) {
+        return should_report(key, now_ms) ? AllowVerdict::NEW_TUPLE : AllowVerdict::OK;
+    }
+
+    const AllowEntry &e = slots[slot];
+    uint32_t previous = last_seen[slot];
+    last_seen[slot] = now_ms | 1;  // 0 marks "not seen since freeze/load"
+    if (previous && e.min_period_ms != PERIOD_UNSEEN &&
+        (now_ms - previous) * 2 < e.min_period_ms) {
+        return should_report(key, now_ms) ? AllowVerdict::TOO_FAST : AllowVerdict::OK;
+    }
+    return AllowVerdict::OK;
+}
+
+size_t Allowlist::serialize(uint8_t *out, size_t capacity) const {
+    if (!frozen || capacity < ALLOWLIST_MAX_BLOB) {
+        return 0;
+    }
+
+    put_le(&out[0], ALLOWLIST_MAGIC, 4);
+    put_le(&out[4], ALLOWLIST_VERSION, 2);
+    put_le(&out[6], frozen_count, 2);
+    put_le(&out[8], ALLOWLIST_SLOTS, 2);
+    put_le(&out[10], ALLOWLIST_BUCKETS, 2);
+    memcpy(&out[ALLOWLIST_HEADER_SIZE], seeds, ALLOWLIST_BUCKETS);
+
+    uint8_t *e = out + ALLOWLIST_HEADER_SIZE + ALLOWLIST_BUCKETS;
+    for (size_t i = 0; i < ALLOWLIST_SLOTS; i++, e += ALLOWLIST_ENTRY_SIZE) {
+        put_le(&e[0], slots[i].key, 4);
+        put_le(&e[4], slots[i].min_period_ms, 2);
+        put_le(&e[6], slots[i].mean_period_ms, 2);
+    }
+    return ALLOWLIST_MAX_BLOB;
+}
+
+bool Allowlist::load(const uint8_t *blob, size_t len) {
+    if (len != ALLOWLIST_MAX_BLOB ||
+        get_le(&blob[0], 4) != ALLOWLIST_MAGIC ||
+        get_le(&blob[4], 2) != ALLOWLIST_VERSION ||
+        get_le(&blob[8], 2) != ALLOWLIST_SLOTS ||
+        get_le(&blob[10], 2) != ALLOWLIST_BUCKETS) {
+        return false;
+    }
+
+    clear();
+    memcpy(seeds, &blob[ALLOWLIST_HEADER_SIZE], ALLOWLIST_BUCKETS);
+
+    const uint8_t *e = blob + ALLOWLIST_HEADER_SIZE + ALLOWLIST_BUCKETS;
+    size_t entries = 0;
+    for (size_t i = 0; i < ALLOWLIST_SLOTS; i++, e += ALLOWLIST_ENTRY_SIZE) {
+        slots[i].key = get_le(&e[0], 4);
+        slots[i].min_period_ms = get_le(&e[4], 2);
+        slots[i].mean_period_ms = get_le(&e[6], 2);
+        if (slots[i].key) {
+            // Every stored key must be reachable through its bucket seed
+            if (lookup(slots[i].key) != (int)i) {
+                clear();
+                return false;
+            }
+            entries++;
+        }
+    }
+
+    if (entries != get_le(&blob[6], 2)) {
+        clear();
+        return false;
+    }
+    frozen_count = entries;
+    frozen = true;
+    return true;
+}
+
+const char *Allowlist::verdict_name(AllowVerdict verdict) {
+    switch (verdict) {
+    case AllowVerdict::OK: return "ok";
+    case AllowVerdict::NEW_TUPLE: return "new_tuple";
+    case AllowVerdict::TOO_FAST: return "too_fast";
+    default: return "unknown";
+    }
+}
+
+}
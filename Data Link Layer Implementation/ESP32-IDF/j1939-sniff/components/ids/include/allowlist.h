@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "payload_model.h"
+
+// Forward declaration for MCP2515 frame type
+struct can_frame;
+
+namespace IDS {
+
+    constexpr size_t ALLOWLIST_MAX_ENTRIES = 256;
+    constexpr size_t ALLOWLIST_LEARN_SLOTS = 512;    // power of two, at most half full
+    constexpr size_t ALLOWLIST_SLOTS = 512;          // frozen table, power of two
+    constexpr size_t ALLOWLIST_BUCKETS = 128;        // perfect hash buckets, power of two
+    constexpr size_t ALLOWLIST_ALERT_CACHE = 32;     // power of two
+    constexpr uint32_t ALLOWLIST_ALERT_HOLDOFF_MS = 1000;
+
+    constexpr uint32_t ALLOWLIST_MAGIC = 0x31574C41; // "ALW1"
+    constexpr uint16_t ALLOWLIST_VERSION = 1;
+    constexpr size_t ALLOWLIST_HEADER_SIZE = 12;
+    constexpr size_t ALLOWLIST_ENTRY_SIZE = 8;
+    constexpr size_t ALLOWLIST_MAX_BLOB = ALLOWLIST_HEADER_SIZE + ALLOWLIST_BUCKETS + ALLOWLIST_SLOTS * ALLOWLIST_ENTRY_SIZE;
+
+    enum class AllowVerdict : uint8_t {
+        OK,
+        NEW_TUPLE,      // (SA, PGN, DLC) never seen while learning
+        TOO_FAST        // interval below half the shortest learned period
+    };
+
+    struct AllowEntry {
+        uint32_t key;            // 0x80000000 | dlc << 26 | pgn << 8 | sa, 0 = empty
+        uint16_t min_period_ms;  // shortest interval seen, 0xFFFF = seen once
+        uint16_t mean_period_ms; // running average interval
+    };
+
+    // Allowlist of (SA, PGN, DLC) tuples with their periods. Learned in an
+    // open-addressing table, then frozen into a perfect hash (hash and
+    // displace): each key hashes to a bucket whose 8 bit seed sends it to a
+    // slot of its own, so an enforced lookup is two hashes and one compare.
+    class Allowlist {
+    public:
+        Allowlist();
+
+        void set_mode(ModelMode new_mode) { mode = new_mode; }
+        ModelMode get_mode() const { return mode; }
+        void clear();
+
+        // Learn or check one frame. Violations by the same key are reported
+        // at most once per ALLOWLIST_ALERT_HOLDOFF_MS. Not thread safe;
+        // callers serialise access.
+        AllowVerdict process(const can_frame* frame, uint32_t now_ms);
+
+        // Build the perfect hash from the learned tuples
+        bool freeze();
+        bool is_frozen() const { return frozen; }
+        size_t learned_count() const { return learn_count; }
+        size_t entry_count() const { return frozen_count; }
+        size_t overflow_count() const { return overflow; }
+
+        size_t serialize(uint8_t* out, size_t capacity) const;
+        bool load(const uint8_t* blob, size_t len);
+
+        static uint32_t key_of(const can_frame* frame);
+        static const char* verdict_name(AllowVerdict verdict);
+
+    private:
+        struct Learned {
+            uint32_t key;
+            uint32_t last_ms;
+            uint16_t min_period_ms;
+            uint16_t mean_period_ms;
+        };
+
+        void learn(uint32_t key, uint32_t now_ms);
+        int lookup(uint32_t key) const;
+        bool should_report(uint32_t key, uint32_t now_ms);
+
+        Learned learned[ALLOWLIST_LEARN_SLOTS];
+        size_t learn_count;
+        size_t overflow;
+
+        uint8_t seeds[ALLOWLIST_BUCKETS];
+        AllowEntry slots[ALLOWLIST_SLOTS];
+        uint32_t last_seen[ALLOWLIST_SLOTS];
+        size_t frozen_count;
+        bool frozen;
+
+        uint32_t alert_keys[ALLOWLIST_ALERT_CACHE];
+        uint32_t alert_ms[ALLOWLIST_ALERT_CACHE];
+
+        ModelMode mode;
+    };
+
+}
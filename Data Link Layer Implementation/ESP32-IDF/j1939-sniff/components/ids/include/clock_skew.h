@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Forward declaration for MCP2515 frame type
+struct can_frame;
+
+namespace IDS {
+
+    constexpr size_t CLOCK_SKEW_SLOTS = 64;              // power of two
+    constexpr int64_t CLOCK_SKEW_MAX_TRACK_MS = 1 << 25;  // restart before fixed point overflow (~9 h)
+
+    struct SkewConfig {
+        uint16_t calibration_intervals = 32;  // intervals averaged to find the nominal period
+        uint16_t batch_size = 50;             // frames averaged per RLS sample
+        uint16_t warmup_batches = 8;          // batches before change detection starts
+        uint8_t forget_shift = 11;            // RLS forgetting factor 1 - 2^-n
+        int32_t kappa_q16 = 3 << 15;          // CUSUM drift allowance (1.5), in error deviations
+        int32_t gamma_q16 = 8 << 16;          // CUSUM alarm threshold, in error deviations
+        int32_t min_dev_ns = 1000;            // floor for the identification error deviation
+    };
+
+    enum class SkewVerdict : uint8_t {
+        OK,
+        SKEW_CHANGE     // the sender's clock skew jumped: likely a different ECU
+    };
+
+    struct SkewProfile {
+        uint32_t key;               // 0x80000000 | (pgn << 8) | sa, 0 = empty slot
+        uint8_t tracking;           // nominal period known
+        uint16_t batch_count;
+        uint16_t calibration_count;
+        uint32_t batches;
+        uint32_t alerts;
+        uint32_t period_us;         // nominal period
+        uint32_t min_interval_us;   // calibration only
+        uint32_t max_interval_us;   // calibration only
+        uint32_t index;             // expected arrivals since origin
+        int64_t first_us;
+        int64_t last_us;
+        int64_t origin_us;
+        int64_t batch_offset_us;    // sum of offsets in the current batch
+        int64_t batch_time_us;      // sum of arrival times in the current batch
+        int64_t offset_ns;          // last averaged clock offset
+        int64_t info;               // RLS information (inverse covariance), ms^2
+        int32_t skew_q16;           // estimated skew in ppm, Q16
+        int32_t error_mean_ns;
+        int32_t error_dev_ns;
+        int32_t cusum_high_q16;
+        int32_t cusum_low_q16;
+    };
+
+    // Per-(PGN, SA) clock offset and skew estimator for periodic messages.
+    // Receive timestamps are compared with the nominal schedule of each
+    // sender; the accumulated offset grows linearly with the sender's clock
+    // skew, which is identified by fixed point recursive least squares and
+    // watched by a CUSUM on the identification error.
+    class ClockSkew {
+    public:
+        explicit ClockSkew(const SkewConfig& config = SkewConfig());
+
+        void set_enabled(bool on) { enabled = on; }
+        bool is_enabled() const { return enabled; }
+        void clear();
+
+        // O(1) per frame. Not thread safe; callers serialise access.
+        SkewVerdict process(const can_frame* frame, int64_t rx_us);
+
+        size_t profile_count() const { return count; }
+        // Slot access for reporting; empty slots have key 0
+        const SkewProfile& slot(size_t index) const { return slots[index]; }
+
+    private:
+        SkewProfile* find(uint32_t key);
+        void calibrate(SkewProfile* p, int64_t rx_us);
+        SkewVerdict finish_batch(SkewProfile* p);
+        void restart(SkewProfile* p, int64_t rx_us);
+
+        SkewConfig config;
+        SkewProfile slots[CLOCK_SKEW_SLOTS];
+        size_t count;
+        bool enabled;
+    };
+
+}
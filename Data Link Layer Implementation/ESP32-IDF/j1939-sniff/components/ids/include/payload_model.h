@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Forward declaration for MCP2515 frame type
+struct can_frame;
+
+namespace IDS {
+
+    constexpr size_t PAYLOAD_MODEL_SLOTS = 128;         // power of two
+    constexpr uint32_t PAYLOAD_MODEL_MAGIC = 0x314D4250; // "PBM1"
+    constexpr uint16_t PAYLOAD_MODEL_VERSION = 1;
+    constexpr uint32_t PAYLOAD_MODEL_MIN_SAMPLES = 16;
+
+    constexpr size_t PAYLOAD_MODEL_HEADER_SIZE = 8;
+    constexpr size_t PAYLOAD_MODEL_ENTRY_SIZE = 40;
+    constexpr size_t PAYLOAD_MODEL_MAX_BLOB = PAYLOAD_MODEL_HEADER_SIZE + PAYLOAD_MODEL_SLOTS * PAYLOAD_MODEL_ENTRY_SIZE;
+
+    enum class ModelMode : uint8_t {
+        OFF,
+        LEARN,
+        ENFORCE
+    };
+
+    enum class Verdict : uint8_t {
+        OK,
+        UNKNOWN_ID,     // no profile for this (PGN, SA)
+        DLC,            // length differs from training
+        CONSTANT_BITS,  // a bit that never changed in training flipped
+        COUNTER,        // a rolling counter byte did not advance by one
+        RANGE           // a byte left its trained [min, max]
+    };
+
+    // Learned behaviour of one (PGN, SA) payload. Payloads are handled as a
+    // little-endian 64-bit word so every check is a few word-wide operations.
+    struct PayloadProfile {
+        uint32_t key;           // 0x80000000 | (pgn << 8) | sa, 0 = empty slot
+        uint8_t dlc;
+        uint8_t counter_bytes;  // bit n set: byte n behaves as a +1 counter
+        uint8_t counter_candidates;
+        uint8_t trained;        // profile has enough samples to be enforced
+        uint8_t counter_misses; // consecutive counter violations
+        uint8_t last_valid;     // last holds a payload seen from this sender
+        uint64_t reference;     // first payload seen
+        uint64_t changed;       // bits that ever differed from reference
+        uint64_t min;           // per-byte minimum
+        uint64_t max;           // per-byte maximum
+        uint64_t last;          // previous payload, for counter checks
+        uint32_t samples;
+    };
+
+    class PayloadModel {
+    public:
+        PayloadModel();
+
+        void set_mode(ModelMode new_mode) { mode = new_mode; }
+        ModelMode get_mode() const { return mode; }
+        void clear();
+
+        // Learn from or check one frame depending on the mode. Returns OK in
+        // LEARN and OFF modes. Not thread safe; callers serialise access.
+        Verdict process(const can_frame* frame);
+
+        size_t profile_count() const { return count; }
+
+        // Compact blob: 8 byte header + 40 bytes per trained profile
+        size_t serialize(uint8_t* out, size_t capacity) const;
+        bool load(const uint8_t* blob, size_t len);
+
+        // Profile key of a frame; 0 for frames that are not profiled (standard
+        // IDs, RTR/error frames and TP.CM/TP.DT transport frames)
+        static uint32_t key_of(const can_frame* frame);
+        static const char* verdict_name(Verdict verdict);
+
+    private:
+        PayloadProfile* find(uint32_t key, bool create);
+        void learn(PayloadProfile* p, uint64_t value, uint8_t dlc);
+        Verdict check(PayloadProfile* p, uint64_t value, uint8_t dlc);
+
+        PayloadProfile slots[PAYLOAD_MODEL_SLOTS];
+        size_t count;
+        ModelMode mode;
+    };
+
+}
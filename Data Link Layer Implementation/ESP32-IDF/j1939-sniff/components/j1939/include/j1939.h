@@ -8,17 +8,19 @@
 #include "freertos/semphr.h"
 #include "esp_log.h"
 #include "driver/spi_master.h"
+#include "trace.h"
+#include "budget.h"
 
-// Forward declarations for MCP2515 classes
-class MCP2515;
-struct can_frame;
+#include "can_controller.h"
 
 namespace J1939 {
-
+    // PGN definitions
     constexpr uint32_t PGN_SINGLE_FRAME_TEST = 0xEF02;
     constexpr uint32_t PGN_PEER_TO_PEER_MESSAGE = 0xEF00;
     constexpr uint32_t PGN_GROUP_MESSAGE = 0xEF10;
     constexpr uint32_t PGN_EXTRA = 0xEF20;
+    constexpr uint32_t PGN_SOFTWARE_ID = 0xFEDA;
+    constexpr uint32_t PGN_COMPONENT_ID = 0xFEEB;
     constexpr uint32_t PGN_TP_CM = 0xEC00;
     constexpr uint32_t PGN_TP_DT = 0xEB00;
     constexpr uint32_t PGN_REQUEST = 0xEA00;
@@ -32,13 +34,36 @@ namespace J1939 {
     constexpr uint8_t SESSION_E = 10;
     constexpr uint8_t SESSION_F = 11;
     
+    // Default configuration
     constexpr uint32_t BUS_BUSY_TIMEOUT_MS = 2000;
     constexpr uint32_t SESSION_TIMEOUT_MS = 1000;
     constexpr uint8_t DEFAULT_SOURCE_ADDRESS = 0x32;
+    constexpr uint8_t GLOBAL_ADDRESS = 0xFF;
+    constexpr uint8_t DEFAULT_PRIORITY = 6;
+
+    // Gap between TP.DT packets: J1939-21's 50 ms for BAMs to all nodes.
+    // Addressed transfers only wait for the previous frame to leave the
+    // transmit buffers, which send in buffer order only one at a time.
+    constexpr uint32_t BAM_PACKET_GAP_MS = 50;
+    constexpr uint32_t ADDRESSED_PACKET_GAP_MS = 10;
+
+    // Reassembly heap: six concurrent BAMs of the largest size (1785 bytes)
+    // with their map nodes, about 11.5 KiB. New sessions are admitted
+    // against it, counting the announced size plus SESSION_OVERHEAD.
+    constexpr size_t HEAP_BUDGET = 12 * 1024;
+    constexpr size_t SESSION_OVERHEAD = 128;
+    extern Budget::Account heap;
+
+    // A TP.CM reserves the whole announced message, so these bound what one
+    // source can hold without sending data. Sessions with no TP.DT within
+    // FIRST_PACKET_TIMEOUT_MS are dropped ahead of SESSION_TIMEOUT_MS.
+    constexpr uint8_t MAX_SESSIONS_PER_SOURCE = 2;
+    constexpr size_t MAX_BYTES_PER_SOURCE = 4 * 1024;
+    constexpr uint32_t FIRST_PACKET_TIMEOUT_MS = 250;
 
-    // Structure that hold multi-frame message data
+    // Structure to hold multi-frame message data
     struct MultiFrameMessage {
-        std::vector<uint8_t> data;
+        std::vector<uint8_t, Budget::Allocator<uint8_t, heap>> data;
         size_t total_size;
         uint32_t pgn;
         uint8_t source_addr;
@@ -47,44 +72,88 @@ namespace J1939 {
         uint16_t total_packets;
         bool complete;
         uint32_t last_activity_time;
+        uint32_t start_time;        // TP.CM received, for the reassembly time metric
+        uint16_t trace_id;          // Trace::NO_TRACE unless the BAM carried a tag
     };
 
-
+    // J1939 Protocol Controller Class
     class Controller {
     public:
-        Controller(MCP2515* mcp, uint8_t source_addr = DEFAULT_SOURCE_ADDRESS);
+        // Constructor & Destructor
+        Controller(CanController* mcp, uint8_t source_addr = DEFAULT_SOURCE_ADDRESS);
         ~Controller();
         
+        // Initialization
         bool init();
         
+        // Message handling. Single frames may be decoded from several tasks
+        // at once (the receive lanes); transport frames and
+        // cleanup_stale_sessions() only ever from one.
         void decode_j1939_message(const can_frame* frame);
         
         // Transport Protocol handlers
         void parse_tp_cm(const can_frame* frame, uint8_t src_addr);
         void parse_tp_dt(const can_frame* frame, uint8_t src_addr);
         
-        bool send_single_frame_message(uint32_t pgn, uint8_t dst, const uint8_t* data, uint8_t len);
-        bool send_multi_frame_message(uint32_t pgn, const uint8_t* data, uint16_t size);
+        // Send methods. dst goes into the PDU specific byte of PDU1 PGNs
+        // (PF < 240), GLOBAL_ADDRESS for everyone; PDU2 PGNs ignore it.
+        bool send_single_frame_message(uint32_t pgn, uint8_t dst, const uint8_t* data, uint8_t len,
+                                       uint16_t trace_id = Trace::NO_TRACE);
+        bool send_multi_frame_message(uint32_t pgn, uint8_t dst, const uint8_t* data, uint16_t size,
+                                      uint16_t trace_id = Trace::NO_TRACE);
         bool send_data_packet(uint8_t seq_num, uint8_t dst, const uint8_t* data, uint8_t len, uint8_t session_number);
         
+        // Session management
         bool is_bus_available();
         bool is_session_valid(uint8_t session_number, uint8_t src_addr);
         bool is_valid_session(uint8_t session);
         void cleanup_stale_sessions();
+        bool admit_session(uint8_t src_addr, uint16_t message_size);
+        void release_session(uint16_t session_id);
         void process_complete_message(const MultiFrameMessage& mfm);
         const char* session_name(uint8_t session);
+        
+        // Receive only what is addressed to this node: PDU1 frames to its
+        // source address or GLOBAL_ADDRESS, and all PDU2 frames. Sets the
+        // controller's acceptance filters and leaves it in normal mode;
+        // frames the hardware lets through anyway are dropped in
+        // decode_j1939_message and counted as "j1939" rx_other_da. This
+        // saves receive work only: addressed sends still wait out other
+        // nodes' BAMs (bus_busy) like broadcasts (see host can_sim).
+        bool set_address_filter(bool enable);
+        bool address_filter_enabled() const { return address_filter; }
 
+        // Utility
         static const char* pgn_to_string(uint32_t pgn);
+        static uint32_t make_can_id(uint32_t pgn, uint8_t dst, uint8_t src, uint8_t priority = DEFAULT_PRIORITY);
+
+        // Received messages are printed as JSON unless a sink is set. The
+        // sink is called from the task that decoded the message.
+        typedef void (*MessageSink)(void* context, uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len);
+        void set_message_sink(MessageSink sink, void* context);
+
+        // JSON line of a received message; up to 8 bytes count as a single
+        // frame. "t" is the bus time in seconds once the node is synchronised.
+        static void print_message(uint32_t pgn, uint8_t src_addr, const uint8_t* data, size_t len);
         
     private:
-        MCP2515* mcp2515;
+        CanController* mcp2515;
         uint8_t source_address;
+        bool address_filter;
         volatile bool bus_busy;
         uint32_t bus_busy_timeout;
         uint16_t message_size;
         SemaphoreHandle_t bus_state_mutex;
-        std::map<uint16_t, MultiFrameMessage> multi_frame_messages;
-        std::map<uint16_t, bool> active_bam_sessions;
+        Budget::StaticMutex bus_state_mutex_memory;
+        std::map<uint16_t, MultiFrameMessage, std::less<uint16_t>,
+                 Budget::Allocator<std::pair<const uint16_t, MultiFrameMessage>, heap>> multi_frame_messages;
+        std::map<uint16_t, bool, std::less<uint16_t>,
+                 Budget::Allocator<std::pair<const uint16_t, bool>, heap>> active_bam_sessions;
+        // Bitmap of sources whose last transfer was abandoned; their BAMs
+        // do not hold bus_busy until one of them completes
+        uint32_t abandoned_sources[8];
+        MessageSink message_sink;
+        void* sink_context;
     };
 
-}
\ No newline at end of file
+} // namespace J1939
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Forward declaration for MCP2515 frame type
+struct can_frame;
+
+namespace Rules {
+
+    constexpr size_t MAX_RULES = 32;            // one bit per rule in every table
+    constexpr size_t MAX_PGN_ENTRIES = 64;
+    constexpr size_t PGN_SLOTS = 128;           // power of two, at most half full
+    constexpr size_t NAME_LEN = 16;
+
+    constexpr uint32_t BLOB_MAGIC = 0x314C5552; // "RUL1"
+    constexpr uint16_t BLOB_VERSION = 1;
+    constexpr size_t HEADER_SIZE = 12;
+    constexpr size_t RULE_RECORD_SIZE = 140;
+    constexpr size_t PGN_RECORD_SIZE = 8;
+    constexpr size_t MAX_BLOB = HEADER_SIZE + MAX_RULES * RULE_RECORD_SIZE + MAX_PGN_ENTRIES * PGN_RECORD_SIZE;
+
+    enum Action : uint8_t {
+        ACTION_ALERT = 0x01,    // report the frame
+        ACTION_DROP = 0x02,     // suppress the frame
+        ACTION_FORWARD = 0x04,  // copy the raw frame to the host
+        ACTION_SMS = 0x08,      // raise an SMS notification
+        ACTION_GPIO = 0x10,     // pulse an output pin
+        ACTION_STATE = 0x20     // set / clear system state bits
+    };
+
+    struct Rule {
+        char name[NAME_LEN];
+        uint8_t actions;
+        uint8_t gpio;
+        uint16_t pulse_ms;
+        uint8_t set_bits;
+        uint8_t clear_bits;
+        uint8_t min_dlc;
+        uint16_t rate_limit;     // fire only above this many matches per window, 0 = always
+        uint16_t rate_window_ms;
+        uint64_t payload_mask;   // little-endian payload word
+        uint64_t payload_value;
+    };
+
+    struct Result {
+        uint32_t fired;          // bit n set: rule n matched
+        uint8_t actions;         // union of the actions of all fired rules
+    };
+
+    // Rule set compiled by Test scripts/rule_compiler.py. Every match field is
+    // a table from field value to a bitmask of the rules accepting it, so a
+    // frame is classified by AND-ing a fixed number of table lookups.
+    class Engine {
+    public:
+        Engine();
+
+        void clear();
+        bool load(const uint8_t* blob, size_t len);
+
+        // Classify one frame and apply state actions. Not thread safe;
+        // callers serialise access.
+        Result evaluate(const can_frame* frame, int64_t now_us);
+
+        size_t rule_count() const { return count; }
+        const Rule& rule(size_t index) const { return rules[index]; }
+
+        uint8_t get_state() const { return state; }
+        void set_state(uint8_t new_state) { state = new_state; }
+
+    private:
+        struct PgnSlot {
+            uint32_t pgn;        // EMPTY_PGN = unused
+            uint32_t rules;
+        };
+
+        static constexpr uint32_t EMPTY_PGN = 0xFFFFFFFF;
+
+        uint32_t pgn_rules(uint32_t pgn) const;
+        bool add_pgn(uint32_t pgn, uint32_t mask);
+
+        Rule rules[MAX_RULES];
+        size_t count;
+
+        uint32_t any_pgn;
+        PgnSlot pgn_slots[PGN_SLOTS];
+        uint32_t sa_table[256];
+        uint32_t da_table[256];
+        uint32_t state_table[256];
+        uint32_t byte_table[8][256];
+        uint32_t dlc_table[9];
+
+        uint32_t rate_rules;
+        int64_t window_start[MAX_RULES];
+        uint16_t window_count[MAX_RULES];
+
+        uint8_t state;
+    };
+
+}
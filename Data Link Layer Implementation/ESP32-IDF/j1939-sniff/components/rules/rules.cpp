@@ -0,0 +1,246 @@
+/**
+ * @file rules.cpp
+ * @brief Decision table rule engine for per-frame detections and reactions
+ * @version 1.0
+ *
+ * Rules are written in a small text language on the host and compiled by
+ * Test scripts/rule_compiler.py into a blob that is loaded over UART, so
+ * detections can change without reflashing. A rule matches on:
+ *
+ * - PGN (or any PGN), source address and destination address sets
+ * - system state: 8 state bits, set from the host or by other rules
+ * - payload mask/value and a minimum DLC
+ * - rate: more than N matching frames within a window
+ *
+ * and triggers any of alert, drop, forward, SMS, GPIO pulse or state update.
+ *
+ * Each rule owns one bit. At load time the per-rule sets are transposed into
+ * tables indexed by field value (SA, DA, state, DLC and every payload byte)
+ * holding the mask of rules that accept that value; PGNs use a half-empty
+ * open-addressing table plus a mask of wildcard rules. Classifying a frame is
+ * therefore a fixed sequence of lookups and ANDs regardless of how many rules
+ * are loaded; only the rate and state bookkeeping walks the (at most 32)
+ * rules that actually matched.
+ *
+ * Blob layout (little-endian):
+ *   header  magic u32, version u16, rule count u16, PGN count u16, reserved u16
+ *   rule    name[16], actions, gpio, pulse_ms u16, set_bits, clear_bits,
+ *           min_dlc, flags (bit0 = any PGN), rate_limit u16, rate_window_ms u16,
+ *           payload_mask u64, payload_value u64,
+ *           SA set[32], DA set[32], state set[32] (256 bit sets)
+ *   pgn     pgn u32, rule mask u32
+ *
+ */
+
+#include "rules.h"
+#include "mcp2515/can.h"
+#include <string.h>
+
+namespace Rules {
+
+static constexpr uint8_t FLAG_ANY_PGN = 0x01;
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static inline bool set_has(const uint8_t *set, uint8_t value) {
+    return set[value >> 3] & (1 << (value & 7));
+}
+
+Engine::Engine() : state(0) {
+    clear();
+}
+
+void Engine::clear() {
+    memset(rules, 0, sizeof(rules));
+    count = 0;
+    any_pgn = 0;
+    for (size_t i = 0; i < PGN_SLOTS; i++) {
+        pgn_slots[i].pgn = EMPTY_PGN;
+        pgn_slots[i].rules = 0;
+    }
+    memset(sa_table, 0, sizeof(sa_table));
+    memset(da_table, 0, sizeof(da_table));
+    memset(state_table, 0, sizeof(state_table));
+    memset(byte_table, 0, sizeof(byte_table));
+    memset(dlc_table, 0, sizeof(dlc_table));
+    rate_rules = 0;
+    memset(window_start, 0, sizeof(window_start));
+    memset(window_count, 0, sizeof(window_count));
+}
+
+bool Engine::add_pgn(uint32_t pgn, uint32_t mask) {
+    uint32_t index = (pgn * 2654435761UL) & (PGN_SLOTS - 1);
+    for (size_t probe = 0; probe < PGN_SLOTS; probe++) {
+        PgnSlot &slot = pgn_slots[index];
+        if (slot.pgn == pgn || slot.pgn == EMPTY_PGN) {
+            slot.pgn = pgn;
+            slot.rules |= mask;
+            return true;
+        }
+        index = (index + 1) & (PGN_SLOTS - 1);
+    }
+    return false;
+}
+
+uint32_t Engine::pgn_rules(uint32_t pgn) const {
+    uint32_t index = (pgn * 2654435761UL) & (PGN_SLOTS - 1);
+    for (size_t probe = 0; probe < PGN_SLOTS; probe++) {
+        const PgnSlot &slot = pgn_slots[index];
+        if (slot.pgn == pgn) {
+            return slot.rules;
+        }
+        if (slot.pgn == EMPTY_PGN) {
+            return 0;
+        }
+        index = (index + 1) & (PGN_SLOTS - 1);
+    }
+    return 0;
+}
+
+bool Engine::load(const uint8_t *blob, size_t len) {
+    if (len < HEADER_SIZE ||
+        get_le(&blob[0], 4) != BLOB_MAGIC ||
+        get_le(&blob[4], 2) != BLOB_VERSION) {
+        return false;
+    }
+
+    size_t rule_total = get_le(&blob[6], 2);
+    size_t pgn_total = get_le(&blob[8], 2);
+    if (rule_total > MAX_RULES || pgn_total > MAX_PGN_ENTRIES ||
+        len != HEADER_SIZE + rule_total * RULE_RECORD_SIZE + pgn_total * PGN_RECORD_SIZE) {
+        return false;
+    }
+
+    clear();
+    uint32_t valid = (rule_total == 32) ? 0xFFFFFFFFUL : ((1UL << rule_total) - 1);
+
+    for (size_t r = 0; r < rule_total; r++) {
+        const uint8_t *e = blob + HEADER_SIZE + r * RULE_RECORD_SIZE;
+        Rule &rule = rules[r];
+        uint32_t bit = 1UL << r;
+
+        memcpy(rule.name, e, NAME_LEN);
+        rule.name[NAME_LEN - 1] = '\0';
+        rule.actions = e[16];
+        rule.gpio = e[17];
+        rule.pulse_ms = get_le(&e[18], 2);
+        rule.set_bits = e[20];
+        rule.clear_bits = e[21];
+        rule.min_dlc = e[22];
+        rule.rate_limit = get_le(&e[24], 2);
+        rule.rate_window_ms = get_le(&e[26], 2);
+        rule.payload_mask = get_le(&e[28], 8);
+        rule.payload_value = get_le(&e[36], 8);
+
+        if (rule.min_dlc > CAN_MAX_DLEN || (rule.rate_limit && !rule.rate_window_ms)) {
+            clear();
+            return false;
+        }
+
+        if (e[23] & FLAG_ANY_PGN) {
+            any_pgn |= bit;
+        }
+        if (rule.rate_limit) {
+            rate_rules |= bit;
+        }
+
+        const uint8_t *sa_set = &e[44];
+        const uint8_t *da_set = &e[76];
+        const uint8_t *state_set = &e[108];
+        for (int v = 0; v < 256; v++) {
+            if (set_has(sa_set, v)) sa_table[v] |= bit;
+            if (set_has(da_set, v)) da_table[v] |= bit;
+            if (set_has(state_set, v)) state_table[v] |= bit;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            uint8_t mask = (rule.payload_mask >> (8 * i)) & 0xFF;
+            uint8_t value = (rule.payload_value >> (8 * i)) & 0xFF;
+            for (int v = 0; v < 256; v++) {
+                if ((v & mask) == value) {
+                    byte_table[i][v] |= bit;
+                }
+            }
+        }
+
+        for (int dlc = rule.min_dlc; dlc <= CAN_MAX_DLEN; dlc++) {
+            dlc_table[dlc] |= bit;
+        }
+    }
+
+    for (size_t p = 0; p < pgn_total; p++) {
+        const uint8_t *e = blob + HEADER_SIZE + rule_total * RULE_RECORD_SIZE + p * PGN_RECORD_SIZE;
+        uint32_t pgn = get_le(&e[0], 4);
+        uint32_t mask = get_le(&e[4], 4);
+        if (pgn > 0x3FFFF || (mask & ~valid) || !add_pgn(pgn, mask)) {
+            clear();
+            return false;
+        }
+    }
+
+    count = rule_total;
+    return true;
+}
+
+Result Engine::evaluate(const can_frame *frame, int64_t now_us) {
+    Result result = {0, 0};
+    if (count == 0 || !(frame->can_id & CAN_EFF_FLAG) || (frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))) {
+        return result;
+    }
+
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint8_t pdu_format = (id >> 16) & 0xFF;
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    uint8_t da = 0xFF;
+    if (pdu_format < 240) {
+        da = pgn & 0xFF;
+        pgn &= 0x3FF00;
+    }
+    uint8_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+
+    uint32_t match = (any_pgn | pgn_rules(pgn)) &
+                     sa_table[id & 0xFF] &
+                     da_table[da] &
+                     state_table[state] &
+                     dlc_table[dlc];
+    // Bytes past the DLC are compared as zero; rules on them already failed the DLC table
+    for (int i = 0; i < 8; i++) {
+        match &= byte_table[i][i < dlc ? frame->data[i] : 0];
+    }
+    if (!match) {
+        return result;
+    }
+
+    for (uint32_t pending = match & rate_rules; pending; pending &= pending - 1) {
+        int r = __builtin_ctz(pending);
+        const Rule &rule = rules[r];
+        if (now_us - window_start[r] >= (int64_t)rule.rate_window_ms * 1000) {
+            window_start[r] = now_us;
+            window_count[r] = 0;
+        }
+        if (window_count[r] < UINT16_MAX) {
+            window_count[r]++;
+        }
+        if (window_count[r] <= rule.rate_limit) {
+            match &= ~(1UL << r);
+        }
+    }
+
+    for (uint32_t pending = match; pending; pending &= pending - 1) {
+        const Rule &rule = rules[__builtin_ctz(pending)];
+        if (rule.actions & ACTION_STATE) {
+            state = (state & ~rule.clear_bits) | rule.set_bits;
+        }
+        result.actions |= rule.actions;
+    }
+    result.fired = match;
+    return result;
+}
+
+}
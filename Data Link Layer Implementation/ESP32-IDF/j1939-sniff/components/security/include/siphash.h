@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace SipHash {
+
+    constexpr size_t KEY_SIZE = 16;
+
+    // SipHash-2-4 (Aumasson and Bernstein), a keyed 64-bit MAC for short
+    // messages: an 8-byte message takes a few hundred cycles, so it can
+    // authenticate frames at the bus rate without the AES engine
+    uint64_t mac(const uint8_t key[KEY_SIZE], const uint8_t* data, size_t len);
+
+}
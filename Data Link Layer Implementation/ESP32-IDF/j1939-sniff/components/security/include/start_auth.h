@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "can_controller.h"
+#include "mcp2515/can.h"
+#include "siphash.h"
+#include "bus_key.h"
+
+namespace StartAuth {
+
+    // Proprietary B like the heartbeat, to all nodes, so address filters
+    // pass them; the addressee is the first byte and under the MAC. Priority
+    // 3, as the time sync: the exchange has a budget of tens of ms and must
+    // not queue behind priority 6 messages and transport packets.
+    constexpr uint32_t PGN_CHALLENGE = 0xFF63;
+    constexpr uint32_t PGN_RESPONSE = 0xFF64;
+    constexpr uint8_t PRIORITY = 3;
+
+    // CHALLENGE: responder address, nonce (7 random bytes)
+    // RESPONSE:  challenger address, counter (LE24), MAC (4 bytes): the start
+    //            of SipHash-2-4 with the bus key over the challenger's and
+    //            responder's addresses, the nonce and the counter
+    constexpr size_t FRAME_SIZE = 8;
+    constexpr size_t NONCE_SIZE = 7;
+    constexpr size_t COUNTER_SIZE = 3;
+    constexpr size_t MAC_SIZE = 4;
+
+    // From the start request to a verified response; a grant later than
+    // this is refused. The budget is split evenly between ATTEMPTS
+    // challenges, each with a new nonce. Waits are in whole FreeRTOS ticks,
+    // rounded up, so the deadline itself is checked on esp_timer.
+    constexpr uint32_t MIN_BUDGET_MS = 10;
+    constexpr uint32_t MAX_BUDGET_MS = 1000;
+    constexpr uint32_t ATTEMPTS = 3;
+
+    // Latencies of the last LATENCY_SAMPLES grants, for the percentiles
+    constexpr size_t LATENCY_SAMPLES = 64;
+
+    // The responder saves its counter in NVS this many responses ahead, so
+    // it never repeats after a restart and flash is written once per block
+    constexpr uint32_t COUNTER_RESERVE = 256;
+
+    enum class Role : uint8_t {
+        VERIFIER,           // the IMM: challenges before it enables ignition
+        RESPONDER           // the KLE: answers with the bus key
+    };
+
+    enum class Result : uint8_t {
+        GRANTED,
+        TIMEOUT,            // no valid response within the budget
+        BAD_MAC,            // only responses without a valid MAC
+        STALE_COUNTER,      // valid MAC, but a counter not newer than the last grant
+        OVER_BUDGET,        // verified, but after the deadline
+        SEND_FAILED,
+        NOT_READY           // not a verifier, or no trusted bus key
+    };
+
+    // Start authorisation by challenge and response over single frames.
+    //
+    // Before the IMM enables ignition it sends a fresh random nonce to the
+    // KLE and waits for the KLE's counter and a MAC over both. Only a node
+    // with the bus key can answer, a recorded answer does not fit a new
+    // nonce, and the counter shows a second key that has fallen behind.
+    // Lost frames are covered by sending another challenge while the budget
+    // lasts; a late answer to an earlier challenge of the same start counts.
+    //
+    // on_frame() runs on the receiver task under the SPI mutex: the KLE
+    // answers from there without a task switch. authorise() blocks its
+    // caller for at most the budget.
+    class Authenticator {
+    public:
+        Authenticator(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr);
+
+        // Bus key from NVS and, for a responder, its counter. peer is the
+        // node at the other end: the KLE for the IMM and the other way round.
+        // A verifier with only the default key starts, but refuses every
+        // start until a key is provisioned (BusKey::trusted).
+        bool init(Role role, uint8_t peer);
+
+        // Every received frame before it is decoded. Returns true for
+        // challenges and responses.
+        bool on_frame(const can_frame* frame);
+
+        // Verifier: challenges the peer and waits for its answer. Prints the
+        // outcome as {"auth":"granted",...} or {"auth":"refused",...} unless
+        // report is false.
+        Result authorise(bool report = true);
+
+        // From {"c":"auth","d":"..."}: "status", "budget,<ms>", "test,<n>"
+        // (n authorisations without actuating, for the percentiles) or
+        // "reset"
+        bool execute(const char* command);
+
+        static const char* result_name(Result result);
+
+    private:
+        uint32_t mac(uint8_t challenger, uint8_t responder, const uint8_t* nonce, uint32_t counter) const;
+        bool send_challenge();
+        void respond(uint8_t challenger, const uint8_t* nonce);
+        void verify(uint8_t responder, const uint8_t* data);
+        void record(uint32_t latency_us);
+        uint32_t percentile_us(uint32_t percent) const;
+        void print_status();
+
+        CanController* can;
+        SemaphoreHandle_t spi_mutex;
+        uint8_t source_address;
+        uint8_t key[SipHash::KEY_SIZE];
+        bool keyed;
+        BusKey::State key_state;
+        Role role;
+        uint8_t peer;
+        volatile uint32_t budget_ms;
+
+        // Responder
+        uint32_t counter;
+        uint32_t reserved;              // counter value saved in NVS
+
+        // Verifier: the start in progress, under the SPI mutex
+        SemaphoreHandle_t answered;
+        StaticSemaphore_t answered_memory;
+        bool pending;
+        uint8_t nonces[ATTEMPTS][NONCE_SIZE];
+        uint32_t sent_attempts;
+        Result outcome;
+        int64_t answered_us;
+        bool have_counter;
+        uint32_t last_counter;          // of the last grant, since start-up
+
+        uint32_t latencies[LATENCY_SAMPLES];
+        size_t latency_count;
+        size_t latency_next;
+    };
+
+}
@@ -0,0 +1,439 @@
+/**
+ * @file start_auth.cpp
+ * @brief Challenge-response start authorisation between the IMM and the KLE
+ * @version 1.0
+ *
+ * The IMM authorises every "Ignition ON" with the KLE before it actuates:
+ *
+ *   {"auth":"granted","peer":"42","latency_us":1840,"attempts":1,"budget_ms":50}
+ *   {"auth":"refused","reason":"timeout","peer":"42","latency_us":50310,"attempts":3,"budget_ms":50}
+ *
+ *   {"c":"auth","d":"budget,30"}    deadline for a grant, split between the attempts
+ *   {"c":"auth","d":"test,200"}     200 authorisations without actuating
+ *   {"c":"auth","d":"status"}
+ *   {"auth":"status","role":"verifier","sa":"32","peer":"42","key":"provisioned","budget_ms":50,"attempt_ms":16,
+ *    "granted":..,"refused":..,"samples":64,"p50_us":..,"p90_us":..,"p99_us":..,"max_us":..}
+ *
+ * latency_us runs from the start request to the verified response, so it
+ * includes both frames on the bus and the KLE's turnaround; the
+ * percentiles are over the last LATENCY_SAMPLES grants. The "auth" group
+ * in "stats" has the full histogram and counts refusals by reason, bad
+ * MACs, stale counters and retries. The KLE's status shows its counter and
+ * the responses it sent.
+ *
+ * The default bus key is public, so while the IMM has no provisioned key
+ * every start is refused before a challenge is sent:
+ *
+ *   {"auth":"refused","reason":"not_ready","key":"default"}
+ *
+ */
+
+#include "start_auth.h"
+#include "bus_key.h"
+#include "j1939.h"
+#include "metrics.h"
+#include "sdkconfig.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* TAG = "StartAuth";
+
+namespace StartAuth {
+
+static Metrics::Counter granted("auth", "granted");
+static Metrics::Counter refused("auth", "refused");
+static Metrics::Counter timeouts("auth", "timeouts");
+static Metrics::Counter over_budget("auth", "over_budget");
+static Metrics::Counter challenges("auth", "challenges");
+static Metrics::Counter retries("auth", "retries");
+static Metrics::Counter responses("auth", "responses");
+static Metrics::Counter tx_failed("auth", "tx_failed");
+static Metrics::Counter bad_mac("auth", "bad_mac");
+static Metrics::Counter stale("auth", "stale_counter");
+static Metrics::Counter unsolicited("auth", "unsolicited");     // responses with no start waiting
+static Metrics::Counter foreign("auth", "foreign");             // addressed to us by a node that is not the peer
+static const uint32_t LATENCY_US[] = {1000, 2000, 3000, 5000, 10000, 20000, 30000, 50000, 100000};
+static Metrics::Histogram latency_us("auth", "latency_us", LATENCY_US);
+
+static const char* const ROLE_NAMES[] = {"verifier", "responder"};
+
+static constexpr uint32_t COUNTER_MASK = 0xFFFFFF;
+static constexpr uint32_t MAX_TEST_COUNT = 1000;
+
+static const char* NVS_NAMESPACE = "security";
+static const char* NVS_COUNTER = "auth_counter";
+
+// Serial number arithmetic on the 24-bit counter, as for the heartbeats
+static bool is_newer(uint32_t counter, uint32_t last) {
+    uint32_t diff = (counter - last) & COUNTER_MASK;
+    return diff != 0 && diff < (COUNTER_MASK + 1) / 2;
+}
+
+// Rounded up, so a wait is never shorter than asked
+static TickType_t ticks_for_us(int64_t us) {
+    if (us <= 0) {
+        return 0;
+    }
+    return (TickType_t)(((uint64_t)us * configTICK_RATE_HZ + 999999) / 1000000);
+}
+
+static uint32_t load_counter() {
+    nvs_handle_t nvs;
+    uint32_t value = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, NVS_COUNTER, &value);
+        nvs_close(nvs);
+    }
+    return value & COUNTER_MASK;
+}
+
+static void save_counter(uint32_t value) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_set_u32(nvs, NVS_COUNTER, value);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+Authenticator::Authenticator(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr)
+    : can(can),
+      spi_mutex(spi_mutex),
+      source_address(source_addr),
+      keyed(false),
+      key_state(BusKey::State::NONE),
+      role(Role::VERIFIER),
+      peer(J1939::GLOBAL_ADDRESS),
+      budget_ms(CONFIG_SECURITY_START_AUTH_BUDGET_MS),
+      counter(0),
+      reserved(0),
+      answered(NULL),
+      pending(false),
+      sent_attempts(0),
+      outcome(Result::TIMEOUT),
+      answered_us(0),
+      have_counter(false),
+      last_counter(0),
+      latency_count(0),
+      latency_next(0) {
+    memset(key, 0, sizeof(key));
+    memset(nonces, 0, sizeof(nonces));
+    memset(latencies, 0, sizeof(latencies));
+}
+
+bool Authenticator::init(Role initial, uint8_t peer_addr) {
+    role = initial;
+    peer = peer_addr;
+    answered = xSemaphoreCreateBinaryStatic(&answered_memory);
+    key_state = BusKey::load(key);
+    if (key_state == BusKey::State::NONE) {
+        return false;
+    }
+    if (role == Role::RESPONDER) {
+        // Continue past everything a previous run may have used
+        counter = load_counter();
+        reserved = (counter + COUNTER_RESERVE) & COUNTER_MASK;
+        save_counter(reserved);
+    }
+    keyed = true;
+    ESP_LOGI(TAG, "Start authorisation as %s with %02X", ROLE_NAMES[(size_t)role], peer);
+    return true;
+}
+
+const char* Authenticator::result_name(Result result) {
+    switch (result) {
+    case Result::GRANTED: return "granted";
+    case Result::TIMEOUT: return "timeout";
+    case Result::BAD_MAC: return "bad_mac";
+    case Result::STALE_COUNTER: return "stale_counter";
+    case Result::OVER_BUDGET: return "over_budget";
+    case Result::SEND_FAILED: return "send_failed";
+    case Result::NOT_READY: return "not_ready";
+    }
+    return "unknown";
+}
+
+uint32_t Authenticator::mac(uint8_t challenger, uint8_t responder, const uint8_t* nonce, uint32_t value) const {
+    uint8_t message[2 + NONCE_SIZE + COUNTER_SIZE];
+    message[0] = challenger;
+    message[1] = responder;
+    memcpy(message + 2, nonce, NONCE_SIZE);
+    for (size_t i = 0; i < COUNTER_SIZE; i++) {
+        message[2 + NONCE_SIZE + i] = (uint8_t)(value >> (8 * i));
+    }
+    return (uint32_t)SipHash::mac(key, message, sizeof(message));
+}
+
+bool Authenticator::on_frame(const can_frame* frame) {
+    if (!(frame->can_id & CAN_EFF_FLAG) || frame->can_dlc != FRAME_SIZE) {
+        return false;
+    }
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    if (pgn != PGN_CHALLENGE && pgn != PGN_RESPONSE) {
+        return false;
+    }
+    uint8_t src_addr = id & 0xFF;
+    if (!keyed || frame->data[0] != source_address) {
+        return true;
+    }
+    if (src_addr != peer) {
+        foreign.inc();
+        return true;
+    }
+
+    if (pgn == PGN_CHALLENGE && role == Role::RESPONDER) {
+        respond(src_addr, frame->data + 1);
+    } else if (pgn == PGN_RESPONSE && role == Role::VERIFIER) {
+        verify(src_addr, frame->data);
+    }
+    return true;
+}
+
+void Authenticator::respond(uint8_t challenger, const uint8_t* nonce) {
+    can_frame reply = {};
+    reply.can_id = J1939::Controller::make_can_id(PGN_RESPONSE, J1939::GLOBAL_ADDRESS, source_address, PRIORITY);
+    reply.can_dlc = FRAME_SIZE;
+    reply.data[0] = challenger;
+    for (size_t i = 0; i < COUNTER_SIZE; i++) {
+        reply.data[1 + i] = (uint8_t)(counter >> (8 * i));
+    }
+    uint32_t tag = mac(challenger, source_address, nonce, counter);
+    for (size_t i = 0; i < MAC_SIZE; i++) {
+        reply.data[FRAME_SIZE - MAC_SIZE + i] = (uint8_t)(tag >> (8 * i));
+    }
+
+    if (can->sendMessage(&reply) == CanController::ERROR_OK) {
+        responses.inc();
+    } else {
+        tx_failed.inc();
+    }
+
+    // A counter is never used twice, even for a response that was not
+    // sent. The NVS write comes after the response is on its way.
+    counter = (counter + 1) & COUNTER_MASK;
+    if (counter == reserved) {
+        reserved = (counter + COUNTER_RESERVE) & COUNTER_MASK;
+        save_counter(reserved);
+    }
+}
+
+void Authenticator::verify(uint8_t responder, const uint8_t* data) {
+    if (!pending) {
+        unsolicited.inc();
+        return;
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; i < COUNTER_SIZE; i++) {
+        value |= (uint32_t)data[1 + i] << (8 * i);
+    }
+    uint32_t tag = 0;
+    for (size_t i = 0; i < MAC_SIZE; i++) {
+        tag |= (uint32_t)data[FRAME_SIZE - MAC_SIZE + i] << (8 * i);
+    }
+
+    // Any challenge of this start: a retry may cross the first answer
+    bool valid = false;
+    for (size_t i = 0; i < sent_attempts && !valid; i++) {
+        valid = tag == mac(source_address, responder, nonces[i], value);
+    }
+    if (!valid) {
+        bad_mac.inc();
+        if (outcome == Result::TIMEOUT) {
+            outcome = Result::BAD_MAC;
+        }
+        return;
+    }
+    if (have_counter && !is_newer(value, last_counter)) {
+        stale.inc();
+        outcome = Result::STALE_COUNTER;
+        return;
+    }
+
+    have_counter = true;
+    last_counter = value;
+    outcome = Result::GRANTED;
+    answered_us = esp_timer_get_time();
+    pending = false;
+    xSemaphoreGive(answered);
+}
+
+bool Authenticator::send_challenge() {
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(budget_ms)) != pdTRUE) {
+        return false;
+    }
+    uint8_t* nonce = nonces[sent_attempts];
+    esp_fill_random(nonce, NONCE_SIZE);
+    sent_attempts++;
+    pending = true;
+
+    can_frame frame = {};
+    frame.can_id = J1939::Controller::make_can_id(PGN_CHALLENGE, J1939::GLOBAL_ADDRESS, source_address, PRIORITY);
+    frame.can_dlc = FRAME_SIZE;
+    frame.data[0] = peer;
+    memcpy(frame.data + 1, nonce, NONCE_SIZE);
+    CanController::ERROR err = can->sendMessage(&frame);
+    xSemaphoreGive(spi_mutex);
+
+    if (err != CanController::ERROR_OK) {
+        tx_failed.inc();
+        return false;
+    }
+    challenges.inc();
+    return true;
+}
+
+void Authenticator::record(uint32_t latency) {
+    latency_us.record(latency);
+    latencies[latency_next] = latency;
+    latency_next = (latency_next + 1) % LATENCY_SAMPLES;
+    if (latency_count < LATENCY_SAMPLES) {
+        latency_count++;
+    }
+}
+
+Result Authenticator::authorise(bool report) {
+    if (role != Role::VERIFIER || !keyed || !BusKey::trusted(key_state)) {
+        printf("{\"auth\":\"refused\",\"reason\":\"%s\",\"key\":\"%s\"}\n", result_name(Result::NOT_READY),
+               BusKey::state_name(key_state));
+        return Result::NOT_READY;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = start_us + (int64_t)budget_ms * 1000;
+    int64_t attempt_us = (int64_t)budget_ms * 1000 / ATTEMPTS;
+
+    // A grant signalled after the previous start had given up
+    xSemaphoreTake(answered, 0);
+    xSemaphoreTake(spi_mutex, portMAX_DELAY);
+    sent_attempts = 0;
+    outcome = Result::TIMEOUT;
+    xSemaphoreGive(spi_mutex);
+
+    bool signalled = false;
+    bool any_sent = false;
+    uint32_t attempts = 0;
+    int64_t now_us = start_us;
+    while (!signalled && attempts < ATTEMPTS && now_us < deadline_us) {
+        if (attempts > 0) {
+            retries.inc();
+        }
+        any_sent |= send_challenge();
+        attempts++;
+        int64_t wait_us = attempts == ATTEMPTS ? deadline_us - now_us : start_us + attempts * attempt_us - now_us;
+        signalled = xSemaphoreTake(answered, ticks_for_us(wait_us)) == pdTRUE;
+        now_us = esp_timer_get_time();
+    }
+
+    xSemaphoreTake(spi_mutex, portMAX_DELAY);
+    pending = false;
+    Result result = outcome;
+    int64_t done_us = answered_us;
+    xSemaphoreGive(spi_mutex);
+
+    uint32_t latency = (uint32_t)((result == Result::GRANTED ? done_us : now_us) - start_us);
+    if (result == Result::GRANTED) {
+        record(latency);
+        if (done_us > deadline_us) {
+            result = Result::OVER_BUDGET;
+            over_budget.inc();
+        }
+    } else if (result == Result::TIMEOUT) {
+        if (!any_sent) {
+            result = Result::SEND_FAILED;
+        } else {
+            timeouts.inc();
+        }
+    }
+
+    if (result == Result::GRANTED) {
+        granted.inc();
+        if (report) {
+            printf("{\"auth\":\"granted\",\"peer\":\"%02X\",\"latency_us\":%" PRIu32 ",\"attempts\":%" PRIu32
+                   ",\"budget_ms\":%" PRIu32 "}\n",
+                   peer, latency, attempts, budget_ms);
+        }
+    } else {
+        refused.inc();
+        if (report) {
+            printf("{\"auth\":\"refused\",\"reason\":\"%s\",\"peer\":\"%02X\",\"latency_us\":%" PRIu32
+                   ",\"attempts\":%" PRIu32 ",\"budget_ms\":%" PRIu32 "}\n",
+                   result_name(result), peer, latency, attempts, budget_ms);
+        }
+    }
+    return result;
+}
+
+// Nearest rank over the retained samples
+uint32_t Authenticator::percentile_us(uint32_t percent) const {
+    if (latency_count == 0) {
+        return 0;
+    }
+    uint32_t sorted[LATENCY_SAMPLES];
+    for (size_t i = 0; i < latency_count; i++) {
+        uint32_t value = latencies[i];
+        size_t j = i;
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    size_t rank = (latency_count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void Authenticator::print_status() {
+    if (role == Role::RESPONDER) {
+        printf("{\"auth\":\"status\",\"role\":\"%s\",\"sa\":\"%02X\",\"peer\":\"%02X\",\"key\":\"%s\",\"counter\":%" PRIu32
+               ",\"responses\":%" PRIu32 ",\"tx_failed\":%" PRIu32 "}\n",
+               ROLE_NAMES[(size_t)role], source_address, peer, BusKey::state_name(key_state), counter, responses.value(),
+               tx_failed.value());
+        return;
+    }
+    printf("{\"auth\":\"status\",\"role\":\"%s\",\"sa\":\"%02X\",\"peer\":\"%02X\",\"key\":\"%s\",\"budget_ms\":%" PRIu32
+           ",\"attempt_ms\":%" PRIu32 ",\"granted\":%" PRIu32 ",\"refused\":%" PRIu32 ",\"samples\":%u,\"p50_us\":%" PRIu32
+           ",\"p90_us\":%" PRIu32 ",\"p99_us\":%" PRIu32 ",\"max_us\":%" PRIu32 "}\n",
+           ROLE_NAMES[(size_t)role], source_address, peer, BusKey::state_name(key_state), budget_ms, budget_ms / ATTEMPTS,
+           granted.value(), refused.value(), (unsigned int)latency_count, percentile_us(50), percentile_us(90),
+           percentile_us(99), percentile_us(100));
+}
+
+bool Authenticator::execute(const char* command) {
+    if (strncmp(command, "budget,", 7) == 0) {
+        uint32_t ms = (uint32_t)strtoul(command + 7, NULL, 10);
+        if (ms < MIN_BUDGET_MS || ms > MAX_BUDGET_MS) {
+            printf("{\"auth\":\"error\",\"reason\":\"budget %" PRIu32 "..%" PRIu32 " ms\"}\n", MIN_BUDGET_MS,
+                   MAX_BUDGET_MS);
+            return false;
+        }
+        budget_ms = ms;
+    } else if (strncmp(command, "test,", 5) == 0) {
+        uint32_t count = (uint32_t)strtoul(command + 5, NULL, 10);
+        if (role != Role::VERIFIER || count == 0 || count > MAX_TEST_COUNT) {
+            printf("{\"auth\":\"error\",\"reason\":\"test needs a verifier and 1..%" PRIu32 " starts\"}\n",
+                   MAX_TEST_COUNT);
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            authorise(false);
+            vTaskDelay(1);
+        }
+    } else if (strcmp(command, "reset") == 0) {
+        latency_count = 0;
+        latency_next = 0;
+    } else if (strcmp(command, "status") != 0) {
+        printf("{\"auth\":\"error\",\"usage\":\"status|budget,<ms>|test,<n>|reset\"}\n");
+        return false;
+    }
+    print_status();
+    return true;
+}
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "can_controller.h"
+#include "budget.h"
+
+namespace Slcan {
+
+    constexpr char CR = '\r';
+    constexpr char BELL = '\a';
+
+    // Longest command: "T1FFFFFFF8" + 16 data digits + 4 timestamp digits
+    constexpr size_t MAX_COMMAND_LEN = 32;
+    constexpr size_t TX_BATCH_SIZE = 1024;
+    constexpr uint32_t TIMESTAMP_WRAP_MS = 60000;
+
+    constexpr const char* HARDWARE_VERSION = "10";
+    constexpr const char* SOFTWARE_VERSION = "13";
+    constexpr const char* SERIAL_NUMBER = "J939";
+
+    // LAWICEL/SLCAN protocol adapter on top of the CAN controller driver
+    // (MCP2515 or TWAI, see can_controller.h).
+    //
+    // Bytes from the host are fed in with feed(); received CAN frames are
+    // added with on_frame(). Everything going back to the host is collected in
+    // one batch buffer and written to the UART by flush(), so a burst of frames
+    // drained from the controller costs a single uart_write_bytes call.
+    class Adapter {
+    public:
+        Adapter(CanController* mcp, SemaphoreHandle_t spi_mutex, uart_port_t uart, CAN_CLOCK clock = MCP_8MHZ);
+        ~Adapter();
+
+        bool init();
+
+        void feed(const uint8_t* data, size_t len);
+        void on_frame(const can_frame* frame);
+        void flush();
+
+        bool is_open() const { return channel_open; }
+
+    private:
+        void execute(const char* cmd, size_t len);
+        bool set_bitrate(char code);
+        bool open_channel(bool listen_only);
+        bool close_channel();
+        bool transmit(const char* cmd, size_t len, bool extended, bool rtr);
+        uint8_t status_flags();
+
+        void flush_locked();
+        void reply(const char* text, size_t len);
+        void reply_ok() { reply(&CR, 1); }
+        void reply_error() { reply(&BELL, 1); }
+
+        CanController* mcp2515;
+        SemaphoreHandle_t spi_mutex;
+        SemaphoreHandle_t tx_mutex;
+        Budget::StaticMutex tx_mutex_memory;
+        uart_port_t uart_num;
+
+        char command[MAX_COMMAND_LEN];
+        size_t command_len;
+
+        uint8_t tx_batch[TX_BATCH_SIZE];
+        size_t tx_len;
+
+        CAN_CLOCK can_clock;
+        CAN_SPEED bitrate;
+        bool channel_open;
+        bool listen_only;
+        bool timestamps;
+        char hex_pairs[256][2];
+    };
+
+}
@@ -0,0 +1,382 @@
+/**
+ * @file slcan.cpp
+ * @brief SLCAN (LAWICEL) serial protocol adapter for the MCP2515
+ * @version 1.0
+ *
+ * Implements the ASCII protocol spoken by LAWICEL CAN232/CANUSB adapters so
+ * the sniffer node can be attached to Linux with `slcand` and used through
+ * SocketCAN (candump, cansniffer, kernel J1939 sockets, ...):
+ *
+ *   slcand -o -s6 -t sw -S 921600 /dev/ttyUSB0 can0
+ *   ip link set can0 up
+ *
+ * Supported commands (all terminated by CR):
+ * - Sn      set bitrate (S0=10k S1=20k S2=50k S3=100k S4=125k S5=250k
+ *           S6=500k S8=1M; S7=800k is not supported by the MCP2515 tables)
+ * - O / L   open the channel in normal / listen-only mode
+ * - C       close the channel
+ * - tiiildd... / Tiiiiiiiildd...   transmit standard / extended frame
+ * - riiil / Riiiiiiiil             transmit standard / extended RTR frame
+ * - Zn      timestamps off (Z0) / on (Z1), 16 bit milliseconds mod 60000
+ * - F       read status flags
+ * - V / v / N   hardware+software version, software version, serial number
+ * - M / m   acceptance code and mask, accepted but ignored
+ *
+ * Successful commands are answered with CR, failed ones with BELL.
+ *
+ */
+
+#include "slcan.h"
+#include "mcp2515/can.h"
+#include "esp_log.h"
+#include <string.h>
+
+namespace Slcan {
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool parse_hex(const char *text, size_t digits, uint32_t *value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < digits; i++) {
+        int nibble = hex_value(text[i]);
+        if (nibble < 0) {
+            return false;
+        }
+        result = (result << 4) | nibble;
+    }
+    *value = result;
+    return true;
+}
+
+Adapter::Adapter(CanController *mcp, SemaphoreHandle_t spi_mutex, uart_port_t uart, CAN_CLOCK clock)
+    : mcp2515(mcp),
+      spi_mutex(spi_mutex),
+      uart_num(uart),
+      command_len(0),
+      tx_len(0),
+      can_clock(clock),
+      bitrate(CAN_500KBPS),
+      channel_open(false),
+      listen_only(false),
+      timestamps(false) {
+    tx_mutex = tx_mutex_memory.create();
+
+    static const char digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 256; i++) {
+        hex_pairs[i][0] = digits[i >> 4];
+        hex_pairs[i][1] = digits[i & 0x0F];
+    }
+}
+
+Adapter::~Adapter() {
+    if (tx_mutex) {
+        vSemaphoreDelete(tx_mutex);
+    }
+}
+
+bool Adapter::init() {
+    return (tx_mutex != NULL);
+}
+
+void Adapter::feed(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = (char)data[i];
+        if (c == '\n') {
+            continue;
+        }
+        if (c == CR) {
+            if (command_len < MAX_COMMAND_LEN) {
+                command[command_len] = '\0';
+            }
+            execute(command, command_len);
+            command_len = 0;
+        } else if (command_len < MAX_COMMAND_LEN - 1) {
+            command[command_len++] = c;
+        } else {
+            // Overlong command, drop it and report the error at its terminator
+            command_len = MAX_COMMAND_LEN;
+        }
+    }
+    flush();
+}
+
+void Adapter::execute(const char *cmd, size_t len) {
+    if (len == 0) {
+        reply_ok();
+        return;
+    }
+    if (len >= MAX_COMMAND_LEN) {
+        reply_error();
+        return;
+    }
+
+    char text[16];
+    switch (cmd[0]) {
+    case 'S':
+        if (len == 2 && !channel_open && set_bitrate(cmd[1])) {
+            reply_ok();
+        } else {
+            reply_error();
+        }
+        break;
+    case 'O':
+    case 'L':
+        if (open_channel(cmd[0] == 'L')) {
+            reply_ok();
+        } else {
+            reply_error();
+        }
+        break;
+    case 'C':
+        close_channel();
+        reply_ok();
+        break;
+    case 't':
+    case 'T':
+    case 'r':
+    case 'R': {
+        bool extended = (cmd[0] == 'T' || cmd[0] == 'R');
+        bool rtr = (cmd[0] == 'r' || cmd[0] == 'R');
+        if (transmit(cmd, len, extended, rtr)) {
+            reply(extended ? "Z\r" : "z\r", 2);
+        } else {
+            reply_error();
+        }
+        break;
+    }
+    case 'Z':
+        if (len == 2 && (cmd[1] == '0' || cmd[1] == '1')) {
+            timestamps = (cmd[1] == '1');
+            reply_ok();
+        } else {
+            reply_error();
+        }
+        break;
+    case 'F': {
+        uint8_t flags = status_flags();
+        text[0] = 'F';
+        memcpy(&text[1], hex_pairs[flags], 2);
+        text[3] = CR;
+        reply(text, 4);
+        break;
+    }
+    case 'V':
+        text[0] = 'V';
+        memcpy(&text[1], HARDWARE_VERSION, 2);
+        memcpy(&text[3], SOFTWARE_VERSION, 2);
+        text[5] = CR;
+        reply(text, 6);
+        break;
+    case 'v':
+        text[0] = 'v';
+        memcpy(&text[1], SOFTWARE_VERSION, 2);
+        text[3] = CR;
+        reply(text, 4);
+        break;
+    case 'N':
+        text[0] = 'N';
+        memcpy(&text[1], SERIAL_NUMBER, 4);
+        text[5] = CR;
+        reply(text, 6);
+        break;
+    case 'M':
+    case 'm':
+        reply_ok();
+        break;
+    default:
+        reply_error();
+        break;
+    }
+}
+
+bool Adapter::set_bitrate(char code) {
+    static const int8_t speeds[] = {
+        CAN_10KBPS, CAN_20KBPS, CAN_50KBPS, CAN_100KBPS, CAN_125KBPS,
+        CAN_250KBPS, CAN_500KBPS, -1, CAN_1000KBPS
+    };
+
+    if (code < '0' || code > '8' || speeds[code - '0'] < 0) {
+        return false;
+    }
+    bitrate = (CAN_SPEED)speeds[code - '0'];
+    return true;
+}
+
+bool Adapter::open_channel(bool listen) {
+    if (channel_open) {
+        return false;
+    }
+
+    bool ok = false;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        ok = (mcp2515->setBitrate(bitrate, can_clock) == CanController::ERROR_OK);
+        if (ok) {
+            ok = ((listen ? mcp2515->setListenOnlyMode() : mcp2515->setNormalMode()) == CanController::ERROR_OK);
+        }
+        mcp2515->clearRXnOVR();
+        xSemaphoreGive(spi_mutex);
+    }
+
+    channel_open = ok;
+    listen_only = listen;
+    return ok;
+}
+
+bool Adapter::close_channel() {
+    channel_open = false;
+    bool ok = false;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        ok = (mcp2515->setConfigMode() == CanController::ERROR_OK);
+        xSemaphoreGive(spi_mutex);
+    }
+    return ok;
+}
+
+bool Adapter::transmit(const char *cmd, size_t len, bool extended, bool rtr) {
+    if (!channel_open || listen_only) {
+        return false;
+    }
+
+    size_t id_digits = extended ? 8 : 3;
+    if (len < 1 + id_digits + 1) {
+        return false;
+    }
+
+    uint32_t id;
+    if (!parse_hex(&cmd[1], id_digits, &id)) {
+        return false;
+    }
+    if (id > (extended ? CAN_EFF_MASK : CAN_SFF_MASK)) {
+        return false;
+    }
+
+    int dlc = hex_value(cmd[1 + id_digits]);
+    if (dlc < 0 || dlc > CAN_MAX_DLEN) {
+        return false;
+    }
+
+    can_frame frame;
+    frame.can_id = id | (extended ? CAN_EFF_FLAG : 0) | (rtr ? CAN_RTR_FLAG : 0);
+    frame.can_dlc = dlc;
+
+    const char *payload = &cmd[2 + id_digits];
+    if (!rtr) {
+        if (len != 2 + id_digits + dlc * 2) {
+            return false;
+        }
+        for (int i = 0; i < dlc; i++) {
+            uint32_t byte;
+            if (!parse_hex(&payload[i * 2], 2, &byte)) {
+                return false;
+            }
+            frame.data[i] = byte;
+        }
+    } else if (len != 2 + id_digits) {
+        return false;
+    }
+
+    bool sent = false;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        sent = (mcp2515->sendMessage(&frame) == CanController::ERROR_OK);
+        xSemaphoreGive(spi_mutex);
+    }
+    return sent;
+}
+
+uint8_t Adapter::status_flags() {
+    uint8_t eflg = 0;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        eflg = mcp2515->getErrorFlags();
+        xSemaphoreGive(spi_mutex);
+    }
+
+    // LAWICEL status bits: 0 RX FIFO full, 2 error warning, 3 data overrun,
+    // 5 error passive, 7 bus error
+    uint8_t flags = 0;
+    if (eflg & (CanController::EFLG_RX0OVR | CanController::EFLG_RX1OVR)) flags |= (1 << 0) | (1 << 3);
+    if (eflg & CanController::EFLG_EWARN) flags |= (1 << 2);
+    if (eflg & (CanController::EFLG_TXEP | CanController::EFLG_RXEP)) flags |= (1 << 5);
+    if (eflg & CanController::EFLG_TXBO) flags |= (1 << 7);
+    return flags;
+}
+
+void Adapter::on_frame(const can_frame *frame) {
+    if (!channel_open) {
+        return;
+    }
+
+    // 'T' + 8 id + dlc + 16 data + 4 timestamp + CR
+    uint8_t line[31];
+    uint8_t *p = line;
+
+    bool extended = (frame->can_id & CAN_EFF_FLAG);
+    bool rtr = (frame->can_id & CAN_RTR_FLAG);
+    uint8_t dlc = frame->can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->can_dlc;
+
+    if (extended) {
+        uint32_t id = frame->can_id & CAN_EFF_MASK;
+        *p++ = rtr ? 'R' : 'T';
+        memcpy(p, hex_pairs[(id >> 24) & 0xFF], 2);
+        memcpy(p + 2, hex_pairs[(id >> 16) & 0xFF], 2);
+        memcpy(p + 4, hex_pairs[(id >> 8) & 0xFF], 2);
+        memcpy(p + 6, hex_pairs[id & 0xFF], 2);
+        p += 8;
+    } else {
+        uint32_t id = frame->can_id & CAN_SFF_MASK;
+        *p++ = rtr ? 'r' : 't';
+        *p++ = hex_pairs[(id >> 8) & 0x0F][1];
+        memcpy(p, hex_pairs[id & 0xFF], 2);
+        p += 2;
+    }
+
+    *p++ = '0' + dlc;
+    if (!rtr) {
+        for (uint8_t i = 0; i < dlc; i++) {
+            memcpy(p, hex_pairs[frame->data[i]], 2);
+            p += 2;
+        }
+    }
+
+    if (timestamps) {
+        uint16_t ts = esp_log_timestamp() % TIMESTAMP_WRAP_MS;
+        memcpy(p, hex_pairs[ts >> 8], 2);
+        memcpy(p + 2, hex_pairs[ts & 0xFF], 2);
+        p += 4;
+    }
+    *p++ = CR;
+
+    reply((const char *)line, p - line);
+}
+
+void Adapter::reply(const char *text, size_t len) {
+    if (xSemaphoreTake(tx_mutex, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+    if (tx_len + len > TX_BATCH_SIZE) {
+        flush_locked();
+    }
+    memcpy(&tx_batch[tx_len], text, len);
+    tx_len += len;
+    xSemaphoreGive(tx_mutex);
+}
+
+void Adapter::flush() {
+    if (xSemaphoreTake(tx_mutex, portMAX_DELAY) == pdTRUE) {
+        flush_locked();
+        xSemaphoreGive(tx_mutex);
+    }
+}
+
+void Adapter::flush_locked() {
+    if (tx_len > 0) {
+        uart_write_bytes(uart_num, tx_batch, tx_len);
+        tx_len = 0;
+    }
+}
+
+}
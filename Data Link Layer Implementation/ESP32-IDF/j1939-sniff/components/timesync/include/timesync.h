@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "can_controller.h"
+#include "mcp2515/can.h"
+#include "budget.h"
+
+namespace TimeSync {
+
+    // Proprietary B, to all nodes, so address filters pass them. Priority 3
+    // puts them ahead of the default priority 6 traffic in arbitration.
+    constexpr uint32_t PGN_SYNC = 0xFF60;
+    constexpr uint32_t PGN_FOLLOW_UP = 0xFF61;
+    constexpr uint8_t PRIORITY = 3;
+
+    // SYNC:      seq, 7 bytes 0xFF
+    // FOLLOW_UP: seq, the time the SYNC with that seq left the master on the
+    //            master's clock (µs, LE56)
+    constexpr size_t FRAME_SIZE = 8;
+
+    constexpr uint32_t DEFAULT_PERIOD_MS = 1000;
+    constexpr uint32_t MIN_PERIOD_MS = 100;
+    constexpr uint32_t TX_TIMEOUT_US = 5000;
+
+    // Servo: a follower off by more than STEP_THRESHOLD_US jumps to the
+    // master's time; below it, it corrects 1/KP_DIVISOR of the offset and
+    // 1/KI_DIVISOR of the frequency error per sample
+    constexpr int64_t STEP_THRESHOLD_US = 1000;
+    constexpr int64_t KP_DIVISOR = 2;
+    constexpr int64_t KI_DIVISOR = 4;
+    constexpr int32_t MAX_DRIFT_PPB = 500000;       // ±500 ppm, far beyond any crystal
+
+    // Samples further apart do not give a usable first drift estimate, and a
+    // master silent this long may be replaced by another
+    constexpr uint32_t MAX_SAMPLE_INTERVAL_MS = 10000;
+    constexpr uint32_t MASTER_TIMEOUT_MS = 5000;
+
+    constexpr uint32_t TASK_STACK_SIZE = 3072;
+    constexpr UBaseType_t TASK_PRIORITY = 8;        // below the J1939 receiver
+
+    enum class Role : uint8_t {
+        OFF,
+        MASTER,
+        FOLLOWER
+    };
+
+    // Bus time shared by all nodes (SyncClock), two-step as in IEEE 1588.
+    //
+    // The master sends SYNC from its own task, takes the time the frame
+    // completed from the CAN controller's transmit interrupt and sends that
+    // time in a FOLLOW_UP. Followers take the receive interrupt time of the
+    // SYNC, and with the FOLLOW_UP have one (local, master) pair per period;
+    // a PI servo turns the pairs into the offset and drift of SyncClock.
+    // Both timestamps are taken at the end of the same frame, so the frame
+    // time on the bus cancels out.
+    //
+    // on_frame() runs on the receiver task under the SPI mutex, which also
+    // covers role changes and the status from execute().
+    class Synchronizer {
+    public:
+        Synchronizer(CanController* can, SemaphoreHandle_t spi_mutex, uint8_t source_addr);
+        ~Synchronizer();
+
+        bool init(Role role);
+
+        // Every received frame before it is decoded. rx_us is the time of
+        // the interrupt that announced it, 0 if it was not the first frame
+        // read after one. Returns true for SYNC and FOLLOW_UP frames.
+        bool on_frame(const can_frame* frame, int64_t rx_us);
+
+        // From {"c":"time","d":"..."}: "master[,<period ms>]", "follow",
+        // "off" or "status"
+        bool execute(const char* command);
+
+    private:
+        static void task_entry(void* arg);
+        void task_loop();
+        void send_sync();
+
+        void set_role(Role next);
+        void sample(int64_t rx_local_us, int64_t master_us);
+        void print_status();
+
+        CanController* can;
+        SemaphoreHandle_t spi_mutex;
+        uint8_t source_address;
+        TaskHandle_t task;
+        Budget::StaticTask<TASK_STACK_SIZE> task_memory;
+
+        volatile Role role;
+        volatile uint32_t period_ms;
+        uint8_t seq;
+
+        // Follower
+        uint8_t master;
+        uint32_t last_sample_ms;
+        bool pending;                   // SYNC received, FOLLOW_UP expected
+        uint8_t pending_seq;
+        int64_t pending_rx_us;          // 0: the SYNC has no interrupt time
+        bool locked;
+        bool have_previous;
+        int64_t last_local_us;
+        int64_t last_master_us;
+        int64_t drift_ppb;
+        int64_t last_error_us;
+        uint32_t sample_count;
+    };
+
+}
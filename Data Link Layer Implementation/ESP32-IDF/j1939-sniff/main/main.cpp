@@ -14,20 +14,94 @@
  * - Interrupt-driven CAN message reception
  * - Message queuing system with timeout handling
  * - JSON output format for received messages
+ * - Raw frame capture as candump log lines or a PCAP stream
+ * - SLCAN (LAWICEL) mode for use as a Linux SocketCAN adapter via slcand
  * 
  * Hardware configuration:
  * - ESP32 connected to MCP2515 CAN controller via SPI
  * - SPI pins: MISO=GPIO19, MOSI=GPIO23, CLK=GPIO18, CS=GPIO5
  * - Interrupt pin: GPIO21
+ * TWAI instead (CAN controller in menuconfig): TX=GPIO25, RX=GPIO26 to a
+ *   3.3 V transceiver
  * 
  * The program processes serial inputs via UART:
- * - Format: [pgn_index,]message
+ * - Format: [@XX,][pgn_index,]message
+ * - Optional @XX sends peer-to-peer (PDU1) PGNs to address XX (hex) instead
+ *   of all nodes; the sniffer itself keeps receiving every frame
  * - Optional pgn_index (1-3) selects PGN type:
  *   1=PEER_TO_PEER, 2=GROUP_MESSAGE, 3=EXTRA
  * - Messages ≤8 bytes sent as single frame
  * - Messages >8 bytes sent using transport protocol (multi-frame)
  * 
- * All received CAN messages are output in JSON format for easy parsing.
+ * JSON commands of the form {"c":"command","d":"data"} control the sniffer:
+ * - "fmt" selects the output format: "json", "candump" or "pcap"
+ *   (candump and pcap stream every raw frame with a µs timestamp and
+ *    silence ESP_LOG output so the stream stays parseable; the UART moves
+ *    to CAPTURE_UART_BAUD and the stream starts CAPTURE_SETTLE_MS later,
+ *    "json" returns to CONSOLE_UART_BAUD)
+ * - "mode" with "slcan" hands the UART to the SLCAN protocol at
+ *   SLCAN_UART_BAUD until the next reset
+ * - "pm" drives the payload anomaly model: "learn", "enforce", "off",
+ *   "clear", "dump" (prints the trained model as hex blob chunks) and a
+ *   chunked upload of a host-trained model: "begin", "+<hex>"..., "commit"
+ *   (see Test scripts/train_payload_model.py)
+ * 
+ * - "al" drives the (SA, PGN, DLC) allowlist: "learn" records every tuple
+ *   and its period, "freeze" builds the perfect-hashed table, stores it in
+ *   NVS and starts enforcing, "enforce" / "off", "erase", "status". A
+ *   stored allowlist is enforced from boot.
+ * - "skew" with "on" / "off" / "clear" / "status" runs the per-(PGN, SA)
+ *   clock skew fingerprinting; "status" prints the nominal period, skew
+ *   and offset of every tracked sender
+ * - "rules" loads a rule set compiled by Test scripts/rule_compiler.py
+ *   ("begin", "+<hex>"..., "commit"), or "clear" / "list" it
+ * - "state" with "<bit>=<0|1>" sets one of the 8 rule engine state bits
+ * - "trace" with "on" / "off" / "clear" / "dump" records the decode stages
+ *   of traced BAMs from other nodes; "dump" prints Chrome trace JSON
+ *   (see Test scripts/trace_capture.py)
+ * - "prof" with "dump" / "reset" / "dump,reset" prints the per-function
+ *   cycle histograms of a CONFIG_DIAG_PROFILE build
+ * - "sched" with "start" / "stop" / "dump" records task switches, blocking
+ *   and mutex holds of an idf.py -DSCHED_TRACE=ON build; "dump" prints
+ *   Chrome trace JSON
+ * - "stats" with "dump" / "reset" / "dump,reset" prints the driver, J1939,
+ *   queue and GPIO counters and histograms, one JSON line per subsystem;
+ *   "push,<ms>" repeats the dump periodically, "push,0" stops
+ * - "mem" prints the free heap, its low-water mark and largest block, the
+ *   stack high-water mark of every task and the heap accounts with their
+ *   compile-time limits
+ * - "flash" with "start[,<ms>]" / "stop" writes NVS in the background to
+ *   measure the receive latency ("rx" in "stats") while flash is busy, e.g.
+ *   to compare builds with and without CONFIG_DIAG_HOT_PATH_IRAM
+ * - "rx" injects frames from the host as if they had been received, in
+ *   candump syntax separated by spaces ("18FEF100#0102 18ECFF0B#20..."), for
+ *   capture replays (see Test scripts/capture_replay.py). "stats" prints the
+ *   injected frame count, CPU time per frame and free heap, "reset" clears
+ *   them. Injection needs the JSON output format.
+ * - "time" with "follow" / "master[,<ms>]" / "off" / "status" sets the
+ *   node's part in the bus time sync; it follows the bus master from
+ *   start-up and, once synchronised, stamps messages and alerts with the
+ *   bus time in "t"
+ * - "hb" with "status" / "expect,<SA>" / "forget,<SA>" shows and edits the
+ *   table of heartbeat peers; the sniffer only listens to heartbeats
+ * - "key" with "<32 hex digits>" / "clear" stores the bus key that
+ *   authenticates them, used from the next start; on the built-in default
+ *   peers are only "unverified", never "alive"
+ * 
+ * Rules are evaluated on every frame before any output and can alert, drop
+ * the frame from the output, forward it to the host as {"forward":...},
+ * emit the KLE "np" SMS command, pulse a GPIO or update the state bits.
+ * 
+ * In enforce mode frames that break the learned payload profile of their
+ * (PGN, SA) are reported as {"alert":"payload","reason":...} lines, and
+ * tuples missing from the allowlist or arriving too fast as
+ * {"alert":"allowlist","reason":...} lines. Senders whose clock skew
+ * suddenly changes are reported as {"alert":"skew",...}; receive times come
+ * from the MCP2515 interrupt so the skew estimate sees µs timestamps. Nodes
+ * whose heartbeats stop, or come without a valid token, are reported as
+ * {"alert":"heartbeat",...}.
+ * 
+ * By default all received CAN messages are output in JSON format for easy parsing.
  * 
  * The complete component can be found at:
  * https://github.com/Isuru-rana/J1939-21-MCP2515-ESPIDF-Component
@@ -36,6 +110,7 @@
 
 #include <esp_log.h>
 #include <nvs_flash.h>
+#include <nvs.h>
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
@@ -43,16 +118,39 @@
 #include "freertos/queue.h"
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <vector>
 #include <map>
 #include "driver/uart.h"
 #include "esp_vfs_dev.h"
-#include "mcp2515/mcp2515.h"
+#include "can_controller.h"
 #include "mcp2515/can.h"
 #include "j1939.h"
+#include "trace.h"
+#include "profile.h"
+#include "sched_trace.h"
+#include "metrics.h"
+#include "budget.h"
+#include "hot_path.h"
+#include "flash_stress.h"
+#include "capture.h"
+#include "slcan.h"
+#include "payload_model.h"
+#include "allowlist.h"
+#include "clock_skew.h"
+#include "rules.h"
+#include "timesync.h"
+#include "sync_clock.h"
+#include "heartbeat.h"
+#include "bus_key.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "cJSON.h"
 
 const char *TAG = "j1939_sniffer";
 #define SOURCE_ADDR 0x72
+#define BUS_BITRATE 500000      // matches CAN_500KBPS below
 #define PIN_NUM_MISO 19
 #define PIN_NUM_MOSI 23
 #define PIN_NUM_CLK 18
@@ -60,21 +158,759 @@ const char *TAG = "j1939_sniffer";
 #define PIN_NUM_INT GPIO_NUM_21
 #define UART_NUM UART_NUM_0
 #define BUF_SIZE 1024
+#define UART_TX_BUF_SIZE 8192    // candump/PCAP stream, ~90 ms at CAPTURE_UART_BAUD
+#define CAPTURE_BUF_SIZE 512
+#define CONSOLE_UART_BAUD 115200
+#define CAPTURE_UART_BAUD 921600  // ~1800 candump or ~2800 PCAP frames/s
+#define CAPTURE_SETTLE_MS 200     // lets the host follow the baud change
+#define SLCAN_UART_BAUD 921600
+#define SLCAN_READ_SIZE 128
+#define PM_DUMP_CHUNK 128
+#define GPIO_PULSE_PINS 34
+#define IDS_NVS_NAMESPACE "ids"
+#define ALLOWLIST_NVS_KEY "allowlist"
 
 spi_device_handle_t spi_handle;
-MCP2515 *mcp2515;
+CanController *mcp2515;
 SemaphoreHandle_t spi_mutex = NULL;
 static QueueHandle_t gpio_evt_queue = NULL;
 J1939::Controller *j1939_controller = NULL;
 TaskHandle_t receiver_task_handle = NULL;
 TaskHandle_t sender_task_handle = NULL;
 
+static Capture::Encoder capture_encoder;
+static volatile Capture::Format output_format = Capture::Format::JSON;
+static uint8_t capture_buf[CAPTURE_BUF_SIZE];
+static size_t capture_len = 0;
+Slcan::Adapter *slcan_adapter = NULL;
+static volatile bool slcan_mode = false;
+static IDS::PayloadModel payload_model;
+static IDS::Allowlist allowlist;
+static IDS::ClockSkew clock_skew;
+static std::vector<uint8_t> blob_upload;
+Rules::Engine *rules_engine = NULL;
+TimeSync::Synchronizer *synchronizer = NULL;
+Heartbeat::Monitor *heartbeat = NULL;
+static esp_timer_handle_t gpio_pulse_timers[GPIO_PULSE_PINS] = {};
+static uint32_t inject_frames = 0;
+static uint64_t inject_cpu_us = 0;
+static uint32_t inject_cpu_max_us = 0;
+
 void receiver_task(void *pvParameters);
 void sender_task(void *pvParameters);
+void handle_frame(const can_frame *frame, Capture::Format format, int64_t rx_time);
 
+static int32_t queue_depth(void *queue) {
+    QueueHandle_t handle = *(QueueHandle_t *)queue;
+    return handle ? (int32_t)uxQueueMessagesWaiting(handle) : 0;
+}
+
+static Metrics::Counter can_interrupts("gpio", "can_interrupts");
+static Metrics::Gauge gpio_evt_depth("queue", "gpio_evt", queue_depth, &gpio_evt_queue);
+static Metrics::Counter gpio_evt_full("queue", "gpio_evt_full");
+static Metrics::Gauge tx_pending("queue", "tx_pending");
+static Metrics::Counter tx_expired("queue", "tx_expired");
+static const uint32_t RX_LATENCY_US[] = {100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+static Metrics::Histogram rx_latency_us("rx", "latency_us", RX_LATENCY_US);     // interrupt to first frame decoded
+
+// Stacks, queue storage and the SPI mutex are reserved at link time; what
+// still comes from the heap is charged to an account reported by "mem"
+static Budget::StaticTask<4096> receiver_task_memory;
+static Budget::StaticTask<4096> sender_task_memory;
+static Budget::StaticQueue<int64_t, 10> gpio_evt_queue_memory;
+static Budget::StaticMutex spi_mutex_memory;
+static Budget::Account uart_tx_heap("uart_tx", 16 * 1024);   // sender backlog
+static Budget::Account cjson_heap("cjson", 4 * 1024);        // one command's tree
+
+static void *cjson_malloc(size_t size) {
+    return cjson_heap.malloc(size);
+}
+
+static void cjson_free(void *ptr) {
+    cjson_heap.free(ptr);
+}
+
+// Queues the interrupt time so frames are timestamped at reception rather
+// than when the receiver task gets to them
 static void IRAM_ATTR gpio_isr_handler(void *arg) {
-    uint32_t gpio_num = (uint32_t)arg;
-    xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
+    SchedTrace::isr_enter();
+    Trace::isr();
+    MCP2515::onInterrupt();
+    can_interrupts.inc();
+    int64_t rx_time = esp_timer_get_time();
+    if (xQueueSendFromISR(gpio_evt_queue, &rx_time, NULL) != pdTRUE) {
+        gpio_evt_full.inc();
+    }
+    SchedTrace::isr_exit();
+}
+
+#if CONFIG_CAN_BACKEND_TWAI
+// Receive alert of the TWAI backend, queued like the INT pin interrupt
+static void can_rx_notify(void *arg, int64_t time_us) {
+    can_interrupts.inc();
+    int64_t rx_time = time_us;
+    if (xQueueSend(gpio_evt_queue, &rx_time, 0) != pdTRUE) {
+        gpio_evt_full.inc();
+    }
+}
+#endif
+
+void enter_slcan_mode() {
+    ESP_LOGI(TAG, "Switching to SLCAN mode at %d baud", SLCAN_UART_BAUD);
+    uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+    esp_log_level_set("*", ESP_LOG_NONE);
+    uart_set_baudrate(UART_NUM, SLCAN_UART_BAUD);
+    slcan_mode = true;
+}
+
+bool append_hex(std::vector<uint8_t> &out, const char *hex) {
+    size_t len = strlen(hex);
+    if (len % 2 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i += 2) {
+        char pair[3] = {hex[i], hex[i + 1], '\0'};
+        char *end;
+        unsigned long value = strtoul(pair, &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+        out.push_back((uint8_t)value);
+    }
+    return true;
+}
+
+// Shared staging for chunked blob uploads: "begin", then "+<hex>" chunks;
+// the caller handles "commit". Returns true if the argument was consumed.
+bool blob_upload_step(const char *arg, size_t max_len) {
+    if (strcmp(arg, "begin") == 0) {
+        blob_upload.clear();
+        blob_upload.reserve(max_len);
+        return true;
+    }
+    if (arg[0] != '+') {
+        return false;
+    }
+    if (blob_upload.size() + strlen(arg + 1) / 2 > max_len || !append_hex(blob_upload, arg + 1)) {
+        ESP_LOGW(TAG, "Upload rejected, send \"begin\" again");
+        blob_upload.clear();
+    }
+    return true;
+}
+
+void payload_model_dump() {
+    uint8_t *blob = (uint8_t*)malloc(IDS::PAYLOAD_MODEL_MAX_BLOB);
+    if (!blob) {
+        ESP_LOGE(TAG, "Memory allocation failed");
+        return;
+    }
+
+    size_t len = 0;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        len = payload_model.serialize(blob, IDS::PAYLOAD_MODEL_MAX_BLOB);
+        xSemaphoreGive(spi_mutex);
+    }
+
+    for (size_t offset = 0; offset < len; offset += PM_DUMP_CHUNK) {
+        size_t chunk = (len - offset < PM_DUMP_CHUNK) ? len - offset : PM_DUMP_CHUNK;
+        printf("{\"pm\":\"");
+        for (size_t i = 0; i < chunk; i++) {
+            printf("%02X", blob[offset + i]);
+        }
+        printf("\"}\n");
+    }
+    printf("{\"pm\":\"end\",\"size\":%u}\n", (unsigned)len);
+    free(blob);
+}
+
+void payload_model_command(const char *arg) {
+    if (blob_upload_step(arg, IDS::PAYLOAD_MODEL_MAX_BLOB)) {
+        return;
+    }
+
+    if (strcmp(arg, "learn") == 0 || strcmp(arg, "enforce") == 0 || strcmp(arg, "off") == 0) {
+        IDS::ModelMode mode = IDS::ModelMode::OFF;
+        if (strcmp(arg, "learn") == 0) {
+            mode = IDS::ModelMode::LEARN;
+        } else if (strcmp(arg, "enforce") == 0) {
+            mode = IDS::ModelMode::ENFORCE;
+        }
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            payload_model.set_mode(mode);
+            xSemaphoreGive(spi_mutex);
+            ESP_LOGI(TAG, "Payload model %s (%u profiles)", arg, (unsigned)payload_model.profile_count());
+        }
+    }
+    else if (strcmp(arg, "clear") == 0) {
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            payload_model.clear();
+            xSemaphoreGive(spi_mutex);
+            ESP_LOGI(TAG, "Payload model cleared");
+        }
+    }
+    else if (strcmp(arg, "dump") == 0) {
+        payload_model_dump();
+    }
+    else if (strcmp(arg, "commit") == 0) {
+        bool loaded = false;
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            loaded = payload_model.load(blob_upload.data(), blob_upload.size());
+            xSemaphoreGive(spi_mutex);
+        }
+        if (loaded) {
+            ESP_LOGI(TAG, "Payload model loaded: %u profiles", (unsigned)payload_model.profile_count());
+        } else {
+            ESP_LOGE(TAG, "Invalid payload model blob (%u bytes)", (unsigned)blob_upload.size());
+        }
+        std::vector<uint8_t>().swap(blob_upload);
+    }
+    else {
+        ESP_LOGW(TAG, "Unknown payload model command: %s", arg);
+    }
+}
+
+static void gpio_pulse_end(void *arg) {
+    gpio_set_level((gpio_num_t)(uint32_t)arg, 0);
+}
+
+bool rule_output_pin_ok(uint8_t pin) {
+    // Output capable, not flash (6-11), UART0 (1, 3) or the CAN controller
+    // wiring
+    if (pin >= GPIO_PULSE_PINS || (pin >= 6 && pin <= 11) || pin == 1 || pin == 3) {
+        return false;
+    }
+#if CONFIG_CAN_BACKEND_TWAI
+    return pin != CONFIG_CAN_TWAI_TX_GPIO && pin != CONFIG_CAN_TWAI_RX_GPIO;
+#else
+    return pin != PIN_NUM_MISO && pin != PIN_NUM_MOSI && pin != PIN_NUM_CLK &&
+           pin != PIN_NUM_CS && pin != PIN_NUM_INT;
+#endif
+}
+
+bool prepare_rule_outputs() {
+    for (size_t i = 0; i < rules_engine->rule_count(); i++) {
+        const Rules::Rule &rule = rules_engine->rule(i);
+        if (!(rule.actions & Rules::ACTION_GPIO)) {
+            continue;
+        }
+        if (!rule_output_pin_ok(rule.gpio)) {
+            ESP_LOGE(TAG, "Rule %s uses unavailable GPIO %u", rule.name, rule.gpio);
+            return false;
+        }
+        if (!gpio_pulse_timers[rule.gpio]) {
+            esp_timer_create_args_t timer_args = {};
+            timer_args.callback = gpio_pulse_end;
+            timer_args.arg = (void*)(uint32_t)rule.gpio;
+            timer_args.name = "rule_gpio";
+            if (esp_timer_create(&timer_args, &gpio_pulse_timers[rule.gpio]) != ESP_OK) {
+                return false;
+            }
+            gpio_reset_pin((gpio_num_t)rule.gpio);
+            gpio_set_direction((gpio_num_t)rule.gpio, GPIO_MODE_OUTPUT);
+            gpio_set_level((gpio_num_t)rule.gpio, 0);
+        }
+    }
+    return true;
+}
+
+void rules_command(const char *arg) {
+    if (blob_upload_step(arg, Rules::MAX_BLOB)) {
+        return;
+    }
+
+    if (strcmp(arg, "commit") == 0) {
+        bool loaded = false;
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            loaded = rules_engine->load(blob_upload.data(), blob_upload.size());
+            if (loaded && !prepare_rule_outputs()) {
+                rules_engine->clear();
+                loaded = false;
+            }
+            xSemaphoreGive(spi_mutex);
+        }
+        if (loaded) {
+            ESP_LOGI(TAG, "Rules loaded: %u rules", (unsigned)rules_engine->rule_count());
+        } else {
+            ESP_LOGE(TAG, "Invalid rule blob (%u bytes)", (unsigned)blob_upload.size());
+        }
+        std::vector<uint8_t>().swap(blob_upload);
+    }
+    else if (strcmp(arg, "clear") == 0) {
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            rules_engine->clear();
+            xSemaphoreGive(spi_mutex);
+            ESP_LOGI(TAG, "Rules cleared");
+        }
+    }
+    else if (strcmp(arg, "list") == 0) {
+        for (size_t i = 0; i < rules_engine->rule_count(); i++) {
+            const Rules::Rule &rule = rules_engine->rule(i);
+            printf("{\"rule\":%u,\"name\":\"%s\",\"actions\":%u}\n",
+                   (unsigned)i, rule.name, rule.actions);
+        }
+        printf("{\"state\":%u}\n", rules_engine->get_state());
+    }
+    else {
+        ESP_LOGW(TAG, "Unknown rules command: %s", arg);
+    }
+}
+
+// "<bit>=<0|1>" sets one of the 8 rule engine state bits
+void state_command(const char *arg) {
+    if (arg[0] < '0' || arg[0] > '7' || arg[1] != '=' || (arg[2] != '0' && arg[2] != '1') || arg[3] != '\0') {
+        ESP_LOGW(TAG, "Invalid state command: %s", arg);
+        return;
+    }
+    uint8_t bit = 1 << (arg[0] - '0');
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        uint8_t state = rules_engine->get_state();
+        rules_engine->set_state(arg[2] == '1' ? (state | bit) : (state & ~bit));
+        xSemaphoreGive(spi_mutex);
+    }
+}
+
+bool allowlist_save() {
+    uint8_t *blob = (uint8_t*)malloc(IDS::ALLOWLIST_MAX_BLOB);
+    if (!blob) {
+        ESP_LOGE(TAG, "Memory allocation failed");
+        return false;
+    }
+
+    size_t len = 0;
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        len = allowlist.serialize(blob, IDS::ALLOWLIST_MAX_BLOB);
+        xSemaphoreGive(spi_mutex);
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = ESP_FAIL;
+    if (len > 0 && nvs_open(IDS_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        err = nvs_set_blob(nvs, ALLOWLIST_NVS_KEY, blob, len);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    free(blob);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store allowlist: %d", err);
+        return false;
+    }
+    return true;
+}
+
+// Called from app_main before the tasks start, so no locking is needed
+bool allowlist_restore() {
+    nvs_handle_t nvs;
+    if (nvs_open(IDS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+
+    bool loaded = false;
+    size_t len = IDS::ALLOWLIST_MAX_BLOB;
+    uint8_t *blob = (uint8_t*)malloc(len);
+    if (blob && nvs_get_blob(nvs, ALLOWLIST_NVS_KEY, blob, &len) == ESP_OK) {
+        loaded = allowlist.load(blob, len);
+    }
+    free(blob);
+    nvs_close(nvs);
+    return loaded;
+}
+
+void allowlist_command(const char *arg) {
+    if (strcmp(arg, "learn") == 0) {
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            allowlist.clear();
+            allowlist.set_mode(IDS::ModelMode::LEARN);
+            xSemaphoreGive(spi_mutex);
+            ESP_LOGI(TAG, "Allowlist learning started");
+        }
+    }
+    else if (strcmp(arg, "freeze") == 0) {
+        bool frozen = false;
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            frozen = allowlist.freeze();
+            if (frozen) {
+                allowlist.set_mode(IDS::ModelMode::ENFORCE);
+            }
+            xSemaphoreGive(spi_mutex);
+        }
+        if (frozen && allowlist_save()) {
+            ESP_LOGI(TAG, "Allowlist frozen: %u tuples, %u dropped, enforcing",
+                     (unsigned)allowlist.entry_count(), (unsigned)allowlist.overflow_count());
+        } else if (!frozen) {
+            ESP_LOGE(TAG, "Allowlist freeze failed (%u tuples learned)", (unsigned)allowlist.learned_count());
+        }
+    }
+    else if (strcmp(arg, "enforce") == 0 || strcmp(arg, "off") == 0) {
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            bool enforce = strcmp(arg, "enforce") == 0;
+            if (enforce && !allowlist.is_frozen()) {
+                ESP_LOGW(TAG, "Allowlist is not frozen");
+            } else {
+                allowlist.set_mode(enforce ? IDS::ModelMode::ENFORCE : IDS::ModelMode::OFF);
+            }
+            xSemaphoreGive(spi_mutex);
+        }
+    }
+    else if (strcmp(arg, "erase") == 0) {
+        if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+            allowlist.clear();
+            allowlist.set_mode(IDS::ModelMode::OFF);
+            xSemaphoreGive(spi_mutex);
+        }
+        nvs_handle_t nvs;
+        if (nvs_open(IDS_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+            nvs_erase_key(nvs, ALLOWLIST_NVS_KEY);
+            nvs_commit(nvs);
+            nvs_close(nvs);
+        }
+        ESP_LOGI(TAG, "Allowlist erased");
+    }
+    else if (strcmp(arg, "status") == 0) {
+        printf("{\"allowlist\":\"%s\",\"learned\":%u,\"entries\":%u,\"overflow\":%u}\n",
+               allowlist.get_mode() == IDS::ModelMode::LEARN ? "learn" :
+               allowlist.get_mode() == IDS::ModelMode::ENFORCE ? "enforce" : "off",
+               (unsigned)allowlist.learned_count(), (unsigned)allowlist.entry_count(),
+               (unsigned)allowlist.overflow_count());
+    }
+    else {
+        ESP_LOGW(TAG, "Unknown allowlist command: %s", arg);
+    }
+}
+
+void clock_skew_report() {
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return;
+    }
+    for (size_t i = 0; i < IDS::CLOCK_SKEW_SLOTS; i++) {
+        const IDS::SkewProfile &p = clock_skew.slot(i);
+        if (!p.key || !p.tracking) {
+            continue;
+        }
+        // Skew is Q16 ppm, printed with three decimals
+        int32_t milli_ppm = (int32_t)(((int64_t)p.skew_q16 * 1000) / 65536);
+        printf("{\"skew\":\"%05" PRIx32 "\",\"sender\":%02X,\"period_us\":%" PRIu32 ",\"ppm\":%s%" PRId32 ".%03" PRId32
+               ",\"offset_us\":%" PRId32 ",\"batches\":%" PRIu32 ",\"alerts\":%" PRIu32 "}\n",
+               (uint32_t)((p.key >> 8) & 0x3FFFF), (unsigned)(p.key & 0xFF), p.period_us,
+               milli_ppm < 0 ? "-" : "", abs(milli_ppm) / 1000, abs(milli_ppm) % 1000,
+               (int32_t)(p.offset_ns / 1000), p.batches, p.alerts);
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+void clock_skew_command(const char *arg) {
+    if (strcmp(arg, "status") == 0) {
+        clock_skew_report();
+        return;
+    }
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return;
+    }
+    if (strcmp(arg, "on") == 0) {
+        clock_skew.set_enabled(true);
+    } else if (strcmp(arg, "off") == 0) {
+        clock_skew.set_enabled(false);
+    } else if (strcmp(arg, "clear") == 0) {
+        clock_skew.clear();
+    } else {
+        ESP_LOGW(TAG, "Unknown skew command: %s", arg);
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+const char *parse_inject_frame(const char *p, can_frame *frame) {
+    memset(frame, 0, sizeof(*frame));
+    const char *id_start = p;
+    uint32_t id = 0;
+    int nibble;
+    while ((nibble = hex_nibble(*p)) >= 0) {
+        id = (id << 4) | nibble;
+        p++;
+    }
+    size_t id_len = p - id_start;
+    if (*p++ != '#' || (id_len != 3 && id_len != 8)) {
+        return NULL;
+    }
+    frame->can_id = id_len == 8 ? ((id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (id & CAN_SFF_MASK);
+
+    while (hex_nibble(p[0]) >= 0 && hex_nibble(p[1]) >= 0) {
+        if (frame->can_dlc == CAN_MAX_DLEN) {
+            return NULL;
+        }
+        frame->data[frame->can_dlc++] = (hex_nibble(p[0]) << 4) | hex_nibble(p[1]);
+        p += 2;
+    }
+    return (*p == ' ' || *p == '\0') ? p : NULL;
+}
+
+void inject_command(const char *arg) {
+    if (strcmp(arg, "stats") == 0) {
+        printf("{\"rx\":%" PRIu32 ",\"cpu_us\":%" PRIu32 ",\"cpu_us_max\":%" PRIu32
+               ",\"heap_free\":%" PRIu32 ",\"heap_min\":%" PRIu32 "}\n",
+               inject_frames, inject_frames ? (uint32_t)(inject_cpu_us / inject_frames) : 0,
+               inject_cpu_max_us, esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+        return;
+    }
+    if (strcmp(arg, "reset") == 0) {
+        inject_frames = 0;
+        inject_cpu_us = 0;
+        inject_cpu_max_us = 0;
+        return;
+    }
+    if (output_format != Capture::Format::JSON) {
+        // The capture buffer belongs to the receiver task
+        ESP_LOGW(TAG, "Frame injection needs the json output format");
+        return;
+    }
+
+    if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return;
+    }
+    const char *p = arg;
+    while (*p) {
+        can_frame frame;
+        const char *next = parse_inject_frame(p, &frame);
+        if (!next) {
+            ESP_LOGW(TAG, "Invalid rx frame: %s", p);
+            break;
+        }
+        int64_t start = esp_timer_get_time();
+        handle_frame(&frame, Capture::Format::JSON, start);
+        uint32_t spent = (uint32_t)(esp_timer_get_time() - start);
+        inject_frames++;
+        inject_cpu_us += spent;
+        if (spent > inject_cpu_max_us) {
+            inject_cpu_max_us = spent;
+        }
+        for (p = next; *p == ' '; p++) {
+        }
+    }
+    xSemaphoreGive(spi_mutex);
+}
+
+bool process_json_message(const uint8_t *data, size_t len) {
+    PROFILE_SCOPE("process_json_message");
+
+    if (len < 2 || data[0] != '{' || data[len-1] != '}') {
+        return false;
+    }
+    
+    char *json_str = (char*)cjson_heap.malloc(len + 1);
+    if (!json_str) {
+        ESP_LOGE(TAG, "Memory allocation failed");
+        return false;
+    }
+    
+    memcpy(json_str, data, len);
+    json_str[len] = '\0';
+    
+    cJSON *root = cJSON_Parse(json_str);
+    cjson_heap.free(json_str);
+    
+    if (!root) {
+        return false;
+    }
+    
+    cJSON *c_lower = cJSON_GetObjectItem(root, "c");
+    cJSON *c_upper = cJSON_GetObjectItem(root, "C");
+    cJSON *d_lower = cJSON_GetObjectItem(root, "d");
+    cJSON *d_upper = cJSON_GetObjectItem(root, "D");
+    
+    cJSON *c = c_lower ? c_lower : c_upper;
+    cJSON *d = d_lower ? d_lower : d_upper;
+    
+    bool is_valid = (c && d && 
+                    cJSON_IsString(c) && 
+                    cJSON_IsString(d));
+    
+    if (is_valid) {
+        const char* cmd = cJSON_GetStringValue(c);
+        const char* data_val = cJSON_GetStringValue(d);
+        
+        if (strcmp(cmd, "mode") == 0) {
+            if (strcmp(data_val, "slcan") == 0) {
+                enter_slcan_mode();
+            } else {
+                ESP_LOGW(TAG, "Unknown mode: %s", data_val);
+            }
+        }
+        else if (strcmp(cmd, "fmt") == 0) {
+            Capture::Format format;
+            if (Capture::Encoder::parse_format(data_val, &format)) {
+                ESP_LOGI(TAG, "Output format set to %s", Capture::Encoder::format_name(format));
+                output_format = format;
+            } else {
+                ESP_LOGW(TAG, "Unknown output format: %s", data_val);
+            }
+        }
+        else if (strcmp(cmd, "pm") == 0) {
+            payload_model_command(data_val);
+        }
+        else if (strcmp(cmd, "al") == 0) {
+            allowlist_command(data_val);
+        }
+        else if (strcmp(cmd, "skew") == 0) {
+            clock_skew_command(data_val);
+        }
+        else if (strcmp(cmd, "rules") == 0) {
+            rules_command(data_val);
+        }
+        else if (strcmp(cmd, "state") == 0) {
+            state_command(data_val);
+        }
+        else if (strcmp(cmd, "rx") == 0) {
+            inject_command(data_val);
+        }
+        else if (strcmp(cmd, "trace") == 0) {
+            Trace::execute(data_val);
+        }
+        else if (strcmp(cmd, "prof") == 0) {
+            Profile::execute(data_val);
+        }
+        else if (strcmp(cmd, "sched") == 0) {
+            SchedTrace::execute(data_val);
+        }
+        else if (strcmp(cmd, "stats") == 0) {
+            Metrics::execute(data_val);
+        }
+        else if (strcmp(cmd, "mem") == 0) {
+            Budget::execute(data_val);
+        }
+        else if (strcmp(cmd, "flash") == 0) {
+            FlashStress::execute(data_val);
+        }
+        else if (strcmp(cmd, "time") == 0) {
+            synchronizer->execute(data_val);
+        }
+        else if (strcmp(cmd, "hb") == 0) {
+            heartbeat->execute(data_val);
+        }
+        else if (strcmp(cmd, "key") == 0) {
+            BusKey::execute(data_val);
+        }
+    }
+    
+    cJSON_Delete(root);
+    return is_valid;
+}
+
+void capture_flush() {
+    if (capture_len > 0) {
+        uart_write_bytes(UART_NUM, capture_buf, capture_len);
+        capture_len = 0;
+    }
+}
+
+void capture_switch_format(Capture::Format format) {
+    capture_flush();
+    uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+    if (format == Capture::Format::JSON) {
+        uart_set_baudrate(UART_NUM, CONSOLE_UART_BAUD);
+        esp_log_level_set("*", ESP_LOG_INFO);
+        return;
+    }
+
+    esp_log_level_set("*", ESP_LOG_NONE);
+    uart_set_baudrate(UART_NUM, CAPTURE_UART_BAUD);
+    vTaskDelay(pdMS_TO_TICKS(CAPTURE_SETTLE_MS));
+    if (format == Capture::Format::PCAP) {
+        capture_len = Capture::Encoder::pcap_global_header(capture_buf);
+        capture_flush();
+    }
+}
+
+void report_alert(const char *kind, const char *reason, const can_frame *frame) {
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    if (((pgn >> 8) & 0xFF) < 240) {
+        pgn &= 0x3FF00;
+    }
+    printf("{\"alert\":\"%s\",\"reason\":\"%s\",\"pgn\":\"%05" PRIx32 "\",\"sender\":%02X,\"data\":\"",
+           kind, reason, pgn, (unsigned)(id & 0xFF));
+    for (int i = 0; i < frame->can_dlc && i < CAN_MAX_DLEN; i++) {
+        printf("%02X", frame->data[i]);
+    }
+    // The detectors keep the local clock, which a servo step never moves
+    if (SyncClock::is_synced()) {
+        int64_t t = SyncClock::now();
+        printf("\",\"t\":%" PRId64 ".%06" PRId64 "}\n", t / 1000000, t % 1000000);
+    } else {
+        printf("\"}\n");
+    }
+}
+
+void apply_rule_actions(const can_frame *frame, const Rules::Result &result, bool json_output) {
+    for (uint32_t pending = result.fired; pending; pending &= pending - 1) {
+        const Rules::Rule &rule = rules_engine->rule(__builtin_ctz(pending));
+
+        if ((rule.actions & Rules::ACTION_GPIO) && gpio_pulse_timers[rule.gpio]) {
+            gpio_set_level((gpio_num_t)rule.gpio, 1);
+            esp_timer_stop(gpio_pulse_timers[rule.gpio]);
+            esp_timer_start_once(gpio_pulse_timers[rule.gpio], (uint64_t)rule.pulse_ms * 1000);
+        }
+
+        if (!json_output) {
+            continue;
+        }
+        if (rule.actions & Rules::ACTION_ALERT) {
+            report_alert("rule", rule.name, frame);
+        }
+        if (rule.actions & Rules::ACTION_SMS) {
+            // Same command the KLE node turns into an SMS
+            printf("{\"c\":\"np\",\"d\":\"IDS %s: %08" PRIX32 "\"}\n", rule.name, (uint32_t)(frame->can_id & CAN_EFF_MASK));
+        }
+        if (rule.actions & Rules::ACTION_FORWARD) {
+            printf("{\"forward\":\"%08" PRIX32 "#", (uint32_t)(frame->can_id & CAN_EFF_MASK));
+            for (int i = 0; i < frame->can_dlc && i < CAN_MAX_DLEN; i++) {
+                printf("%02X", frame->data[i]);
+            }
+            printf("\"}\n");
+        }
+    }
+}
+
+void handle_frame(const can_frame *frame, Capture::Format format, int64_t rx_time) {
+    Rules::Result result = rules_engine->evaluate(frame, rx_time);
+    if (result.fired) {
+        apply_rule_actions(frame, result, !slcan_mode && format == Capture::Format::JSON);
+        if (result.actions & Rules::ACTION_DROP) {
+            return;
+        }
+    }
+
+    if (slcan_mode) {
+        slcan_adapter->on_frame(frame);
+        return;
+    }
+
+    if (format == Capture::Format::JSON) {
+        heartbeat->on_frame(frame);
+        IDS::AllowVerdict allow = allowlist.process(frame, (uint32_t)(rx_time / 1000));
+        if (allow != IDS::AllowVerdict::OK) {
+            report_alert("allowlist", IDS::Allowlist::verdict_name(allow), frame);
+        }
+        if (clock_skew.process(frame, rx_time) == IDS::SkewVerdict::SKEW_CHANGE) {
+            report_alert("skew", "skew_change", frame);
+        }
+        IDS::Verdict verdict = payload_model.process(frame);
+        if (verdict != IDS::Verdict::OK && verdict != IDS::Verdict::UNKNOWN_ID) {
+            report_alert("payload", IDS::PayloadModel::verdict_name(verdict), frame);
+        }
+        j1939_controller->decode_j1939_message(frame);
+        return;
+    }
+
+    // The receiver task flushes before this can fill up
+    capture_len += capture_encoder.encode(format, frame, rx_time, capture_buf + capture_len);
 }
 
 bool init_spi(spi_device_handle_t *spi_handle) {
@@ -109,78 +945,133 @@ void init_interrupt_pin() {
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
     gpio_config(&io_conf);
-    gpio_evt_queue = xQueueCreate(10, sizeof(uint32_t));
-    gpio_install_isr_service(0);
+    gpio_evt_queue = gpio_evt_queue_memory.create();
+    gpio_install_isr_service(HOT_PATH_INTR_FLAGS);
     gpio_isr_handler_add(PIN_NUM_INT, gpio_isr_handler, (void *)(uint32_t)PIN_NUM_INT);
     ESP_LOGI(TAG, "GPIO interrupt initialized on pin %d", PIN_NUM_INT);
 }
 
+void init_uart() {
+    uart_config_t uart_config = {
+        .baud_rate = CONSOLE_UART_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
+    uart_param_config(UART_NUM, &uart_config);
+    uart_driver_install(UART_NUM, BUF_SIZE * 2, UART_TX_BUF_SIZE, 0, NULL, 0);
+}
+
 void receiver_task(void *pvParameters) {
-    uint32_t gpio_num;
+    int64_t rx_time;
     can_frame frame;
+    Capture::Format active_format = Capture::Format::JSON;
     ESP_LOGI(TAG, "Receiver task started");
     for (;;) {
-        if (xQueueReceive(gpio_evt_queue, &gpio_num, pdMS_TO_TICKS(100))) {
-            if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                while (mcp2515->checkReceive()) {
-                    if (mcp2515->readMessage(&frame) == MCP2515::ERROR_OK) {
-                        j1939_controller->decode_j1939_message(&frame);
+        if (output_format != active_format) {
+            active_format = output_format;
+            capture_switch_format(active_format);
+        }
+        if (xQueueReceive(gpio_evt_queue, &rx_time, pdMS_TO_TICKS(100))) {
+            bool held = xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE;
+            bool first = true;
+            while (held && mcp2515->checkReceive()) {
+                if (mcp2515->readMessage(&frame) == CanController::ERROR_OK) {
+                    // Sync frames are still captured and checked like any other
+                    synchronizer->on_frame(&frame, first ? rx_time : 0);
+                    handle_frame(&frame, active_format, rx_time);
+                    if (first) {
+                        rx_latency_us.record((uint32_t)(esp_timer_get_time() - rx_time));
+                        first = false;
                     }
                 }
+                // Only the first frame of a drain raised the interrupt
+                rx_time = esp_timer_get_time();
+                if (capture_len + Capture::CANDUMP_MAX_LINE > sizeof(capture_buf)) {
+                    // Never wait on the UART while other tasks wait on the SPI bus
+                    xSemaphoreGive(spi_mutex);
+                    capture_flush();
+                    held = xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE;
+                }
+            }
+            if (held) {
                 mcp2515->clearRXInterrupts();
                 xSemaphoreGive(spi_mutex);
             }
         } else {
             if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                 if (mcp2515->checkReceive()) {
-                    if (mcp2515->readMessage(&frame) == MCP2515::ERROR_OK) {
-                        j1939_controller->decode_j1939_message(&frame);
+                    if (mcp2515->readMessage(&frame) == CanController::ERROR_OK) {
+                        synchronizer->on_frame(&frame, 0);
+                        handle_frame(&frame, active_format, esp_timer_get_time());
                         mcp2515->clearRXInterrupts();
                     }
                 }
                 xSemaphoreGive(spi_mutex);
             }
         }
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        capture_flush();
+        if (slcan_mode) {
+            slcan_adapter->flush();
+        }
+        // The two MCP2515 receive buffers last ~0.5 ms on a busy bus, so a
+        // capture stream must not sleep between drains
+        if (active_format == Capture::Format::JSON) {
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
         j1939_controller->cleanup_stale_sessions();
     }
 }
 
+// Optional "@XX," prefix of a UART line: the destination address in hex for
+// peer-to-peer (PDU1) PGNs. Without it messages go to all nodes.
+static uint8_t parse_destination(uint8_t **line, size_t *len) {
+    uint8_t *p = *line;
+    if (*len >= 4 && p[0] == '@' && isxdigit(p[1]) && isxdigit(p[2]) && p[3] == ',') {
+        char hex[3] = {(char)p[1], (char)p[2], '\0'};
+        *line += 4;
+        *len -= 4;
+        return (uint8_t)strtoul(hex, NULL, 16);
+    }
+    return J1939::GLOBAL_ADDRESS;
+}
+
 void sender_task(void *pvParameters) {
     ESP_LOGI(TAG, "Sender task started");
-    uart_config_t uart_config = {
-        .baud_rate = 115200,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
-    uart_param_config(UART_NUM, &uart_config);
-    uart_driver_install(UART_NUM, BUF_SIZE * 2, 0, 0, NULL, 0);
-    
     uint8_t data[BUF_SIZE];
     uint8_t *data_ptr = data;
     size_t data_len = 0;
     
     typedef struct {
         uint32_t pgn;
+        uint8_t dst;
         uint8_t data[BUF_SIZE];
         size_t len;
         bool is_multi_frame;
         uint32_t timestamp;
+        uint16_t trace_id;
     } message_entry_t;
     
-    std::vector<message_entry_t> message_queue;
+    std::vector<message_entry_t, Budget::Allocator<message_entry_t, uart_tx_heap>> message_queue;
     
     while (1) {
+        if (slcan_mode) {
+            int read_len = uart_read_bytes(UART_NUM, data, SLCAN_READ_SIZE, pdMS_TO_TICKS(10));
+            if (read_len > 0) {
+                slcan_adapter->feed(data, read_len);
+            }
+            continue;
+        }
+        
         bool message_sent = false;
         for (auto it = message_queue.begin(); it != message_queue.end();) {
             if (j1939_controller->is_bus_available()) {
                 if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                     bool send_result;
                     if (it->is_multi_frame) {
-                        send_result = j1939_controller->send_multi_frame_message(it->pgn, it->data, it->len);
+                        send_result = j1939_controller->send_multi_frame_message(it->pgn, it->dst, it->data, it->len, it->trace_id);
                     } else {
-                        send_result = j1939_controller->send_single_frame_message(it->pgn, 0xFF, it->data, it->len);
+                        send_result = j1939_controller->send_single_frame_message(it->pgn, it->dst, it->data, it->len, it->trace_id);
                     }
                     xSemaphoreGive(spi_mutex);
                     if (send_result) {
@@ -190,6 +1081,7 @@ void sender_task(void *pvParameters) {
                         uint32_t current_time = esp_log_timestamp();
                         if (current_time - it->timestamp > 5000) {
                             ESP_LOGW(TAG, "Message in queue timed out, removing");
+                            tx_expired.inc();
                             it = message_queue.erase(it);
                         } else {
                             ++it;
@@ -206,11 +1098,13 @@ void sender_task(void *pvParameters) {
             }
         }
         
+        tx_pending.set(message_queue.size());
         int len = uart_read_bytes(UART_NUM, data_ptr, 1, message_queue.empty() ? portMAX_DELAY : 10);
         if (len > 0) {
             data_ptr++;
             data_len++;
             if (*(data_ptr - 1) == '\n' || *(data_ptr - 1) == '\r' || data_len >= BUF_SIZE - 1) {
+                int64_t line_time = esp_timer_get_time();
                 *data_ptr = '\0';
                 data_ptr = data;
                 if (data_len > 0 && (data[data_len - 1] == '\n' || data[data_len - 1] == '\r')) {
@@ -218,15 +1112,24 @@ void sender_task(void *pvParameters) {
                     data_len--;
                 }
                 
+                if (process_json_message(data, data_len)) {
+                    data_len = 0;
+                    data_ptr = data;
+                    continue;
+                }
+                
                 uint8_t pgn_index = 0;
-                uint8_t *message_start = data;
-                size_t message_len = data_len;
+                uint8_t *line = data;
+                size_t line_len = data_len;
+                uint8_t dst = parse_destination(&line, &line_len);
+                uint8_t *message_start = line;
+                size_t message_len = line_len;
                 uint32_t selected_pgn = J1939::PGN_EXTRA;
                 
-                if (data_len >= 3 && data[0] >= '1' && data[0] <= '3' && data[1] == ',') {
-                    pgn_index = data[0] - '0';
-                    message_start = &data[2];
-                    message_len = data_len - 2;
+                if (line_len >= 3 && line[0] >= '1' && line[0] <= '3' && line[1] == ',') {
+                    pgn_index = line[0] - '0';
+                    message_start = &line[2];
+                    message_len = line_len - 2;
                     
                     switch (pgn_index) {
                     case 1:
@@ -243,17 +1146,20 @@ void sender_task(void *pvParameters) {
                         break;
                     }
                 } else {
-                    message_start = data;
-                    message_len = data_len;
+                    message_start = line;
+                    message_len = line_len;
                 }
                 
+                uint16_t trace_id = Trace::begin();
+                Trace::record_at(Trace::Stage::UART_LINE, trace_id, message_len, line_time);
+
                 bool sent = false;
                 if (j1939_controller->is_bus_available()) {
                     if (xSemaphoreTake(spi_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
                         if (message_len <= 8) {
-                            sent = j1939_controller->send_single_frame_message(selected_pgn, 0xFF, message_start, message_len);
+                            sent = j1939_controller->send_single_frame_message(selected_pgn, dst, message_start, message_len, trace_id);
                         } else {
-                            sent = j1939_controller->send_multi_frame_message(selected_pgn, message_start, message_len);
+                            sent = j1939_controller->send_multi_frame_message(selected_pgn, dst, message_start, message_len, trace_id);
                         }
                         xSemaphoreGive(spi_mutex);
                     }
@@ -262,11 +1168,15 @@ void sender_task(void *pvParameters) {
                 if (!sent) {
                     message_entry_t entry;
                     entry.pgn = selected_pgn;
+                    entry.dst = dst;
                     memcpy(entry.data, message_start, message_len);
                     entry.len = message_len;
                     entry.is_multi_frame = (message_len > 8);
                     entry.timestamp = esp_log_timestamp();
+                    entry.trace_id = trace_id;
                     message_queue.push_back(entry);
+                    tx_pending.set(message_queue.size());
+                    Trace::record(Trace::Stage::QUEUED, trace_id);
                 }
                 data_len = 0;
                 data_ptr = data;
@@ -286,42 +1196,88 @@ extern "C" void app_main(void) {
     }
     ESP_ERROR_CHECK(ret);
     
+    cJSON_Hooks hooks = {cjson_malloc, cjson_free};
+    cJSON_InitHooks(&hooks);
+
+#if CONFIG_CAN_BACKEND_TWAI
+    static TwaiCan can_device;
+    mcp2515 = &can_device;
+    gpio_evt_queue = gpio_evt_queue_memory.create();
+    can_device.setReceiveNotify(can_rx_notify, NULL);
+#else
     if (!init_spi(&spi_handle)) {
         ESP_LOGE(TAG, "Failed to initialize SPI");
         return;
     }
-    
-    mcp2515 = new MCP2515(&spi_handle);
+
+    static MCP2515 mcp2515_device(&spi_handle);
+    mcp2515 = &mcp2515_device;
     init_interrupt_pin();
+#endif
     
-    if (mcp2515->reset() != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to reset MCP2515");
+    if (mcp2515->reset() != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to reset CAN controller");
         return;
     }
     
-    if (mcp2515->setBitrate(CAN_500KBPS, MCP_8MHZ) != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to set MCP2515 bitrate");
+    if (mcp2515->setBitrate(CAN_500KBPS, MCP_8MHZ) != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to set CAN bitrate");
         return;
     }
     
-    if (mcp2515->setNormalMode() != MCP2515::ERROR_OK) {
-        ESP_LOGE(TAG, "Failed to set MCP2515 normal mode");
+    if (mcp2515->setNormalMode() != CanController::ERROR_OK) {
+        ESP_LOGE(TAG, "Failed to set CAN normal mode");
         return;
     }
     
-    mcp2515->setInterruptMask(MCP2515::CANINTF_RX0IF | MCP2515::CANINTF_RX1IF);
+    mcp2515->setInterruptMask(CanController::CANINTF_RX0IF | CanController::CANINTF_RX1IF);
     vTaskDelay(100 / portTICK_PERIOD_MS);
     
-    spi_mutex = xSemaphoreCreateMutex();
+    spi_mutex = spi_mutex_memory.create();
+    
+    static Slcan::Adapter slcan_instance(mcp2515, spi_mutex, UART_NUM, MCP_8MHZ);
+    slcan_adapter = &slcan_instance;
+    if (!slcan_adapter->init()) {
+        ESP_LOGE(TAG, "Failed to initialize SLCAN adapter");
+        return;
+    }
+    
+    static Rules::Engine rules_instance;
+    rules_engine = &rules_instance;
     
-    j1939_controller = new J1939::Controller(mcp2515, SOURCE_ADDR);
+    if (allowlist_restore()) {
+        allowlist.set_mode(IDS::ModelMode::ENFORCE);
+        ESP_LOGI(TAG, "Allowlist restored from NVS: %u tuples, enforcing", (unsigned)allowlist.entry_count());
+    }
+    
+    SchedTrace::watch(spi_mutex, "spi_mutex");
+    SchedTrace::watch(gpio_evt_queue, "gpio_evt_queue");
+    Trace::init(SOURCE_ADDR);
+    static J1939::Controller j1939_device(mcp2515, SOURCE_ADDR);
+    j1939_controller = &j1939_device;
     if (!j1939_controller->init()) {
         ESP_LOGE(TAG, "Failed to initialize J1939 controller");
         return;
     }
     
+    static TimeSync::Synchronizer synchronizer_instance(mcp2515, spi_mutex, SOURCE_ADDR);
+    synchronizer = &synchronizer_instance;
+    if (!synchronizer->init(TimeSync::Role::FOLLOWER)) {
+        ESP_LOGE(TAG, "Failed to initialize time sync");
+        return;
+    }
+    
+    static Heartbeat::Monitor heartbeat_instance(mcp2515, spi_mutex, SOURCE_ADDR, BUS_BITRATE);
+    heartbeat = &heartbeat_instance;
+    if (!heartbeat->init(false)) {
+        ESP_LOGE(TAG, "Failed to initialize heartbeat monitor");
+        return;
+    }
+    
     ESP_LOGI(TAG, "MCP2515 and J1939 initialized and ready!");
     
-    xTaskCreate(receiver_task, "j1939_receiver", 4096, NULL, 10, &receiver_task_handle);
-    xTaskCreate(sender_task, "j1939_sender", 4096, NULL, 5, &sender_task_handle);
+    init_uart();
+    
+    receiver_task_handle = receiver_task_memory.create(receiver_task, "j1939_receiver", NULL, 10);
+    sender_task_handle = sender_task_memory.create(sender_task, "j1939_sender", NULL, 5);
 }
\ No newline at end of file
@@ -0,0 +1,337 @@
+/**
+ * @file capture_reader.cpp
+ * @brief Capture file reader for host tools
+ * @version 1.0
+ *
+ */
+
+#include "capture_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+namespace Host {
+
+static constexpr uint32_t PCAP_MAGIC_USEC = 0xA1B2C3D4;
+static constexpr uint32_t PCAP_MAGIC_NSEC = 0xA1B23C4D;
+static constexpr uint32_t LINKTYPE_CAN_SOCKETCAN = 227;
+static constexpr size_t PCAP_MAX_RECORD = 72;       // CAN FD frame
+static constexpr size_t JSON_MAX_MESSAGE = 1785;    // 255 TP.DT packets
+static constexpr int64_t JSON_FRAME_SPACING_US = 1000;
+
+// Session numbers J1939::Controller::send_multi_frame_message cycles through
+static const uint8_t TP_SESSIONS[] = {2, 3, 6, 7, 10, 11};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static uint32_t swap32(uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Pointer to the value of "key": in a flat JSON line, or NULL
+static const char *json_value(const char *line, const char *key) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    return p ? p + strlen(pattern) : NULL;
+}
+
+static bool json_hex(const char *value, uint32_t *out) {
+    if (!value) {
+        return false;
+    }
+    if (*value == '"') {
+        value++;
+    }
+    uint32_t v = 0;
+    int digits = 0;
+    while (hex_value(*value) >= 0 && digits < 8) {
+        v = (v << 4) | hex_value(*value++);
+        digits++;
+    }
+    *out = v;
+    return digits > 0;
+}
+
+CaptureReader::CaptureReader()
+    : file(NULL),
+      capture_format(CaptureFormat::UNKNOWN),
+      skipped_records(0),
+      pcap_swapped(false),
+      pcap_nanoseconds(false),
+      json_time_us(0),
+      json_session_index(0) {
+}
+
+CaptureReader::~CaptureReader() {
+    close();
+}
+
+bool CaptureReader::open(const char *path) {
+    close();
+    file = fopen(path, "rb");
+    skipped_records = 0;
+    capture_format = CaptureFormat::UNKNOWN;
+    json_time_us = 0;
+    json_session_index = 0;
+    pending.clear();
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[24];
+    size_t got = fread(header, 1, sizeof(header), file);
+    uint32_t magic = got >= 4 ? (header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24)) : 0;
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+        swap32(magic) == PCAP_MAGIC_USEC || swap32(magic) == PCAP_MAGIC_NSEC) {
+        pcap_swapped = swap32(magic) == PCAP_MAGIC_USEC || swap32(magic) == PCAP_MAGIC_NSEC;
+        pcap_nanoseconds = (pcap_swapped ? swap32(magic) : magic) == PCAP_MAGIC_NSEC;
+        uint32_t linktype = header[20] | (header[21] << 8) | (header[22] << 16) | ((uint32_t)header[23] << 24);
+        if (got != sizeof(header) || (pcap_swapped ? swap32(linktype) : linktype) != LINKTYPE_CAN_SOCKETCAN) {
+            close();
+            return false;
+        }
+        capture_format = CaptureFormat::PCAP;
+        return true;
+    }
+
+    // Text: the first record decides between candump and JSON
+    rewind(file);
+    int c;
+    while ((c = fgetc(file)) != EOF && isspace(c)) {
+    }
+    capture_format = c == '{' ? CaptureFormat::JSON : CaptureFormat::CANDUMP;
+    rewind(file);
+    return true;
+}
+
+void CaptureReader::close() {
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+const char *CaptureReader::format_name(CaptureFormat format) {
+    switch (format) {
+    case CaptureFormat::CANDUMP: return "candump";
+    case CaptureFormat::PCAP: return "pcap";
+    case CaptureFormat::JSON: return "json";
+    default: return "unknown";
+    }
+}
+
+bool CaptureReader::parse_candump_line(const char *line, TimedFrame *out) {
+    if (line[0] != '(') {
+        return false;
+    }
+
+    char *end;
+    long long seconds = strtoll(line + 1, &end, 10);
+    if (*end != '.') {
+        return false;
+    }
+    const char *frac = end + 1;
+    long long micros = strtoll(frac, &end, 10);
+    if (*end != ')' || end - frac != 6) {
+        return false;
+    }
+    out->time_us = seconds * 1000000LL + micros;
+
+    const char *p = end + 1;
+    while (*p == ' ') p++;
+    while (*p && *p != ' ') p++;   // interface name
+    while (*p == ' ') p++;
+
+    const char *id_start = p;
+    uint32_t id = 0;
+    while (hex_value(*p) >= 0) {
+        id = (id << 4) | hex_value(*p++);
+    }
+    size_t id_len = p - id_start;
+    if (*p++ != '#' || (id_len != 3 && id_len != 8)) {
+        return false;
+    }
+
+    memset(&out->frame, 0, sizeof(out->frame));
+    out->frame.can_id = id;
+    if (id_len == 8) {
+        out->frame.can_id |= CAN_EFF_FLAG;
+    }
+
+    if (*p == 'R') {
+        out->frame.can_id |= CAN_RTR_FLAG;
+        return true;
+    }
+
+    uint8_t dlc = 0;
+    while (hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0) {
+        if (dlc >= CAN_MAX_DLEN) {
+            return false;
+        }
+        out->frame.data[dlc++] = (hex_value(p[0]) << 4) | hex_value(p[1]);
+        p += 2;
+    }
+    out->frame.can_dlc = dlc;
+    return *p == '\0' || isspace((unsigned char)*p);
+}
+
+bool CaptureReader::next_pcap(TimedFrame *out) {
+    uint8_t record[16 + PCAP_MAX_RECORD];
+    while (fread(record, 1, 16, file) == 16) {
+        uint32_t fields[4];
+        for (int i = 0; i < 4; i++) {
+            const uint8_t *p = record + i * 4;
+            fields[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            if (pcap_swapped) {
+                fields[i] = swap32(fields[i]);
+            }
+        }
+        uint32_t incl_len = fields[2];
+        if (incl_len > PCAP_MAX_RECORD) {
+            // Corrupt length: nothing after it can be trusted
+            skipped_records++;
+            return false;
+        }
+        if (fread(record + 16, 1, incl_len, file) != incl_len) {
+            return false;
+        }
+        if (incl_len < 8) {
+            skipped_records++;
+            continue;
+        }
+
+        // SocketCAN header: can_id in network byte order, then the length
+        const uint8_t *cf = record + 16;
+        uint8_t dlc = cf[4];
+        if (dlc > CAN_MAX_DLEN || 8u + dlc > incl_len) {
+            skipped_records++;
+            continue;
+        }
+        out->time_us = (int64_t)fields[0] * 1000000 + (pcap_nanoseconds ? fields[1] / 1000 : fields[1]);
+        memset(&out->frame, 0, sizeof(out->frame));
+        out->frame.can_id = read_be32(cf);
+        out->frame.can_dlc = dlc;
+        memcpy(out->frame.data, cf + 8, dlc);
+        return true;
+    }
+    return false;
+}
+
+bool CaptureReader::parse_json_line(const char *line) {
+    if (strstr(line, "\"alert\"") || strstr(line, "\"forward\"")) {
+        return false;
+    }
+
+    uint32_t pgn, sender;
+    const char *size = json_value(line, "size");
+    const char *data = json_value(line, "data");
+    if (!json_hex(json_value(line, "pgn"), &pgn) || !json_hex(json_value(line, "sender"), &sender) ||
+        !size || !data || *data != '"' || pgn > 0x3FFFF || sender > 0xFF) {
+        return false;
+    }
+
+    uint8_t bytes[JSON_MAX_MESSAGE];
+    size_t len = 0;
+    for (const char *p = data + 1; hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; p += 2) {
+        if (len == sizeof(bytes)) {
+            return false;
+        }
+        bytes[len++] = (hex_value(p[0]) << 4) | hex_value(p[1]);
+    }
+
+    const char *t = json_value(line, "t");
+    if (t) {
+        json_time_us = (int64_t)(atof(t) * 1e6);
+    }
+
+    TimedFrame f = {};
+    if (strncmp(size, "\"SF\"", 4) == 0) {
+        if (len > CAN_MAX_DLEN) {
+            return false;
+        }
+        f.time_us = json_time_us;
+        f.frame.can_id = CAN_EFF_FLAG | 0x18000000 | (pgn << 8) | sender;
+        f.frame.can_dlc = len;
+        memcpy(f.frame.data, bytes, len);
+        pending.push_back(f);
+        json_time_us += JSON_FRAME_SPACING_US;
+        return true;
+    }
+
+    size_t total = strtoul(size, NULL, 10);
+    if (total != len || len <= CAN_MAX_DLEN) {
+        return false;
+    }
+
+    uint8_t session = TP_SESSIONS[json_session_index];
+    json_session_index = (json_session_index + 1) % sizeof(TP_SESSIONS);
+    size_t packets = (len + 6) / 7;
+
+    f.time_us = json_time_us;
+    f.frame.can_id = CAN_EFF_FLAG | 0x18ECFF00 | sender;
+    f.frame.can_dlc = 8;
+    f.frame.data[0] = 0x20 | (session << 4);
+    f.frame.data[1] = len & 0xFF;
+    f.frame.data[2] = (len >> 8) & 0xFF;
+    f.frame.data[3] = packets > 255 ? 0xFF : packets;
+    f.frame.data[4] = 0xFF;
+    f.frame.data[5] = pgn & 0xFF;
+    f.frame.data[6] = (pgn >> 8) & 0xFF;
+    f.frame.data[7] = (pgn >> 16) & 0xFF;
+    pending.push_back(f);
+
+    for (size_t seq = 1; seq <= packets; seq++) {
+        json_time_us += JSON_FRAME_SPACING_US;
+        size_t offset = (seq - 1) * 7;
+        size_t chunk = len - offset < 7 ? len - offset : 7;
+        f.time_us = json_time_us;
+        f.frame.can_id = CAN_EFF_FLAG | 0x18EBFF00 | sender;
+        memset(f.frame.data, 0xFF, sizeof(f.frame.data));
+        f.frame.data[0] = (((seq - 1) % 15) + 1) | (session << 4);
+        memcpy(&f.frame.data[1], bytes + offset, chunk);
+        pending.push_back(f);
+    }
+    json_time_us += JSON_FRAME_SPACING_US;
+    return true;
+}
+
+bool CaptureReader::next(TimedFrame *out) {
+    if (!pending.empty()) {
+        *out = pending.front();
+        pending.pop_front();
+        return true;
+    }
+    if (!file) {
+        return false;
+    }
+    if (capture_format == CaptureFormat::PCAP) {
+        return next_pcap(out);
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        if (capture_format == CaptureFormat::JSON) {
+            if (parse_json_line(line)) {
+                *out = pending.front();
+                pending.pop_front();
+                return true;
+            }
+        } else if (parse_candump_line(line, out)) {
+            return true;
+        }
+        skipped_records++;
+    }
+    return false;
+}
+
+}
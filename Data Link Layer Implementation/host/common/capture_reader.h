@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include "mcp2515/can.h"
+
+namespace Host {
+
+    struct TimedFrame {
+        int64_t time_us;
+        can_frame frame;
+    };
+
+    enum class CaptureFormat : uint8_t {
+        UNKNOWN,
+        CANDUMP,
+        PCAP,
+        JSON
+    };
+
+    // Reads frames from a capture file written by the sniffer or by can-utils.
+    // The format is detected from the start of the file:
+    //
+    // - candump -L log lines: (1712345678.123456) can0 18EF0042#0102030405060708
+    // - PCAP with LINKTYPE_CAN_SOCKETCAN, either byte order, µs or ns stamps
+    // - the sniffer's JSON output: {"pgn":"0f004","sender":00,"size":"SF","data":"..."}
+    //   Single frames become one priority 6 frame; multi-frame messages are
+    //   segmented again into a BAM and its TP.DT packets with the session
+    //   numbers the J1939 controller uses. The lines carry no time, so frames
+    //   are spaced 1 ms apart unless a line has a "t" field in seconds.
+    //   Alert and forward lines are skipped.
+    class CaptureReader {
+    public:
+        CaptureReader();
+        ~CaptureReader();
+
+        bool open(const char* path);
+        void close();
+
+        // Returns false at the end of the capture; unparseable records are skipped
+        bool next(TimedFrame* out);
+
+        size_t skipped() const { return skipped_records; }
+        CaptureFormat format() const { return capture_format; }
+        static const char* format_name(CaptureFormat format);
+
+        static bool parse_candump_line(const char* line, TimedFrame* out);
+
+    private:
+        bool next_pcap(TimedFrame* out);
+        bool parse_json_line(const char* line);
+
+        FILE* file;
+        CaptureFormat capture_format;
+        size_t skipped_records;
+        bool pcap_swapped;
+        bool pcap_nanoseconds;
+        int64_t json_time_us;
+        uint8_t json_session_index;
+        std::deque<TimedFrame> pending;
+    };
+
+}
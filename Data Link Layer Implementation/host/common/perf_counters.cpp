@@ -0,0 +1,97 @@
+/**
+ * @file perf_counters.cpp
+ * @brief Hardware performance counters for host tools
+ * @version 1.0
+ *
+ */
+
+#include "perf_counters.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Host {
+
+#ifdef __linux__
+PerfCounters::PerfCounters() {
+    static const uint64_t configs[COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    for (int i = 0; i < COUNT; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (int i = 0; i < COUNT; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+void PerfCounters::start() {
+    for (int i = 0; i < COUNT; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::stop(double values[COUNT]) {
+    for (int i = 0; i < COUNT; i++) {
+        values[i] = 0;
+        if (fds[i] < 0) {
+            continue;
+        }
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t data[3];
+        if (read(fds[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0) {
+            // Scaled up when the counter was multiplexed with others
+            values[i] = (double)data[0] * data[1] / data[2];
+        }
+    }
+}
+#else
+PerfCounters::PerfCounters() {
+    for (int i = 0; i < COUNT; i++) {
+        fds[i] = -1;
+    }
+}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::start() {}
+
+void PerfCounters::stop(double values[COUNT]) {
+    for (int i = 0; i < COUNT; i++) {
+        values[i] = 0;
+    }
+}
+#endif
+
+bool PerfCounters::any_available() const {
+    for (int i = 0; i < COUNT; i++) {
+        if (fds[i] >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
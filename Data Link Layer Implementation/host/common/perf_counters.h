@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace Host {
+
+    // Hardware counters of the calling thread, user space only. Counters the
+    // kernel refuses (perf_event_paranoid, no PMU in a VM) stay unavailable.
+    class PerfCounters {
+    public:
+        enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, COUNT };
+
+        PerfCounters();
+        ~PerfCounters();
+
+        bool available(int counter) const { return fds[counter] >= 0; }
+        bool any_available() const;
+        void start();
+        void stop(double values[COUNT]);
+
+    private:
+        int fds[COUNT];
+    };
+
+}
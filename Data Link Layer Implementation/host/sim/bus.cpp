@@ -0,0 +1,460 @@
+/**
+ * @file bus.cpp
+ * @brief Bit-level CAN bus model for the simulator
+ * @version 1.0
+ *
+ * A frame is modelled from SOF to the end of the intermission:
+ *
+ * - Arbitration compares the identifier, SRR, IDE and RTR bits of every
+ *   node with a pending frame, one bit at a time. A node sending recessive
+ *   while another sends dominant drops out. Nodes left with identical
+ *   arbitration fields but different frames collide in the control or data
+ *   field and cause an error frame.
+ * - The duration is the stuffed length of SOF..CRC (CRC-15 computed over the
+ *   real bits) plus delimiters, ACK, EOF and 3 bits of intermission.
+ * - With a bit error rate, the first corrupted bit is drawn from a geometric
+ *   distribution; the frame is cut there and followed by a 14 bit error
+ *   frame. Transmitters add 8 to their TEC and receivers 1 to their REC,
+ *   successful frames count them down. Error passive transmitters suspend
+ *   for 8 bits after each frame, bus-off nodes stay silent for 128 x 11 bits
+ *   and then recover as the MCP2515 does. Failed frames stay pending and are
+ *   retransmitted.
+ * - Frames that pass a node's acceptance filters go into two receive
+ *   buffers that are emptied after the configured service time each; a
+ *   frame arriving with both full is lost.
+ *
+ */
+
+#include "bus.h"
+#include "mcp2515/mcp2515.h"
+#include <string.h>
+#include <algorithm>
+#include <array>
+
+namespace Sim {
+
+static constexpr uint32_t INTERMISSION_BITS = 3;
+static constexpr uint32_t ERROR_FRAME_BITS = 14;   // flag, echo and delimiter
+static constexpr uint32_t SUSPEND_BITS = 8;
+static constexpr uint32_t BUS_OFF_RECOVERY_BITS = 128 * 11;
+
+Node::Node(Bus *bus, int index)
+    : stats(),
+      bus(bus),
+      node_index(index),
+      rx_count(0),
+      masks{},
+      filters{},
+      filter_ext{false, true, false, false, false, false},
+      rx_busy(false),
+      tec(0),
+      rec(0),
+      bus_off(false),
+      suspend_until_ns(0) {
+    memset(tx, 0, sizeof(tx));
+    memset(rx, 0, sizeof(rx));
+}
+
+bool Node::queue_frame(const can_frame &frame) {
+    for (TxBuffer &buffer : tx) {
+        if (!buffer.pending) {
+            buffer.pending = true;
+            buffer.frame = frame;
+            buffer.queued_ns = bus->kernel->now();
+            bus->request_arbitration();
+            return true;
+        }
+    }
+    stats.tx_rejected++;
+    return false;
+}
+
+int Node::next_buffer() const {
+    for (int i = TX_BUFFERS - 1; i >= 0; i--) {
+        if (tx[i].pending) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Node::set_filter_mask(size_t mask, uint32_t value) {
+    masks[mask] = value & CAN_EFF_MASK;
+}
+
+void Node::set_filter(size_t filter, bool ext, uint32_t value) {
+    filters[filter] = value & CAN_EFF_MASK;
+    filter_ext[filter] = ext;
+}
+
+bool Node::accepts(const can_frame &frame) const {
+    bool ext = frame.can_id & CAN_EFF_FLAG;
+    uint32_t id = ext ? (frame.can_id & CAN_EFF_MASK) : ((frame.can_id & CAN_SFF_MASK) << 18);
+    for (size_t i = 0; i < RX_FILTERS; i++) {
+        uint32_t mask = masks[i < 2 ? 0 : 1];
+        if (filter_ext[i] == ext && ((id ^ filters[i]) & mask) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ErrorState Node::error_state() const {
+    if (bus_off) {
+        return ErrorState::BUS_OFF;
+    }
+    return (tec > 127 || rec > 127) ? ErrorState::PASSIVE : ErrorState::ACTIVE;
+}
+
+void Node::service_rx() {
+    can_frame frame = rx[0];
+    memmove(&rx[0], &rx[1], sizeof(can_frame) * (RX_BUFFERS - 1));
+    rx_count--;
+
+    if (receiver) {
+        bus->kernel->run_as(node_index, [this, &frame]() { receiver(frame); });
+    }
+
+    if (rx_count > 0) {
+        bus->kernel->schedule(bus->kernel->now() + bus->config.rx_service_us * 1000ULL, [this]() { service_rx(); });
+    } else {
+        rx_busy = false;
+    }
+}
+
+Bus::Bus(Kernel *kernel, const BusConfig &config, uint64_t seed)
+    : stats(),
+      kernel(kernel),
+      config(config),
+      bit_time_ns(1000000000ULL / config.bitrate),
+      rng(seed),
+      busy(false),
+      arbitration_pending(false) {
+}
+
+Node *Bus::add_node() {
+    nodes.emplace_back(new Node(this, (int)nodes.size()));
+    return nodes.back().get();
+}
+
+double Bus::load(uint64_t elapsed_ns) const {
+    return elapsed_ns ? (double)stats.busy_ns / elapsed_ns : 0;
+}
+
+size_t Bus::arbitration_bits(const can_frame &frame, uint8_t *bits) {
+    size_t n = 0;
+    bool rtr = frame.can_id & CAN_RTR_FLAG;
+    if (frame.can_id & CAN_EFF_FLAG) {
+        uint32_t id = frame.can_id & CAN_EFF_MASK;
+        for (int i = 28; i >= 18; i--) bits[n++] = (id >> i) & 1;
+        bits[n++] = 1;  // SRR
+        bits[n++] = 1;  // IDE
+        for (int i = 17; i >= 0; i--) bits[n++] = (id >> i) & 1;
+    } else {
+        uint32_t id = frame.can_id & CAN_SFF_MASK;
+        for (int i = 10; i >= 0; i--) bits[n++] = (id >> i) & 1;
+    }
+    bits[n++] = rtr;
+    if (!(frame.can_id & CAN_EFF_FLAG)) {
+        bits[n++] = 0;  // IDE
+    }
+    return n;
+}
+
+uint32_t Bus::frame_bits(const can_frame &frame) {
+    uint8_t bits[160];
+    size_t n = 0;
+    auto push = [&](uint32_t value, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+            bits[n++] = (value >> i) & 1;
+        }
+    };
+
+    bool rtr = frame.can_id & CAN_RTR_FLAG;
+    uint8_t dlc = frame.can_dlc > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame.can_dlc;
+
+    push(0, 1);                                         // SOF
+    if (frame.can_id & CAN_EFF_FLAG) {
+        uint32_t id = frame.can_id & CAN_EFF_MASK;
+        push(id >> 18, 11);
+        push(3, 2);                                     // SRR, IDE
+        push(id & 0x3FFFF, 18);
+        push(rtr, 1);
+        push(0, 2);                                     // r1, r0
+    } else {
+        push(frame.can_id & CAN_SFF_MASK, 11);
+        push(rtr, 1);
+        push(0, 2);                                     // IDE, r0
+    }
+    push(dlc, 4);
+    if (!rtr) {
+        for (int i = 0; i < dlc; i++) {
+            push(frame.data[i], 8);
+        }
+    }
+
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool next = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+    push(crc, 15);
+
+    // A complementary bit follows every run of five, and starts the next run
+    uint32_t stuffed = 0;
+    int last = -1;
+    int run = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (bits[i] == last) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5) {
+            stuffed++;
+            last = !last;
+            run = 1;
+        }
+    }
+
+    return (uint32_t)n + stuffed + 3 + 7;              // CRC delimiter, ACK, ACK delimiter, EOF
+}
+
+void Bus::request_arbitration() {
+    if (!busy && !arbitration_pending) {
+        arbitration_pending = true;
+        kernel->schedule(kernel->now(), [this]() { arbitrate(); });
+    }
+}
+
+void Bus::arbitrate() {
+    arbitration_pending = false;
+    if (busy) {
+        return;
+    }
+
+    uint64_t now = kernel->now();
+    uint64_t suspended_until = UINT64_MAX;
+    std::vector<Contender> active;
+    for (auto &node : nodes) {
+        int buffer = node->next_buffer();
+        if (node->bus_off || buffer < 0) {
+            continue;
+        }
+        if (node->suspend_until_ns > now) {
+            suspended_until = std::min(suspended_until, node->suspend_until_ns);
+            continue;
+        }
+        active.push_back(Contender{node.get(), buffer});
+    }
+
+    if (active.empty()) {
+        if (suspended_until != UINT64_MAX) {
+            arbitration_pending = true;
+            kernel->schedule(suspended_until, [this]() { arbitrate(); });
+        }
+        return;
+    }
+
+    // Wired-AND: a recessive bit loses against any dominant one
+    std::vector<std::array<uint8_t, 32>> fields(active.size());
+    size_t length = 0;
+    for (size_t i = 0; i < active.size(); i++) {
+        const can_frame &frame = active[i].node->tx[active[i].buffer].frame;
+        length = std::max(length, arbitration_bits(frame, fields[i].data()));
+    }
+    std::vector<size_t> contending(active.size());
+    for (size_t i = 0; i < active.size(); i++) {
+        contending[i] = i;
+    }
+    for (size_t bit = 0; bit < length && contending.size() > 1; bit++) {
+        bool dominant = false;
+        for (size_t i : contending) {
+            dominant |= fields[i][bit] == 0;
+        }
+        if (!dominant) {
+            continue;
+        }
+        std::vector<size_t> remaining;
+        for (size_t i : contending) {
+            if (fields[i][bit] == 0) {
+                remaining.push_back(i);
+            } else {
+                active[i].node->stats.arbitration_lost++;
+            }
+        }
+        contending.swap(remaining);
+    }
+
+    std::vector<Contender> winners;
+    for (size_t i : contending) {
+        winners.push_back(active[i]);
+    }
+    const can_frame &frame = winners[0].node->tx[winners[0].buffer].frame;
+    uint32_t bits = frame_bits(frame);
+
+    // Position of the first bit error, if any
+    uint32_t error_bit = UINT32_MAX;
+    for (size_t i = 1; i < winners.size(); i++) {
+        const can_frame &other = winners[i].node->tx[winners[i].buffer].frame;
+        if (other.can_dlc != frame.can_dlc || memcmp(other.data, frame.data, frame.can_dlc) != 0) {
+            stats.collisions++;
+            error_bit = std::min<uint32_t>(error_bit, 1 + (uint32_t)length + 6);
+        }
+    }
+    if (config.bit_error_rate > 0) {
+        std::geometric_distribution<uint32_t> first_error(config.bit_error_rate);
+        uint32_t hit = first_error(rng);
+        if (hit < bits) {
+            error_bit = std::min(error_bit, hit);
+        }
+    }
+
+    busy = true;
+    if (error_bit < bits) {
+        uint64_t duration = (uint64_t)(error_bit + 1 + ERROR_FRAME_BITS + INTERMISSION_BITS) * bit_time_ns;
+        stats.busy_ns += duration;
+        kernel->schedule(now + duration, [this, winners]() {
+            fail(winners);
+            end_of_frame();
+        });
+        return;
+    }
+
+    stats.busy_ns += (uint64_t)(bits + INTERMISSION_BITS) * bit_time_ns;
+    kernel->schedule(now + (uint64_t)bits * bit_time_ns, [this, winners]() { complete(winners); });
+    kernel->schedule(now + (uint64_t)(bits + INTERMISSION_BITS) * bit_time_ns, [this]() { end_of_frame(); });
+}
+
+void Bus::end_of_frame() {
+    busy = false;
+    arbitrate();
+}
+
+void Bus::add_error(Node *node, uint16_t amount, bool transmitter) {
+    if (node->bus_off) {
+        return;
+    }
+    if (!transmitter) {
+        if (node->rec < 255) {
+            node->rec += amount;
+        }
+        return;
+    }
+
+    node->tec += amount;
+    node->stats.tx_errors++;
+    if (node->tec > 255) {
+        node->bus_off = true;
+        node->stats.bus_off_events++;
+        kernel->schedule(kernel->now() + (uint64_t)BUS_OFF_RECOVERY_BITS * bit_time_ns, [this, node]() {
+            node->bus_off = false;
+            node->tec = 0;
+            node->rec = 0;
+            request_arbitration();
+        });
+    }
+}
+
+void Bus::complete(const std::vector<Contender> &transmitters) {
+    uint64_t now = kernel->now();
+    can_frame frame = transmitters[0].node->tx[transmitters[0].buffer].frame;
+    stats.frames++;
+
+    for (const Contender &t : transmitters) {
+        Node *node = t.node;
+        bool passive = node->error_state() == ErrorState::PASSIVE;
+        node->tx[t.buffer].pending = false;
+        node->stats.tx_frames++;
+        node->stats.tx_latency_us.push_back((uint32_t)((now - node->tx[t.buffer].queued_ns) / 1000));
+        if (node->tec > 0) {
+            node->tec--;
+        }
+        node->suspend_until_ns = passive ? now + (uint64_t)(INTERMISSION_BITS + SUSPEND_BITS) * bit_time_ns : 0;
+    }
+
+    for (auto &node : nodes) {
+        bool transmitter = false;
+        for (const Contender &t : transmitters) {
+            transmitter |= t.node == node.get();
+        }
+        if (transmitter || node->bus_off) {
+            continue;
+        }
+
+        if (node->rec > 127) {
+            node->rec = 120;
+        } else if (node->rec > 0) {
+            node->rec--;
+        }
+
+        if (!node->accepts(frame)) {
+            node->stats.rx_filtered++;
+            continue;
+        }
+        if (node->rx_count == RX_BUFFERS) {
+            node->stats.rx_overflows++;
+            continue;
+        }
+        node->rx[node->rx_count++] = frame;
+        node->stats.rx_frames++;
+        if (!node->rx_busy) {
+            node->rx_busy = true;
+            Node *receiver = node.get();
+            kernel->schedule(now + config.rx_service_us * 1000ULL, [receiver]() { receiver->service_rx(); });
+        }
+    }
+}
+
+void Bus::fail(const std::vector<Contender> &transmitters) {
+    uint64_t now = kernel->now();
+    stats.error_frames++;
+
+    for (auto &node : nodes) {
+        bool transmitter = false;
+        for (const Contender &t : transmitters) {
+            transmitter |= t.node == node.get();
+        }
+        bool passive = node->error_state() == ErrorState::PASSIVE;
+        add_error(node.get(), transmitter ? 8 : 1, transmitter);
+        if (transmitter && passive) {
+            node->suspend_until_ns = now + (uint64_t)SUSPEND_BITS * bit_time_ns;
+        }
+    }
+}
+
+}
+
+MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame) {
+    if (frame->can_dlc > CAN_MAX_DLEN) {
+        return ERROR_FAILTX;
+    }
+    if (!node) {
+        return ERROR_OK;
+    }
+    return node->queue_frame(*frame) ? ERROR_OK : ERROR_ALLTXBUSY;
+}
+
+MCP2515::ERROR MCP2515::setFilterMask(const MASK num, const bool ext, const uint32_t ulData) {
+    if (num != MASK0 && num != MASK1) {
+        return ERROR_FAIL;
+    }
+    if (node) {
+        node->set_filter_mask(num, ext ? ulData : (ulData & CAN_SFF_MASK) << 18);
+    }
+    return ERROR_OK;
+}
+
+MCP2515::ERROR MCP2515::setFilter(const RXF num, const bool ext, const uint32_t ulData) {
+    if ((size_t)num >= Sim::RX_FILTERS) {
+        return ERROR_FAIL;
+    }
+    if (node) {
+        node->set_filter(num, ext, ext ? ulData : (ulData & CAN_SFF_MASK) << 18);
+    }
+    return ERROR_OK;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+#include "kernel.h"
+#include "mcp2515/can.h"
+
+namespace Sim {
+
+    constexpr size_t TX_BUFFERS = 3;    // MCP2515 TXB0..TXB2
+    constexpr size_t RX_BUFFERS = 2;    // MCP2515 RXB0, RXB1 with rollover
+    constexpr size_t RX_FILTERS = 6;    // RXF0-1 on mask 0, RXF2-5 on mask 1
+
+    struct BusConfig {
+        uint32_t bitrate = 250000;          // J1939 default
+        double bit_error_rate = 0;          // per bit; a hit turns the frame into an error frame
+        uint32_t rx_service_us = 100;       // interrupt, task switch and SPI read per received frame
+    };
+
+    enum class ErrorState : uint8_t {
+        ACTIVE,
+        PASSIVE,
+        BUS_OFF
+    };
+
+    struct NodeStats {
+        uint64_t tx_frames;
+        uint64_t tx_errors;             // transmissions destroyed by an error frame
+        uint64_t tx_rejected;           // sendMessage with all buffers pending
+        uint64_t arbitration_lost;
+        uint64_t rx_frames;
+        uint64_t rx_filtered;           // frames no acceptance filter matched
+        uint64_t rx_overflows;          // frames lost with both receive buffers full
+        uint64_t bus_off_events;
+        std::vector<uint32_t> tx_latency_us;   // load into a buffer to end of frame
+    };
+
+    class Bus;
+
+    // One CAN controller on the bus: the MCP2515 buffers and the CAN fault
+    // confinement counters.
+    class Node {
+    public:
+        typedef std::function<void(const can_frame&)> Receiver;
+
+        Node(Bus* bus, int index);
+
+        int index() const { return node_index; }
+
+        // Loads the first free transmit buffer; false when all are pending
+        bool queue_frame(const can_frame& frame);
+
+        // Called for every frame read from the receive buffers, as the node
+        void set_receiver(Receiver receiver) { this->receiver = receiver; }
+
+        // MCP2515 acceptance filters, identifiers in 29-bit space (standard
+        // IDs shifted up by 18). A frame is accepted if a filter of its
+        // format matches under that filter's mask. The defaults are the
+        // driver's after reset(): everything accepted.
+        void set_filter_mask(size_t mask, uint32_t value);
+        void set_filter(size_t filter, bool ext, uint32_t value);
+        bool accepts(const can_frame& frame) const;
+
+        ErrorState error_state() const;
+        uint16_t transmit_errors() const { return tec; }
+        uint16_t receive_errors() const { return rec; }
+
+        NodeStats stats;
+
+    private:
+        friend class Bus;
+
+        struct TxBuffer {
+            bool pending;
+            can_frame frame;
+            uint64_t queued_ns;
+        };
+
+        // Equal priorities: the MCP2515 sends the highest numbered buffer first
+        int next_buffer() const;
+        void service_rx();
+
+        Bus* bus;
+        int node_index;
+        Receiver receiver;
+        TxBuffer tx[TX_BUFFERS];
+        can_frame rx[RX_BUFFERS];
+        size_t rx_count;
+        uint32_t masks[2];
+        uint32_t filters[RX_FILTERS];
+        bool filter_ext[RX_FILTERS];
+        bool rx_busy;
+        uint16_t tec;
+        uint16_t rec;
+        bool bus_off;
+        uint64_t suspend_until_ns;
+    };
+
+    struct BusStats {
+        uint64_t frames;
+        uint64_t error_frames;
+        uint64_t collisions;        // same arbitration field, different frame
+        uint64_t busy_ns;
+    };
+
+    // Bit-level CAN bus: wired-AND arbitration on the identifier bits, exact
+    // frame lengths with bit stuffing and CRC, error frames, error counters
+    // with error passive and bus-off, and automatic retransmission.
+    class Bus {
+    public:
+        Bus(Kernel* kernel, const BusConfig& config, uint64_t seed);
+
+        Node* add_node();
+        size_t node_count() const { return nodes.size(); }
+        Node* node(size_t index) { return nodes[index].get(); }
+
+        uint64_t bit_ns() const { return bit_time_ns; }
+        double load(uint64_t elapsed_ns) const;
+
+        // Bits on the wire from SOF to the end of EOF, including stuff bits
+        static uint32_t frame_bits(const can_frame& frame);
+        // Identifier, SRR, IDE and RTR as sent during arbitration, MSB first
+        static size_t arbitration_bits(const can_frame& frame, uint8_t* bits);
+
+        BusStats stats;
+
+    private:
+        friend class Node;
+
+        struct Contender {
+            Node* node;
+            int buffer;
+        };
+
+        void request_arbitration();
+        void arbitrate();
+        void complete(const std::vector<Contender>& transmitters);
+        void fail(const std::vector<Contender>& transmitters);
+        void end_of_frame();
+        void add_error(Node* node, uint16_t amount, bool transmitter);
+
+        Kernel* kernel;
+        BusConfig config;
+        uint64_t bit_time_ns;
+        std::mt19937_64 rng;
+        std::vector<std::unique_ptr<Node>> nodes;
+        bool busy;
+        bool arbitration_pending;
+    };
+
+}
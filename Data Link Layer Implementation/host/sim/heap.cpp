@@ -0,0 +1,108 @@
+/**
+ * @file heap.cpp
+ * @brief Per-node heap accounting for the simulator
+ * @version 1.0
+ *
+ * Every allocation carries a 16 byte header with its size and owner, so the
+ * bytes can be returned to the right owner even when another thread frees
+ * them. Counters are atomic because thread start-up and exit run outside the
+ * kernel's one-at-a-time hand-over.
+ *
+ */
+
+#include "heap.h"
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+namespace Sim {
+
+struct alignas(16) AllocationHeader {
+    size_t size;
+    int owner;
+};
+
+struct OwnerCounters {
+    std::atomic<int64_t> current;
+    std::atomic<int64_t> peak;
+    std::atomic<uint64_t> allocations;
+};
+
+static OwnerCounters counters[MAX_HEAP_OWNERS + 1];
+static thread_local int owner_tag = -1;
+
+static OwnerCounters &counters_of(int owner) {
+    return counters[(owner >= 0 && owner < MAX_HEAP_OWNERS) ? owner + 1 : 0];
+}
+
+void set_heap_owner(int owner) {
+    owner_tag = owner;
+}
+
+int heap_owner() {
+    return owner_tag;
+}
+
+HeapStats heap_stats(int owner) {
+    OwnerCounters &c = counters_of(owner);
+    return HeapStats{c.current.load(), c.peak.load(), c.allocations.load()};
+}
+
+void heap_reset() {
+    for (OwnerCounters &c : counters) {
+        c.peak.store(c.current.load());
+        c.allocations.store(0);
+    }
+}
+
+static void *tracked_alloc(size_t size) {
+    AllocationHeader *header = (AllocationHeader *)malloc(sizeof(AllocationHeader) + size);
+    if (!header) {
+        throw std::bad_alloc();
+    }
+    header->size = size;
+    header->owner = owner_tag;
+
+    OwnerCounters &c = counters_of(owner_tag);
+    int64_t now = c.current.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+    int64_t peak = c.peak.load(std::memory_order_relaxed);
+    while (now > peak && !c.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    return header + 1;
+}
+
+static void tracked_free(void *p) {
+    if (!p) {
+        return;
+    }
+    AllocationHeader *header = (AllocationHeader *)p - 1;
+    counters_of(header->owner).current.fetch_sub((int64_t)header->size, std::memory_order_relaxed);
+    free(header);
+}
+
+}
+
+void *operator new(size_t size) {
+    return Sim::tracked_alloc(size);
+}
+
+void *operator new[](size_t size) {
+    return Sim::tracked_alloc(size);
+}
+
+void operator delete(void *p) noexcept {
+    Sim::tracked_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    Sim::tracked_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    Sim::tracked_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    Sim::tracked_free(p);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Sim {
+
+    constexpr int MAX_HEAP_OWNERS = 256;
+
+    struct HeapStats {
+        int64_t current;        // bytes allocated and not yet freed
+        int64_t peak;
+        uint64_t allocations;
+    };
+
+    // Heap use is charged to the owner set on the allocating thread (a node
+    // index, or -1 for the simulator itself). The global operator new/delete
+    // of the host tools are replaced for this.
+    void set_heap_owner(int owner);
+    int heap_owner();
+    HeapStats heap_stats(int owner);
+    void heap_reset();
+
+    class HeapOwner {
+    public:
+        explicit HeapOwner(int owner) : previous(heap_owner()) { set_heap_owner(owner); }
+        ~HeapOwner() { set_heap_owner(previous); }
+    private:
+        int previous;
+    };
+
+}
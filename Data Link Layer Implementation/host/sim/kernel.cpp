@@ -0,0 +1,219 @@
+/**
+ * @file kernel.cpp
+ * @brief Discrete-event kernel and FreeRTOS/ESP-IDF shims for the simulator
+ * @version 1.0
+ *
+ */
+
+#include "kernel.h"
+#include "heap.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+
+namespace Sim {
+
+static Kernel *active_kernel = NULL;
+static thread_local Task *current_task = NULL;
+
+Kernel::Kernel(uint32_t tick_rate_hz)
+    : now_ns(0),
+      tick_period_ns(1000000000ULL / tick_rate_hz),
+      next_seq(0),
+      event_count(0),
+      running(NULL),
+      stopping(false),
+      inline_delays(false),
+      log_enabled(false),
+      warnings(0),
+      errors(0) {
+    active_kernel = this;
+}
+
+Kernel::~Kernel() {
+    shutdown();
+    if (active_kernel == this) {
+        active_kernel = NULL;
+    }
+}
+
+Kernel *Kernel::active() {
+    return active_kernel;
+}
+
+int Kernel::current_node() {
+    return heap_owner();
+}
+
+void Kernel::schedule(uint64_t at_ns, Action action) {
+    if (at_ns < now_ns) {
+        at_ns = now_ns;
+    }
+    queue.push_back(Event{at_ns, next_seq++, std::move(action)});
+    std::push_heap(queue.begin(), queue.end(), EventOrder());
+}
+
+void Kernel::spawn(int node, uint64_t at_ns, Action body) {
+    Task *task = new Task();
+    task->node = node;
+    task->body = std::move(body);
+    task->finished = false;
+    tasks.emplace_back(task);
+    task->thread = std::thread(&Kernel::task_main, this, task);
+    schedule(at_ns, [this, task]() { resume(task); });
+}
+
+void Kernel::run_until(uint64_t end_ns) {
+    while (!queue.empty() && queue.front().time <= end_ns) {
+        std::pop_heap(queue.begin(), queue.end(), EventOrder());
+        Event event = std::move(queue.back());
+        queue.pop_back();
+        now_ns = event.time;
+        event_count++;
+        event.action();
+    }
+    if (now_ns < end_ns) {
+        now_ns = end_ns;
+    }
+}
+
+void Kernel::shutdown() {
+    stopping = true;
+    for (auto &task : tasks) {
+        if (!task->finished) {
+            resume(task.get());
+        }
+        task->thread.join();
+    }
+    tasks.clear();
+    queue.clear();
+}
+
+void Kernel::resume(Task *task) {
+    if (task->finished) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(baton);
+    running = task;
+    task->wake.notify_one();
+    kernel_wake.wait(lock, [this]() { return running == NULL; });
+}
+
+void Kernel::task_main(Task *task) {
+    {
+        std::unique_lock<std::mutex> lock(baton);
+        task->wake.wait(lock, [this, task]() { return running == task; });
+    }
+
+    current_task = task;
+    set_heap_owner(task->node);
+    if (!stopping) {
+        try {
+            task->body();
+        } catch (const TaskStop &) {
+        }
+    }
+    set_heap_owner(-1);
+
+    std::unique_lock<std::mutex> lock(baton);
+    task->finished = true;
+    running = NULL;
+    kernel_wake.notify_one();
+}
+
+void Kernel::sleep_until(uint64_t wake_ns) {
+    if (inline_delays) {
+        now_ns = wake_ns > now_ns ? wake_ns : now_ns;
+        return;
+    }
+
+    Task *task = current_task;
+    if (!task) {
+        fprintf(stderr, "sim: delay outside of a task\n");
+        abort();
+    }
+    if (stopping) {
+        throw TaskStop();
+    }
+
+    schedule(wake_ns, [this, task]() { resume(task); });
+    {
+        std::unique_lock<std::mutex> lock(baton);
+        running = NULL;
+        kernel_wake.notify_one();
+        task->wake.wait(lock, [this, task]() { return running == task; });
+    }
+
+    if (stopping) {
+        throw TaskStop();
+    }
+}
+
+void Kernel::run_as(int node, const Action &action) {
+    HeapOwner owner(node);
+    action();
+}
+
+uint64_t Kernel::log_count(char level) const {
+    return level == 'E' ? errors : (level == 'W' ? warnings : 0);
+}
+
+void Kernel::count_log(char level) {
+    if (level == 'E') {
+        errors++;
+    } else if (level == 'W') {
+        warnings++;
+    }
+}
+
+void log(char level, const char *tag, const char *format, ...) {
+    Kernel *kernel = Kernel::active();
+    if (!kernel) {
+        return;
+    }
+    kernel->count_log(level);
+    if (!kernel->is_log_enabled()) {
+        return;
+    }
+
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    printf("[%12.6f] n%-3d %c %s: %s\n", kernel->now() / 1e9, Kernel::current_node(), level, tag, message);
+}
+
+}
+
+uint32_t esp_log_timestamp() {
+    Sim::Kernel *kernel = Sim::Kernel::active();
+    return kernel ? (uint32_t)(kernel->now() / 1000000) : 0;
+}
+
+int64_t esp_timer_get_time() {
+    Sim::Kernel *kernel = Sim::Kernel::active();
+    return kernel ? (int64_t)(kernel->now() / 1000) : 0;
+}
+
+TickType_t xTaskGetTickCount() {
+    Sim::Kernel *kernel = Sim::Kernel::active();
+    return (TickType_t)(kernel->now() / kernel->tick_ns());
+}
+
+void vTaskDelay(TickType_t ticks) {
+    Sim::Kernel *kernel = Sim::Kernel::active();
+    uint64_t tick = kernel->now() / kernel->tick_ns();
+    kernel->sleep_until((tick + ticks) * kernel->tick_ns());
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment) {
+    Sim::Kernel *kernel = Sim::Kernel::active();
+    *previous_wake += increment;
+    kernel->sleep_until((uint64_t)*previous_wake * kernel->tick_ns());
+}
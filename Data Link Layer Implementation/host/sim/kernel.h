@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace Sim {
+
+    typedef std::function<void()> Action;
+
+    // Thrown from a delay when the simulation shuts down, to unwind a task
+    struct TaskStop {};
+
+    struct Task {
+        int node;
+        Action body;
+        std::thread thread;
+        std::condition_variable wake;
+        bool finished;
+    };
+
+    // Deterministic discrete-event kernel with simulated FreeRTOS tasks.
+    //
+    // Events are ordered by time and then by scheduling order. Tasks are
+    // host threads, but only the event loop or a single task runs at any
+    // moment: control is handed over explicitly on every delay, so a run is
+    // reproducible and the simulated code needs no locking. Time only moves
+    // between events, so a run takes as long as its events need to execute.
+    class Kernel {
+    public:
+        explicit Kernel(uint32_t tick_rate_hz);
+        ~Kernel();
+
+        uint64_t now() const { return now_ns; }
+        uint64_t tick_ns() const { return tick_period_ns; }
+        uint64_t events() const { return event_count; }
+
+        void schedule(uint64_t at_ns, Action action);
+        // Starts a task for a node at the given time
+        void spawn(int node, uint64_t at_ns, Action body);
+
+        // Processes events up to and including end_ns
+        void run_until(uint64_t end_ns);
+        // Unwinds and joins all tasks; pending events are dropped
+        void shutdown();
+
+        // Task side: suspend the calling task until the given time
+        void sleep_until(uint64_t wake_ns);
+        // Runs an event handler on behalf of a node (heap accounting, logs)
+        void run_as(int node, const Action& action);
+
+        // Kernel of the current run, for the FreeRTOS and ESP-IDF shims
+        static Kernel* active();
+        static int current_node();
+
+        // Delays only advance the clock, without switching tasks; for single
+        // threaded callers such as the benchmarks
+        void set_inline_delays(bool on) { inline_delays = on; }
+
+        void set_log_enabled(bool on) { log_enabled = on; }
+        bool is_log_enabled() const { return log_enabled; }
+        uint64_t log_count(char level) const;
+        void count_log(char level);
+
+    private:
+        struct Event {
+            uint64_t time;
+            uint64_t seq;
+            Action action;
+        };
+        struct EventOrder {
+            bool operator()(const Event& a, const Event& b) const {
+                return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+            }
+        };
+
+        void resume(Task* task);
+        void task_main(Task* task);
+
+        uint64_t now_ns;
+        uint64_t tick_period_ns;
+        uint64_t next_seq;
+        uint64_t event_count;
+        std::vector<Event> queue;
+        std::vector<std::unique_ptr<Task>> tasks;
+
+        std::mutex baton;
+        std::condition_variable kernel_wake;
+        Task* running;
+        bool stopping;
+        bool inline_delays;
+
+        bool log_enabled;
+        uint64_t warnings;
+        uint64_t errors;
+    };
+
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// The simulator runs J1939 on the simulated MCP2515 only; the TWAI backend
+// needs the ESP-IDF driver.
+
+#include "mcp2515/mcp2515.h"
+
+typedef MCP2515 CanController;
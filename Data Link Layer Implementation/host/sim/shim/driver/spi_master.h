@@ -0,0 +1,3 @@
+#pragma once
+
+// The simulated MCP2515 has no SPI bus
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Milliseconds of simulated time since the start of the run
+uint32_t esp_log_timestamp();
+
+namespace Sim {
+    // Prints with the simulated time and node when logging is enabled
+    void log(char level, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
+}
+
+#define ESP_LOGE(tag, format, ...) Sim::log('E', tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) Sim::log('W', tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) Sim::log('I', tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) Sim::log('D', tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) Sim::log('V', tag, format, ##__VA_ARGS__)
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Microseconds of simulated time since the start of the run
+int64_t esp_timer_get_time();
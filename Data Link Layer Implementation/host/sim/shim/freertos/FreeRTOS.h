@@ -0,0 +1,31 @@
+#pragma once
+
+// FreeRTOS subset for running firmware components in the simulator.
+// Tasks, delays and the tick count follow the simulated clock of Sim::Kernel.
+
+#include <stdint.h>
+
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 100      // ESP-IDF default, the projects do not change it
+#endif
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE  ((BaseType_t)1)
+#define pdFALSE ((BaseType_t)0)
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS ((TickType_t)(1000 / configTICK_RATE_HZ))
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+// Simulated tasks run one at a time, as on a single core
+#define portNUM_PROCESSORS 1
+#define IRAM_ATTR
+inline BaseType_t xPortGetCoreID() { return 0; }
+
+#include "freertos/task.h"
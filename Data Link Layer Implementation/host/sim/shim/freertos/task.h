@@ -0,0 +1,9 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+// Suspend the calling simulated task. As on FreeRTOS the task wakes on a
+// tick boundary, so a delay of n ticks lasts between n - 1 and n periods.
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t* previous_wake, TickType_t increment);
+TickType_t xTaskGetTickCount();
@@ -0,0 +1,797 @@
+/**
+ * @file can_sim.cpp
+ * @brief Multi-node J1939 scaling simulation on a simulated CAN bus
+ * @version 1.0
+ *
+ * Runs N unmodified J1939::Controller instances, each with a simulated
+ * MCP2515, on the discrete-event bus of host/sim. Every node runs two
+ * FreeRTOS-style tasks on the simulated clock:
+ *
+ * - a periodic task sending one single frame message every --period-ms
+ * - a transport task sending BAM transfers of --tp-size bytes with
+ *   exponentially distributed gaps, --tp-rate transfers per second
+ *
+ * With --unicast the single frames are peer-to-peer (PDU1) messages to the
+ * next node's address instead of broadcasts; --address-filter sets every
+ * controller's acceptance filters to its own address and global
+ * (J1939::Controller::set_address_filter), so frames for other nodes never
+ * reach the receive buffers. The receive CPU per node is the frames serviced
+ * times --rx-service-us, which compares the two directly. Without transport
+ * traffic, every single frame is delivered and the filter takes receive CPU
+ * from 1.42 % to 0.09 % per node (144000 to 9600 frames serviced):
+ *
+ *   can_sim --nodes 16 --unicast --tp-rate 0
+ *   can_sim --nodes 16 --unicast --tp-rate 0 --address-filter
+ *
+ * With the default BAM traffic the filter still takes receive CPU from
+ * 0.79 % to 0.24 %, but only 42.70 % of the single frames and 84.83 % of
+ * the TP transfers arrive, filtered or not. 57 % of the single frame sends
+ * fail. Every BAM on the bus holds each controller's transmitter (bus_busy).
+ * 640 sends give up after 500 ms of waiting, and 4747 are rejected with all
+ * three TX buffers full, when the periodic task catches up on the periods
+ * it missed:
+ *
+ *   can_sim --nodes 16 --unicast
+ *   can_sim --nodes 16 --unicast --address-filter
+ *
+ * --flood-rate adds a rogue node announcing BAMs of the largest size across
+ * all six sessions without ever sending their data, from --flood-sources
+ * source addresses (0x80 up). Each announcement reserves reassembly heap and
+ * holds every controller's transmitter (bus_busy) unless the reassembly
+ * quotas turn it away; the single frame and TP lines show what it costs the
+ * other nodes:
+ *
+ *   can_sim --nodes 8 --flood-rate 20
+ *   can_sim --nodes 8 --flood-rate 200 --flood-sources 16
+ *
+ * --heartbeat-ms gives every node a Heartbeat::Monitor publishing at that
+ * period and watching all the others. Halfway through the traffic --kill
+ * disconnects the last N nodes (they stop sending) and --swap replaces the
+ * N before them with units that have the wrong bus key. Reported are the
+ * period the nodes settled on and the heartbeats' share of the bus against
+ * LOAD_BUDGET_PPM, the latency from the event to each surviving node's
+ * missing and bad token alerts against the bound MISS_LIMIT * period +
+ * CHECK_INTERVAL_MS, and missing alerts for nodes that never stopped:
+ *
+ *   can_sim --nodes 8 --heartbeat-ms 200 --kill 1 --swap 1
+ *   can_sim --nodes 16 --heartbeat-ms 100 --kill 2 --tp-rate 2 --tp-size 1785
+ *
+ * Payloads carry the sender and a sequence number, so every receiving node
+ * checks integrity and end-to-end latency (from the send call to the message
+ * sink). After the traffic stops the bus runs on until transfers in flight
+ * have finished or timed out. Reported are bus load, transmit latency,
+ * delivery ratio and latency of single frames and TP transfers, receive
+ * buffer overflows, heap use per node and the simulation speed. Like the
+ * firmware's receiver task, every node sweeps stale sessions every 10 ms.
+ *
+ * Runs are deterministic for a given seed.
+ *
+ *   can_sim --nodes 16 --duration 60
+ *   can_sim --sweep 2,4,8,16,32 --tp-rate 0.5 --error-rate 1e-5
+ *
+ */
+
+#include "j1939.h"
+#include "heartbeat.h"
+#include "bus.h"
+#include "heap.h"
+#include "kernel.h"
+#include "mcp2515/mcp2515.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+static constexpr size_t MAX_NODES = 250;
+static constexpr uint16_t MAX_TP_SIZE = 255 * 7;
+static constexpr uint32_t SF_PGN_BASE = 0xFF00;   // proprietary B, one PGN per node
+static constexpr uint8_t FLOOD_SOURCE_BASE = 0x80;
+static constexpr size_t MAX_FLOOD_SOURCES = 64;
+
+struct Options {
+    size_t nodes = 8;
+    Sim::BusConfig bus;
+    double duration_s = 60;
+    uint32_t period_ms = 100;
+    double tp_rate = 0.2;
+    uint16_t tp_size = 64;
+    uint64_t seed = 1;
+    bool unicast = false;
+    bool address_filter = false;
+    double flood_rate = 0;
+    size_t flood_sources = 1;
+    uint32_t heartbeat_ms = 0;
+    size_t kill = 0;
+    size_t swap = 0;
+    bool verbose = false;
+    std::vector<size_t> sweep;
+};
+
+struct Run;
+
+struct Ecu {
+    Run *run;
+    size_t index;
+    uint8_t address;
+    Sim::Node *node;
+    MCP2515 *mcp;
+    J1939::Controller *controller;
+    Heartbeat::Monitor *heartbeat;
+    bool silent;                    // disconnected by --kill: sends nothing
+    std::mt19937_64 rng;
+};
+
+struct HeartbeatResult {
+    uint64_t frames = 0;
+    uint64_t bits = 0;              // heartbeat frames on the wire during the traffic
+    uint64_t false_missing = 0;     // missing alerts for nodes that kept running
+    uint64_t expected_missing = 0;
+    uint64_t expected_bad_token = 0;
+    uint32_t period_ms = 0;         // after stretching to the budget share
+    uint32_t bound_ms = 0;          // the survivors' longest detection bound
+    std::vector<uint32_t> missing_us;       // event to alert, per (observer, peer)
+    std::vector<uint32_t> bad_token_us;
+    std::set<uint32_t> reported;            // (observer, peer, alert) already counted
+};
+
+struct Traffic {
+    uint64_t attempted = 0;
+    uint64_t failed = 0;            // the controller gave up sending
+    uint64_t received = 0;          // intact deliveries, summed over receivers
+    uint64_t corrupt = 0;
+    uint64_t other_da = 0;          // unicast messages decoded by a node they were not for
+    std::unordered_map<uint64_t, uint64_t> sent_ns;
+    std::vector<uint32_t> latency_us;
+};
+
+struct Run {
+    const Options *options;
+    Sim::Kernel *kernel;
+    uint64_t traffic_end_ns;
+    std::vector<Ecu> ecus;
+    Traffic single;
+    Traffic tp;
+    uint64_t flood_sent = 0;
+    uint64_t event_ns = 0;          // --kill and --swap take effect
+    HeartbeatResult heartbeat;
+};
+
+struct Result {
+    size_t nodes;
+    double simulated_s;
+    double wall_s;
+    uint64_t events;
+    Sim::BusStats bus;
+    double load;
+    uint64_t bus_off;
+    uint64_t rx_frames;
+    uint64_t rx_filtered;
+    uint64_t rx_overflows;
+    uint64_t tx_rejected;
+    uint64_t arbitration_lost;
+    std::vector<uint32_t> tx_latency_us;
+    Traffic single;
+    Traffic tp;
+    uint64_t flood_sent;
+    HeartbeatResult heartbeat;
+    uint64_t expected_single;
+    uint64_t expected_tp;
+    int64_t heap_peak_max;
+    int64_t heap_peak_mean;
+    uint64_t warnings;
+    uint64_t errors;
+};
+
+static void fill_payload(uint8_t address, uint32_t seq, uint8_t *data, size_t len) {
+    data[0] = address;
+    data[1] = seq & 0xFF;
+    data[2] = (seq >> 8) & 0xFF;
+    data[3] = (seq >> 16) & 0xFF;
+    data[4] = (seq >> 24) & 0xFF;
+    for (size_t i = 5; i < len; i++) {
+        data[i] = (uint8_t)(address * 31 + seq * 7 + i * 13);
+    }
+}
+
+static uint64_t message_key(uint8_t address, uint32_t seq) {
+    return ((uint64_t)address << 32) | seq;
+}
+
+// Node addresses are 1..N; with --unicast each node sends to the next one
+static uint8_t unicast_destination(const Run *run, uint8_t address) {
+    return (uint8_t)(address % run->ecus.size() + 1);
+}
+
+static void on_message(void *context, uint32_t pgn, uint8_t src_addr, const uint8_t *data, size_t len) {
+    Ecu *ecu = (Ecu *)context;
+    Run *run = ecu->run;
+    Sim::HeapOwner owner(-1);
+
+    Traffic &traffic = len > 8 ? run->tp : run->single;
+    if (len < 5 || data[0] != src_addr) {
+        traffic.corrupt++;
+        return;
+    }
+    if (len <= 8 && run->options->unicast && unicast_destination(run, src_addr) != ecu->address) {
+        traffic.other_da++;
+        return;
+    }
+
+    uint32_t seq = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+    uint8_t expected[MAX_TP_SIZE];
+    fill_payload(src_addr, seq, expected, len);
+    auto sent = traffic.sent_ns.find(message_key(src_addr, seq));
+    if (sent == traffic.sent_ns.end() || memcmp(expected, data, len) != 0) {
+        traffic.corrupt++;
+        return;
+    }
+
+    traffic.received++;
+    traffic.latency_us.push_back((uint32_t)((run->kernel->now() - sent->second) / 1000));
+}
+
+static void periodic_task(Ecu *ecu) {
+    Run *run = ecu->run;
+    TickType_t period = pdMS_TO_TICKS(run->options->period_ms);
+    TickType_t wake = xTaskGetTickCount();
+    uint32_t pgn = SF_PGN_BASE | (ecu->index & 0xFF);
+    uint8_t dst = J1939::GLOBAL_ADDRESS;
+    if (run->options->unicast) {
+        pgn = J1939::PGN_PEER_TO_PEER_MESSAGE;
+        dst = unicast_destination(run, ecu->address);
+    }
+
+    for (uint32_t seq = 0; run->kernel->now() < run->traffic_end_ns && !ecu->silent; seq++) {
+        uint8_t data[8];
+        fill_payload(ecu->address, seq, data, sizeof(data));
+        {
+            Sim::HeapOwner owner(-1);
+            run->single.sent_ns[message_key(ecu->address, seq)] = run->kernel->now();
+            run->single.attempted++;
+        }
+        if (!ecu->controller->send_single_frame_message(pgn, dst, data, sizeof(data))) {
+            run->single.failed++;
+        }
+        vTaskDelayUntil(&wake, period);
+    }
+}
+
+static void transport_task(Ecu *ecu) {
+    Run *run = ecu->run;
+    std::exponential_distribution<double> gap_s(run->options->tp_rate);
+    uint16_t size = run->options->tp_size;
+
+    for (uint32_t seq = 0;; seq++) {
+        TickType_t ticks = pdMS_TO_TICKS(gap_s(ecu->rng) * 1000);
+        vTaskDelay(ticks ? ticks : 1);
+        if (run->kernel->now() >= run->traffic_end_ns || ecu->silent) {
+            return;
+        }
+
+        uint8_t data[MAX_TP_SIZE];
+        fill_payload(ecu->address, seq, data, size);
+        {
+            Sim::HeapOwner owner(-1);
+            run->tp.sent_ns[message_key(ecu->address, seq)] = run->kernel->now();
+            run->tp.attempted++;
+        }
+        if (!ecu->controller->send_multi_frame_message(J1939::PGN_EXTRA, J1939::GLOBAL_ADDRESS, data, size)) {
+            run->tp.failed++;
+        }
+    }
+}
+
+// Nodes are killed or swapped from the last one down
+static bool is_killed(const Run *run, size_t index) {
+    return index >= run->ecus.size() - run->options->kill;
+}
+
+static bool is_swapped(const Run *run, size_t index) {
+    size_t end = run->ecus.size() - run->options->kill;
+    return index < end && index >= end - run->options->swap;
+}
+
+static const uint8_t BUS_KEY[SipHash::KEY_SIZE] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+static const uint8_t WRONG_KEY[SipHash::KEY_SIZE] = {
+    0xF0, 0xE1, 0xD2, 0xC3, 0xB4, 0xA5, 0x96, 0x87, 0x78, 0x69, 0x5A, 0x4B, 0x3C, 0x2D, 0x1E, 0x0F
+};
+
+static void on_heartbeat_alert(void *context, Heartbeat::Alert alert, uint8_t peer, uint32_t silent_ms) {
+    Ecu *ecu = (Ecu *)context;
+    Run *run = ecu->run;
+    Sim::HeapOwner owner(-1);
+    if (is_killed(run, ecu->index) || is_swapped(run, ecu->index)) {
+        return;
+    }
+    size_t peer_index = (size_t)peer - 1;
+    bool affected = peer_index < run->ecus.size() && (is_killed(run, peer_index) || is_swapped(run, peer_index));
+    HeartbeatResult &hb = run->heartbeat;
+    if (alert == Heartbeat::Alert::MISSING && !affected) {
+        hb.false_missing++;
+        return;
+    }
+    if ((alert != Heartbeat::Alert::MISSING && alert != Heartbeat::Alert::BAD_TOKEN) || !affected ||
+        !hb.reported.insert(((uint32_t)ecu->address << 16) | ((uint32_t)peer << 8) | (uint32_t)alert).second) {
+        return;
+    }
+    uint32_t latency_us = (uint32_t)((run->kernel->now() - run->event_ns) / 1000);
+    (alert == Heartbeat::Alert::MISSING ? hb.missing_us : hb.bad_token_us).push_back(latency_us);
+}
+
+// The firmware's heartbeat task: publish when due, check the peers
+static void heartbeat_task(Ecu *ecu) {
+    Run *run = ecu->run;
+    bool swapped = is_swapped(run, ecu->index);
+    for (;;) {
+        if (ecu->silent) {
+            return;
+        }
+        if (swapped && run->kernel->now() >= run->event_ns) {
+            // The replacement unit: same address and period, other key
+            ecu->heartbeat->start(WRONG_KEY, 1, true);
+            swapped = false;
+        }
+        uint32_t wait_ms = ecu->heartbeat->publish();
+        ecu->heartbeat->check();
+        wait_ms = std::min(wait_ms, Heartbeat::CHECK_INTERVAL_MS);
+        TickType_t ticks = pdMS_TO_TICKS(wait_ms);
+        vTaskDelay(ticks ? ticks : 1);
+    }
+}
+
+// Takes the killed nodes off the bus halfway through the traffic
+static void event_task(Run *run) {
+    for (Ecu &ecu : run->ecus) {
+        if (is_killed(run, ecu.index)) {
+            ecu.silent = true;
+        }
+    }
+}
+
+// The firmware's receiver task sweeps stale sessions every 10 ms
+static void housekeeping_task(Ecu *ecu) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(10) ? pdMS_TO_TICKS(10) : 1);
+        ecu->controller->cleanup_stale_sessions();
+    }
+}
+
+// TP.CM BAM announcements of 1785 bytes with no TP.DT after them
+static void flood_task(Run *run, MCP2515 *mcp) {
+    static const uint8_t sessions[] = {
+        J1939::SESSION_A, J1939::SESSION_B, J1939::SESSION_C,
+        J1939::SESSION_D, J1939::SESSION_E, J1939::SESSION_F
+    };
+    std::mt19937_64 rng(run->options->seed ^ 0xF100D);
+    std::exponential_distribution<double> gap_s(run->options->flood_rate);
+
+    for (uint32_t n = 0;; n++) {
+        TickType_t ticks = pdMS_TO_TICKS(gap_s(rng) * 1000);
+        vTaskDelay(ticks ? ticks : 1);
+        if (run->kernel->now() >= run->traffic_end_ns) {
+            return;
+        }
+
+        uint8_t src = (uint8_t)(FLOOD_SOURCE_BASE + n % run->options->flood_sources);
+        uint8_t session = sessions[(n / run->options->flood_sources) % sizeof(sessions)];
+        can_frame frame;
+        frame.can_id = J1939::Controller::make_can_id(J1939::PGN_TP_CM, J1939::GLOBAL_ADDRESS, src);
+        frame.can_dlc = 8;
+        frame.data[0] = 0x20 | (session << 4);
+        frame.data[1] = MAX_TP_SIZE & 0xFF;
+        frame.data[2] = MAX_TP_SIZE >> 8;
+        frame.data[3] = 255;
+        frame.data[4] = 0;
+        frame.data[5] = J1939::PGN_EXTRA & 0xFF;
+        frame.data[6] = (J1939::PGN_EXTRA >> 8) & 0xFF;
+        frame.data[7] = (J1939::PGN_EXTRA >> 16) & 0xFF;
+        if (mcp->sendMessage(&frame) == MCP2515::ERROR_OK) {
+            run->flood_sent++;
+        }
+    }
+}
+
+static double percentile_ms(std::vector<uint32_t> values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(q * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1000.0;
+}
+
+static double ratio_percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 100.0;
+}
+
+static Result run_once(const Options &options, size_t nodes, bool print_nodes) {
+    Sim::heap_reset();
+    Sim::Kernel kernel(CONFIG_FREERTOS_HZ);
+    kernel.set_log_enabled(options.verbose);
+    Sim::Bus bus(&kernel, options.bus, options.seed);
+
+    uint16_t packets = (options.tp_size + 6) / 7;
+    uint64_t traffic_ns = (uint64_t)(options.duration_s * 1e9);
+    uint64_t drain_ns = (3000ULL + packets * 60ULL) * 1000000ULL;
+
+    Run run;
+    run.options = &options;
+    run.kernel = &kernel;
+    run.traffic_end_ns = traffic_ns;
+    run.event_ns = traffic_ns / 2 / kernel.tick_ns() * kernel.tick_ns();
+    run.ecus.resize(nodes);
+
+    std::mt19937_64 rng(options.seed);
+    uint64_t period_ticks = pdMS_TO_TICKS(options.period_ms);
+    for (size_t i = 0; i < nodes; i++) {
+        Ecu *ecu = &run.ecus[i];
+        ecu->run = &run;
+        ecu->index = i;
+        ecu->address = (uint8_t)(i + 1);
+        ecu->node = bus.add_node();
+        ecu->mcp = new MCP2515(ecu->node);
+        ecu->rng.seed(options.seed * 1000003ULL + i);
+        {
+            // The controller and everything it allocates count as the node's heap
+            Sim::HeapOwner owner((int)i);
+            ecu->controller = new J1939::Controller(ecu->mcp, ecu->address);
+            ecu->controller->init();
+            if (options.address_filter) {
+                ecu->controller->set_address_filter(true);
+            }
+        }
+        ecu->controller->set_message_sink(on_message, ecu);
+        ecu->heartbeat = NULL;
+        ecu->silent = false;
+        if (options.heartbeat_ms) {
+            ecu->heartbeat = new Heartbeat::Monitor(ecu->mcp, NULL, ecu->address, options.bus.bitrate);
+            ecu->heartbeat->start(BUS_KEY, 1, true);
+            ecu->heartbeat->set_period(options.heartbeat_ms);
+            ecu->heartbeat->set_alert_sink(on_heartbeat_alert, ecu);
+        }
+        ecu->node->set_receiver([ecu](const can_frame &frame) {
+            if (!ecu->heartbeat || !ecu->heartbeat->on_frame(&frame)) {
+                ecu->controller->decode_j1939_message(&frame);
+            }
+        });
+
+        uint64_t phase = (rng() % period_ticks) * kernel.tick_ns();
+        kernel.spawn((int)i, phase, [ecu]() { periodic_task(ecu); });
+        if (options.tp_rate > 0) {
+            kernel.spawn((int)i, 0, [ecu]() { transport_task(ecu); });
+        }
+        kernel.spawn((int)i, 0, [ecu]() { housekeeping_task(ecu); });
+        if (ecu->heartbeat) {
+            kernel.spawn((int)i, phase, [ecu]() { heartbeat_task(ecu); });
+        }
+    }
+
+    if (options.heartbeat_ms) {
+        // Listens only, to measure what the heartbeats take of the bus
+        Sim::Node *observer = bus.add_node();
+        observer->set_receiver([&run](const can_frame &frame) {
+            uint32_t pgn = ((frame.can_id & CAN_EFF_MASK) >> 8) & 0x3FFFF;
+            if (pgn == Heartbeat::PGN_HEARTBEAT && run.kernel->now() < run.traffic_end_ns) {
+                run.heartbeat.frames++;
+                run.heartbeat.bits += Sim::Bus::frame_bits(frame);
+            }
+        });
+        size_t survivors = nodes - options.kill - options.swap;
+        run.heartbeat.expected_missing = survivors * (options.kill + options.swap);
+        run.heartbeat.expected_bad_token = survivors * options.swap;
+        if (options.kill) {
+            kernel.spawn((int)nodes, run.event_ns, [&run]() { event_task(&run); });
+        }
+    }
+
+    MCP2515 *flood_mcp = NULL;
+    if (options.flood_rate > 0) {
+        flood_mcp = new MCP2515(bus.add_node());
+        kernel.spawn((int)nodes, 0, [&run, flood_mcp]() { flood_task(&run, flood_mcp); });
+    }
+
+    auto wall_start = std::chrono::steady_clock::now();
+    kernel.run_until(traffic_ns + drain_ns);
+    auto wall_end = std::chrono::steady_clock::now();
+
+    Result result = {};
+    result.nodes = nodes;
+    result.simulated_s = kernel.now() / 1e9;
+    result.wall_s = std::chrono::duration<double>(wall_end - wall_start).count();
+    result.events = kernel.events();
+    result.bus = bus.stats;
+    result.load = bus.load(kernel.now());
+    result.warnings = kernel.log_count('W');
+    result.errors = kernel.log_count('E');
+    result.expected_single = run.single.attempted * (options.unicast ? 1 : nodes - 1);
+    result.expected_tp = run.tp.attempted * (nodes - 1);
+
+    int64_t heap_total = 0;
+    for (size_t i = 0; i < nodes; i++) {
+        Sim::NodeStats &s = bus.node(i)->stats;
+        result.bus_off += s.bus_off_events;
+        result.rx_frames += s.rx_frames;
+        result.rx_filtered += s.rx_filtered;
+        result.rx_overflows += s.rx_overflows;
+        result.tx_rejected += s.tx_rejected;
+        result.arbitration_lost += s.arbitration_lost;
+        result.tx_latency_us.insert(result.tx_latency_us.end(), s.tx_latency_us.begin(), s.tx_latency_us.end());
+        int64_t peak = Sim::heap_stats((int)i).peak;
+        result.heap_peak_max = std::max(result.heap_peak_max, peak);
+        heap_total += peak;
+    }
+    result.heap_peak_mean = heap_total / (int64_t)nodes;
+
+    for (Ecu &ecu : run.ecus) {
+        if (ecu.heartbeat && !is_killed(&run, ecu.index) && !is_swapped(&run, ecu.index)) {
+            run.heartbeat.period_ms = std::max(run.heartbeat.period_ms, ecu.heartbeat->effective_period_ms());
+            run.heartbeat.bound_ms = std::max(run.heartbeat.bound_ms, ecu.heartbeat->bound_ms());
+        }
+    }
+
+    if (print_nodes) {
+        static const char *STATES[] = {"active", "passive", "bus-off"};
+        printf("node  SA  tx_frames  tx_p99_ms  arb_lost  tx_errors  state     tec  rec  rx_ovf  heap_peak_B\n");
+        for (size_t i = 0; i < nodes; i++) {
+            Sim::Node *node = bus.node(i);
+            Sim::NodeStats &s = node->stats;
+            printf("%4zu  %02X  %9llu  %9.2f  %8llu  %9llu  %-8s %4u %4u  %6llu  %11lld\n",
+                   i, run.ecus[i].address, (unsigned long long)s.tx_frames, percentile_ms(s.tx_latency_us, 0.99),
+                   (unsigned long long)s.arbitration_lost, (unsigned long long)s.tx_errors,
+                   STATES[(int)node->error_state()], node->transmit_errors(), node->receive_errors(),
+                   (unsigned long long)s.rx_overflows, (long long)Sim::heap_stats((int)i).peak);
+        }
+        printf("\n");
+    }
+
+    kernel.shutdown();
+    for (Ecu &ecu : run.ecus) {
+        Sim::HeapOwner owner((int)ecu.index);
+        delete ecu.heartbeat;
+        delete ecu.controller;
+        delete ecu.mcp;
+    }
+    delete flood_mcp;
+
+    result.single = std::move(run.single);
+    result.tp = std::move(run.tp);
+    result.flood_sent = run.flood_sent;
+    result.heartbeat = std::move(run.heartbeat);
+    return result;
+}
+
+// Share of each node's time spent servicing received frames
+static double rx_cpu_percent(const Options &options, const Result &r) {
+    double busy_s = r.rx_frames * (options.bus.rx_service_us / 1e6);
+    return r.simulated_s > 0 ? 100.0 * busy_s / (r.nodes * r.simulated_s) : 0;
+}
+
+static void print_traffic(const char *name, const Traffic &t, uint64_t expected) {
+    printf("%-9s %llu sent, %llu failed, %llu/%llu delivered (%.2f %%), %llu corrupt, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           name, (unsigned long long)t.attempted, (unsigned long long)t.failed,
+           (unsigned long long)t.received, (unsigned long long)expected, ratio_percent(t.received, expected),
+           (unsigned long long)t.corrupt, percentile_ms(t.latency_us, 0.5), percentile_ms(t.latency_us, 0.99),
+           percentile_ms(t.latency_us, 1.0));
+}
+
+static void print_report(const Options &options, const Result &r) {
+    printf("%zu nodes, %u kbit/s, %.1f s simulated in %.2f s (%.0fx real time, %llu events)\n\n",
+           r.nodes, options.bus.bitrate / 1000, r.simulated_s, r.wall_s,
+           r.wall_s > 0 ? r.simulated_s / r.wall_s : 0, (unsigned long long)r.events);
+    printf("bus       load %.1f %%, %llu frames, %llu error frames, %llu collisions, %llu bus-off\n",
+           r.load * 100, (unsigned long long)r.bus.frames, (unsigned long long)r.bus.error_frames,
+           (unsigned long long)r.bus.collisions, (unsigned long long)r.bus_off);
+    printf("tx        latency p50 %.2f ms, p99 %.2f ms, max %.2f ms, %llu rejected (all buffers busy), %llu arbitration losses\n",
+           percentile_ms(r.tx_latency_us, 0.5), percentile_ms(r.tx_latency_us, 0.99),
+           percentile_ms(r.tx_latency_us, 1.0), (unsigned long long)r.tx_rejected,
+           (unsigned long long)r.arbitration_lost);
+    printf("rx        %llu frames serviced, %llu filtered, %llu overflows, %.2f %% CPU per node at %u us per frame\n",
+           (unsigned long long)r.rx_frames, (unsigned long long)r.rx_filtered, (unsigned long long)r.rx_overflows,
+           rx_cpu_percent(options, r), options.bus.rx_service_us);
+    if (options.unicast) {
+        printf("unicast   %llu decoded by nodes they were not addressed to\n", (unsigned long long)r.single.other_da);
+    }
+    if (options.flood_rate > 0) {
+        printf("flood     %llu BAM announcements without data from %zu sources\n",
+               (unsigned long long)r.flood_sent, options.flood_sources);
+    }
+    print_traffic("single", r.single, r.expected_single);
+    print_traffic("tp", r.tp, r.expected_tp);
+    if (options.heartbeat_ms) {
+        const HeartbeatResult &hb = r.heartbeat;
+        double traffic_s = std::min(options.duration_s, r.simulated_s);
+        printf("heartbeat period %u ms (%u ms set), %llu frames, %.3f %% of the bus (budget %.2f %%)\n",
+               hb.period_ms, options.heartbeat_ms, (unsigned long long)hb.frames,
+               100.0 * hb.bits / (options.bus.bitrate * traffic_s), Heartbeat::LOAD_BUDGET_PPM / 10000.0);
+        printf("detect    missing %zu/%llu, p50 %.1f ms, p99 %.1f ms, max %.1f ms (bound %u ms); "
+               "bad token %zu/%llu, p50 %.1f ms, max %.1f ms; %llu false missing\n",
+               hb.missing_us.size(), (unsigned long long)hb.expected_missing, percentile_ms(hb.missing_us, 0.5),
+               percentile_ms(hb.missing_us, 0.99), percentile_ms(hb.missing_us, 1.0),
+               hb.bound_ms,
+               hb.bad_token_us.size(), (unsigned long long)hb.expected_bad_token,
+               percentile_ms(hb.bad_token_us, 0.5), percentile_ms(hb.bad_token_us, 1.0),
+               (unsigned long long)hb.false_missing);
+    }
+    printf("heap      peak per node max %lld B, mean %lld B (Controller object %zu B)\n",
+           (long long)r.heap_peak_max, (long long)r.heap_peak_mean, sizeof(J1939::Controller));
+    printf("j1939     %llu warnings, %llu errors\n", (unsigned long long)r.warnings, (unsigned long long)r.errors);
+}
+
+static void print_sweep_row(const Options &options, const Result &r, bool header) {
+    if (header) {
+        printf("nodes  load_%%  frames  err_frames  tx_p99_ms  sf_ok_%%  sf_p99_ms  tp_ok_%%  tp_p99_ms  rx_ovf  rx_cpu_%%  heap_max_B  speedup\n");
+    }
+    printf("%5zu  %6.1f  %6llu  %10llu  %9.2f  %7.2f  %9.2f  %7.2f  %9.1f  %6llu  %8.2f  %10lld  %6.0fx\n",
+           r.nodes, r.load * 100, (unsigned long long)r.bus.frames, (unsigned long long)r.bus.error_frames,
+           percentile_ms(r.tx_latency_us, 0.99), ratio_percent(r.single.received, r.expected_single),
+           percentile_ms(r.single.latency_us, 0.99), ratio_percent(r.tp.received, r.expected_tp),
+           percentile_ms(r.tp.latency_us, 0.99), (unsigned long long)r.rx_overflows,
+           rx_cpu_percent(options, r), (long long)r.heap_peak_max, r.wall_s > 0 ? r.simulated_s / r.wall_s : 0);
+    fflush(stdout);
+}
+
+static bool parse_sweep(const char *arg, std::vector<size_t> *out) {
+    out->clear();
+    const char *p = arg;
+    while (*p) {
+        char *end;
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p || n < 2 || n > MAX_NODES) {
+            return false;
+        }
+        out->push_back(n);
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') {
+            return false;
+        }
+    }
+    return !out->empty();
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --nodes N         J1939 nodes on the bus (default 8, 2..%zu)\n"
+        "  --bitrate B       bit/s (default 250000)\n"
+        "  --duration S      seconds of traffic (default 60)\n"
+        "  --period-ms MS    single frame period per node (default 100)\n"
+        "  --tp-rate R       BAM transfers per second per node, 0 = none (default 0.2)\n"
+        "  --tp-size N       BAM payload bytes (default 64)\n"
+        "  --error-rate P    bit error probability (default 0)\n"
+        "  --rx-service-us U receive buffer service time per frame (default 100)\n"
+        "  --seed N          random seed (default 1)\n"
+        "  --unicast         single frames peer-to-peer to the next node instead of broadcast\n"
+        "  --address-filter  acceptance filters for the node's own address and global\n"
+        "  --flood-rate R    BAM announcements without data per second from a rogue node (default 0)\n"
+        "  --flood-sources N source addresses the rogue node cycles through (default 1, 1..%zu)\n"
+        "  --heartbeat-ms MS authenticated heartbeats at this period, 0 = none (default 0, up to %zu nodes)\n"
+        "  --kill N          with heartbeats, the last N nodes stop sending halfway through\n"
+        "  --swap N          with heartbeats, the N nodes before them get the wrong bus key\n"
+        "  --sweep N,N,...   one summary row per node count\n"
+        "  --verbose         print controller logs with simulated time\n",
+        name, MAX_NODES, MAX_FLOOD_SOURCES, Heartbeat::MAX_PEERS + 1);
+}
+
+int main(int argc, char **argv) {
+    Options options;
+
+    static const option long_options[] = {
+        {"nodes", required_argument, NULL, 'n'},
+        {"bitrate", required_argument, NULL, 'b'},
+        {"duration", required_argument, NULL, 'd'},
+        {"period-ms", required_argument, NULL, 'p'},
+        {"tp-rate", required_argument, NULL, 't'},
+        {"tp-size", required_argument, NULL, 's'},
+        {"error-rate", required_argument, NULL, 'e'},
+        {"rx-service-us", required_argument, NULL, 'x'},
+        {"seed", required_argument, NULL, 'r'},
+        {"unicast", no_argument, NULL, 'u'},
+        {"address-filter", no_argument, NULL, 'a'},
+        {"flood-rate", required_argument, NULL, 'f'},
+        {"flood-sources", required_argument, NULL, 'o'},
+        {"heartbeat-ms", required_argument, NULL, 'H'},
+        {"kill", required_argument, NULL, 'k'},
+        {"swap", required_argument, NULL, 'S'},
+        {"sweep", required_argument, NULL, 'w'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hv", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': options.nodes = strtoul(optarg, NULL, 10); break;
+        case 'b': options.bus.bitrate = strtoul(optarg, NULL, 10); break;
+        case 'd': options.duration_s = atof(optarg); break;
+        case 'p': options.period_ms = strtoul(optarg, NULL, 10); break;
+        case 't': options.tp_rate = atof(optarg); break;
+        case 's': options.tp_size = (uint16_t)strtoul(optarg, NULL, 10); break;
+        case 'e': options.bus.bit_error_rate = atof(optarg); break;
+        case 'x': options.bus.rx_service_us = strtoul(optarg, NULL, 10); break;
+        case 'r': options.seed = strtoull(optarg, NULL, 10); break;
+        case 'u': options.unicast = true; break;
+        case 'a': options.address_filter = true; break;
+        case 'f': options.flood_rate = atof(optarg); break;
+        case 'o': options.flood_sources = strtoul(optarg, NULL, 10); break;
+        case 'H': options.heartbeat_ms = strtoul(optarg, NULL, 10); break;
+        case 'k': options.kill = strtoul(optarg, NULL, 10); break;
+        case 'S': options.swap = strtoul(optarg, NULL, 10); break;
+        case 'w':
+            if (!parse_sweep(optarg, &options.sweep)) {
+                fprintf(stderr, "invalid --sweep %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'v': options.verbose = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (options.nodes < 2 || options.nodes > MAX_NODES) {
+        fprintf(stderr, "nodes must be 2..%zu\n", MAX_NODES);
+        return 1;
+    }
+    if (options.bus.bitrate < 10000 || options.bus.bitrate > 1000000) {
+        fprintf(stderr, "bitrate must be 10000..1000000\n");
+        return 1;
+    }
+    if (pdMS_TO_TICKS(options.period_ms) == 0) {
+        fprintf(stderr, "period must be at least one tick (%u ms)\n", (unsigned)portTICK_PERIOD_MS);
+        return 1;
+    }
+    if (options.tp_size < 9 || options.tp_size > MAX_TP_SIZE) {
+        fprintf(stderr, "tp-size must be 9..%u\n", MAX_TP_SIZE);
+        return 1;
+    }
+    if (options.flood_rate < 0 || options.flood_sources < 1 || options.flood_sources > MAX_FLOOD_SOURCES) {
+        fprintf(stderr, "flood-rate must be >= 0 and flood-sources 1..%zu\n", MAX_FLOOD_SOURCES);
+        return 1;
+    }
+    if (options.heartbeat_ms) {
+        // Every node tracks all the others; at least one must survive
+        size_t largest = options.sweep.empty() ? options.nodes
+                                               : *std::max_element(options.sweep.begin(), options.sweep.end());
+        size_t smallest = options.sweep.empty() ? options.nodes
+                                                : *std::min_element(options.sweep.begin(), options.sweep.end());
+        if (options.heartbeat_ms < Heartbeat::MIN_PERIOD_MS || options.heartbeat_ms > Heartbeat::MAX_PERIOD_MS ||
+            largest > Heartbeat::MAX_PEERS + 1 || options.kill + options.swap >= smallest) {
+            fprintf(stderr, "heartbeat-ms must be %u..%u with up to %zu nodes, kill + swap below the node count\n",
+                    (unsigned)Heartbeat::MIN_PERIOD_MS, (unsigned)Heartbeat::MAX_PERIOD_MS, Heartbeat::MAX_PEERS + 1);
+            return 1;
+        }
+    } else if (options.kill || options.swap) {
+        fprintf(stderr, "kill and swap need --heartbeat-ms\n");
+        return 1;
+    }
+    if (options.duration_s <= 0 || options.tp_rate < 0 || options.bus.bit_error_rate < 0 ||
+        options.bus.bit_error_rate >= 1) {
+        fprintf(stderr, "invalid duration, tp-rate or error-rate\n");
+        return 1;
+    }
+
+    if (options.sweep.empty()) {
+        Result result = run_once(options, options.nodes, true);
+        print_report(options, result);
+        return 0;
+    }
+
+    printf("%u kbit/s, %.1f s, period %u ms, tp %.2f/s x %u B, bit error rate %g, seed %llu\n\n",
+           options.bus.bitrate / 1000, options.duration_s, options.period_ms, options.tp_rate,
+           options.tp_size, options.bus.bit_error_rate, (unsigned long long)options.seed);
+    for (size_t i = 0; i < options.sweep.size(); i++) {
+        Result result = run_once(options, options.sweep[i], false);
+        print_sweep_row(options, result, i == 0);
+    }
+    return 0;
+}
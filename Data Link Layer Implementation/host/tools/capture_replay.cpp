@@ -0,0 +1,308 @@
+/**
+ * @file capture_replay.cpp
+ * @brief Replays captures into the J1939 receive path under stress
+ * @version 1.0
+ *
+ * Feeds a candump log, a PCAP file or a JSON capture of the sniffer to
+ * J1939::Controller::decode_j1939_message on the simulated clock of host/sim,
+ * so session timeouts see the capture's own timing:
+ *
+ * - original timing (--speed 1), scaled timing (--speed 10 is ten times
+ *   faster) or --max-rate, where each frame follows as soon as the previous
+ *   one has been decoded
+ * - --drop P and --reorder P drop a frame, or swap it with the next one,
+ *   with probability P
+ *
+ * As on the sniffer, stale sessions are cleaned up every 10 ms of simulated
+ * time. Reported are the share of announced TP transfers that were
+ * reassembled (also for a clean replay when faults are injected), CPU time
+ * per frame, the controller's peak heap, and the densest 100 ms of the
+ * replayed traffic against the rate the receive path can sustain on this
+ * host.
+ *
+ * To replay into a device over its UART instead, use
+ * Test scripts/capture_replay.py.
+ *
+ *   capture_replay --speed 10 drive.pcap
+ *   capture_replay --max-rate --drop 0.01 --reorder 0.01 drive.log
+ *
+ */
+
+#include "j1939.h"
+#include "capture_reader.h"
+#include "heap.h"
+#include "kernel.h"
+#include "freertos/FreeRTOS.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+static constexpr uint64_t CLEANUP_PERIOD_NS = 10000000;     // receiver task loop
+static constexpr int64_t RATE_WINDOW_US = 100000;
+
+struct ReplayOptions {
+    double speed = 1;
+    bool max_rate = false;
+    double drop = 0;
+    double reorder = 0;
+    uint64_t seed = 1;
+    bool verbose = false;
+};
+
+struct ReplayResult {
+    size_t frames = 0;
+    size_t dropped = 0;
+    size_t reordered = 0;
+    size_t announced = 0;           // TP.CM announcements in the capture
+    size_t reassembled = 0;
+    size_t single_frames = 0;
+    uint64_t warnings = 0;
+    uint64_t errors = 0;
+    double simulated_s = 0;
+    double cpu_s = 0;
+    std::vector<uint32_t> frame_ns;
+    Sim::HeapStats heap = {};
+    int64_t heap_held = 0;
+    size_t peak_window_frames = 0;
+};
+
+static void on_message(void *context, uint32_t pgn, uint8_t src_addr, const uint8_t *data, size_t len) {
+    ReplayResult *result = (ReplayResult *)context;
+    if (len > 8) {
+        result->reassembled++;
+    } else {
+        result->single_frames++;
+    }
+}
+
+static bool is_tp_announcement(const can_frame &frame) {
+    // The controller starts a session for every TP.CM with a zero low nibble
+    uint32_t id = frame.can_id & CAN_EFF_MASK;
+    return (frame.can_id & CAN_EFF_FLAG) && ((id >> 16) & 0xFF) == 0xEC && (frame.data[0] & 0x0F) == 0;
+}
+
+static double thread_cpu_s() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void inject_faults(std::vector<Host::TimedFrame> *frames, const ReplayOptions &options, ReplayResult *result) {
+    std::mt19937_64 rng(options.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    std::vector<Host::TimedFrame> kept;
+    kept.reserve(frames->size());
+    for (const Host::TimedFrame &f : *frames) {
+        if (options.drop > 0 && chance(rng) < options.drop) {
+            result->dropped++;
+        } else {
+            kept.push_back(f);
+        }
+    }
+
+    // Swap payloads, not times: the frames arrive out of order on schedule
+    for (size_t i = 0; i + 1 < kept.size(); i++) {
+        if (options.reorder > 0 && chance(rng) < options.reorder) {
+            std::swap(kept[i].frame, kept[i + 1].frame);
+            result->reordered++;
+            i++;
+        }
+    }
+    frames->swap(kept);
+}
+
+static ReplayResult replay(std::vector<Host::TimedFrame> frames, const ReplayOptions &options, bool inject) {
+    ReplayResult result;
+    for (const Host::TimedFrame &f : frames) {
+        result.announced += is_tp_announcement(f.frame);
+    }
+    if (inject) {
+        inject_faults(&frames, options, &result);
+    }
+    result.frames = frames.size();
+    result.frame_ns.reserve(frames.size());
+
+    Sim::heap_reset();
+    Sim::Kernel kernel(CONFIG_FREERTOS_HZ);
+    kernel.set_log_enabled(options.verbose);
+
+    J1939::Controller *controller;
+    {
+        // Receive only: the controller never touches the MCP2515 here
+        Sim::HeapOwner owner(0);
+        controller = new J1939::Controller(NULL);
+        controller->init();
+    }
+    controller->set_message_sink(on_message, &result);
+
+    int64_t start_us = frames.empty() ? 0 : frames.front().time_us;
+    uint64_t clock_ns = 0;
+    uint64_t next_cleanup = CLEANUP_PERIOD_NS;
+    size_t window_start = 0;
+    double cpu_start = thread_cpu_s();
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!options.max_rate) {
+            int64_t offset_us = frames[i].time_us - start_us;
+            uint64_t at = offset_us > 0 ? (uint64_t)(offset_us * 1000 / options.speed) : 0;
+            clock_ns = std::max(clock_ns, at);
+
+            // Densest stretch of the replayed traffic, in replay time
+            while ((frames[i].time_us - frames[window_start].time_us) / options.speed > RATE_WINDOW_US) {
+                window_start++;
+            }
+            result.peak_window_frames = std::max(result.peak_window_frames, i - window_start + 1);
+        }
+
+        while (next_cleanup <= clock_ns) {
+            kernel.run_until(next_cleanup);
+            Sim::HeapOwner owner(0);
+            controller->cleanup_stale_sessions();
+            next_cleanup += CLEANUP_PERIOD_NS;
+        }
+        kernel.run_until(clock_ns);
+
+        auto begin = std::chrono::steady_clock::now();
+        {
+            Sim::HeapOwner owner(0);
+            controller->decode_j1939_message(&frames[i].frame);
+        }
+        uint64_t spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        result.frame_ns.push_back((uint32_t)std::min<uint64_t>(spent, UINT32_MAX));
+        if (options.max_rate) {
+            clock_ns += spent;
+        }
+    }
+
+    result.cpu_s = thread_cpu_s() - cpu_start;
+    result.simulated_s = kernel.now() / 1e9;
+    result.warnings = kernel.log_count('W');
+    result.errors = kernel.log_count('E');
+    result.heap = Sim::heap_stats(0);
+    result.heap_held = result.heap.current;
+
+    Sim::HeapOwner owner(0);
+    delete controller;
+    return result;
+}
+
+static double percentile_ns(std::vector<uint32_t> values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(q * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static double percent(size_t part, size_t whole) {
+    return whole ? 100.0 * part / whole : 100.0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options] capture.{log,pcap,json}\n"
+        "  --speed X         replay X times faster than recorded (default 1)\n"
+        "  --max-rate        ignore timestamps, decode back to back\n"
+        "  --drop P          drop each frame with probability P\n"
+        "  --reorder P       swap a frame with the next one with probability P\n"
+        "  --seed N          fault injection seed (default 1)\n"
+        "  --verbose         print controller logs with replay time\n",
+        name);
+}
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+
+    static const option long_options[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"max-rate", no_argument, NULL, 'm'},
+        {"drop", required_argument, NULL, 'd'},
+        {"reorder", required_argument, NULL, 'o'},
+        {"seed", required_argument, NULL, 'r'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hv", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's': options.speed = atof(optarg); break;
+        case 'm': options.max_rate = true; break;
+        case 'd': options.drop = atof(optarg); break;
+        case 'o': options.reorder = atof(optarg); break;
+        case 'r': options.seed = strtoull(optarg, NULL, 10); break;
+        case 'v': options.verbose = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.speed <= 0 || options.drop < 0 || options.drop > 1 || options.reorder < 0 || options.reorder > 1) {
+        fprintf(stderr, "speed must be positive, drop and reorder within 0..1\n");
+        return 1;
+    }
+
+    Host::CaptureReader reader;
+    if (!reader.open(argv[optind])) {
+        fprintf(stderr, "cannot open %s (or not a CAN capture)\n", argv[optind]);
+        return 1;
+    }
+    std::vector<Host::TimedFrame> frames;
+    Host::TimedFrame f;
+    while (reader.next(&f)) {
+        frames.push_back(f);
+    }
+    if (frames.empty()) {
+        fprintf(stderr, "no frames\n");
+        return 1;
+    }
+
+    bool inject = options.drop > 0 || options.reorder > 0;
+    ReplayResult r = replay(frames, options, inject);
+
+    double span_s = (frames.back().time_us - frames.front().time_us) / 1e6;
+    printf("capture   %s (%s), %zu frames over %.3f s, %zu skipped records\n", argv[optind],
+           Host::CaptureReader::format_name(reader.format()), frames.size(), span_s, reader.skipped());
+    if (options.max_rate) {
+        printf("replay    max rate: %.3f s simulated\n", r.simulated_s);
+    } else {
+        printf("replay    %.3gx speed: %.3f s simulated\n", options.speed, r.simulated_s);
+    }
+    if (inject) {
+        printf("inject    %zu dropped (%.2f %%), %zu swapped (%.2f %%), seed %llu\n",
+               r.dropped, percent(r.dropped, frames.size()), r.reordered, percent(r.reordered, frames.size()),
+               (unsigned long long)options.seed);
+    }
+    printf("rx        %zu single frame messages, %llu j1939 warnings, %llu errors\n",
+           r.single_frames, (unsigned long long)r.warnings, (unsigned long long)r.errors);
+    printf("tp        %zu/%zu announced transfers reassembled (%.2f %%)", r.reassembled, r.announced,
+           percent(r.reassembled, r.announced));
+    if (inject) {
+        ReplayResult clean = replay(frames, options, false);
+        printf(", clean replay %zu/%zu (%.2f %%)", clean.reassembled, clean.announced,
+               percent(clean.reassembled, clean.announced));
+    }
+    printf("\n");
+
+    double mean_ns = r.frames ? r.cpu_s * 1e9 / r.frames : 0;
+    printf("cpu       %.0f ns/frame mean (thread CPU), p50 %.0f ns, p99 %.0f ns, max %.0f ns\n", mean_ns,
+           percentile_ns(r.frame_ns, 0.5), percentile_ns(r.frame_ns, 0.99), percentile_ns(r.frame_ns, 1.0));
+    printf("memory    controller heap peak %lld B, %lld B held at the end (object included), %llu allocations\n",
+           (long long)r.heap.peak, (long long)r.heap_held, (unsigned long long)r.heap.allocations);
+    if (!options.max_rate && mean_ns > 0) {
+        printf("load      densest 100 ms: %zu frames (%.0f frames/s); receive path limit on this host %.0f frames/s\n",
+               r.peak_window_frames, r.peak_window_frames * 1e6 / RATE_WINDOW_US, 1e9 / mean_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,527 @@
+/**
+ * @file j1939_bench.cpp
+ * @brief Microbenchmarks for the J1939 data link layer hot paths
+ * @version 1.0
+ *
+ * Runs fixed synthetic workloads through the sniffer's J1939::Controller on
+ * the simulated clock of host/sim:
+ *
+ * - decode_sf_flood: single frames of eight PGNs from eight senders
+ * - decode_bam_N: one BAM (TP.CM) and its TP.DT packets for N bytes
+ * - decode_interleaved_6: six 64 byte BAMs from six senders, with their
+ *   packets interleaved
+ * - stale_churn_96: 96 announced sessions that never complete, expired by
+ *   cleanup_stale_sessions
+ * - encode_sf, encode_bam_N: send_single_frame_message and the frame building
+ *   of send_multi_frame_message. Delays only advance the simulated clock and
+ *   the frames are discarded by the MCP2515 shim.
+ * - pgn_to_string over all known PGNs and an unknown one
+ *
+ * Each workload is checked (messages delivered, warnings logged) so a broken
+ * path cannot pass as a fast one. Reported are ns per frame (per call for
+ * pgn_to_string) as the median and minimum of the repetitions, ns and heap
+ * allocations per message, and cycles, instructions and cache misses per
+ * frame where perf_event_open is permitted. Times include the allocation
+ * accounting of host/sim/heap.cpp.
+ *
+ * --profile prints the PROFILE_SCOPE histograms of the firmware code after
+ * the run, in the format of the firmware's "prof" command; it needs a build
+ * with -DDIAG_PROFILE=ON, whose timings then include the profiler. --stats
+ * prints the J1939 counters and histograms of the firmware's "stats" command,
+ * summed over all repetitions.
+ *
+ * --json writes the results for later comparison; --baseline compares with
+ * such a file and exits with status 3 when a workload got slower by more than
+ * --threshold percent.
+ *
+ *   j1939_bench --json bench.json
+ *   j1939_bench --baseline bench.json --threshold 10 --filter decode
+ *
+ */
+
+#include "j1939.h"
+#include "heap.h"
+#include "kernel.h"
+#include "mcp2515/mcp2515.h"
+#include "perf_counters.h"
+#include "profile.h"
+#include "metrics.h"
+#include "freertos/FreeRTOS.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+static constexpr uint8_t TP_SESSIONS[] = {
+    J1939::SESSION_A, J1939::SESSION_B, J1939::SESSION_C,
+    J1939::SESSION_D, J1939::SESSION_E, J1939::SESSION_F
+};
+static constexpr size_t TP_SESSION_COUNT = sizeof(TP_SESSIONS) / sizeof(TP_SESSIONS[0]);
+static constexpr size_t BAM_SIZES[] = {9, 64, 256, 1785};
+static constexpr uint32_t BENCH_PGN = 0xFEF1;
+static constexpr size_t CHURN_SENDERS = 16;
+
+struct Fixture {
+    Sim::Kernel kernel;
+    J1939::Controller *controller;
+    uint64_t delivered;
+    uint64_t checksum;      // keeps the payloads live
+
+    Fixture() : kernel(CONFIG_FREERTOS_HZ), controller(NULL), delivered(0), checksum(0) {
+        kernel.set_inline_delays(true);
+        // The MCP2515 shim without a node discards what the controller sends
+        mcp2515 = new MCP2515(NULL);
+        controller = new J1939::Controller(mcp2515);
+        controller->init();
+        controller->set_message_sink(on_message, this);
+    }
+
+    ~Fixture() {
+        delete controller;
+        delete mcp2515;
+    }
+
+    static void on_message(void *context, uint32_t pgn, uint8_t src_addr, const uint8_t *data, size_t len) {
+        Fixture *fixture = (Fixture *)context;
+        fixture->delivered++;
+        fixture->checksum += pgn + src_addr + len + (len ? data[len - 1] : 0);
+    }
+
+private:
+    MCP2515 *mcp2515;
+};
+
+struct Workload {
+    std::string name;
+    const char *unit;
+    size_t units;               // frames (or calls) per iteration
+    size_t messages;            // messages received, sent or expired per iteration
+    uint64_t delivered;         // messages the sink should see per iteration
+    uint64_t warnings;          // controller warnings expected per iteration
+    std::function<bool(Fixture &)> iteration;
+};
+
+struct Result {
+    std::string name;
+    const char *unit;
+    bool ok;
+    uint64_t iterations;
+    double ns_per_unit;         // median of the repetitions
+    double ns_per_unit_min;
+    double ns_per_message;
+    double allocs_per_message;
+    double counters[Host::PerfCounters::COUNT];   // per unit, negative if unavailable
+};
+
+static can_frame make_frame(uint32_t id, const uint8_t *data, uint8_t len) {
+    can_frame frame = {};
+    frame.can_id = CAN_EFF_FLAG | id;
+    frame.can_dlc = len;
+    memcpy(frame.data, data, len);
+    return frame;
+}
+
+static void append_bam(std::vector<can_frame> *frames, uint8_t src, uint8_t session, size_t size) {
+    uint16_t packets = (uint16_t)((size + 6) / 7);
+    uint8_t cm[8] = {
+        (uint8_t)(0x20 | (session << 4)), (uint8_t)(size & 0xFF), (uint8_t)(size >> 8),
+        (uint8_t)std::min<uint16_t>(packets, 255), 0xFF,
+        (uint8_t)(BENCH_PGN & 0xFF), (uint8_t)(BENCH_PGN >> 8), (uint8_t)(BENCH_PGN >> 16)
+    };
+    frames->push_back(make_frame(0x18ECFF00 | src, cm, 8));
+}
+
+static can_frame bam_packet(uint8_t src, uint8_t session, uint16_t seq, size_t size) {
+    uint8_t dt[8];
+    dt[0] = (uint8_t)((((seq - 1) % 15) + 1) | (session << 4));
+    for (size_t i = 0; i < 7; i++) {
+        size_t offset = (seq - 1) * 7 + i;
+        dt[1 + i] = offset < size ? (uint8_t)(offset * 31 + src) : 0xFF;
+    }
+    return make_frame(0x18EBFF00 | src, dt, 8);
+}
+
+static Workload decode_workload(const std::string &name, std::vector<can_frame> frames, size_t messages) {
+    size_t count = frames.size();
+    return {name, "frame", count, messages, messages, 0, [frames](Fixture &f) {
+        for (const can_frame &frame : frames) {
+            f.controller->decode_j1939_message(&frame);
+        }
+        return true;
+    }};
+}
+
+static std::vector<Workload> build_workloads() {
+    std::vector<Workload> workloads;
+
+    std::vector<can_frame> flood;
+    static const uint32_t flood_pgns[] = {
+        0xF004, 0xF003, 0xFEF1, 0xFEEE, 0xF001, 0xFEBF, 0xFE6C, 0xFEF2
+    };
+    for (size_t i = 0; i < 1024; i++) {
+        uint8_t data[8];
+        for (size_t b = 0; b < 8; b++) {
+            data[b] = (uint8_t)(i + b);
+        }
+        uint32_t pgn = flood_pgns[i % 8];
+        uint8_t src = (uint8_t)((i / 8) % 8);
+        flood.push_back(make_frame(0x0C000000 | (pgn << 8) | src, data, 8));
+    }
+    workloads.push_back(decode_workload("decode_sf_flood", flood, flood.size()));
+
+    for (size_t size : BAM_SIZES) {
+        std::vector<can_frame> frames;
+        append_bam(&frames, 0x21, J1939::SESSION_A, size);
+        for (uint16_t seq = 1; seq <= (size + 6) / 7; seq++) {
+            frames.push_back(bam_packet(0x21, J1939::SESSION_A, seq, size));
+        }
+        workloads.push_back(decode_workload("decode_bam_" + std::to_string(size), frames, 1));
+    }
+
+    std::vector<can_frame> interleaved;
+    for (size_t s = 0; s < TP_SESSION_COUNT; s++) {
+        append_bam(&interleaved, (uint8_t)(0x30 + s), TP_SESSIONS[s], 64);
+    }
+    for (uint16_t seq = 1; seq <= (64 + 6) / 7; seq++) {
+        for (size_t s = 0; s < TP_SESSION_COUNT; s++) {
+            interleaved.push_back(bam_packet((uint8_t)(0x30 + s), TP_SESSIONS[s], seq, 64));
+        }
+    }
+    workloads.push_back(decode_workload("decode_interleaved_6", interleaved, TP_SESSION_COUNT));
+
+    // Every session is announced and then expires; each removal is logged
+    std::vector<can_frame> announcements;
+    for (size_t src = 0; src < CHURN_SENDERS; src++) {
+        for (size_t s = 0; s < TP_SESSION_COUNT; s++) {
+            append_bam(&announcements, (uint8_t)(0x40 + src), TP_SESSIONS[s], 256);
+        }
+    }
+    size_t churn = announcements.size();
+    workloads.push_back({"stale_churn_" + std::to_string(churn), "frame", churn, churn, 0, churn,
+                         [announcements](Fixture &f) {
+        for (const can_frame &frame : announcements) {
+            f.controller->decode_j1939_message(&frame);
+        }
+        f.kernel.run_until(f.kernel.now() + (J1939::SESSION_TIMEOUT_MS + 1) * 1000000ull);
+        f.controller->cleanup_stale_sessions();
+        return true;
+    }});
+
+    static const uint8_t sf_payload[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    workloads.push_back({"encode_sf", "frame", 1, 1, 0, 0, [](Fixture &f) {
+        return f.controller->send_single_frame_message(J1939::PGN_SINGLE_FRAME_TEST, J1939::GLOBAL_ADDRESS, sf_payload, 8);
+    }});
+
+    for (size_t size : BAM_SIZES) {
+        std::vector<uint8_t> payload(size);
+        for (size_t i = 0; i < size; i++) {
+            payload[i] = (uint8_t)i;
+        }
+        workloads.push_back({"encode_bam_" + std::to_string(size), "frame", 1 + (size + 6) / 7, 1, 0, 0,
+                             [payload](Fixture &f) {
+            return f.controller->send_multi_frame_message(J1939::PGN_EXTRA, J1939::GLOBAL_ADDRESS, payload.data(), (uint16_t)payload.size());
+        }});
+    }
+
+    static const uint32_t lookup_pgns[] = {
+        J1939::PGN_REQUEST, J1939::PGN_TP_CM, J1939::PGN_TP_DT, J1939::PGN_ACK,
+        J1939::PGN_COMPONENT_ID, J1939::PGN_SOFTWARE_ID, J1939::PGN_PEER_TO_PEER_MESSAGE,
+        J1939::PGN_GROUP_MESSAGE, J1939::PGN_EXTRA, J1939::PGN_SINGLE_FRAME_TEST, 0xF004
+    };
+    size_t lookups = sizeof(lookup_pgns) / sizeof(lookup_pgns[0]);
+    workloads.push_back({"pgn_to_string", "call", lookups, 0, 0, 0, [lookups](Fixture &f) {
+        for (size_t i = 0; i < lookups; i++) {
+            f.checksum += (uintptr_t)J1939::Controller::pgn_to_string(lookup_pgns[i]);
+        }
+        return true;
+    }});
+
+    return workloads;
+}
+
+// Runs the given number of iterations; false if an iteration failed or the
+// controller did not deliver or warn as expected
+static bool run_iterations(Fixture &f, const Workload &w, uint64_t iterations) {
+    uint64_t delivered = f.delivered;
+    uint64_t warnings = f.kernel.log_count('W');
+    bool ok = true;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ok &= w.iteration(f);
+    }
+    return ok && f.delivered - delivered == iterations * w.delivered && f.kernel.log_count('W') - warnings == iterations * w.warnings &&
+           f.kernel.log_count('E') == 0;
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point begin) {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static Result measure(const Workload &w, double min_time_s, int repetitions, Host::PerfCounters &perf) {
+    Result result = {};
+    result.name = w.name;
+    result.unit = w.unit;
+    result.ok = true;
+
+    Sim::HeapOwner owner(0);
+    Fixture fixture;
+
+    // Warm up, then grow the iteration count until one repetition takes min_time
+    uint64_t iterations = 1;
+    result.ok &= run_iterations(fixture, w, iterations);
+    while (true) {
+        auto begin = std::chrono::steady_clock::now();
+        result.ok &= run_iterations(fixture, w, iterations);
+        double ns = elapsed_ns(begin);
+        if (ns >= min_time_s * 1e9 || !result.ok) {
+            break;
+        }
+        uint64_t target = ns > 0 ? (uint64_t)(iterations * min_time_s * 1e9 / ns * 1.1) : iterations * 10;
+        iterations = std::max(iterations * 2, std::min(target, iterations * 100));
+    }
+    result.iterations = iterations;
+
+    std::vector<double> per_unit;
+    double total_ns = 0;
+    double totals[Host::PerfCounters::COUNT] = {};
+    uint64_t allocations = Sim::heap_stats(0).allocations;
+
+    for (int rep = 0; rep < repetitions && result.ok; rep++) {
+        double values[Host::PerfCounters::COUNT];
+        perf.start();
+        auto begin = std::chrono::steady_clock::now();
+        result.ok &= run_iterations(fixture, w, iterations);
+        double ns = elapsed_ns(begin);
+        perf.stop(values);
+
+        per_unit.push_back(ns / (iterations * w.units));
+        total_ns += ns;
+        for (int i = 0; i < Host::PerfCounters::COUNT; i++) {
+            totals[i] += values[i];
+        }
+    }
+    allocations = Sim::heap_stats(0).allocations - allocations;
+
+    uint64_t runs = (uint64_t)per_unit.size() * iterations;
+    if (runs == 0) {
+        result.ok = false;
+        return result;
+    }
+    std::sort(per_unit.begin(), per_unit.end());
+    result.ns_per_unit = per_unit[per_unit.size() / 2];
+    result.ns_per_unit_min = per_unit.front();
+    result.ns_per_message = w.messages ? total_ns / (runs * w.messages) : 0;
+    result.allocs_per_message = w.messages ? (double)allocations / (runs * w.messages) : 0;
+    for (int i = 0; i < Host::PerfCounters::COUNT; i++) {
+        result.counters[i] = perf.available(i) ? totals[i] / (runs * w.units) : -1;
+    }
+    return result;
+}
+
+static void json_number(FILE *out, const char *key, double value, const char *format = "%.2f") {
+    fprintf(out, ",\"%s\":", key);
+    if (value < 0) {
+        fprintf(out, "null");
+    } else {
+        fprintf(out, format, value);
+    }
+}
+
+// One benchmark per line, so --baseline can read the file back line by line
+static bool write_json(const char *path, const std::vector<Result> &results, double min_time_s, int repetitions,
+                       bool perf) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return false;
+    }
+    fprintf(out, "{\"tool\":\"j1939_bench\",\"schema\":1,\"tick_hz\":%d,\"compiler\":\"%s\","
+                 "\"min_time_s\":%.3f,\"repetitions\":%d,\"perf_counters\":%s,\"benchmarks\":[\n",
+            CONFIG_FREERTOS_HZ, __VERSION__, min_time_s, repetitions, perf ? "true" : "false");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(out, "{\"name\":\"%s\",\"unit\":\"%s\",\"ok\":%s,\"iterations\":%llu", r.name.c_str(), r.unit,
+                r.ok ? "true" : "false", (unsigned long long)r.iterations);
+        json_number(out, "ns_per_unit", r.ns_per_unit);
+        json_number(out, "ns_per_unit_min", r.ns_per_unit_min);
+        json_number(out, "ns_per_message", r.ns_per_message);
+        json_number(out, "allocs_per_message", r.allocs_per_message, "%.3f");
+        json_number(out, "cycles_per_unit", r.counters[Host::PerfCounters::CYCLES], "%.1f");
+        json_number(out, "instructions_per_unit", r.counters[Host::PerfCounters::INSTRUCTIONS], "%.1f");
+        json_number(out, "cache_misses_per_unit", r.counters[Host::PerfCounters::CACHE_MISSES], "%.3f");
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return true;
+}
+
+static bool read_baseline(const char *path, std::map<std::string, double> *baseline) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        char name[128];
+        const char *value = strstr(line, "\"ns_per_unit\":");
+        if (sscanf(line, "{\"name\":\"%127[^\"]\"", name) == 1 && value) {
+            (*baseline)[name] = atof(value + strlen("\"ns_per_unit\":"));
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+static void print_counter(double value, const char *format) {
+    if (value < 0) {
+        printf("  %10s", "n/a");
+    } else {
+        printf(format, value);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --filter TEXT     only run workloads whose name contains TEXT\n"
+        "  --min-time S      duration of one repetition (default 0.1)\n"
+        "  --repetitions N   repetitions per workload (default 5)\n"
+        "  --json PATH       write the results as JSON (- for stdout)\n"
+        "  --baseline PATH   compare ns per frame with an earlier --json file\n"
+        "  --threshold PCT   slowdown that counts as a regression (default 10)\n"
+        "  --profile         print the PROFILE_SCOPE histograms (-DDIAG_PROFILE=ON)\n"
+        "  --stats           print the firmware metrics after the run\n"
+        "  --list            list the workloads\n",
+        name);
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    double min_time_s = 0.1;
+    int repetitions = 5;
+    double threshold = 10;
+    bool list = false;
+    bool profile = false;
+    bool stats = false;
+
+    static const option options[] = {
+        {"filter", required_argument, NULL, 'f'},
+        {"min-time", required_argument, NULL, 't'},
+        {"repetitions", required_argument, NULL, 'n'},
+        {"json", required_argument, NULL, 'j'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"threshold", required_argument, NULL, 'p'},
+        {"profile", no_argument, NULL, 'P'},
+        {"stats", no_argument, NULL, 'S'},
+        {"list", no_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 't': min_time_s = atof(optarg); break;
+        case 'n': repetitions = atoi(optarg); break;
+        case 'j': json_path = optarg; break;
+        case 'b': baseline_path = optarg; break;
+        case 'p': threshold = atof(optarg); break;
+        case 'P': profile = true; break;
+        case 'S': stats = true; break;
+        case 'l': list = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (min_time_s <= 0 || repetitions <= 0 || threshold < 0) {
+        fprintf(stderr, "min-time and repetitions must be positive, threshold not negative\n");
+        return 1;
+    }
+
+    std::map<std::string, double> baseline;
+    if (baseline_path && !read_baseline(baseline_path, &baseline)) {
+        fprintf(stderr, "cannot open %s\n", baseline_path);
+        return 1;
+    }
+
+    std::vector<Workload> workloads = build_workloads();
+    if (list) {
+        for (const Workload &w : workloads) {
+            printf("%-22s %5zu %ss, %zu messages per iteration\n", w.name.c_str(), w.units, w.unit, w.messages);
+        }
+        return 0;
+    }
+
+    if (profile && !PROFILE_ENABLED) {
+        fprintf(stderr, "built without -DDIAG_PROFILE=ON, --profile prints no sites\n");
+    }
+
+    Host::PerfCounters perf;
+    if (!perf.any_available()) {
+        fprintf(stderr, "hardware counters unavailable (perf_event_paranoid or no PMU), reporting times only\n");
+    }
+
+    printf("%-22s %5s  %9s  %9s  %10s  %10s  %10s  %10s  %10s\n", "benchmark", "unit", "ns/unit", "min",
+           "ns/msg", "allocs/msg", "cycles", "instr", "misses");
+
+    std::vector<Result> results;
+    bool failed = false;
+    bool regressed = false;
+    for (const Workload &w : workloads) {
+        if (filter && w.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        Result r = measure(w, min_time_s, repetitions, perf);
+        results.push_back(r);
+
+        printf("%-22s %5s  %9.1f  %9.1f", r.name.c_str(), r.unit, r.ns_per_unit, r.ns_per_unit_min);
+        if (w.messages) {
+            printf("  %10.1f  %10.3f", r.ns_per_message, r.allocs_per_message);
+        } else {
+            printf("  %10s  %10s", "-", "-");
+        }
+        print_counter(r.counters[Host::PerfCounters::CYCLES], "  %10.1f");
+        print_counter(r.counters[Host::PerfCounters::INSTRUCTIONS], "  %10.1f");
+        print_counter(r.counters[Host::PerfCounters::CACHE_MISSES], "  %10.3f");
+
+        auto base = baseline.find(r.name);
+        if (r.ok && base != baseline.end() && base->second > 0) {
+            double change = 100.0 * (r.ns_per_unit - base->second) / base->second;
+            bool regression = change > threshold;
+            printf("  %+6.1f %%%s", change, regression ? " REGRESSION" : "");
+            regressed |= regression;
+        }
+        if (!r.ok) {
+            printf("  FAILED");
+            failed = true;
+        }
+        printf("\n");
+    }
+
+    if (profile) {
+        Profile::dump();
+    }
+    if (stats) {
+        Metrics::dump();
+    }
+
+    if (json_path && !write_json(json_path, results, min_time_s, repetitions, perf.any_available())) {
+        return 1;
+    }
+    if (failed) {
+        fprintf(stderr, "a workload did not deliver the expected messages\n");
+        return 2;
+    }
+    return regressed ? 3 : 0;
+}
@@ -0,0 +1,109 @@
+# bus_latency_test.py
+# Script to run the firmware ping/echo probe and store the CAN round trip as CSV
+#
+# One node pings, every other node on the bus answers (echo is on by
+# default). Timing happens on the nodes with esp_timer, so unlike
+# complete_latency_test.py the serial links and Python are not part of the
+# measurement. Only the pinging node needs to be connected; --echo-port
+# switches echo on at a peer that was turned off.
+#
+# Results go to results/bus_latency_<size>_bytes.csv with the columns of
+# complete_latency_test.py followed by one_way_latency_ms, send_time_ms, size
+# and the µs timestamps, so plot_latency.py reads them unchanged.
+
+import serial
+import sys
+import os
+import time
+import argparse
+import statistics
+
+CSV_HEADER_START = "message_id,round_trip_latency_ms"
+
+def run_size(ser, count, size, interval_ms, timeout):
+    ser.reset_input_buffer()
+    ser.write(('{"c":"ping","d":"%d,%d,%d"}\n' % (count, size, interval_ms)).encode("utf-8"))
+
+    header = None
+    rows = []
+    summary = None
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        line = ser.readline().decode("utf-8", errors="replace").strip()
+        if not line:
+            continue
+        if line.startswith(CSV_HEADER_START):
+            header = line
+        elif line.startswith('{"probe":"error"'):
+            return None, [], line
+        elif line.startswith('{"probe":"done"'):
+            summary = line
+            break
+        elif header and line[0].isdigit() and line.count(",") == header.count(","):
+            rows.append(line)
+    else:
+        ser.write(b'{"c":"ping","d":"stop"}\n')
+    return header, rows, summary
+
+def save(path, header, rows):
+    os.makedirs(os.path.dirname(path) or ".", exist_ok=True)
+    with open(path, "w") as f:
+        f.write(header + "\n")
+        for row in rows:
+            f.write(row + "\n")
+
+def report(size, rows, summary):
+    if not rows:
+        print(f"{size:5d} B: no replies ({summary})")
+        return
+    rtt = [float(r.split(",")[1]) for r in rows]
+    one_way = [float(r.split(",")[4]) for r in rows]
+    p99 = sorted(rtt)[min(len(rtt) - 1, int(0.99 * len(rtt)))]
+    print(f"{size:5d} B: {len(rows)} replies, RTT mean {statistics.mean(rtt):.3f} ms, "
+          f"median {statistics.median(rtt):.3f} ms, p99 {p99:.3f} ms, "
+          f"one-way ~{statistics.median(one_way):.3f} ms")
+    if summary:
+        print(f"         {summary}")
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure CAN round-trip latency with the firmware ping/echo probe')
+    parser.add_argument('--port', required=True, help='Serial port of the pinging node')
+    parser.add_argument('--echo-port', help='Serial port of a responder to switch echo on')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    parser.add_argument('--count', type=int, default=50, help='Requests per size')
+    parser.add_argument('--sizes', default='8,50,150,200', help='Comma separated message sizes (6..1785 bytes)')
+    parser.add_argument('--interval', type=int, default=100, help='Minimum ms between requests')
+    parser.add_argument('--output-dir', default='results', help='Directory for the CSV files')
+    args = parser.parse_args()
+
+    try:
+        sizes = [int(s) for s in args.sizes.split(",")]
+    except ValueError:
+        print("Sizes must be integers")
+        sys.exit(1)
+
+    if args.echo_port:
+        with serial.Serial(args.echo_port, args.baud, timeout=0.1) as peer:
+            time.sleep(0.5)
+            peer.write(b'{"c":"echo","d":"on"}\n')
+
+    ser = serial.Serial(args.port, args.baud, timeout=0.2)
+    time.sleep(0.5)
+
+    for size in sizes:
+        # TP.DT packets are paced 50 ms apart, in both directions
+        packets = (size + 6) // 7 if size > 8 else 0
+        timeout = args.count * (args.interval / 1000.0 + 1.0 + packets * 0.12) + 5
+        header, rows, summary = run_size(ser, args.count, size, args.interval, timeout)
+        if header is None:
+            print(f"{size:5d} B: {summary or 'no run started, is the node running the probe firmware?'}")
+            continue
+        path = os.path.join(args.output_dir, f"bus_latency_{size}_bytes.csv")
+        save(path, header, rows)
+        report(size, rows, summary)
+        print(f"         saved {path}")
+
+    ser.close()
+
+if __name__ == "__main__":
+    main()
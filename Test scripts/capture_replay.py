@@ -0,0 +1,273 @@
+# capture_replay.py
+# Script to replay candump, PCAP or JSON captures into the sniffer's receive path over serial
+#
+# Frames are injected with the sniffer's {"c":"rx"} command, several per
+# line, and go through the same rules, IDS and J1939 decoding as frames from
+# the bus. Timing follows the capture (--speed scales it) or --max-rate sends
+# as fast as the UART allows; --drop and --reorder inject faults. At the end
+# the reassembled transfers echoed by the sniffer are compared with the
+# transfers announced in the capture, and the sniffer reports CPU time per
+# frame and its free heap.
+#
+# The host build replays the same captures without hardware and much faster:
+# Data Link Layer Implementation/host, tool capture_replay.
+
+import serial
+import sys
+import time
+import argparse
+import struct
+import random
+import threading
+
+PCAP_MAGIC_USEC = 0xA1B2C3D4
+PCAP_MAGIC_NSEC = 0xA1B23C4D
+LINKTYPE_CAN_SOCKETCAN = 227
+CAN_EFF_FLAG = 0x80000000
+CAN_EFF_MASK = 0x1FFFFFFF
+CAN_SFF_MASK = 0x7FF
+TP_SESSIONS = [2, 3, 6, 7, 10, 11]
+JSON_FRAME_SPACING = 0.001
+MAX_COMMAND_LEN = 1000      # the sniffer reads lines of up to 1023 bytes
+
+def read_candump(path):
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            parts = line.strip().split()
+            if len(parts) < 3 or not parts[0].startswith("("):
+                continue
+            can_id, sep, data = parts[2].partition("#")
+            if not sep or len(can_id) not in (3, 8) or data.startswith("R"):
+                continue
+            try:
+                ident = int(can_id, 16) | (CAN_EFF_FLAG if len(can_id) == 8 else 0)
+                yield float(parts[0].strip("()")), ident, bytes.fromhex(data)
+            except ValueError:
+                continue
+
+def read_pcap(path):
+    with open(path, "rb") as f:
+        header = f.read(24)
+        magic = struct.unpack("<I", header[:4])[0]
+        order = "<" if magic in (PCAP_MAGIC_USEC, PCAP_MAGIC_NSEC) else ">"
+        magic = struct.unpack(order + "I", header[:4])[0]
+        scale = 1e-9 if magic == PCAP_MAGIC_NSEC else 1e-6
+        if struct.unpack(order + "I", header[20:24])[0] != LINKTYPE_CAN_SOCKETCAN:
+            raise ValueError("not a SocketCAN capture")
+        while True:
+            record = f.read(16)
+            if len(record) < 16:
+                return
+            seconds, fraction, incl_len, _ = struct.unpack(order + "IIII", record)
+            body = f.read(incl_len)
+            if len(body) < incl_len or incl_len < 8:
+                return
+            # The SocketCAN header keeps the identifier in network byte order
+            ident = struct.unpack(">I", body[:4])[0]
+            dlc = min(body[4], 8)
+            yield seconds + fraction * scale, ident, body[8:8 + dlc]
+
+def json_field(line, key):
+    marker = '"%s":' % key
+    start = line.find(marker)
+    if start < 0:
+        return None
+    value = line[start + len(marker):]
+    if value.startswith('"'):
+        return value[1:value.index('"', 1)]
+    end = 0
+    while end < len(value) and value[end] not in ",}":
+        end += 1
+    return value[:end]
+
+def read_json(path):
+    # Re-segments decoded messages the way J1939::Controller sends them
+    clock = 0.0
+    session = 0
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            if '"alert"' in line or '"forward"' in line:
+                continue
+            pgn, sender = json_field(line, "pgn"), json_field(line, "sender")
+            size, data = json_field(line, "size"), json_field(line, "data")
+            if None in (pgn, sender, size, data):
+                continue
+            try:
+                pgn, sender, payload = int(pgn, 16), int(sender, 16), bytes.fromhex(data)
+            except ValueError:
+                continue
+            if json_field(line, "t"):
+                clock = float(json_field(line, "t"))
+            if size == "SF":
+                yield clock, CAN_EFF_FLAG | 0x18000000 | (pgn << 8) | sender, payload
+                clock += JSON_FRAME_SPACING
+                continue
+            number = TP_SESSIONS[session]
+            session = (session + 1) % len(TP_SESSIONS)
+            packets = (len(payload) + 6) // 7
+            yield clock, CAN_EFF_FLAG | 0x18ECFF00 | sender, bytes(
+                [0x20 | (number << 4), len(payload) & 0xFF, len(payload) >> 8, min(packets, 255), 0xFF,
+                 pgn & 0xFF, (pgn >> 8) & 0xFF, pgn >> 16])
+            for seq in range(1, packets + 1):
+                clock += JSON_FRAME_SPACING
+                chunk = payload[(seq - 1) * 7:seq * 7].ljust(7, b"\xff")
+                yield clock, CAN_EFF_FLAG | 0x18EBFF00 | sender, bytes([((seq - 1) % 15 + 1) | (number << 4)]) + chunk
+            clock += JSON_FRAME_SPACING
+
+def read_capture(path):
+    with open(path, "rb") as f:
+        start = f.read(4)
+    if len(start) == 4:
+        magics = struct.unpack("<I", start) + struct.unpack(">I", start)
+        if PCAP_MAGIC_USEC in magics or PCAP_MAGIC_NSEC in magics:
+            return list(read_pcap(path))
+    if start.lstrip()[:1] == b"{":
+        return list(read_json(path))
+    return list(read_candump(path))
+
+def is_tp_announcement(ident, data):
+    # The controller starts a session for every TP.CM with a zero low nibble
+    return bool(ident & CAN_EFF_FLAG) and ((ident >> 16) & 0xFF) == 0xEC and len(data) > 0 and (data[0] & 0x0F) == 0
+
+def format_frame(ident, data):
+    if ident & CAN_EFF_FLAG:
+        return "%08X#%s" % (ident & CAN_EFF_MASK, data.hex().upper())
+    return "%03X#%s" % (ident & CAN_SFF_MASK, data.hex().upper())
+
+class Replayer:
+    def __init__(self, ser, speed, max_rate, batch_ms):
+        self.ser = ser
+        self.speed = speed
+        self.max_rate = max_rate
+        self.batch = batch_ms / 1000.0
+        self.reassembled = 0
+        self.single_frames = 0
+        self.alerts = 0
+        self.stats = None
+        self.running = True
+        self.reader = threading.Thread(target=self.read_output, daemon=True)
+
+    def read_output(self):
+        while self.running:
+            line = self.ser.readline().decode("utf-8", errors="replace").strip()
+            if not line:
+                continue
+            if line.startswith('{"rx":'):
+                self.stats = line
+            elif '"alert"' in line:
+                self.alerts += 1
+            elif '"size":"SF"' in line:
+                self.single_frames += 1
+            elif '"size":' in line:
+                self.reassembled += 1
+
+    def send(self, frames):
+        self.ser.write(('{"c":"rx","d":"%s"}\n' % " ".join(frames)).encode("utf-8"))
+
+    def run(self, frames):
+        self.reader.start()
+        self.ser.write(b'{"c":"rx","d":"reset"}\n')
+        start_wall = time.time()
+        start_capture = frames[0][0] if frames else 0
+        batch = []
+        batch_len = 0
+        batch_due = None
+
+        for timestamp, ident, data in frames:
+            due = (timestamp - start_capture) / self.speed
+            text = format_frame(ident, data)
+            full = batch_len + len(text) + 1 > MAX_COMMAND_LEN
+            late = batch_due is not None and not self.max_rate and due - batch_due > self.batch
+            if batch and (full or late):
+                self.flush(batch, batch_due, start_wall)
+                batch, batch_len = [], 0
+            if not batch:
+                batch_due = due
+            batch.append(text)
+            batch_len += len(text) + 1
+        if batch:
+            self.flush(batch, batch_due, start_wall)
+
+        elapsed = time.time() - start_wall
+        time.sleep(1.5)
+        self.ser.write(b'{"c":"rx","d":"stats"}\n')
+        deadline = time.time() + 2
+        while self.stats is None and time.time() < deadline:
+            time.sleep(0.05)
+        self.running = False
+        return elapsed
+
+    def flush(self, batch, due, start_wall):
+        if not self.max_rate:
+            wait = due - (time.time() - start_wall)
+            if wait > 0:
+                time.sleep(wait)
+        self.send(batch)
+
+def inject_faults(frames, drop, reorder, seed):
+    rng = random.Random(seed)
+    kept = [f for f in frames if not (drop > 0 and rng.random() < drop)]
+    dropped = len(frames) - len(kept)
+    swapped = 0
+    i = 0
+    while i + 1 < len(kept):
+        if reorder > 0 and rng.random() < reorder:
+            # Frames arrive out of order on the original schedule
+            (t0, i0, d0), (t1, i1, d1) = kept[i], kept[i + 1]
+            kept[i], kept[i + 1] = (t0, i1, d1), (t1, i0, d0)
+            swapped += 1
+            i += 1
+        i += 1
+    return kept, dropped, swapped
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay a capture into the sniffer receive path over serial')
+    parser.add_argument('capture', help='candump log, PCAP or JSON capture')
+    parser.add_argument('--port', required=True, help='Serial port of the sniffer')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    parser.add_argument('--speed', type=float, default=1.0, help='Replay this many times faster than recorded')
+    parser.add_argument('--max-rate', action='store_true', help='Ignore timestamps and send as fast as possible')
+    parser.add_argument('--batch-ms', type=float, default=10.0, help='Frames due within this window share one command')
+    parser.add_argument('--drop', type=float, default=0.0, help='Drop each frame with this probability')
+    parser.add_argument('--reorder', type=float, default=0.0, help='Swap a frame with the next one with this probability')
+    parser.add_argument('--seed', type=int, default=1, help='Fault injection seed')
+    args = parser.parse_args()
+
+    if args.speed <= 0:
+        print("Speed must be positive")
+        sys.exit(1)
+
+    try:
+        frames = read_capture(args.capture)
+    except (OSError, ValueError) as e:
+        print(f"Cannot read {args.capture}: {e}")
+        sys.exit(1)
+    if not frames:
+        print("No frames in capture")
+        sys.exit(1)
+
+    announced = sum(1 for _, ident, data in frames if is_tp_announcement(ident, data))
+    frames, dropped, swapped = inject_faults(frames, args.drop, args.reorder, args.seed)
+
+    ser = serial.Serial(args.port, args.baud, timeout=0.1)
+    time.sleep(0.5)
+    ser.reset_input_buffer()
+    ser.write(b'{"c":"fmt","d":"json"}\n')
+
+    replayer = Replayer(ser, args.speed, args.max_rate, args.batch_ms)
+    elapsed = replayer.run(frames)
+    ser.close()
+
+    print(f"Replayed {len(frames)} frames in {elapsed:.2f} s ({len(frames) / max(elapsed, 1e-6):.0f} frames/s)")
+    if dropped or swapped:
+        print(f"Injected {dropped} drops and {swapped} swaps (seed {args.seed})")
+    rate = 100.0 * replayer.reassembled / announced if announced else 100.0
+    print(f"Reassembled {replayer.reassembled}/{announced} announced transfers ({rate:.2f} %), "
+          f"{replayer.single_frames} single frame messages, {replayer.alerts} alerts")
+    if replayer.stats:
+        print(f"Sniffer: {replayer.stats}")
+    else:
+        print("Sniffer did not report stats")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,206 @@
+# capture_split.py
+# Script to record the sniffer's candump/PCAP stream into rotating capture files
+
+import serial
+import sys
+import time
+import argparse
+import struct
+import os
+from datetime import datetime
+
+PCAP_MAGIC_USEC = 0xA1B2C3D4
+PCAP_GLOBAL_HEADER_SIZE = 24
+PCAP_RECORD_HEADER_SIZE = 16
+
+class RotatingWriter:
+    def __init__(self, directory, prefix, extension, max_bytes, max_seconds, max_files, header=b""):
+        self.directory = directory
+        self.prefix = prefix
+        self.extension = extension
+        self.max_bytes = max_bytes
+        self.max_seconds = max_seconds
+        self.max_files = max_files
+        self.header = header
+        self.file = None
+        self.file_bytes = 0
+        self.file_started = 0
+        self.files = []
+        self.total_records = 0
+        os.makedirs(directory, exist_ok=True)
+
+    def open_next(self):
+        self.close()
+        timestamp = datetime.now().strftime("%Y%m%d_%H%M%S_%f")
+        path = os.path.join(self.directory, f"{self.prefix}_{timestamp}.{self.extension}")
+        self.file = open(path, "wb")
+        self.file.write(self.header)
+        self.file_bytes = len(self.header)
+        self.file_started = time.time()
+        self.files.append(path)
+        print(f"Writing {path}")
+
+        while self.max_files > 0 and len(self.files) > self.max_files:
+            old = self.files.pop(0)
+            try:
+                os.remove(old)
+            except OSError as e:
+                print(f"Could not remove {old}: {e}")
+
+    def should_rotate(self, next_len):
+        if self.file is None:
+            return True
+        if self.max_bytes > 0 and self.file_bytes + next_len > self.max_bytes:
+            return True
+        if self.max_seconds > 0 and time.time() - self.file_started >= self.max_seconds:
+            return True
+        return False
+
+    def write_record(self, record):
+        # Records are never split across files so every file stays valid on its own
+        if self.should_rotate(len(record)):
+            self.open_next()
+        self.file.write(record)
+        self.file_bytes += len(record)
+        self.total_records += 1
+
+    def close(self):
+        if self.file:
+            self.file.close()
+            self.file = None
+
+class CaptureSplitter:
+    def __init__(self, source, directory, prefix, max_bytes, max_seconds, max_files):
+        self.source = source
+        self.directory = directory
+        self.prefix = prefix
+        self.max_bytes = max_bytes
+        self.max_seconds = max_seconds
+        self.max_files = max_files
+        self.buffer = b""
+        self.writer = None
+        self.format = None
+        self.byte_order = "<"
+
+    def detect_format(self):
+        # Skip boot noise until a PCAP header or a candump line starts
+        while True:
+            if len(self.buffer) >= 4:
+                magic_le = struct.unpack("<I", self.buffer[:4])[0]
+                magic_be = struct.unpack(">I", self.buffer[:4])[0]
+                if magic_le == PCAP_MAGIC_USEC or magic_be == PCAP_MAGIC_USEC:
+                    if len(self.buffer) < PCAP_GLOBAL_HEADER_SIZE:
+                        return False
+                    self.byte_order = "<" if magic_le == PCAP_MAGIC_USEC else ">"
+                    header = self.buffer[:PCAP_GLOBAL_HEADER_SIZE]
+                    self.buffer = self.buffer[PCAP_GLOBAL_HEADER_SIZE:]
+                    self.format = "pcap"
+                    self.writer = RotatingWriter(self.directory, self.prefix, "pcap", self.max_bytes,
+                                                 self.max_seconds, self.max_files, header)
+                    print("Detected PCAP stream")
+                    return True
+            if self.buffer.startswith(b"(") and b"\n" in self.buffer:
+                self.format = "candump"
+                self.writer = RotatingWriter(self.directory, self.prefix, "log", self.max_bytes,
+                                             self.max_seconds, self.max_files)
+                print("Detected candump log stream")
+                return True
+
+            start = self.find_stream_start()
+            if start < 0:
+                self.buffer = self.buffer[-3:]
+                return False
+            if start == 0:
+                return False
+            self.buffer = self.buffer[start:]
+
+    def find_stream_start(self):
+        candidates = [self.buffer.find(struct.pack("<I", PCAP_MAGIC_USEC)),
+                      self.buffer.find(struct.pack(">I", PCAP_MAGIC_USEC)),
+                      self.buffer.find(b"\n(") + 1 if b"\n(" in self.buffer else -1]
+        if self.buffer.startswith(b"("):
+            candidates.append(0)
+        candidates = [c for c in candidates if c >= 0]
+        return min(candidates) if candidates else -1
+
+    def drain(self):
+        if self.format is None and not self.detect_format():
+            return
+
+        if self.format == "pcap":
+            while len(self.buffer) >= PCAP_RECORD_HEADER_SIZE:
+                incl_len = struct.unpack(self.byte_order + "I", self.buffer[8:12])[0]
+                total = PCAP_RECORD_HEADER_SIZE + incl_len
+                if len(self.buffer) < total:
+                    break
+                self.writer.write_record(self.buffer[:total])
+                self.buffer = self.buffer[total:]
+        else:
+            while b"\n" in self.buffer:
+                line, self.buffer = self.buffer.split(b"\n", 1)
+                if line.startswith(b"("):
+                    self.writer.write_record(line + b"\n")
+
+    def run(self, duration=0):
+        start = time.time()
+        try:
+            while duration <= 0 or time.time() - start < duration:
+                chunk = self.source.read(4096)
+                if not chunk:
+                    if not isinstance(self.source, serial.Serial):
+                        break
+                    continue
+                self.buffer += chunk
+                self.drain()
+        except KeyboardInterrupt:
+            print("\nStopping...")
+        finally:
+            if self.writer:
+                self.writer.close()
+                print(f"Recorded {self.writer.total_records} frames into {len(self.writer.files)} file(s)")
+
+def main():
+    parser = argparse.ArgumentParser(description='Split the sniffer capture stream into rotating files')
+    parser.add_argument('--port', help='Serial port of the sniffer (omit to read stdin)')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate of the JSON console')
+    parser.add_argument('--capture-baud', type=int, default=921600,
+                        help='Baud rate the sniffer streams candump/PCAP at')
+    parser.add_argument('--input', help='Read a previously recorded raw stream instead of a port')
+    parser.add_argument('--format', choices=['candump', 'pcap'], help='Ask the sniffer to switch to this format first')
+    parser.add_argument('--dir', default='captures', help='Output directory')
+    parser.add_argument('--prefix', default='j1939', help='Output file name prefix')
+    parser.add_argument('--max-mb', type=float, default=16.0, help='Rotate after this many megabytes (0 = never)')
+    parser.add_argument('--max-seconds', type=float, default=0, help='Rotate after this many seconds (0 = never)')
+    parser.add_argument('--max-files', type=int, default=0, help='Keep only the newest N files (0 = keep all)')
+    parser.add_argument('--duration', type=float, default=0, help='Stop after this many seconds (0 = run until Ctrl+C)')
+    args = parser.parse_args()
+
+    if args.port:
+        # Without --format the sniffer is expected to be streaming already
+        source = serial.Serial(args.port, args.baud if args.format else args.capture_baud, timeout=0.1)
+        source.reset_input_buffer()
+        if args.format:
+            command = '{"c":"fmt","d":"%s"}\n' % args.format
+            source.write(command.encode('utf-8'))
+            source.flush()
+            # The sniffer changes baud after draining its console output and
+            # holds the stream back for 200 ms so we can follow in time
+            time.sleep(0.05)
+            source.baudrate = args.capture_baud
+            print(f"Requested {args.format} output from {args.port} at {args.capture_baud} baud")
+    elif args.input:
+        source = open(args.input, "rb")
+    else:
+        source = sys.stdin.buffer
+
+    splitter = CaptureSplitter(source, args.dir, args.prefix, int(args.max_mb * 1024 * 1024),
+                               args.max_seconds, args.max_files)
+    splitter.run(args.duration)
+
+    if args.port and args.format:
+        source.write(b'{"c":"fmt","d":"json"}\n')
+        source.flush()
+    source.close()
+
+if __name__ == "__main__":
+    main()
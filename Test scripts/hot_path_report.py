@@ -0,0 +1,149 @@
+# hot_path_report.py
+# Script to report where the receive/transmit hot path was linked and its size
+#
+# Reads the link map of an ESP-IDF build (build/<project>.map) and lists the
+# functions and tables marked HOT_PATH / HOT_DATA in the MCP2515 driver and
+# the J1939 controller (components/diag/include/hot_path.h), plus the SPI
+# master calls they make, with the memory each ended up in:
+#
+#   python hot_path_report.py ../Data\ Link\ Layer\ Implementation/ESP32-IDF/j1939-CLM/build/j1939-test-1.map
+#
+# With CONFIG_DIAG_HOT_PATH_IRAM every entry should be in IRAM or DRAM;
+# --strict exits with status 1 if any is still in flash, for use after a
+# build. The totals are the IRAM and DRAM the option costs.
+
+import sys
+import re
+import argparse
+
+# (class or namespace path, name); None for C functions
+HOT_FUNCTIONS = [
+    (("MCP2515",), "readRegister"),
+    (("MCP2515",), "readRegisters"),
+    (("MCP2515",), "setRegister"),
+    (("MCP2515",), "setRegisters"),
+    (("MCP2515",), "modifyRegister"),
+    (("MCP2515",), "getStatus"),
+    (("MCP2515",), "prepareId"),
+    (("MCP2515",), "sendMessage"),
+    (("MCP2515",), "readMessage"),
+    (("MCP2515",), "checkReceive"),
+    (("MCP2515",), "clearRXInterrupts"),
+    (("MCP2515",), "TXB"),
+    (("MCP2515",), "RXB"),
+    (("J1939", "Controller"), "is_bus_available"),
+    (("J1939", "Controller"), "is_session_valid"),
+    (("J1939", "Controller"), "parse_tp_cm"),
+    (("J1939", "Controller"), "parse_tp_dt"),
+    (("J1939", "Controller"), "decode_j1939_message"),
+    (("J1939", "Controller"), "send_single_frame_message"),
+    (("J1939", "Controller"), "send_data_packet"),
+    (None, "spi_device_transmit"),
+    (None, "spi_device_polling_transmit"),
+    (None, "spi_device_queue_trans"),
+    (None, "spi_device_get_trans_result"),
+]
+
+# ESP32 address ranges
+REGIONS = [
+    ("iram", 0x40070000, 0x400A0000),
+    ("flash", 0x400C2000, 0x40C00000),
+    ("rodata", 0x3F400000, 0x3F800000),
+    ("dram", 0x3FFAE000, 0x40000000),
+]
+
+INPUT_SECTION = re.compile(r'^ (\.\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+SECTION_NAME = re.compile(r'^ (\.\S+)$')
+SECTION_BODY = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+SYMBOL = re.compile(r'^\s+0x([0-9a-f]+)\s+(\S+)$')
+
+def mangled_fragment(scope, name):
+    # Itanium ABI nested name, e.g. 7MCP251512readRegister
+    if scope is None:
+        return None
+    return "".join(f"{len(part)}{part}" for part in scope + (name,))
+
+def display_name(scope, name):
+    return "::".join((scope or ()) + (name,))
+
+def region(address):
+    for name, start, end in REGIONS:
+        if start <= address < end:
+            return name
+    return "other"
+
+def read_sections(path):
+    # Input sections of the memory map with the symbols defined in each
+    sections = []
+    in_map = False
+    pending = None
+    with open(path, encoding="utf-8", errors="replace") as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if not in_map:
+                in_map = line.startswith("Linker script and memory map")
+                continue
+            if pending is not None:
+                m = SECTION_BODY.match(line)
+                pending_name, pending = pending, None
+                if m:
+                    sections.append({"section": pending_name, "address": int(m.group(1), 16),
+                                     "size": int(m.group(2), 16), "object": m.group(3), "symbols": []})
+                    continue
+            m = INPUT_SECTION.match(line)
+            if m:
+                sections.append({"section": m.group(1), "address": int(m.group(2), 16),
+                                 "size": int(m.group(3), 16), "object": m.group(4), "symbols": []})
+                continue
+            m = SECTION_NAME.match(line)
+            if m:
+                pending = m.group(1)
+                continue
+            m = SYMBOL.match(line)
+            if m and sections:
+                sections[-1]["symbols"].append(m.group(2))
+    return sections
+
+def matches(scope, name, text):
+    fragment = mangled_fragment(scope, name)
+    if fragment is None:
+        return re.search(r'(^|\.)' + re.escape(name) + r'$', text) is not None
+    return fragment in text
+
+def main():
+    parser = argparse.ArgumentParser(description='Report the placement of the CAN hot path from a link map')
+    parser.add_argument('map', help='Link map, build/<project>.map')
+    parser.add_argument('--strict', action='store_true', help='Exit with status 1 if part of the hot path is in flash')
+    args = parser.parse_args()
+
+    sections = [s for s in read_sections(args.map) if s["size"] > 0]
+
+    rows = []
+    for scope, name in HOT_FUNCTIONS:
+        found = False
+        for s in sections:
+            if any(matches(scope, name, sym) for sym in s["symbols"]) or matches(scope, name, s["section"]):
+                rows.append((display_name(scope, name), region(s["address"]), s["size"], s["section"]))
+                found = True
+        if not found:
+            rows.append((display_name(scope, name), "missing", 0, ""))
+
+    width = max(len(r[0]) for r in rows)
+    print(f"{'symbol':<{width}}  {'region':<8} {'bytes':>6}  section")
+    totals = {}
+    for symbol, where, size, section in rows:
+        print(f"{symbol:<{width}}  {where:<8} {size:>6}  {section}")
+        totals[where] = totals.get(where, 0) + size
+    print()
+    for where in sorted(totals):
+        if where != "missing":
+            print(f"{where}: {totals[where]} bytes")
+
+    in_flash = [r for r in rows if r[1] in ("flash", "rodata")]
+    if in_flash:
+        print(f"{len(in_flash)} hot path entries in flash")
+        if args.strict:
+            sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,197 @@
+# ota_push.py
+# Script to update nodes over CAN through a gateway node on the serial port
+#
+# The gateway runs the same firmware and forwards the image to each target
+# with the "ota" command (components/can_ota). One chunk is in flight at a
+# time; the target acknowledges it once buffered and programs it while the
+# next one is sent:
+#
+#   python ota_push.py --port /dev/ttyUSB0 --nodes 10,20 --version 7 build/j1939-test-1.bin --reboot
+#
+# An interrupted update continues where it stopped when the script is run
+# again with the same image: the target answers BEGIN with the offset it has
+# already written and verified. Per node the script reports the time, the
+# bytes sent and the effective throughput.
+#
+# The gateway signs each BEGIN with its bus key. A target with a different
+# key refuses with "bad_mac". A target that another gateway is updating
+# refuses with "in_progress". --version is the image's release number, signed
+# with it: a target refuses a version below the last one it installed with
+# "old_version", so raise it with every release. The END is signed over the
+# nonce of the target's READY, so a recorded update can't be replayed.
+
+import serial
+import sys
+import time
+import base64
+import hashlib
+import argparse
+
+CHUNK_SIZE = 512
+
+# The status line and the summary printed by the gateway
+STATUS_PREFIX = '{"ota":"status"'
+DONE_PREFIX = '{"ota":"done"'
+ERROR_PREFIX = '{"ota":"error"'
+
+def json_field(line, key):
+    start = line.find('"%s":' % key)
+    if start < 0:
+        return None
+    start += len(key) + 3
+    if line[start] == '"':
+        return line[start + 1:line.index('"', start + 1)]
+    end = start
+    while end < len(line) and line[end] not in ',}':
+        end += 1
+    return line[start:end]
+
+class Gateway:
+    def __init__(self, ser, verbose):
+        self.ser = ser
+        self.verbose = verbose
+
+    def command(self, data):
+        self.ser.write(('{"c":"ota","d":"%s"}\n' % data).encode("utf-8"))
+
+    def wait_status(self, node, timeout):
+        # Next status from the node, or None on timeout
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            line = self.ser.readline().decode("utf-8", errors="replace").strip()
+            if not line:
+                continue
+            if self.verbose:
+                print(f"  < {line}")
+            if line.startswith(ERROR_PREFIX):
+                return "error", 0, line
+            if line.startswith(STATUS_PREFIX) and int(json_field(line, "src"), 16) == node:
+                return json_field(line, "status"), int(json_field(line, "offset")), line
+            if line.startswith(DONE_PREFIX) and int(json_field(line, "src"), 16) == node:
+                print(f"  gateway: {line}")
+        return None, 0, None
+
+def begin(gw, node, image, version, digest, timeout, retries):
+    for _ in range(retries):
+        gw.command("begin,%02X,%d,%d,%s" % (node, len(image), version, digest))
+        # Resuming hashes the flash already written, which takes a while for
+        # a large prefix
+        status, offset, line = gw.wait_status(node, timeout + len(image) / 200000.0)
+        if status == "ready":
+            return offset
+        if status is not None:
+            print(f"  begin refused: {line}")
+            return None
+    return None
+
+def push(gw, node, image, args):
+    digest = hashlib.sha256(image).hexdigest()
+    start = time.time()
+
+    offset = begin(gw, node, image, args.version, digest, args.timeout, args.retries)
+    if offset is None:
+        print(f"node {node:02X}: no READY")
+        return False
+    resumed_from = offset
+    if offset:
+        print(f"node {node:02X}: resuming at {offset} of {len(image)} bytes")
+
+    sent = 0
+    resends = 0
+    timeouts = 0
+    last_report = time.time()
+    while offset < len(image):
+        chunk = image[offset:offset + CHUNK_SIZE]
+        gw.command("data,%d,%s" % (offset, base64.b64encode(chunk).decode("ascii")))
+        sent += len(chunk)
+        status, reply_offset, line = gw.wait_status(node, args.timeout)
+
+        if status == "ack":
+            offset = reply_offset
+            timeouts = 0
+        elif status == "busy":
+            # Both buffers still being programmed
+            resends += 1
+            time.sleep(0.05)
+        elif status == "bad_offset":
+            # A chunk or its acknowledgement was lost: continue where the
+            # target expects
+            resends += 1
+            offset = reply_offset
+        elif status is None:
+            resends += 1
+            timeouts += 1
+            if timeouts >= args.retries:
+                # The target may have restarted: start again from its
+                # saved progress
+                offset = begin(gw, node, image, args.version, digest, args.timeout, args.retries)
+                if offset is None:
+                    print(f"node {node:02X}: lost during transfer")
+                    return False
+                timeouts = 0
+        else:
+            print(f"node {node:02X}: failed at {offset}: {line}")
+            return False
+
+        if time.time() - last_report >= 5:
+            last_report = time.time()
+            print(f"node {node:02X}: {offset}/{len(image)} bytes ({100.0 * offset / len(image):.0f}%)")
+
+    gw.command("end,reboot" if args.reboot else "end")
+    # The target checks the hash before answering
+    status, _, line = gw.wait_status(node, args.timeout + 5)
+    elapsed = time.time() - start
+    if status != "done":
+        print(f"node {node:02X}: not verified: {line or 'no reply'}")
+        return False
+
+    transferred = len(image) - resumed_from
+    print(f"node {node:02X}: {transferred} bytes in {elapsed:.1f} s, {transferred / elapsed:.0f} B/s "
+          f"({sent} sent, {resends} resends, resumed from {resumed_from})")
+    return True
+
+def main():
+    parser = argparse.ArgumentParser(description='Update nodes over CAN through a gateway node')
+    parser.add_argument('image', help='Application image, build/<project>.bin')
+    parser.add_argument('--port', required=True, help='Serial port of the gateway node')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    parser.add_argument('--nodes', required=True, help='Comma separated J1939 addresses (hex) of the nodes to update')
+    parser.add_argument('--version', type=int, required=True,
+                        help='Release number of the image; nodes refuse one below the last they installed')
+    parser.add_argument('--reboot', action='store_true', help='Restart each node into the new image once verified')
+    parser.add_argument('--timeout', type=float, default=2.0, help='Seconds to wait for a status')
+    parser.add_argument('--retries', type=int, default=5, help='Timeouts in a row before starting over with BEGIN')
+    parser.add_argument('--verbose', action='store_true', help='Print every line from the gateway')
+    args = parser.parse_args()
+
+    if not 0 <= args.version <= 0xFFFFFFFF:
+        print("Version must fit in 32 bits")
+        sys.exit(1)
+    try:
+        nodes = [int(n, 16) for n in args.nodes.split(",")]
+    except ValueError:
+        print("Nodes must be hex addresses")
+        sys.exit(1)
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    print(f"{args.image}: {len(image)} bytes, sha256 {hashlib.sha256(image).hexdigest()}")
+
+    ser = serial.Serial(args.port, args.baud, timeout=0.1)
+    time.sleep(0.5)
+    ser.reset_input_buffer()
+    gw = Gateway(ser, args.verbose)
+
+    failed = []
+    for node in nodes:
+        if not push(gw, node, image, args):
+            gw.command("abort")
+            failed.append(node)
+
+    ser.close()
+    if failed:
+        print("failed: " + ",".join(f"{n:02X}" for n in failed))
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
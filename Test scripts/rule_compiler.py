@@ -0,0 +1,338 @@
+# rule_compiler.py
+# Script to compile sniffer IDS rules into decision table blobs and load them over serial
+#
+# Rule file syntax, one statement per line, '#' starts a comment:
+#
+#   state ignition 0
+#   rule unknown_eec1: pgn 0xF004 sa !0x00 -> alert, sms
+#   rule door_lock_off: pgn 0xEF00 da 0x21 state !ignition -> drop, alert
+#   rule horn_flood: pgn 0xFF21 data 0:0x01=0x01 rate 10/1000 -> gpio 2 200
+#   rule ignition_on: pgn 0xFEF1 sa 0x00 data 3:0x01=0x01 -> set ignition
+#   rule ignition_off: pgn 0xFEF1 sa 0x00 data 3:0x01=0x00 -> clear ignition
+#
+# Conditions (all must hold, anything omitted matches everything):
+#   pgn <pgn>[,<pgn>...] | any     PDU1 PGNs are given without the destination
+#   sa [!]<set>  da [!]<set>       set = value or lo-hi, comma separated;
+#                                  PDU2 frames have DA 0xFF
+#   state [!]<name>                repeatable
+#   data <byte>:<mask>=<value>     repeatable
+#   dlc <n>                        minimum data length
+#   rate <n>/<ms>                  fire only above n matches per ms window
+# Actions (comma separated): alert, drop, forward, sms, gpio <pin> <ms>,
+#   set <state>, clear <state>
+
+import serial
+import sys
+import time
+import argparse
+import struct
+
+BLOB_MAGIC = 0x314C5552  # "RUL1"
+BLOB_VERSION = 1
+MAX_RULES = 32
+MAX_PGN_ENTRIES = 64
+NAME_LEN = 16
+HEADER_FORMAT = "<IHHHH"
+RULE_FORMAT = "<16sBBHBBBBHHQQ32s32s32s"
+PGN_FORMAT = "<II"
+UPLOAD_CHUNK = 256
+
+ACTION_ALERT = 0x01
+ACTION_DROP = 0x02
+ACTION_FORWARD = 0x04
+ACTION_SMS = 0x08
+ACTION_GPIO = 0x10
+ACTION_STATE = 0x20
+FLAG_ANY_PGN = 0x01
+
+SIMPLE_ACTIONS = {"alert": ACTION_ALERT, "drop": ACTION_DROP, "forward": ACTION_FORWARD, "sms": ACTION_SMS}
+
+class RuleError(Exception):
+    pass
+
+def parse_int(text):
+    try:
+        return int(text, 0)
+    except ValueError:
+        raise RuleError(f"invalid number '{text}'")
+
+def parse_set(text, limit=256):
+    negate = text.startswith("!")
+    values = set()
+    for item in text.lstrip("!").split(","):
+        if "-" in item:
+            lo, hi = item.split("-", 1)
+            values.update(range(parse_int(lo), parse_int(hi) + 1))
+        else:
+            values.add(parse_int(item))
+    if any(v < 0 or v >= limit for v in values):
+        raise RuleError(f"value out of range in '{text}'")
+    return set(range(limit)) - values if negate else values
+
+def bitset(values):
+    out = bytearray(32)
+    for v in values:
+        out[v >> 3] |= 1 << (v & 7)
+    return bytes(out)
+
+class Rule:
+    def __init__(self, name):
+        self.name = name
+        self.pgns = None             # None = any PGN
+        self.sa = set(range(256))
+        self.da = set(range(256))
+        self.states = set(range(256))
+        self.payload_mask = 0
+        self.payload_value = 0
+        self.min_dlc = 0
+        self.rate_limit = 0
+        self.rate_window_ms = 0
+        self.actions = 0
+        self.gpio = 0
+        self.pulse_ms = 0
+        self.set_bits = 0
+        self.clear_bits = 0
+
+    def pack(self):
+        name = self.name.encode("ascii")[:NAME_LEN - 1]
+        flags = FLAG_ANY_PGN if self.pgns is None else 0
+        return struct.pack(RULE_FORMAT, name, self.actions, self.gpio, self.pulse_ms,
+                           self.set_bits, self.clear_bits, self.min_dlc, flags,
+                           self.rate_limit, self.rate_window_ms,
+                           self.payload_mask, self.payload_value,
+                           bitset(self.sa), bitset(self.da), bitset(self.states))
+
+class RuleCompiler:
+    def __init__(self):
+        self.state_bits = {}
+        self.rules = []
+
+    def state_bit(self, name):
+        if name not in self.state_bits:
+            raise RuleError(f"unknown state '{name}'")
+        return self.state_bits[name]
+
+    def parse_conditions(self, rule, tokens):
+        i = 0
+        while i < len(tokens):
+            key = tokens[i]
+            if i + 1 >= len(tokens):
+                raise RuleError(f"'{key}' needs an argument")
+            arg = tokens[i + 1]
+            i += 2
+            if key == "pgn":
+                rule.pgns = None if arg == "any" else {parse_int(p) for p in arg.split(",")}
+                if rule.pgns and any(p < 0 or p > 0x3FFFF for p in rule.pgns):
+                    raise RuleError(f"PGN out of range in '{arg}'")
+                if rule.pgns and any(((p >> 8) & 0xFF) < 240 and (p & 0xFF) for p in rule.pgns):
+                    raise RuleError(f"PDU1 PGN with a destination in '{arg}', use 'da'")
+            elif key == "sa":
+                rule.sa = parse_set(arg)
+            elif key == "da":
+                rule.da = parse_set(arg)
+            elif key == "state":
+                bit = 1 << self.state_bit(arg.lstrip("!"))
+                want = 0 if arg.startswith("!") else bit
+                rule.states = {s for s in rule.states if (s & bit) == want}
+            elif key == "data":
+                try:
+                    index, expr = arg.split(":", 1)
+                    mask, value = expr.split("=", 1)
+                except ValueError:
+                    raise RuleError(f"data condition must be <byte>:<mask>=<value>, got '{arg}'")
+                index, mask, value = parse_int(index), parse_int(mask), parse_int(value)
+                if not 0 <= index < 8 or not 0 <= mask <= 0xFF or value & ~mask:
+                    raise RuleError(f"invalid data condition '{arg}'")
+                rule.payload_mask |= mask << (8 * index)
+                rule.payload_value = (rule.payload_value & ~(0xFF << (8 * index))) | (value << (8 * index))
+                rule.min_dlc = max(rule.min_dlc, index + 1)
+            elif key == "dlc":
+                rule.min_dlc = max(rule.min_dlc, parse_int(arg))
+                if rule.min_dlc > 8:
+                    raise RuleError("dlc must be 0-8")
+            elif key == "rate":
+                count, window = arg.split("/", 1)
+                rule.rate_limit, rule.rate_window_ms = parse_int(count), parse_int(window)
+                if not 0 < rule.rate_limit < 65536 or not 0 < rule.rate_window_ms < 65536:
+                    raise RuleError(f"invalid rate '{arg}'")
+            else:
+                raise RuleError(f"unknown condition '{key}'")
+
+    def parse_actions(self, rule, text):
+        for action in [a.split() for a in text.split(",")]:
+            if not action:
+                continue
+            if action[0] in SIMPLE_ACTIONS and len(action) == 1:
+                rule.actions |= SIMPLE_ACTIONS[action[0]]
+            elif action[0] == "gpio" and len(action) == 3:
+                rule.actions |= ACTION_GPIO
+                rule.gpio, rule.pulse_ms = parse_int(action[1]), parse_int(action[2])
+                if not 0 <= rule.gpio < 40 or not 0 < rule.pulse_ms < 65536:
+                    raise RuleError("gpio needs <pin> <pulse ms>")
+            elif action[0] in ("set", "clear") and len(action) == 2:
+                rule.actions |= ACTION_STATE
+                bit = 1 << self.state_bit(action[1])
+                if action[0] == "set":
+                    rule.set_bits |= bit
+                else:
+                    rule.clear_bits |= bit
+            else:
+                raise RuleError(f"unknown action '{' '.join(action)}'")
+        if not rule.actions:
+            raise RuleError("rule has no actions")
+
+    def parse_line(self, line):
+        line = line.split("#", 1)[0].strip()
+        if not line:
+            return
+        if line.startswith("state "):
+            parts = line.split()
+            if len(parts) != 3 or not 0 <= parse_int(parts[2]) < 8:
+                raise RuleError("state needs <name> <bit 0-7>")
+            self.state_bits[parts[1]] = parse_int(parts[2])
+        elif line.startswith("rule "):
+            head, sep, actions = line[5:].partition("->")
+            name, colon, conditions = head.partition(":")
+            if not sep or not colon or not name.strip():
+                raise RuleError("rule must look like 'rule <name>: <conditions> -> <actions>'")
+            if len(self.rules) >= MAX_RULES:
+                raise RuleError(f"more than {MAX_RULES} rules")
+            rule = Rule(name.strip())
+            self.parse_conditions(rule, conditions.split())
+            self.parse_actions(rule, actions)
+            self.rules.append(rule)
+        else:
+            raise RuleError(f"unknown statement '{line.split()[0]}'")
+
+    def parse_file(self, path):
+        with open(path, "r") as f:
+            for number, line in enumerate(f, 1):
+                try:
+                    self.parse_line(line)
+                except RuleError as e:
+                    raise RuleError(f"{path}:{number}: {e}")
+
+    def pgn_table(self):
+        table = {}
+        for index, rule in enumerate(self.rules):
+            for pgn in rule.pgns or ():
+                table[pgn] = table.get(pgn, 0) | (1 << index)
+        if len(table) > MAX_PGN_ENTRIES:
+            raise RuleError(f"more than {MAX_PGN_ENTRIES} distinct PGNs")
+        return table
+
+    def compile(self):
+        pgns = self.pgn_table()
+        blob = struct.pack(HEADER_FORMAT, BLOB_MAGIC, BLOB_VERSION, len(self.rules), len(pgns), 0)
+        for rule in self.rules:
+            blob += rule.pack()
+        for pgn, mask in sorted(pgns.items()):
+            blob += struct.pack(PGN_FORMAT, pgn, mask)
+        return blob
+
+class RuleEvaluator:
+    # Reference implementation of the firmware's Rules::Engine for checking logs
+    def __init__(self, rules):
+        self.rules = rules
+        self.state = 0
+        self.windows = [(0.0, 0)] * len(rules)
+
+    def evaluate(self, timestamp, can_id, data):
+        pdu_format = (can_id >> 16) & 0xFF
+        pgn = (can_id >> 8) & 0x3FFFF
+        da = 0xFF
+        if pdu_format < 240:
+            da = pgn & 0xFF
+            pgn &= 0x3FF00
+        payload = int.from_bytes(data[:8].ljust(8, b"\0"), "little")
+
+        fired = []
+        for index, rule in enumerate(self.rules):
+            if rule.pgns is not None and pgn not in rule.pgns:
+                continue
+            if (can_id & 0xFF) not in rule.sa or da not in rule.da or self.state not in rule.states:
+                continue
+            if len(data) < rule.min_dlc or (payload & rule.payload_mask) != rule.payload_value:
+                continue
+            if rule.rate_limit:
+                start, count = self.windows[index]
+                if timestamp - start >= rule.rate_window_ms / 1000.0:
+                    start, count = timestamp, 0
+                count += 1
+                self.windows[index] = (start, count)
+                if count <= rule.rate_limit:
+                    continue
+            fired.append(rule)
+        for rule in fired:
+            if rule.actions & ACTION_STATE:
+                self.state = (self.state & ~rule.clear_bits) | rule.set_bits
+        return fired
+
+def check_log(rules, path):
+    evaluator = RuleEvaluator(rules)
+    counts = {}
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            parts = line.strip().split()
+            if len(parts) < 3 or not parts[0].startswith("("):
+                continue
+            can_id, sep, data = parts[2].partition("#")
+            if not sep or len(can_id) != 8 or data.startswith("R"):
+                continue
+            timestamp = float(parts[0].strip("()"))
+            for rule in evaluator.evaluate(timestamp, int(can_id, 16), bytes.fromhex(data)):
+                counts[rule.name] = counts.get(rule.name, 0) + 1
+                print(f"{timestamp:.6f} {rule.name}: {parts[2]}")
+    print("Fired: " + (", ".join(f"{k}={v}" for k, v in sorted(counts.items())) or "none"))
+
+def upload(port, baud, blob):
+    ser = serial.Serial(port, baud, timeout=1)
+    time.sleep(0.5)
+    ser.reset_input_buffer()
+
+    def send(data):
+        ser.write(('{"c":"rules","d":"%s"}\n' % data).encode("utf-8"))
+        ser.flush()
+        time.sleep(0.05)
+
+    send("begin")
+    for offset in range(0, len(blob), UPLOAD_CHUNK):
+        send("+" + blob[offset:offset + UPLOAD_CHUNK].hex().upper())
+    send("commit")
+
+    deadline = time.time() + 2
+    while time.time() < deadline:
+        line = ser.readline().decode("utf-8", errors="replace").strip()
+        if "Rules loaded" in line or "rule blob" in line:
+            print(line)
+            break
+    ser.close()
+
+def main():
+    parser = argparse.ArgumentParser(description='Compile sniffer IDS rules into a decision table blob')
+    parser.add_argument('rules', help='Rule file')
+    parser.add_argument('--output', default='rules.bin', help='Compiled blob to write')
+    parser.add_argument('--check', metavar='LOG', help='Run the rules over a candump log on the host')
+    parser.add_argument('--port', help='Load the compiled rules into the sniffer on this serial port')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    args = parser.parse_args()
+
+    compiler = RuleCompiler()
+    try:
+        compiler.parse_file(args.rules)
+        blob = compiler.compile()
+    except RuleError as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+
+    with open(args.output, "wb") as f:
+        f.write(blob)
+    print(f"Compiled {len(compiler.rules)} rules ({len(blob)} bytes) -> {args.output}")
+
+    if args.check:
+        check_log(compiler.rules, args.check)
+    if args.port:
+        upload(args.port, args.baud, blob)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,184 @@
+# trace_capture.py
+# Script to collect the message stage traces of several nodes into one Chrome trace
+#
+# Each node records when a traced message passes each firmware stage (see
+# components/diag/trace.cpp) on its own esp_timer clock. This script starts
+# or dumps the recording on every given port, shifts the clocks of the other
+# nodes so that each traced BAM is received when it was announced, links the
+# sender and receiver rows with flow arrows and writes one file for
+# chrome://tracing or ui.perfetto.dev.
+#
+#   python trace_capture.py --ports COM5,COM6 --start
+#   ... send messages from the sender's UART ...
+#   python trace_capture.py --ports COM5,COM6 --output results/trace.json
+#
+# The first port is the reference clock; bus time of the BAM announce itself
+# (about 0.3 ms at 500 kbit/s) is not corrected. Nodes that follow the bus
+# time master (components/timesync) dump in bus time and are left as they
+# are, so the gap between announce and interrupt is the real one.
+#
+# --kind sched collects the FreeRTOS scheduling traces of nodes built with
+# idf.py -DSCHED_TRACE=ON (components/diag/sched_trace.cpp) instead. Those
+# carry no trace IDs, so each node keeps its own clock and gets its own
+# processes in the file:
+#
+#   python trace_capture.py --kind sched --ports COM5 --start
+#   python trace_capture.py --kind sched --ports COM5 --output results/sched.json
+
+import serial
+import sys
+import os
+import time
+import json
+import argparse
+import statistics
+
+DUMP_START = '{"traceEvents":['
+
+# Commands of each kind: start recording, stop recording
+COMMANDS = {
+    "trace": (["clear", "on"], "off"),
+    "sched": (["start"], "stop"),
+}
+
+def command(ser, kind, data):
+    ser.write(('{"c":"%s","d":"%s"}\n' % (kind, data)).encode("utf-8"))
+
+def read_dump(ser, kind, timeout):
+    ser.reset_input_buffer()
+    command(ser, kind, "dump")
+    lines = None
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        line = ser.readline().decode("utf-8", errors="replace").strip()
+        if lines is None:
+            if line == DUMP_START:
+                lines = [line]
+            continue
+        lines.append(line)
+        if line.startswith('],"displayTimeUnit"'):
+            return json.loads("\n".join(lines))
+    return None
+
+def end_time(event):
+    return event["ts"] + event.get("dur", 0)
+
+def first_stage(events, name):
+    # Earliest event of the given stage per trace ID
+    found = {}
+    for e in events:
+        if e.get("name") == name and e.get("ph") in ("X", "i"):
+            trace = e["args"]["trace"]
+            if trace not in found or e["ts"] < found[trace]["ts"]:
+                found[trace] = e
+    return found
+
+def align(reference, other):
+    sent = first_stage(reference, "bam_announce")
+    received = first_stage(other, "rx_isr")
+    deltas = [end_time(sent[t]) - received[t]["ts"] for t in sent if t in received]
+    if not deltas:
+        sent = first_stage(other, "bam_announce")
+        received = first_stage(reference, "rx_isr")
+        deltas = [received[t]["ts"] - end_time(sent[t]) for t in sent if t in received]
+    return statistics.median(deltas) if deltas else None
+
+def flows(dumps):
+    # Arrows from the BAM announce on the sender to the interrupt on each receiver
+    result = []
+    senders = {}
+    for events in dumps:
+        for trace, e in first_stage(events, "bam_announce").items():
+            senders[trace] = e
+    flow_id = 0
+    for events in dumps:
+        for trace, e in first_stage(events, "rx_isr").items():
+            s = senders.get(trace)
+            if s is None or s["pid"] == e["pid"]:
+                continue
+            flow_id += 1
+            result.append({"name": "bus", "cat": "j1939", "ph": "s", "id": flow_id,
+                           "ts": end_time(s), "pid": s["pid"], "tid": s["tid"]})
+            result.append({"name": "bus", "cat": "j1939", "ph": "f", "bp": "e", "id": flow_id,
+                           "ts": e["ts"], "pid": e["pid"], "tid": e["tid"]})
+    return result
+
+def separate(events, index, port):
+    # Moves the processes of one node's scheduling trace out of the way of the others
+    for e in events:
+        e["pid"] += 100 * index
+        if e.get("name") == "process_name":
+            e["args"]["name"] = f"{port} {e['args']['name']}"
+
+def main():
+    parser = argparse.ArgumentParser(description='Collect firmware message traces as one Chrome trace')
+    parser.add_argument('--kind', choices=sorted(COMMANDS), default='trace', help='Message stage trace or scheduling trace')
+    parser.add_argument('--ports', required=True, help='Comma separated serial ports, the first is the reference clock')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    parser.add_argument('--start', action='store_true', help='Clear and start recording instead of dumping')
+    parser.add_argument('--stop', action='store_true', help='Stop recording after the dump')
+    parser.add_argument('--timeout', type=float, default=10, help='Seconds to wait for each dump')
+    parser.add_argument('--output', default='results/trace.json', help='Output file')
+    args = parser.parse_args()
+
+    ports = [p for p in args.ports.split(",") if p]
+    links = []
+    for port in ports:
+        ser = serial.Serial(port, args.baud, timeout=0.2)
+        links.append(ser)
+    time.sleep(0.5)
+
+    start_commands, stop_command = COMMANDS[args.kind]
+    if args.start:
+        for ser in links:
+            for data in start_commands:
+                command(ser, args.kind, data)
+        print(f"Recording on {', '.join(ports)}")
+        return
+
+    dumps = []
+    synced = []
+    for port, ser in zip(ports, links):
+        dump = read_dump(ser, args.kind, args.timeout)
+        if args.stop:
+            command(ser, args.kind, stop_command)
+        if dump is None:
+            print(f"{port}: no trace dump, is the node running the tracing firmware?")
+            sys.exit(1)
+        node = dump["otherData"].get("node")
+        print(f"{port}: {f'node {node}, ' if node is not None else ''}{dump['otherData']['events']} events, "
+              f"{dump['otherData']['overwritten']} overwritten")
+        dumps.append(dump["traceEvents"])
+        synced.append(dump["otherData"].get("sync", False))
+
+    if args.kind == "sched":
+        for index, (port, events) in enumerate(zip(ports, dumps)):
+            separate(events, index, port)
+
+    for port, events, in_bus_time in zip(ports[1:], dumps[1:] if args.kind == "trace" else [], synced[1:]):
+        # Dumps of nodes following the bus time master share one clock
+        if in_bus_time and synced[0]:
+            print(f"{port}: in bus time")
+            continue
+        offset = align(dumps[0], events)
+        if offset is None:
+            print(f"{port}: no BAM shared with {ports[0]}, clock left unaligned")
+            continue
+        for e in events:
+            if "ts" in e:
+                e["ts"] += offset
+        print(f"{port}: clock shifted by {offset / 1000.0:.3f} ms")
+
+    merged = [e for events in dumps for e in events]
+    if args.kind == "trace":
+        merged += flows(dumps)
+    os.makedirs(os.path.dirname(args.output) or ".", exist_ok=True)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": merged, "displayTimeUnit": "ms"}, f)
+    print(f"Saved {args.output}")
+
+    for ser in links:
+        ser.close()
+
+if __name__ == "__main__":
+    main()
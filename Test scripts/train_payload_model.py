@@ -0,0 +1,264 @@
+# train_payload_model.py
+# Script to train the sniffer's payload anomaly model from candump logs and load it over serial
+
+import serial
+import sys
+import time
+import argparse
+import struct
+
+MODEL_MAGIC = 0x314D4250  # "PBM1"
+MODEL_VERSION = 1
+MIN_SAMPLES = 16
+MAX_PROFILES = 128
+HEADER_FORMAT = "<IHH"
+ENTRY_FORMAT = "<IBBxxQQQQ"
+UPLOAD_CHUNK = 256
+
+CAN_EFF_FLAG = 0x80000000
+PGN_TP_CM = 0xEC00
+PGN_TP_DT = 0xEB00
+
+def profile_key(can_id):
+    # Same key as IDS::PayloadModel::key_of: PDU1 PGNs drop the destination byte,
+    # transport frames are not profiled (0)
+    pdu_format = (can_id >> 16) & 0xFF
+    pgn = (can_id >> 8) & 0x3FFFF
+    if pdu_format < 240:
+        pgn &= 0x3FF00
+    if pgn in (PGN_TP_CM, PGN_TP_DT):
+        return 0
+    return CAN_EFF_FLAG | (pgn << 8) | (can_id & 0xFF)
+
+def parse_candump_line(line):
+    # "(1712345678.123456) can0 18EF0042#0102030405060708"
+    parts = line.strip().split()
+    if len(parts) < 3 or not parts[0].startswith("("):
+        return None
+    can_id, sep, data = parts[2].partition("#")
+    if not sep or len(can_id) != 8 or data.startswith("R"):
+        return None
+    try:
+        return int(can_id, 16), bytes.fromhex(data)
+    except ValueError:
+        return None
+
+def read_frames(paths):
+    for path in paths:
+        with open(path, "r", errors="replace") as f:
+            for line in f:
+                frame = parse_candump_line(line)
+                if frame:
+                    yield frame
+
+class Profile:
+    def __init__(self, key):
+        self.key = key
+        self.dlc = 0
+        self.counter_bytes = 0
+        self.counter_candidates = 0
+        self.reference = [0] * 8
+        self.changed = [0] * 8
+        self.min = [0] * 8
+        self.max = [0] * 8
+        self.last = [0] * 8
+        self.samples = 0
+        self.trained = False
+        self.last_valid = False
+        self.counter_misses = 0
+
+    def counter_steps(self, value):
+        mask = 0
+        for i in range(8):
+            step = (value[i] - self.last[i]) & 0xFF == 1
+            wrap = value[i] == self.min[i] and self.last[i] == self.max[i]
+            if step or wrap:
+                mask |= 1 << i
+        return mask
+
+    def learn(self, value, dlc):
+        if self.samples == 0:
+            self.dlc = dlc
+            self.reference = list(value)
+            self.min = list(value)
+            self.max = list(value)
+            self.last = list(value)
+            self.last_valid = True
+            self.counter_candidates = (1 << dlc) - 1
+            self.samples = 1
+            return
+
+        self.dlc = max(self.dlc, dlc)
+        for i in range(8):
+            self.changed[i] |= value[i] ^ self.reference[i]
+            self.min[i] = min(self.min[i], value[i])
+            self.max[i] = max(self.max[i], value[i])
+
+        self.counter_candidates &= self.counter_steps(value)
+        never_changed = sum(1 << i for i in range(8) if self.changed[i] == 0)
+        self.counter_bytes = self.counter_candidates & ~never_changed & 0xFF
+
+        self.last = list(value)
+        self.samples += 1
+        self.trained = self.samples >= MIN_SAMPLES
+
+    def check(self, value, dlc):
+        if dlc != self.dlc:
+            return "dlc"
+        for i in range(dlc):
+            if (value[i] ^ self.reference[i]) & ~self.changed[i] & 0xFF:
+                return "constant_bits"
+        for i in range(dlc):
+            if value[i] < self.min[i] or value[i] > self.max[i]:
+                return "range"
+        if self.counter_bytes and self.last_valid:
+            if self.counter_bytes & ~self.counter_steps(value):
+                self.counter_misses += 1
+                if self.counter_misses >= 2:
+                    self.counter_misses = 0
+                    self.last = list(value)
+                return "counter"
+            self.counter_misses = 0
+        self.last = list(value)
+        self.last_valid = True
+        return "ok"
+
+class PayloadModel:
+    def __init__(self):
+        self.profiles = {}
+
+    def process(self, can_id, data, learn):
+        key = profile_key(can_id)
+        if key == 0:
+            return "ok"
+        dlc = min(len(data), 8)
+        value = list(data[:dlc]) + [0] * (8 - dlc)
+        profile = self.profiles.get(key)
+        if learn:
+            if profile is None:
+                if len(self.profiles) >= MAX_PROFILES:
+                    return "ok"
+                profile = self.profiles[key] = Profile(key)
+            profile.learn(value, dlc)
+            return "ok"
+        if profile is None:
+            return "unknown_id"
+        if not profile.trained:
+            return "ok"
+        return profile.check(value, dlc)
+
+    def serialize(self):
+        entries = [p for p in self.profiles.values() if p.trained]
+        blob = struct.pack(HEADER_FORMAT, MODEL_MAGIC, MODEL_VERSION, len(entries))
+        for p in entries:
+            blob += struct.pack(ENTRY_FORMAT, p.key, p.dlc, p.counter_bytes,
+                                int.from_bytes(bytes(p.reference), "little"),
+                                int.from_bytes(bytes(p.changed), "little"),
+                                int.from_bytes(bytes(p.min), "little"),
+                                int.from_bytes(bytes(p.max), "little"))
+        return blob
+
+    @staticmethod
+    def load(blob):
+        magic, version, count = struct.unpack_from(HEADER_FORMAT, blob)
+        if magic != MODEL_MAGIC or version != MODEL_VERSION:
+            raise ValueError("not a payload model blob")
+        entry_size = struct.calcsize(ENTRY_FORMAT)
+        if len(blob) != struct.calcsize(HEADER_FORMAT) + count * entry_size:
+            raise ValueError("payload model blob has the wrong size")
+        model = PayloadModel()
+        for i in range(count):
+            key, dlc, counter_bytes, reference, changed, low, high = struct.unpack_from(
+                ENTRY_FORMAT, blob, struct.calcsize(HEADER_FORMAT) + i * entry_size)
+            p = Profile(key)
+            p.dlc = dlc
+            p.counter_bytes = counter_bytes
+            p.reference = list(reference.to_bytes(8, "little"))
+            p.changed = list(changed.to_bytes(8, "little"))
+            p.min = list(low.to_bytes(8, "little"))
+            p.max = list(high.to_bytes(8, "little"))
+            p.samples = MIN_SAMPLES
+            p.trained = True
+            model.profiles[key] = p
+        return model
+
+def describe(model):
+    for p in sorted(model.profiles.values(), key=lambda p: p.key):
+        pgn = (p.key >> 8) & 0x3FFFF
+        changed = bytes(p.changed).hex().upper()
+        state = "trained" if p.trained else "untrained"
+        print(f"PGN {pgn:05X} SA {p.key & 0xFF:02X}: dlc={p.dlc} samples={p.samples} "
+              f"changed={changed} counters={p.counter_bytes:08b} ({state})")
+
+def upload(port, baud, blob):
+    ser = serial.Serial(port, baud, timeout=1)
+    time.sleep(0.5)
+    ser.reset_input_buffer()
+
+    def send(data):
+        ser.write(('{"c":"pm","d":"%s"}\n' % data).encode("utf-8"))
+        ser.flush()
+        time.sleep(0.05)
+
+    send("begin")
+    for offset in range(0, len(blob), UPLOAD_CHUNK):
+        send("+" + blob[offset:offset + UPLOAD_CHUNK].hex().upper())
+    send("commit")
+
+    deadline = time.time() + 2
+    while time.time() < deadline:
+        line = ser.readline().decode("utf-8", errors="replace").strip()
+        if "Payload model" in line or "payload model" in line:
+            print(line)
+            break
+    ser.close()
+
+def main():
+    parser = argparse.ArgumentParser(description='Train and load the sniffer payload anomaly model')
+    parser.add_argument('--train', nargs='+', metavar='LOG', help='candump logs of normal traffic')
+    parser.add_argument('--model', default='payload_model.bin', help='Model blob to write or read')
+    parser.add_argument('--check', nargs='+', metavar='LOG', help='Check candump logs against the model')
+    parser.add_argument('--port', help='Upload the model to the sniffer on this serial port')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate')
+    parser.add_argument('--enforce', action='store_true', help='Switch the sniffer to enforce mode after upload')
+    parser.add_argument('--verbose', action='store_true', help='Print every learned profile')
+    args = parser.parse_args()
+
+    if args.train:
+        model = PayloadModel()
+        frames = 0
+        for can_id, data in read_frames(args.train):
+            model.process(can_id, data, learn=True)
+            frames += 1
+        blob = model.serialize()
+        with open(args.model, "wb") as f:
+            f.write(blob)
+        trained = sum(1 for p in model.profiles.values() if p.trained)
+        print(f"Learned {len(model.profiles)} profiles from {frames} frames, "
+              f"{trained} trained ({len(blob)} bytes) -> {args.model}")
+        if args.verbose:
+            describe(model)
+    else:
+        with open(args.model, "rb") as f:
+            blob = f.read()
+        model = PayloadModel.load(blob)
+
+    if args.check:
+        model = PayloadModel.load(blob)
+        counts = {}
+        for can_id, data in read_frames(args.check):
+            verdict = model.process(can_id, data, learn=False)
+            counts[verdict] = counts.get(verdict, 0) + 1
+            if verdict not in ("ok", "unknown_id"):
+                print(f"{verdict}: {can_id:08X}#{data.hex().upper()}")
+        print("Verdicts: " + ", ".join(f"{k}={v}" for k, v in sorted(counts.items())))
+
+    if args.port:
+        upload(args.port, args.baud, blob)
+        if args.enforce:
+            ser = serial.Serial(args.port, args.baud, timeout=1)
+            ser.write(b'{"c":"pm","d":"enforce"}\n')
+            ser.close()
+
+if __name__ == "__main__":
+    main()